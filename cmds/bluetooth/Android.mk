@@ -2,7 +2,7 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
-    btcommon.cpp headsetBase.cpp service.cpp socket.cpp android_bluetooth_c.c
+    btcommon.cpp btjournal.cpp bthealth.cpp headsetBase.cpp service.cpp socket.cpp android_bluetooth_c.c
 LOCAL_MODULE:= bluetest
 LOCAL_MODULE_TAGS:=optional
 
@@ -21,3 +21,155 @@ include $(BUILD_EXECUTABLE)
 ALL_DEFAULT_INSTALLED_MODULES += $(TARGET_OUT)/bin/bluetest
 endif
 endif
+
+# Stand-in for bluetoothd, for load testing bluetest without radios
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= mockbluez.cpp
+LOCAL_MODULE:= mockbluez
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/dbus
+
+LOCAL_SHARED_LIBRARIES := libutils libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Benchmark for the headset AT command reader
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= atbench.cpp btcommon.cpp
+LOCAL_MODULE:= atbench
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libbluedroid libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Table, fuzz and pty checks for the headset AT command parser
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= atfuzz.cpp btcommon.cpp
+LOCAL_MODULE:= atfuzz
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libbluedroid libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Throughput benchmark for the socket bulk transfer path
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= bulkbench.cpp btcommon.cpp android_bluetooth_c.c
+LOCAL_MODULE:= bulkbench
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libcutils libbluedroid libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Method call template cache benchmark, against mockbluez
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= tmplbench.cpp
+LOCAL_MODULE:= tmplbench
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libcutils libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Round trip checks and throughput benchmark for the OOB base64 code
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= base64test.cpp
+LOCAL_MODULE:= base64test
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libcutils libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Suspend/resume storms on the A2DP sink state machine, against mockbluez
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+    sinkstorm.cpp btcommon.cpp btjournal.cpp bthealth.cpp headsetBase.cpp socket.cpp android_bluetooth_c.c
+LOCAL_MODULE:= sinkstorm
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libbluedroid libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Checks for the AG acceptor, with AF_UNIX listeners standing in for RFCOMM
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= listentest.cpp btcommon.cpp android_bluetooth_c.c
+LOCAL_MODULE:= listentest
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libcutils libbluedroid libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
+
+# Parse, format and lookup benchmark for the Bluetooth address helpers
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= addrbench.cpp
+LOCAL_MODULE:= addrbench
+LOCAL_MODULE_TAGS:=optional
+
+LOCAL_C_INCLUDES += external/klaatu-services/include
+LOCAL_C_INCLUDES += external/dbus
+LOCAL_C_INCLUDES += external/bluetooth/bluez/lib system/bluetooth/bluedroid/include
+
+LOCAL_SHARED_LIBRARIES := libutils libcutils libdbus
+
+ifeq ($(PLATFORM_VERSION),4.1.2)
+include $(BUILD_EXECUTABLE)
+endif
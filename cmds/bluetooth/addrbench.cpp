@@ -0,0 +1,234 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * addrbench: benchmark for the Bluetooth address helpers in btcommon.cpp,
+ * against what they replaced.  Checks first that on random addresses, in
+ * either case:
+ *   - bt_addr_parse() agrees with strtol() per byte, and rejects what
+ *     isn't "XX:XX:XX:XX:XX:XX"
+ *   - bt_addr_format() agrees with sprintf("%2.2X:...")
+ *   - bt_addr_map finds what a KeyedVector<String8> keyed by the string
+ *     finds, and nothing else
+ * Then times each pair: parsing, formatting, and looking an address string
+ * up among a set of known devices.
+ *
+ *   addrbench [-n addresses] [-d devices] [-r rounds]
+ */
+
+#include "btcommon.cpp"
+
+namespace android {
+// btcommon.cpp's D-Bus helpers use service.cpp's connection; nothing here calls them
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+static int failures;
+static volatile uint64_t sink;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// get_bdaddr() and get_bdaddr_as_string() as they were before bt_addr_t
+static int strtol_parse(const char *str, bdaddr_t *ba) {
+    char *d = ((char *)ba) + 5, *endp;
+    for (int i = 0; i < 6; i++) {
+        *d-- = strtol(str, &endp, 16);
+        if (*endp != ':' && i != 5) {
+            memset(ba, 0, sizeof(bdaddr_t));
+            return -1;
+        }
+        str = endp + 1;
+    }
+    return 0;
+}
+
+static void sprintf_format(const bdaddr_t *ba, char *str) {
+    const uint8_t *b = (const uint8_t *)ba;
+    sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X", b[5], b[4], b[3], b[2], b[1], b[0]);
+}
+
+static bt_addr_t random_addr(void) {
+    bt_addr_t addr = ((bt_addr_t)(lrand48() & 0xffffff) << 24) | (lrand48() & 0xffffff);
+    return addr == BT_ADDR_NONE ? 0 : addr;
+}
+
+static double ns_each(nsecs_t elapsed, long ops) {
+    return (double)elapsed / ops;
+}
+
+static void check_agreement(char (*strs)[BTADDR_SIZE], const bt_addr_t *addrs, int n) {
+    for (int i = 0; i < n; i++) {
+        bdaddr_t ba;
+        bt_addr_t addr;
+        char a[BTADDR_SIZE], b[BTADDR_SIZE];
+        check(strtol_parse(strs[i], &ba) == 0 && bt_addr_parse(strs[i], &addr) == 0
+                && addr == addrs[i] && bt_addr_pack(&ba) == addr, "parse disagrees with strtol");
+        bt_addr_format(addr, a);
+        sprintf_format(&ba, b);
+        check(!strcmp(a, b) && !strcasecmp(a, strs[i]), "format disagrees with sprintf");
+    }
+
+    static const char *bad[] = { "", "00:11:22:33:44", "00:11:22:33:44:5", "00-11-22-33-44-55",
+            "0:11:22:33:44:55", "00:11:22:33:44:5G", " 00:11:22:33:44:55", "00:11:22:33:4455:" };
+    bt_addr_t addr;
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+        check(bt_addr_parse(bad[i], &addr) < 0, "malformed address parsed");
+}
+
+static void bench_parse(char (*strs)[BTADDR_SIZE], int n, int rounds) {
+    bdaddr_t ba;
+    bt_addr_t addr;
+    long ops = (long)n * rounds;
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++) {
+            strtol_parse(strs[i], &ba);
+            sink += ba.b[0];
+        }
+    nsecs_t old_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++) {
+            bt_addr_parse(strs[i], &addr);
+            sink += addr;
+        }
+    nsecs_t new_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    printf("parse:  strtol %6.1f ns, bt_addr_parse %5.1f ns\n", ns_each(old_ns, ops), ns_each(new_ns, ops));
+}
+
+static void bench_format(const bt_addr_t *addrs, int n, int rounds) {
+    char str[BTADDR_SIZE];
+    long ops = (long)n * rounds;
+
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++) {
+            bdaddr_t ba;
+            bt_addr_unpack(addrs[i], &ba);
+            sprintf_format(&ba, str);
+            sink += str[1];
+        }
+    nsecs_t old_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++) {
+            bt_addr_format(addrs[i], str);
+            sink += str[1];
+        }
+    nsecs_t new_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    printf("format: sprintf %5.1f ns, bt_addr_format %4.1f ns\n", ns_each(old_ns, ops), ns_each(new_ns, ops));
+}
+
+// Looks up every address string, of which one in four is a known device
+static void bench_lookup(char (*strs)[BTADDR_SIZE], const bt_addr_t *addrs, int n, int devices, int rounds) {
+    KeyedVector<String8, void *> byString;
+    bt_addr_map_t *map = bt_addr_map_new();
+    for (int i = 0; i < n; i += 4) {
+        if ((int)byString.size() == devices)
+            break;
+        byString.add(String8(strs[i]), (void *)(intptr_t)(i + 1));
+        bt_addr_map_put(map, addrs[i], (void *)(intptr_t)(i + 1));
+    }
+    check(bt_addr_map_size(map) == byString.size(), "map and KeyedVector hold different devices");
+
+    for (int i = 0; i < n; i++) {
+        bt_addr_t addr;
+        ssize_t idx = byString.indexOfKey(String8(strs[i]));
+        void *want = idx >= 0 ? byString.valueAt(idx) : NULL;
+        check(bt_addr_parse(strs[i], &addr) == 0 && bt_addr_map_get(map, addr) == want,
+                "map lookup disagrees with KeyedVector");
+    }
+
+    long ops = (long)n * rounds;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++)
+            sink += byString.indexOfKey(String8(strs[i]));
+    nsecs_t old_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int r = 0; r < rounds; r++)
+        for (int i = 0; i < n; i++) {
+            bt_addr_t addr;
+            if (bt_addr_parse(strs[i], &addr) == 0)
+                sink += (uintptr_t)bt_addr_map_get(map, addr);
+        }
+    nsecs_t new_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    printf("lookup among %zu: KeyedVector<String8> %6.1f ns, bt_addr_parse + bt_addr_map %5.1f ns\n",
+            byString.size(), ns_each(old_ns, ops), ns_each(new_ns, ops));
+    bt_addr_map_free(map);
+}
+
+int main(int argc, char **argv) {
+    int n = 4096, devices = 256, rounds = 500;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'd':
+            devices = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n addresses] [-d devices] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n <= 0 || devices <= 0 || rounds <= 0) {
+        fprintf(stderr, "addrbench: need addresses, devices and rounds > 0\n");
+        return 1;
+    }
+
+    char (*strs)[BTADDR_SIZE] = (char (*)[BTADDR_SIZE])malloc(n * BTADDR_SIZE);
+    bt_addr_t *addrs = (bt_addr_t *)malloc(n * sizeof(bt_addr_t));
+    if (!strs || !addrs) {
+        fprintf(stderr, "addrbench: out of memory\n");
+        return 1;
+    }
+    srand48(1);
+    for (int i = 0; i < n; i++) {
+        addrs[i] = random_addr();
+        bt_addr_format(addrs[i], strs[i]);
+        if (i & 1)      // BlueZ hands out upper case, but either must parse
+            for (char *p = strs[i]; *p; p++)
+                *p = tolower(*p);
+    }
+
+    printf("%d addresses x %d rounds\n", n, rounds);
+    check_agreement(strs, addrs, n);
+    bench_parse(strs, n, rounds);
+    bench_format(addrs, n, rounds);
+    bench_lookup(strs, addrs, n, devices, rounds);
+    free(strs);
+    free(addrs);
+    printf("addrbench: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
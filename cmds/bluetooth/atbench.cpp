@@ -0,0 +1,273 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * atbench: benchmark for the headset AT command reader.  A writer thread
+ * replays a recorded HFP session, in the bursts a car kit sends it, over a
+ * socketpair (or a pty with -p, which is what an RFCOMM tty looks like).
+ * The lines are read back with get_line() from headsetBase.cpp and with
+ * the byte at a time reader it replaced; both must return exactly the
+ * lines that were sent.  Reports time, read() and poll() calls per line.
+ *
+ *   atbench [-p] [-n sessions] [-s seed]
+ */
+
+#include <unistd.h>
+#include <poll.h>
+
+// Count the reader's system calls; headsetBase.cpp is built in below
+static int nreads, npolls;
+static ssize_t counted_read(int fd, void *buf, size_t len) {
+    nreads++;
+    return read(fd, buf, len);
+}
+static int counted_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    npolls++;
+    return poll(fds, nfds, timeout);
+}
+#define read counted_read
+#define poll counted_poll
+#include "headsetBase.cpp"
+#undef read
+#undef poll
+
+#include <pthread.h>
+#include <termios.h>
+#include <utils/Timers.h>
+
+namespace android {
+// btcommon.cpp's D-Bus helpers use service.cpp's connection; nothing here calls them
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+// Service level connection, a call and its teardown, as logged from a
+// car kit.  0xAD is the soft hyphen some kits put in dial strings.
+static const char *session[] = {
+    "AT+BRSF=127",
+    "AT+BAC=1,2",
+    "AT+CIND=?",
+    "AT+CIND?",
+    "AT+CMER=3,0,0,1",
+    "AT+CHLD=?",
+    "AT+XAPL=0000-0000-0100,10",
+    "AT+CMEE=1",
+    "AT+CLIP=1",
+    "AT+CCWA=1",
+    "AT+NREC=0",
+    "AT+VGS=10",
+    "AT+VGM=8",
+    "AT+COPS=3,0",
+    "AT+COPS?",
+    "AT+BIA=0,0,0,1,1,1,0",
+    "AT+CSCS=\"UTF-8\"",
+    "AT+CPBS=\"ME\"",
+    "AT+CPBR=?",
+    "AT+CPBR=1,100",
+    "AT+CNUM",
+    "AT+BTRH?",
+    "ATD555\xad" "0100\xad" "1234;",
+    "AT+CLCC",
+    "AT+IPHONEACCEV=2,1,5,2,0",
+    "AT+VTS=1",
+    "AT+VGS=12",
+    "AT+CLCC",
+    "AT+CHUP",
+    "AT+CLCC",
+    "AT+BVRA=1",
+    "AT+BVRA=0",
+    "AT+CIND?",
+};
+#define SESSION_LINES (int)(sizeof(session) / sizeof(session[0]))
+
+struct writer_args {
+    int fd;
+    int sessions;
+    unsigned seed;
+};
+
+// Send each command CR terminated, one to four commands per write(), now
+// and then with a stray LF ahead of it as some kits do
+static void *writer(void *arg) {
+    writer_args *w = (writer_args *)arg;
+    char burst[512];
+    int len = 0, inburst = 0, want = 1;
+    for (int s = 0; s < w->sessions; s++) {
+        for (int i = 0; i < SESSION_LINES; i++) {
+            if (rand_r(&w->seed) % 16 == 0)
+                burst[len++] = '\xa';
+            len += snprintf(burst + len, sizeof(burst) - len, "%s\r", session[i]);
+            if (++inburst < want)
+                continue;
+            for (int off = 0; off < len; ) {
+                int n = write(w->fd, burst + off, len - off);
+                if (n <= 0)
+                    return NULL;
+                off += n;
+            }
+            len = inburst = 0;
+            want = 1 + rand_r(&w->seed) % 4;
+        }
+    }
+    if (len)
+        write(w->fd, burst, len);
+    return NULL;
+}
+
+static uint32_t hash_line(uint32_t h, const char *line) {
+    for (; *line; line++)
+        h = (h ^ (unsigned char)*line) * 16777619;
+    return (h ^ '\n') * 16777619;
+}
+
+// The reader get_line() replaced: a poll() and then one read() per byte
+static const char *legacy_get_line(int fd, char *buf, int len, int timeout_ms, int *err) {
+    char *bufit = buf;
+    struct pollfd pfd;
+
+    *bufit = 0;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    *err = 0;
+    int ret = counted_poll(&pfd, 1, timeout_ms);
+    if (ret <= 0) {
+        *err = ret < 0 ? errno : 0;
+        return NULL;
+    }
+    while ((int)(bufit - buf) < (len - 1)) {
+        int rc = counted_read(fd, bufit, 1);
+        if (!rc)
+            break;
+        if (rc < 0) {
+            *err = errno;
+            return NULL;
+        }
+        if (*bufit == '\xd')
+            break;
+        if (*bufit == '\xa')
+            bufit = buf;
+        else
+            bufit++;
+    }
+    *bufit = 0;
+    for (char *p = buf; *p; p++)
+        *p &= 0x7F;
+    return buf;
+}
+
+// Open a connected pair: a socketpair, or a raw pty master and slave
+static bool open_pair(bool pty, int fds[2]) {
+    if (!pty)
+        return socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+    int master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        return false;
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        return false;
+    // no CR to NL mapping or echo: the reader must see the bytes as sent
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fds[0] = slave;
+    fds[1] = master;
+    return true;
+}
+
+static bool run(bool pty, bool legacy, int sessions, unsigned seed, uint32_t expect) {
+    int fds[2];
+    if (!open_pair(pty, fds)) {
+        fprintf(stderr, "atbench: can't open a %s: %s\n", pty ? "pty" : "socketpair", strerror(errno));
+        return false;
+    }
+    at_rx_buffer_t rx;
+    rx.start = rx.end = 0;
+    char buf[256];
+    writer_args w = { fds[1], sessions, seed };
+    pthread_t thread;
+    nreads = npolls = 0;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    pthread_create(&thread, NULL, writer, &w);
+
+    uint32_t h = 2166136261u;
+    int lines = 0, err = 0;
+    while (lines < sessions * SESSION_LINES) {
+        const char *line = legacy ? legacy_get_line(fds[0], buf, sizeof(buf), 1000, &err)
+                                  : get_line(fds[0], &rx, 1000, &err);
+        if (!line) {
+            fprintf(stderr, "atbench: reader stopped after %d lines, error %d\n", lines, err);
+            break;
+        }
+        h = hash_line(h, line);
+        lines++;
+    }
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    printf("%-10s %-13s %7d lines in %6lld ms, %6.2f us/line, %5.2f reads/line, %5.2f polls/line %s\n",
+           pty ? "pty" : "socketpair", legacy ? "byte at once" : "buffered", lines,
+           (long long)(elapsed / 1000000), elapsed / 1000.0 / (lines ? lines : 1),
+           (double)nreads / (lines ? lines : 1), (double)npolls / (lines ? lines : 1),
+           h == expect ? "ok" : "MISMATCH");
+    return h == expect;
+}
+
+int main(int argc, char **argv) {
+    bool pty = false;
+    int sessions = 2000;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "pn:s:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pty = true;
+            break;
+        case 'n':
+            sessions = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p] [-n sessions] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (sessions <= 0)
+        sessions = 1;
+
+    // what the HF sent, with the eighth bit masked off
+    uint32_t expect = 2166136261u;
+    for (int s = 0; s < sessions; s++) {
+        for (int i = 0; i < SESSION_LINES; i++) {
+            char line[256];
+            int j;
+            for (j = 0; session[i][j]; j++)
+                line[j] = session[i][j] & 0x7F;
+            line[j] = 0;
+            expect = hash_line(expect, line);
+        }
+    }
+
+    bool ok = run(pty, true, sessions, seed, expect);
+    ok = run(pty, false, sessions, seed, expect) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,342 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * atfuzz: checks for the headset AT command parser and dispatcher in
+ * headsetBase.cpp.
+ *   - every name in the command table parses back to its id, in either case
+ *   - a set of known lines tokenize as expected
+ *   - mutated HFP traffic never makes at_parse() step outside the line or
+ *     hand out more than AT_MAX_ARGS arguments
+ *   - over a raw pty, a scripted exchange and the mutated lines each get
+ *     exactly the replies the dispatcher should send
+ *
+ *   atfuzz [-n iterations] [-s seed]
+ */
+
+#include "headsetBase.cpp"
+
+#include <termios.h>
+
+namespace android {
+// btcommon.cpp's D-Bus helpers use service.cpp's connection; nothing here calls them
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAIL %s:%d: ", __FUNCTION__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+static void check_table() {
+    for (int i = 0; attable[i].name; i++) {
+        char line[64], lower[64];
+        snprintf(line, sizeof(line), "AT%s", attable[i].name);
+        for (int j = 0; ; j++) {
+            lower[j] = tolower(line[j]);
+            if (!line[j])
+                break;
+        }
+        at_command_t cmd;
+        CHECK(at_parse(line, &cmd) == 0 && cmd.id == i, "%s parses as %d", attable[i].name, cmd.id);
+        // ATD takes its dial string from the rest of the line, even if empty
+        CHECK(at_parse(lower, &cmd) == 0 && cmd.id == i, "%s in lower case parses as %d", attable[i].name, cmd.id);
+    }
+}
+
+struct vector_t {
+    const char *line;
+    int ret;
+    int id;
+    int form;
+    const char *args;              // '|' separated
+};
+
+static const vector_t vectors[] = {
+    { "AT", 0, AT_AT, AT_FORM_EXEC, "" },
+    { "at", 0, AT_AT, AT_FORM_EXEC, "" },
+    { "  AT+CIND?", 0, AT_CIND, AT_FORM_READ, "" },
+    { "AT+CIND=?", 0, AT_CIND, AT_FORM_TEST, "" },
+    { "at+cmer=3,0,0,1", 0, AT_CMER, AT_FORM_SET, "3|0|0|1" },
+    { "AT+BIA=0,,1, 1 ,", 0, AT_BIA, AT_FORM_SET, "0||1|1|" },
+    { "AT+CSCS=\"UTF-8\"", 0, AT_CSCS, AT_FORM_SET, "UTF-8" },
+    { "AT+CPBF=\"a,b\",2", 0, AT_CPBF, AT_FORM_SET, "a,b|2" },
+    { "AT+XAPL=0000-0000-0100,10", 0, AT_XAPL, AT_FORM_SET, "0000-0000-0100|10" },
+    { "ATD5550100;", 0, AT_D, AT_FORM_EXEC, "5550100;" },
+    { "ATD>1;", 0, AT_D, AT_FORM_EXEC, ">1;" },
+    { "ATA", 0, AT_A, AT_FORM_EXEC, "" },
+    { "AT+FOO=1", 0, AT_UNKNOWN, AT_FORM_SET, "1" },
+    { "AT+", -1, AT_UNKNOWN, AT_FORM_EXEC, "" },
+    { "AT ", -1, AT_AT, AT_FORM_EXEC, "" },
+    { "AT+CIND?x", -1, AT_CIND, AT_FORM_READ, "" },
+    { "A", -1, AT_UNKNOWN, AT_FORM_EXEC, "" },
+    { "+CIND?", -1, AT_UNKNOWN, AT_FORM_EXEC, "" },
+    { "AT+VGS=1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16", 0, AT_VGS, AT_FORM_SET,
+      "1|2|3|4|5|6|7|8|9|10|11|12|13|14|15|16" },
+    { "AT+VGS=1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17", -1, AT_VGS, AT_FORM_SET, NULL },
+};
+
+static void check_vectors() {
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        const vector_t *v = &vectors[i];
+        char line[256];
+        strcpy(line, v->line);
+        at_command_t cmd;
+        int ret = at_parse(line, &cmd);
+        CHECK(ret == v->ret, "\"%s\" returned %d", v->line, ret);
+        if (ret != 0 || v->ret != 0) {
+            if (ret == v->ret && v->id != AT_UNKNOWN && v->args)
+                CHECK(cmd.id == v->id, "\"%s\" has id %d", v->line, cmd.id);
+            continue;
+        }
+        CHECK(cmd.id == v->id, "\"%s\" has id %d", v->line, cmd.id);
+        CHECK(cmd.form == v->form, "\"%s\" has form %d", v->line, cmd.form);
+        String8 args;
+        for (int a = 0; a < cmd.argc; a++) {
+            if (a)
+                args.append("|");
+            args.append(cmd.argv[a]);
+        }
+        CHECK(strcmp(args.string(), v->args) == 0, "\"%s\" has arguments \"%s\"", v->line, args.string());
+    }
+}
+
+static const char *corpus[] = {
+    "AT", "AT+BRSF=127", "AT+CIND=?", "AT+CIND?", "AT+CMER=3,0,0,1", "AT+CHLD=?",
+    "AT+CHLD=2", "AT+CLIP=1", "AT+CCWA=1", "AT+VGS=10", "AT+COPS=3,0", "AT+COPS?",
+    "AT+BIA=0,0,0,1,1,1,0", "AT+CSCS=\"UTF-8\"", "AT+CPBR=1,100", "ATD555\xad" "0100;",
+    "ATA", "AT+CHUP", "AT+XAPL=0000-0000-0100,10", "AT+IPHONEACCEV=2,1,5,2,0",
+    "AT+CPBF=\"smith, j\"",
+};
+#define CORPUS_SIZE (int)(sizeof(corpus) / sizeof(corpus[0]))
+
+// A corpus line with a few random edits.  Never contains CR, LF or NUL, so
+// it also goes over the wire as exactly one line.
+static int mutate(unsigned *seed, char *out, int size) {
+    static const char specials[] = "AT+=?,\" ;>aZ09";
+    const char *src = corpus[rand_r(seed) % CORPUS_SIZE];
+    int len = strlen(src);
+    memcpy(out, src, len);
+    int edits = rand_r(seed) % 4;
+    for (int e = 0; e < edits; e++) {
+        int pos = len ? rand_r(seed) % (len + 1) : 0;
+        char c = rand_r(seed) % 2 ? specials[rand_r(seed) % (sizeof(specials) - 1)] : 1 + rand_r(seed) % 255;
+        if (c == '\xd' || c == '\xa')
+            c = ',';
+        switch (rand_r(seed) % 4) {
+        case 0:                    // insert
+            if (len < size - 1) {
+                memmove(out + pos + 1, out + pos, len - pos);
+                out[pos] = c;
+                len++;
+            }
+            break;
+        case 1:                    // replace
+            if (pos < len)
+                out[pos] = c;
+            break;
+        case 2:                    // delete
+            if (pos < len) {
+                memmove(out + pos, out + pos + 1, len - pos - 1);
+                len--;
+            }
+            break;
+        case 3:                    // truncate
+            len = pos;
+            break;
+        }
+    }
+    out[len] = 0;
+    return len;
+}
+
+static void check_fuzz(int iterations, unsigned seed) {
+    for (int i = 0; i < iterations; i++) {
+        char tmp[128];
+        int len = mutate(&seed, tmp, sizeof(tmp));
+        // exactly sized, so running off the end shows up under a checker
+        char *line = (char *)malloc(len + 1);
+        memcpy(line, tmp, len + 1);
+        at_command_t cmd;
+        int ret = at_parse(line, &cmd);
+        CHECK(ret == 0 || ret == -1, "\"%s\" returned %d", tmp, ret);
+        if (ret == 0) {
+            CHECK(cmd.id >= AT_UNKNOWN && cmd.id < AT_NUM_COMMANDS, "\"%s\" has id %d", tmp, cmd.id);
+            CHECK(cmd.argc >= 0 && cmd.argc <= AT_MAX_ARGS, "\"%s\" has %d arguments", tmp, cmd.argc);
+            for (int a = 0; a < cmd.argc; a++)
+                CHECK(cmd.argv[a] >= line && cmd.argv[a] <= line + len, "\"%s\" argument %d outside the line", tmp, a);
+        }
+        free(line);
+    }
+}
+
+struct reply_ctx {
+    int fd;
+    at_tx_buffer_t *tx;
+};
+
+static int handle_brsf(const at_command_t *cmd, void *user) {
+    reply_ctx *ctx = (reply_ctx *)user;
+    if (cmd->form != AT_FORM_SET || cmd->argc != 1)
+        return AT_RESULT_ERROR;
+    send_line(ctx->fd, ctx->tx, "+BRSF: 871");
+    return AT_RESULT_OK;
+}
+
+static int handle_dial(const at_command_t *cmd, void *user) {
+    return strcmp(cmd->argv[0], "555-0100;") == 0 ? AT_RESULT_OK : AT_RESULT_ERROR;
+}
+
+static int handle_ok(const at_command_t *cmd, void *user) {
+    return AT_RESULT_OK;
+}
+
+// What the dispatcher must answer to a line, with the handlers above
+static String8 expected_reply(const char *text) {
+    char line[256];
+    strcpy(line, text);
+    for (char *p = line; *p; p++)
+        *p &= 0x7F;
+    at_command_t cmd;
+    if (!*line)
+        return String8();
+    if (at_parse(line, &cmd) != 0 || cmd.id == AT_UNKNOWN || !at_handlers[cmd.id].handler)
+        return String8("\r\nERROR\r\n");
+    if (cmd.id == AT_BRSF)
+        return cmd.form == AT_FORM_SET && cmd.argc == 1 ? String8("\r\n+BRSF: 871\r\n\r\nOK\r\n") : String8("\r\nERROR\r\n");
+    if (cmd.id == AT_D)
+        return strcmp(cmd.argv[0], "555-0100;") == 0 ? String8("\r\nOK\r\n") : String8("\r\nERROR\r\n");
+    if (cmd.id == AT_AT)
+        return String8(cmd.form == AT_FORM_EXEC ? "\r\nOK\r\n" : "\r\nERROR\r\n");
+    return String8("\r\nOK\r\n");
+}
+
+static bool open_pty(int *master, int *slave) {
+    *master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
+    if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0)
+        return false;
+    *slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+    if (*slave < 0)
+        return false;
+    struct termios tio;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    fcntl(*master, F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+// Send one line from the HF side, have the AG side process it and collect
+// what comes back
+static String8 exchange(int master, int slave, at_rx_buffer_t *rx, at_tx_buffer_t *tx, const char *line) {
+    String8 out = String8::format("%s\r", line);
+    write(master, out.string(), out.length());
+    int err;
+    process_at_command(slave, rx, tx, 1000, &err);
+    String8 reply;
+    char buf[512];
+    int n;
+    while ((n = read(master, buf, sizeof(buf) - 1)) > 0) {
+        buf[n] = 0;
+        reply.append(buf);
+    }
+    return reply;
+}
+
+static void check_pty(int iterations, unsigned seed) {
+    int master, slave;
+    if (!open_pty(&master, &slave)) {
+        CHECK(false, "can't open a pty: %s", strerror(errno));
+        return;
+    }
+    at_rx_buffer_t rx;
+    at_tx_buffer_t tx;
+    rx.start = rx.end = 0;
+    tx.start = tx.end = 0;
+    reply_ctx ctx = { slave, &tx };
+    registerATHandlerNative(AT_BRSF, handle_brsf, &ctx);
+    registerATHandlerNative(AT_D, handle_dial, NULL);
+    registerATHandlerNative(AT_CIND, handle_ok, NULL);
+    registerATHandlerNative(AT_CMER, handle_ok, NULL);
+    registerATHandlerNative(AT_VGS, handle_ok, NULL);
+
+    static const struct {
+        const char *line;
+        const char *reply;
+    } script[] = {
+        { "AT", "\r\nOK\r\n" },
+        { "AT+BRSF=127", "\r\n+BRSF: 871\r\n\r\nOK\r\n" },
+        { "AT+CIND=?", "\r\nOK\r\n" },
+        { "AT+CMER=3,0,0,1", "\r\nOK\r\n" },
+        { "AT+CHLD=?", "\r\nERROR\r\n" },
+        { "ATD555\xad" "0100;", "\r\nOK\r\n" },
+        { "AT+VGS=10", "\r\nOK\r\n" },
+        { "AT?", "\r\nERROR\r\n" },
+        { "AT+FOO", "\r\nERROR\r\n" },
+        { "hello", "\r\nERROR\r\n" },
+    };
+    for (size_t i = 0; i < sizeof(script) / sizeof(script[0]); i++) {
+        String8 reply = exchange(master, slave, &rx, &tx, script[i].line);
+        CHECK(strcmp(reply.string(), script[i].reply) == 0, "\"%s\" got \"%s\"", script[i].line, reply.string());
+    }
+    for (int i = 0; i < iterations; i++) {
+        char line[128];
+        mutate(&seed, line, sizeof(line));
+        String8 reply = exchange(master, slave, &rx, &tx, line);
+        String8 want = expected_reply(line);
+        CHECK(strcmp(reply.string(), want.string()) == 0, "\"%s\" got \"%s\", expected \"%s\"", line, reply.string(), want.string());
+    }
+    close(master);
+    close(slave);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 200000;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!classInitNative()) {
+        printf("FAIL: AT command table\n");
+        return 1;
+    }
+    check_table();
+    check_vectors();
+    check_fuzz(iterations, seed);
+    check_pty(iterations / 20, seed);
+    printf("%s: %d failures\n", argv[0], failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * base64test: checks and benchmark for the OOB base64 code in btcommon.cpp.
+ * Runs the RFC 4648 vectors, then random round trips, comparing the block
+ * path this CPU gets against the scalar code on every length, and then
+ * corrupted and badly padded input, which must all be refused.  Finally
+ * times encode and decode, scalar and block path, on a 32 byte OOB blob
+ * and on a 64 KB buffer.
+ *
+ *   base64test [-n round_trips] [-s seed]
+ */
+
+#include "btcommon.cpp"
+
+#include <utils/Timers.h>
+
+namespace android {
+// btcommon.cpp's D-Bus helpers use service.cpp's connection; nothing here calls them
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+#define MAX_LEN 1024
+
+static int failures;
+
+static void fail(const char *what, size_t len) {
+    if (failures++ < 10)
+        printf("FAILED: %s, length %zu\n", what, len);
+}
+
+static void check_vectors(void) {
+    static const char *vectors[][2] = {
+        { "", "" }, { "f", "Zg==" }, { "fo", "Zm8=" }, { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" }, { "fooba", "Zm9vYmE=" }, { "foobar", "Zm9vYmFy" },
+    };
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        char out[16];
+        uint8_t back[16];
+        size_t len = strlen(vectors[i][0]);
+        size_t n = bt_base64_encode((const uint8_t *)vectors[i][0], len, out);
+        if (n != strlen(vectors[i][1]) || memcmp(out, vectors[i][1], n))
+            fail("RFC 4648 encode", len);
+        if (bt_base64_decode(vectors[i][1], n, back) != (ssize_t)len || memcmp(back, vectors[i][0], len))
+            fail("RFC 4648 decode", len);
+    }
+}
+
+static void check_round_trips(int rounds, unsigned seed) {
+    uint8_t in[MAX_LEN], back[BT_BASE64_DECODED_MAX(BT_BASE64_ENCODED_LEN(MAX_LEN))];
+    char out[BT_BASE64_ENCODED_LEN(MAX_LEN)], ref[BT_BASE64_ENCODED_LEN(MAX_LEN)];
+    for (int r = 0; r < rounds; r++) {
+        // mostly short, as OOB blobs are, but long enough to cover the blocks
+        size_t len = rand_r(&seed) % (r % 8 ? 64 : MAX_LEN);
+        for (size_t i = 0; i < len; i++)
+            in[i] = rand_r(&seed);
+        size_t n = bt_base64_encode(in, len, out);
+        if (n != BT_BASE64_ENCODED_LEN(len) || base64_encode_scalar(in, len, ref) != n || memcmp(out, ref, n))
+            fail("encode differs from scalar", len);
+        ssize_t m = bt_base64_decode(out, n, back);
+        if (m != (ssize_t)len || memcmp(back, in, len))
+            fail("round trip", len);
+        if (base64_decode_scalar(out, n, back) != (ssize_t)len || memcmp(back, in, len))
+            fail("scalar round trip", len);
+        if (!n)
+            continue;
+
+        // a character outside the alphabet anywhere must be refused
+        static const char bad[] = "\0 \n=-_.*\x80\xff";
+        size_t pos = rand_r(&seed) % n;
+        char saved = out[pos];
+        char c = bad[rand_r(&seed) % (sizeof(bad) - 1)];
+        // '=' is padding where padding may go
+        if (!(c == '=' && pos >= n - 2 && (pos == n - 1 || out[n - 1] == '='))) {
+            out[pos] = c;
+            if (bt_base64_decode(out, n, back) >= 0)
+                fail("corrupt input accepted", len);
+            out[pos] = saved;
+        }
+        // truncated to a length that isn't a whole number of quads
+        if (bt_base64_decode(out, n - 1 - rand_r(&seed) % (n < 3 ? n : 3), back) >= 0)
+            fail("truncated input accepted", len);
+    }
+}
+
+static void check_padding(void) {
+    static const char *bad[] = { "=", "==", "===", "====", "Zg=", "Z===", "Zg=a", "Zm9v=Zg=", "Zg==Zm9v", "Zm=v" };
+    uint8_t back[16];
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+        if (bt_base64_decode(bad[i], strlen(bad[i]), back) >= 0)
+            fail(bad[i], strlen(bad[i]));
+}
+
+static void bench(const char *name, size_t len, bool blocks) {
+    uint8_t *in = (uint8_t *)malloc(len), *back = (uint8_t *)malloc(BT_BASE64_DECODED_MAX(BT_BASE64_ENCODED_LEN(len)));
+    char *out = (char *)malloc(BT_BASE64_ENCODED_LEN(len));
+    unsigned seed = 1;
+    for (size_t i = 0; i < len; i++)
+        in[i] = rand_r(&seed);
+    size_t (*enc)(const uint8_t *, size_t, char *) = base64_encode_blocks;
+    size_t (*dec)(const char *, size_t, uint8_t *) = base64_decode_blocks;
+    if (!blocks) {
+        base64_encode_blocks = base64_encode_none;
+        base64_decode_blocks = base64_decode_none;
+    }
+    int iterations = (64 << 20) / len;     // 64 MB of input each way
+    size_t n = 0;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int i = 0; i < iterations; i++)
+        n = bt_base64_encode(in, len, out);
+    nsecs_t encoded = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    ssize_t m = 0;
+    for (int i = 0; i < iterations; i++)
+        m = bt_base64_decode(out, n, back);
+    nsecs_t decoded = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    base64_encode_blocks = enc;
+    base64_decode_blocks = dec;
+    if (m != (ssize_t)len || memcmp(back, in, len))
+        fail("benchmark round trip", len);
+    printf("%-6s %6zu bytes: encode %7.1f MB/s %7.1f ns/call, decode %7.1f MB/s %7.1f ns/call\n",
+            name, len, 64.0 / (encoded / 1E9), (double)encoded / iterations,
+            64.0 / (decoded / 1E9), (double)decoded / iterations);
+    free(in);
+    free(out);
+    free(back);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 200000;
+    unsigned seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n round_trips] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    pthread_once(&base64_once, base64_init);
+    const char *path = base64_encode_blocks == base64_encode_none ? "scalar only"
+#ifdef BT_BASE64_SSSE3
+                     : base64_encode_blocks == base64_encode_ssse3 ? "ssse3"
+#endif
+                     : "neon";
+    printf("block path: %s\n", path);
+    check_vectors();
+    check_round_trips(rounds, seed);
+    check_padding();
+    printf("%d round trips: %s\n", rounds, failures ? "FAILED" : "ok");
+
+    bench("scalar", 32, false);
+    bench("blocks", 32, true);
+    bench("scalar", 65536, false);
+    bench("blocks", 65536, true);
+    return failures ? 1 : 0;
+}
@@ -1,6 +1,7 @@
 
 static const char *signames[] = {
     "type='signal',interface='org.freedesktop.DBus'",
+    "type='signal',interface='"BLUEZ_DBUS_BASE_IFC".Manager'",
     "type='signal',interface='"BLUEZ_DBUS_BASE_IFC".Adapter'",
     "type='signal',interface='"BLUEZ_DBUS_BASE_IFC".Device'",
     "type='signal',interface='"BLUEZ_DBUS_BASE_IFC".Input'",
@@ -13,8 +14,29 @@ static const char *signames[] = {
     "type='signal',interface='org.bluez.audio.Manager'",
     NULL};
 
+// Where the narrow match rules for each signal interface are anchored (see
+// match_scope() in service.cpp); signames above is the wide set used by -W
+#define MATCH_NONE    0      // unicast to us, no rule needed
+#define MATCH_ROOT    1      // on "/"
+#define MATCH_ADAPTER 2      // on each tracked adapter
+#define MATCH_DEVICE  3      // on each created device
+static CHARMAPTYPE matchscopemap[] = {
+    {"org.freedesktop.DBus", MATCH_NONE},
+    {BLUEZ_DBUS_BASE_IFC ".Manager", MATCH_ROOT},
+    {BLUEZ_DBUS_BASE_IFC ".Adapter", MATCH_ADAPTER},
+    {BLUEZ_DBUS_BASE_IFC ".NetworkServer", MATCH_ADAPTER},
+    {BLUEZ_DBUS_BASE_IFC ".Device", MATCH_DEVICE},
+    {BLUEZ_DBUS_BASE_IFC ".Input", MATCH_DEVICE},
+    {BLUEZ_DBUS_BASE_IFC ".Network", MATCH_DEVICE},
+    {BLUEZ_DBUS_BASE_IFC ".HealthDevice", MATCH_DEVICE},
+    {BLUEZ_DBUS_BASE_IFC ".AudioSink", MATCH_DEVICE},
+    {NULL, MATCH_NONE}};
+
 #define SIGNITEMS \
     SIGDEF("org.freedesktop.DBus", "NameAcquired", BSIG_NameAcquired) \
+    SIGDEF("org.bluez.Manager", "AdapterAdded", BSIG_ManagerAdapterAdded) \
+    SIGDEF("org.bluez.Manager", "AdapterRemoved", BSIG_ManagerAdapterRemoved) \
+    SIGDEF("org.bluez.Manager", "DefaultAdapterChanged", BSIG_ManagerDefaultAdapterChanged) \
     SIGDEF("org.bluez.Adapter", "DeviceFound", BSIG_AdapterDeviceFound) \
     SIGDEF("org.bluez.Adapter", "DeviceDisappeared", BSIG_AdapterDeviceDisappeared) \
     SIGDEF("org.bluez.Adapter", "DeviceCreated", BSIG_AdapterDeviceCreated) \
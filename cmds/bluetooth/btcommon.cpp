@@ -89,6 +89,36 @@ bool zzdbus_message_append_args_valist (DBusMessage *message, int type, va_list
     return TRUE;
 }
 
+/*
+ * The event loop holds this across dbus_connection_dispatch(), and
+ * dbus_func_async() holds it from sending a call until its notify function
+ * is attached.  Without it a quick reply can be dispatched in between and
+ * is then dropped, leaving the caller waiting forever.  Recursive, as
+ * handlers running under dispatch issue async calls of their own.
+ */
+static pthread_mutex_t dispatchLock;
+static pthread_once_t dispatchLockOnce = PTHREAD_ONCE_INIT;
+
+static void dispatch_lock_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&dispatchLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void dbus_dispatch_lock(void)
+{
+    pthread_once(&dispatchLockOnce, dispatch_lock_init);
+    pthread_mutex_lock(&dispatchLock);
+}
+
+void dbus_dispatch_unlock(void)
+{
+    pthread_mutex_unlock(&dispatchLock);
+}
+
 static void async_cb(DBusPendingCall *call, void *data)
 {
     dbus_async_call_t *req = (dbus_async_call_t *)data;
@@ -107,13 +137,141 @@ static void async_cb(DBusPendingCall *call, void *data)
     free(req);
 }
 
+/*
+ * Method call templates.  dbus_message_new_method_call() validates and
+ * marshals destination, path, interface and member on every call; the
+ * same GetProperties/SetProperty/DiscoverServices calls are made over and
+ * over, so keep one header-only message per (path, interface, method) and
+ * dbus_message_copy() it, which leaves only the arguments to marshal.
+ * The copy is unlocked and has no serial, so it can be sent as is.
+ * Device paths come and go, so the cache is bounded and, once full, a
+ * clock sweep replaces a template that has not been used since the hand
+ * last passed it.
+ */
+#define MSG_TEMPLATE_BUCKETS 64
+#define MSG_TEMPLATE_MAX 256
+
+typedef struct msg_template {
+    struct msg_template *next;
+    uint32_t hash;
+    bool referenced;              // used since the clock hand last passed
+    char *path;
+    const char *ifc;              // interface and method names are literals
+    const char *func;
+    DBusMessage *msg;
+} msg_template_t;
+
+static msg_template_t *msgTemplates[MSG_TEMPLATE_BUCKETS];
+static msg_template_t *msgTemplateClock[MSG_TEMPLATE_MAX];
+static int msgTemplateCount;
+static int msgTemplateHand;
+static uint64_t msgTemplateHits, msgTemplateMisses, msgTemplateEvictions;
+static pthread_mutex_t msgTemplateLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t template_hash(const char *path, const char *ifc, const char *func)
+{
+    uint32_t h = 2166136261u;     // FNV-1a
+    for (const char *p = path; *p; p++)
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    for (const char *p = ifc; *p; p++)
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    for (const char *p = func; *p; p++)
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    return h;
+}
+
+// Take a template slot for reuse, unlinked from its bucket.  Called with
+// msgTemplateLock held.
+static msg_template_t *template_evict(void)
+{
+    msg_template_t *t;
+    if (msgTemplateCount < MSG_TEMPLATE_MAX) {
+        t = (msg_template_t *)malloc(sizeof(msg_template_t));
+        if (t)
+            msgTemplateClock[msgTemplateCount++] = t;
+        return t;
+    }
+    for (;;) {
+        t = msgTemplateClock[msgTemplateHand];
+        msgTemplateHand = (msgTemplateHand + 1) % MSG_TEMPLATE_MAX;
+        if (!t->referenced)
+            break;
+        t->referenced = false;
+    }
+    msg_template_t **p = &msgTemplates[t->hash % MSG_TEMPLATE_BUCKETS];
+    while (*p != t)
+        p = &(*p)->next;
+    *p = t->next;
+    free(t->path);
+    dbus_message_unref(t->msg);
+    msgTemplateEvictions++;
+    return t;
+}
+
+static DBusMessage *new_method_call(const char *path, const char *ifc, const char *func)
+{
+    uint32_t hash = template_hash(path, ifc, func);
+    msg_template_t **bucket = &msgTemplates[hash % MSG_TEMPLATE_BUCKETS];
+    DBusMessage *msg = NULL;
+
+    pthread_mutex_lock(&msgTemplateLock);
+    for (msg_template_t *t = *bucket; t; t = t->next) {
+        if (t->hash == hash && !strcmp(t->path, path) && !strcmp(t->func, func) && !strcmp(t->ifc, ifc)) {
+            t->referenced = true;
+            msg = dbus_message_copy(t->msg);
+            msgTemplateHits++;
+            break;
+        }
+    }
+    if (!msg) {
+        msgTemplateMisses++;
+        DBusMessage *tmpl = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, path, ifc, func);
+        msg_template_t *t = tmpl ? template_evict() : NULL;
+        if (t) {
+            t->hash = hash;
+            t->referenced = false;
+            t->path = strdup(path);
+            t->ifc = ifc;
+            t->func = func;
+            t->msg = tmpl;
+            t->next = *bucket;
+            *bucket = t;
+            msg = dbus_message_copy(tmpl);
+        } else if (tmpl) {
+            dbus_message_unref(tmpl);
+        }
+    }
+    pthread_mutex_unlock(&msgTemplateLock);
+    if (!msg)
+        msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, path, ifc, func);
+    return msg;
+}
+
+void dbus_template_stats(msg_template_stats_t *stats)
+{
+    pthread_mutex_lock(&msgTemplateLock);
+    stats->hits = msgTemplateHits;
+    stats->misses = msgTemplateMisses;
+    stats->evictions = msgTemplateEvictions;
+    stats->count = msgTemplateCount;
+    pthread_mutex_unlock(&msgTemplateLock);
+}
+
 static DBusPendingCall *startreq(int timeout_ms, //void (*user_cb)(DBusMessage *, void *, void*), void *user, 
 const char *path, const char *ifc, const char *func, int first_arg_type, va_list args)
 {
     dbus_bool_t reply = FALSE;
     DBusPendingCall *call = NULL; 
-    DBusMessage *msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, path, ifc, func); 
-    if (!dbus_message_append_args_valist(msg, first_arg_type, args)) {
+    if (!path) {
+        // e.g. global_adapter while bluetoothd has no adapter
+        ALOGE("%s: no object for %s.%s", __FUNCTION__, ifc, func);
+        return NULL;
+    }
+    DBusMessage *msg = new_method_call(path, ifc, func); 
+    if (!msg) {
+        printf("Could not allocate method call!");
+    }
+    else if (!dbus_message_append_args_valist(msg, first_arg_type, args)) {
         printf("Could not append argument to method call!");
     }
     else {
@@ -127,6 +285,7 @@ const char *path, const char *ifc, const char *func, int first_arg_type, va_list
 dbus_bool_t dbus_func_async(int timeout_ms, void (*reply)(DBusMessage *, void *, void*), void *user, const char *path, const char *ifc, const char *func, int first_arg_type, ...) {
     va_list lst;
     va_start(lst, first_arg_type);
+    dbus_dispatch_lock();
     DBusPendingCall * call = startreq(timeout_ms, path, ifc, func, first_arg_type, lst);
     va_end(lst);
     if (call) {
@@ -136,6 +295,7 @@ dbus_bool_t dbus_func_async(int timeout_ms, void (*reply)(DBusMessage *, void *,
         //pending->method = msg; 
         dbus_pending_call_set_notify(call, async_cb, pending, NULL);
     }
+    dbus_dispatch_unlock();
     return call != NULL;
 }
 DBusMessage * dbus_func_args(const char *path, const char *ifc, const char *func, int first_arg_type, ...) {
@@ -145,6 +305,7 @@ DBusMessage * dbus_func_args(const char *path, const char *ifc, const char *func
     DBusPendingCall * call = startreq(-1, path, ifc, func, first_arg_type, lst);
     va_end(lst);
     DBusError err;
+    dbus_error_init(&err);
     if (call) {
         dbus_pending_call_block (call);
         reply = dbus_pending_call_steal_reply (call);
@@ -363,23 +524,201 @@ printf("[%s:%d]\n", __FUNCTION__, __LINE__);
     return 1;
 }
 
-int get_bdaddr(const char *str, bdaddr_t *ba) {
-    char *d = ((char *)ba) + 5, *endp;
-    int i;
-    for(i = 0; i < 6; i++) {
-        *d-- = strtol(str, &endp, 16);
-        if (*endp != ':' && i != 5) {
-            memset(ba, 0, sizeof(bdaddr_t));
+/*
+ * Addresses.  These are parsed for every found device and every accepted
+ * connection, so parsing and formatting go through tables rather than
+ * strtol/sprintf, and lookups key on the address packed into 48 bits of a
+ * bt_addr_t instead of on its string.
+ */
+static const int8_t hexval[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+static const char hexdigit[] = "0123456789ABCDEF";
+
+// Strictly "XX:XX:XX:XX:XX:XX", either case; anything after it is ignored
+int bt_addr_parse(const char *str, bt_addr_t *addr)
+{
+    const uint8_t *s = (const uint8_t *)str;
+    bt_addr_t v = 0;
+    for (int i = 0; i < 6; i++, s += 3) {
+        int hi = hexval[s[0]];
+        if (hi < 0)
             return -1;
-        }
-        str = endp + 1;
+        int lo = hexval[s[1]];
+        if (lo < 0 || (i < 5 && s[2] != ':'))
+            return -1;
+        v = (v << 8) | (hi << 4) | lo;
     }
+    *addr = v;
+    return 0;
+}
+
+void bt_addr_format(bt_addr_t addr, char *str)
+{
+    for (int i = 5; i >= 0; i--, addr >>= 8) {
+        str[i * 3] = hexdigit[(addr >> 4) & 15];
+        str[i * 3 + 1] = hexdigit[addr & 15];
+        str[i * 3 + 2] = ':';
+    }
+    str[BTADDR_SIZE - 1] = 0;
+}
+
+int get_bdaddr(const char *str, bdaddr_t *ba) {
+    bt_addr_t addr;
+    if (bt_addr_parse(str, &addr) < 0) {
+        memset(ba, 0, sizeof(bdaddr_t));
+        return -1;
+    }
+    bt_addr_unpack(addr, ba);
     return 0;
 }
 
 void get_bdaddr_as_string(const bdaddr_t *ba, char *str) {
-    const uint8_t *b = (const uint8_t *)ba;
-    sprintf(str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X", b[5], b[4], b[3], b[2], b[1], b[0]);
+    bt_addr_format(bt_addr_pack(ba), str);
+}
+
+/*
+ * Open-addressing map from bt_addr_t to a pointer: linear probing over a
+ * power-of-two table kept at most half full, with backward-shift deletion
+ * so there are no tombstones.  Not locked; callers hold their own lock.
+ */
+#define BT_ADDR_MAP_MIN 16
+
+typedef struct {
+    bt_addr_t addr;            // BT_ADDR_NONE for an empty slot
+    void *value;
+} bt_addr_slot_t;
+
+struct bt_addr_map {
+    bt_addr_slot_t *slots;
+    size_t mask;
+    size_t count;
+};
+
+static bt_addr_slot_t *addr_map_alloc(size_t size)
+{
+    bt_addr_slot_t *slots = (bt_addr_slot_t *)malloc(size * sizeof(*slots));
+    for (size_t i = 0; slots && i < size; i++)
+        slots[i].addr = BT_ADDR_NONE;
+    return slots;
+}
+
+bt_addr_map_t *bt_addr_map_new(void)
+{
+    bt_addr_map_t *map = (bt_addr_map_t *)calloc(1, sizeof(*map));
+    if (!map)
+        return NULL;
+    map->slots = addr_map_alloc(BT_ADDR_MAP_MIN);
+    if (!map->slots) {
+        free(map);
+        return NULL;
+    }
+    map->mask = BT_ADDR_MAP_MIN - 1;
+    return map;
+}
+
+void bt_addr_map_free(bt_addr_map_t *map)
+{
+    if (!map)
+        return;
+    free(map->slots);
+    free(map);
+}
+
+size_t bt_addr_map_size(const bt_addr_map_t *map)
+{
+    return map->count;
+}
+
+static bt_addr_slot_t *addr_map_find(const bt_addr_map_t *map, bt_addr_t addr)
+{
+    size_t i = bt_addr_hash(addr) & map->mask;
+    while (map->slots[i].addr != addr && map->slots[i].addr != BT_ADDR_NONE)
+        i = (i + 1) & map->mask;
+    return &map->slots[i];
+}
+
+void *bt_addr_map_get(const bt_addr_map_t *map, bt_addr_t addr)
+{
+    bt_addr_slot_t *slot = addr_map_find(map, addr);
+    return slot->addr == addr && addr != BT_ADDR_NONE ? slot->value : NULL;
+}
+
+// Add or replace; returns -ENOMEM if the table could not grow
+int bt_addr_map_put(bt_addr_map_t *map, bt_addr_t addr, void *value)
+{
+    if (addr == BT_ADDR_NONE)
+        return -EINVAL;
+    if ((map->count + 1) * 2 > map->mask + 1) {
+        size_t size = (map->mask + 1) * 2;
+        bt_addr_slot_t *old = map->slots, *slots = addr_map_alloc(size);
+        if (!slots)
+            return -ENOMEM;
+        map->slots = slots;
+        map->mask = size - 1;
+        for (size_t i = 0; i < size / 2; i++)
+            if (old[i].addr != BT_ADDR_NONE)
+                *addr_map_find(map, old[i].addr) = old[i];
+        free(old);
+    }
+    bt_addr_slot_t *slot = addr_map_find(map, addr);
+    if (slot->addr == BT_ADDR_NONE)
+        map->count++;
+    slot->addr = addr;
+    slot->value = value;
+    return 0;
+}
+
+// Returns the value that was removed, NULL if addr was not there
+void *bt_addr_map_remove(bt_addr_map_t *map, bt_addr_t addr)
+{
+    bt_addr_slot_t *slot = addr_map_find(map, addr);
+    if (slot->addr != addr || addr == BT_ADDR_NONE)
+        return NULL;
+    void *value = slot->value;
+    size_t hole = slot - map->slots;
+    // pull later members of the probe run back over the hole
+    for (size_t i = (hole + 1) & map->mask; map->slots[i].addr != BT_ADDR_NONE; i = (i + 1) & map->mask) {
+        size_t home = bt_addr_hash(map->slots[i].addr) & map->mask;
+        if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].addr = BT_ADDR_NONE;
+    map->count--;
+    return value;
+}
+
+// Walk the members in no particular order: start with *pos at 0, and stop
+// at NULL, so NULL values are never seen.  Removing during a walk can skip
+// members; collect what to remove and do it afterwards.
+void *bt_addr_map_next(const bt_addr_map_t *map, size_t *pos, bt_addr_t *addr)
+{
+    for (; *pos <= map->mask; (*pos)++) {
+        const bt_addr_slot_t *slot = &map->slots[*pos];
+        if (slot->addr != BT_ADDR_NONE) {
+            (*pos)++;
+            *addr = slot->addr;
+            return slot->value;
+        }
+    }
+    return NULL;
 }
 
 bool debug_no_encrypt() {
@@ -397,19 +736,280 @@ bool debug_no_encrypt() {
     }
 #endif
 }
+/*
+ * Base64 (RFC 4648, padded) for OOB hash/randomizer blobs.  The scalar
+ * code handles any length and all the error cases; the vector paths only
+ * take whole blocks of well-formed input and leave the tail, or anything
+ * they don't like, to it.  SSSE3 is picked at run time from cpuid; NEON is
+ * used whenever the target was built for it, as the rest of such a build
+ * already assumes it.
+ */
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static int8_t base64_value[256];      // -1 for anything outside the alphabet
+
+static size_t base64_encode_scalar(const uint8_t *in, size_t len, char *out)
+{
+    char *p = out;
+    for (; len >= 3; in += 3, len -= 3) {
+        uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+        *p++ = base64_alphabet[v >> 18];
+        *p++ = base64_alphabet[(v >> 12) & 63];
+        *p++ = base64_alphabet[(v >> 6) & 63];
+        *p++ = base64_alphabet[v & 63];
+    }
+    if (len) {
+        uint32_t v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+        *p++ = base64_alphabet[v >> 18];
+        *p++ = base64_alphabet[(v >> 12) & 63];
+        *p++ = len > 1 ? base64_alphabet[(v >> 6) & 63] : '=';
+        *p++ = '=';
+    }
+    return p - out;
+}
+
+// Decodes whole quads; padding is only allowed in the last one
+static ssize_t base64_decode_scalar(const char *in, size_t len, uint8_t *out)
+{
+    uint8_t *p = out;
+    if (len & 3)
+        return -1;
+    for (; len; in += 4, len -= 4) {
+        int a = base64_value[(uint8_t)in[0]], b = base64_value[(uint8_t)in[1]];
+        int c = base64_value[(uint8_t)in[2]], d = base64_value[(uint8_t)in[3]];
+        if ((a | b) < 0)
+            return -1;
+        if ((c | d) < 0) {
+            if (len != 4 || in[3] != '=' || (c < 0 && in[2] != '='))
+                return -1;
+            *p++ = (a << 2) | (b >> 4);
+            if (c >= 0)
+                *p++ = (b << 4) | (c >> 2);
+            break;
+        }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        *p++ = v >> 16;
+        *p++ = v >> 8;
+        *p++ = v;
+    }
+    return p - out;
+}
+
+#if (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__SSSE3__) || defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define BT_BASE64_SSSE3
+#include <cpuid.h>
+#include <tmmintrin.h>
+
+// 12 input bytes to 16 characters per round; reads 16, so stops 4 short
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(const uint8_t *in, size_t len, char *out)
+{
+    const __m128i shuf = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done = 0;
+    for (; len - done >= 16; done += 12) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + done)), shuf);
+        // split each 3 byte group into four 6 bit indices, one per byte
+        __m128i hi = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i lo = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        __m128i idx = _mm_or_si128(hi, lo);
+        // map each index range to the offset that turns it into ASCII
+        __m128i sel = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        sel = _mm_or_si128(sel, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+        __m128i chars = _mm_add_epi8(idx, _mm_shuffle_epi8(shift, sel));
+        _mm_storeu_si128((__m128i *)(out + done / 3 * 4), chars);
+    }
+    return done;
+}
+
+// 16 characters to 12 bytes per round, stopping at the first block holding
+// anything but alphabet characters.  Writes 16 bytes per round.
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(const char *in, size_t len, uint8_t *out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t done = 0;
+    for (; len - done >= 16; done += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, mask_2f));
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+            break;
+        __m128i eq_2f = _mm_cmpeq_epi8(v, mask_2f);
+        v = _mm_add_epi8(v, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles)));
+        // merge four 6 bit values into 24 bits per 32 bit lane, then pack
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i *)(out + done / 4 * 3), _mm_shuffle_epi8(v, pack));
+    }
+    return done;
+}
+
+static bool base64_have_ssse3(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+}
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define BT_BASE64_NEON
+#include <arm_neon.h>
+
+static uint8x8_t base64_lookup_neon(uint8x8x4_t lo, uint8x8x4_t hi, uint8x8_t idx)
+{
+    // vtbl gives 0 for indices past 32, which vtbx then fills from the top half
+    uint8x8_t r = vtbl4_u8(lo, idx);
+    return vtbx4_u8(r, hi, vsub_u8(idx, vdup_n_u8(32)));
+}
+
+// 24 input bytes to 32 characters per round
+static size_t base64_encode_neon(const uint8_t *in, size_t len, char *out)
+{
+    const uint8_t *a = (const uint8_t *)base64_alphabet;
+    uint8x8x4_t lo = { { vld1_u8(a), vld1_u8(a + 8), vld1_u8(a + 16), vld1_u8(a + 24) } };
+    uint8x8x4_t hi = { { vld1_u8(a + 32), vld1_u8(a + 40), vld1_u8(a + 48), vld1_u8(a + 56) } };
+    const uint8x8_t m63 = vdup_n_u8(63);
+    size_t done = 0;
+    for (; len - done >= 24; done += 24) {
+        uint8x8x3_t v = vld3_u8(in + done);
+        uint8x8x4_t c;
+        c.val[0] = vshr_n_u8(v.val[0], 2);
+        c.val[1] = vand_u8(vorr_u8(vshl_n_u8(v.val[0], 4), vshr_n_u8(v.val[1], 4)), m63);
+        c.val[2] = vand_u8(vorr_u8(vshl_n_u8(v.val[1], 2), vshr_n_u8(v.val[2], 6)), m63);
+        c.val[3] = vand_u8(v.val[2], m63);
+        for (int i = 0; i < 4; i++)
+            c.val[i] = base64_lookup_neon(lo, hi, c.val[i]);
+        vst4_u8((uint8_t *)out + done / 3 * 4, c);
+    }
+    return done;
+}
+
+// Value of each character, with 0xff lanes for anything outside the alphabet
+static uint8x8_t base64_value_neon(uint8x8_t c, uint8x8_t *bad)
+{
+    uint8x8_t upper = vand_u8(vcge_u8(c, vdup_n_u8('A')), vcle_u8(c, vdup_n_u8('Z')));
+    uint8x8_t lower = vand_u8(vcge_u8(c, vdup_n_u8('a')), vcle_u8(c, vdup_n_u8('z')));
+    uint8x8_t digit = vand_u8(vcge_u8(c, vdup_n_u8('0')), vcle_u8(c, vdup_n_u8('9')));
+    uint8x8_t plus = vceq_u8(c, vdup_n_u8('+'));
+    uint8x8_t slash = vceq_u8(c, vdup_n_u8('/'));
+    uint8x8_t v = vand_u8(upper, vsub_u8(c, vdup_n_u8('A')));
+    v = vorr_u8(v, vand_u8(lower, vsub_u8(c, vdup_n_u8('a' - 26))));
+    v = vorr_u8(v, vand_u8(digit, vadd_u8(c, vdup_n_u8(52 - '0'))));
+    v = vorr_u8(v, vand_u8(plus, vdup_n_u8(62)));
+    v = vorr_u8(v, vand_u8(slash, vdup_n_u8(63)));
+    uint8x8_t ok = vorr_u8(vorr_u8(upper, lower), vorr_u8(digit, vorr_u8(plus, slash)));
+    *bad = vorr_u8(*bad, vmvn_u8(ok));
+    return v;
+}
+
+// 32 characters to 24 bytes per round, stopping at any block that isn't
+// all alphabet characters
+static size_t base64_decode_neon(const char *in, size_t len, uint8_t *out)
+{
+    size_t done = 0;
+    for (; len - done >= 32; done += 32) {
+        uint8x8x4_t c = vld4_u8((const uint8_t *)in + done);
+        uint8x8_t bad = vdup_n_u8(0);
+        for (int i = 0; i < 4; i++)
+            c.val[i] = base64_value_neon(c.val[i], &bad);
+        if (vget_lane_u64(vreinterpret_u64_u8(bad), 0))
+            break;
+        uint8x8x3_t v;
+        v.val[0] = vorr_u8(vshl_n_u8(c.val[0], 2), vshr_n_u8(c.val[1], 4));
+        v.val[1] = vorr_u8(vshl_n_u8(c.val[1], 4), vshr_n_u8(c.val[2], 2));
+        v.val[2] = vorr_u8(vshl_n_u8(c.val[2], 6), c.val[3]);
+        vst3_u8(out + done / 4 * 3, v);
+    }
+    return done;
+}
+#endif
+
+static size_t base64_encode_none(const uint8_t *in, size_t len, char *out)
+{
+    return 0;
+}
+
+static size_t base64_decode_none(const char *in, size_t len, uint8_t *out)
+{
+    return 0;
+}
+
+// Vector front ends: return how much input they consumed
+static size_t (*base64_encode_blocks)(const uint8_t *in, size_t len, char *out) = base64_encode_none;
+static size_t (*base64_decode_blocks)(const char *in, size_t len, uint8_t *out) = base64_decode_none;
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+static void base64_init(void)
+{
+    memset(base64_value, -1, sizeof(base64_value));
+    for (int i = 0; i < 64; i++)
+        base64_value[(uint8_t)base64_alphabet[i]] = i;
+#ifdef BT_BASE64_SSSE3
+    if (base64_have_ssse3()) {
+        base64_encode_blocks = base64_encode_ssse3;
+        base64_decode_blocks = base64_decode_ssse3;
+    }
+#endif
+#ifdef BT_BASE64_NEON
+    base64_encode_blocks = base64_encode_neon;
+    base64_decode_blocks = base64_decode_neon;
+#endif
+}
+
+// Encode len bytes into out, which must hold BT_BASE64_ENCODED_LEN(len)
+// bytes; returns the number of characters written (no terminator).
+size_t bt_base64_encode(const uint8_t *in, size_t len, char *out)
+{
+    pthread_once(&base64_once, base64_init);
+    size_t done = base64_encode_blocks(in, len, out);
+    return done / 3 * 4 + base64_encode_scalar(in + done, len - done, out + done / 3 * 4);
+}
+
+// Decode len characters into out, which must hold BT_BASE64_DECODED_MAX(len)
+// bytes; returns the number of bytes written or -1 for malformed input.
+ssize_t bt_base64_decode(const char *in, size_t len, uint8_t *out)
+{
+    pthread_once(&base64_once, base64_init);
+    size_t done = base64_decode_blocks(in, len, out);
+    ssize_t n = base64_decode_scalar(in + done, len - done, out + done / 4 * 3);
+    return n < 0 ? -1 : (ssize_t)(done / 4 * 3) + n;
+}
+
 String8 bt_tobase64(const char *arg, int len)
 {
-   String8 retval;
-// 'a' 'z'
-// 'A' 'Z'
-// ~ ! * ( ) '
-   return retval;
+    char *buf = (char *)malloc(BT_BASE64_ENCODED_LEN(len));
+    if (!buf)
+        return String8();
+    size_t n = bt_base64_encode((const uint8_t *)arg, len, buf);
+    String8 retval(buf, n);
+    free(buf);
+    return retval;
 }
 
+// Returns a malloc'd buffer holding the decoded bytes, or NULL if arg is
+// not valid base64.  The caller frees it.
 const char *bt_frombase64(String8 arg, int *len)
 {
-   char *retval = NULL;
-   return retval;
+    uint8_t *retval = (uint8_t *)malloc(BT_BASE64_DECODED_MAX(arg.length()));
+    if (!retval)
+        return NULL;
+    ssize_t n = bt_base64_decode(arg.string(), arg.length(), retval);
+    if (n < 0) {
+        free(retval);
+        return NULL;
+    }
+    *len = n;
+    return (const char *)retval;
 }
 
 #if 0
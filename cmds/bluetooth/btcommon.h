@@ -30,6 +30,7 @@
 #include <utils/Vector.h>
 #include <utils/KeyedVector.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 
 namespace android {
 #define BLUEZ_DBUS_BASE_PATH      "/org/bluez"
@@ -39,8 +40,10 @@ namespace android {
 // It would be nicer to retrieve this from bluez using GetDefaultAdapter,
 // but this is only possible when the adapter is up (and hcid is running).
 // It is much easier just to hardcode bluetooth adapter to hci0
+// (the service itself enumerates all adapters with ListAdapters)
 #define BLUETOOTH_ADAPTER_HCI_NUM 0
 #define BLUEZ_ADAPTER_OBJECT_NAME BLUEZ_DBUS_BASE_PATH "/hci0"
+#define BLUEZ_MAX_ADAPTERS 8
 #define BTADDR_SIZE 18   // size of BT address character array (including null)
 
 // size of the dbus event loops pollfd structure, hopefully never to be grown
@@ -62,6 +65,17 @@ DBusMessage * dbus_func_args(const char *path, const char *ifc, const char *func
 int dbus_returns_int32(DBusMessage *reply);
 int dbus_returns_uint32(DBusMessage *reply);
 int dbus_returns_unixfd(DBusMessage *reply);
+void dbus_dispatch_lock(void);
+void dbus_dispatch_unlock(void);
+
+// Method call template cache counters (btcommon.cpp)
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int count;                 // templates held
+} msg_template_stats_t;
+void dbus_template_stats(msg_template_stats_t *stats);
 
 typedef KeyedVector<String8, String8> BTProperties;
 int parse_properties(BTProperties& prop, DBusMessageIter *iter);
@@ -70,8 +84,88 @@ void append_dict_args(DBusMessage *reply, const char *first_key, ...);
 void append_variant(DBusMessageIter *iter, int type, void *val);
 int get_bdaddr(const char *str, bdaddr_t *ba);
 void get_bdaddr_as_string(const bdaddr_t *ba, char *str);
+
+// A bdaddr_t packed into the low 48 bits, most significant byte first as
+// printed, so 00:1A:7D:DA:71:13 is 0x001a7dda7113 (btcommon.cpp)
+typedef uint64_t bt_addr_t;
+#define BT_ADDR_NONE ((bt_addr_t)-1)     // never a real address
+int bt_addr_parse(const char *str, bt_addr_t *addr);
+void bt_addr_format(bt_addr_t addr, char *str);   // str holds BTADDR_SIZE
+static inline bt_addr_t bt_addr_pack(const bdaddr_t *ba) {
+    const uint8_t *b = (const uint8_t *)ba;
+    return ((bt_addr_t)b[5] << 40) | ((bt_addr_t)b[4] << 32) | ((bt_addr_t)b[3] << 24)
+         | ((bt_addr_t)b[2] << 16) | ((bt_addr_t)b[1] << 8) | b[0];
+}
+static inline void bt_addr_unpack(bt_addr_t addr, bdaddr_t *ba) {
+    uint8_t *b = (uint8_t *)ba;
+    for (int i = 0; i < 6; i++, addr >>= 8)
+        b[i] = addr & 0xff;
+}
+// Mixes every input bit into the low bits, which is all a power-of-two
+// table looks at (the 64-bit finaliser from MurmurHash3)
+static inline uint32_t bt_addr_hash(bt_addr_t addr) {
+    addr ^= addr >> 33;
+    addr *= 0xff51afd7ed558ccdULL;
+    addr ^= addr >> 33;
+    addr *= 0xc4ceb9fe1a85ec53ULL;
+    addr ^= addr >> 33;
+    return (uint32_t)addr;
+}
+typedef struct bt_addr_map bt_addr_map_t;
+bt_addr_map_t *bt_addr_map_new(void);
+void bt_addr_map_free(bt_addr_map_t *map);
+size_t bt_addr_map_size(const bt_addr_map_t *map);
+void *bt_addr_map_get(const bt_addr_map_t *map, bt_addr_t addr);
+int bt_addr_map_put(bt_addr_map_t *map, bt_addr_t addr, void *value);
+void *bt_addr_map_remove(bt_addr_map_t *map, bt_addr_t addr);
+void *bt_addr_map_next(const bt_addr_map_t *map, size_t *pos, bt_addr_t *addr);
 bool debug_no_encrypt();
 
+// Base64 for OOB data (btcommon.cpp).  Decode buffers need a few bytes of
+// slack because the vector decoder stores whole blocks.
+#define BT_BASE64_ENCODED_LEN(n) (((n) + 2) / 3 * 4)
+#define BT_BASE64_DECODED_MAX(n) ((n) / 4 * 3 + 4)
+size_t bt_base64_encode(const uint8_t *in, size_t len, char *out);
+ssize_t bt_base64_decode(const char *in, size_t len, uint8_t *out);
+String8 bt_tobase64(const char *arg, int len);
+const char *bt_frombase64(String8 arg, int *len);
+
+// Binary journal of incoming D-Bus messages (btjournal.cpp)
+typedef void (*bt_journal_cb_t)(DBusMessage *msg, nsecs_t timestamp, void *user);
+int bt_journal_open(const char *path, size_t size);
+void bt_journal_close(void);
+bool bt_journal_enabled(void);
+void bt_journal_append(DBusMessage *msg);
+int bt_journal_replay(const char *path, bt_journal_cb_t cb, void *user);
+
+// Streaming IEEE 11073 reader for HDP data channels (bthealth.cpp)
+typedef struct bt_health_channel bt_health_channel_t;
+typedef struct {
+    uint16_t invoke_id;              // of the event report carrying the value
+    uint16_t obj_handle;             // metric object the value belongs to
+    uint16_t attr_id;                // attribute id for variable scans, else 0
+    uint32_t event_time;             // relative time stamp of the report
+    const uint8_t *data;             // observed value, still 11073 encoded
+    uint16_t len;
+} bt_health_measurement_t;
+typedef struct {
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t apdus;
+    uint64_t measurements;
+    uint64_t errors;                 // malformed or oversized APDUs
+    nsecs_t first_read;
+    nsecs_t last_read;
+    nsecs_t latency_total;           // first byte of an APDU read to it being parsed
+    nsecs_t latency_max;
+} bt_health_stats_t;
+typedef void (*bt_health_cb_t)(bt_health_channel_t *ch, const bt_health_measurement_t *m, void *user);
+bt_health_channel_t *bt_health_open(int fd, bt_health_cb_t cb, void *user);
+int bt_health_fd(bt_health_channel_t *ch);
+int bt_health_read(bt_health_channel_t *ch);
+void bt_health_get_stats(bt_health_channel_t *ch, bt_health_stats_t *stats);
+void bt_health_close(bt_health_channel_t *ch);
+
 // Result codes from Bluez DBus calls
 #define BOND_RESULT_ERROR                      -1
 #define BOND_RESULT_SUCCESS                     0
@@ -0,0 +1,336 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define LOG_TAG "bluetooth_health.cpp"
+
+#include "btcommon.h"
+#include "utils/Log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+/*
+ * Streaming reader for HDP data channels.  Bytes are read from the
+ * non-blocking channel fd straight into a per-channel ring and IEEE
+ * 11073-20601 APDUs are cut out of it as soon as they are complete, so a
+ * short read never blocks and several APDUs arriving together cost one
+ * read.  Observation scans in event reports are handed to the callback one
+ * value at a time; everything else is only counted.
+ */
+
+namespace android {
+
+#define BT_HEALTH_RING_SIZE 16384     // power of two, larger than any APDU we accept
+#define BT_HEALTH_RING_MASK (BT_HEALTH_RING_SIZE - 1)
+
+// APDU choices (20601 clause A.10)
+#define APDU_AARQ 0xe200
+#define APDU_AARE 0xe300
+#define APDU_RLRQ 0xe400
+#define APDU_RLRE 0xe500
+#define APDU_ABRT 0xe600
+#define APDU_PRST 0xe700
+
+// DATA-apdu message choices carrying event reports
+#define ROIV_CMIP_EVENT_REPORT           0x0100
+#define ROIV_CMIP_CONFIRMED_EVENT_REPORT 0x0101
+
+// event types (nomenclature partition 1)
+#define MDC_NOTI_CONFIG             0x0d1c
+#define MDC_NOTI_SCAN_REPORT_FIXED  0x0d1d
+#define MDC_NOTI_SCAN_REPORT_VAR    0x0d1e
+
+struct bt_health_channel {
+    int fd;
+    bt_health_cb_t cb;
+    void *user;
+    uint8_t ring[BT_HEALTH_RING_SIZE];
+    uint32_t head;                    // free-running write position
+    uint32_t tail;                    // free-running start of the next APDU
+    nsecs_t head_time;                // arrival of the byte at tail
+    uint8_t apdu[BT_HEALTH_RING_SIZE];  // linear copy of an APDU that wraps
+    bt_health_stats_t stats;
+};
+
+typedef struct {
+    const uint8_t *p;
+    uint32_t left;
+} cursor_t;
+
+static bool get16(cursor_t *c, uint16_t *v)
+{
+    if (c->left < 2)
+        return false;
+    *v = (c->p[0] << 8) | c->p[1];
+    c->p += 2;
+    c->left -= 2;
+    return true;
+}
+
+static bool get32(cursor_t *c, uint32_t *v)
+{
+    uint16_t hi, lo;
+    if (!get16(c, &hi) || !get16(c, &lo))
+        return false;
+    *v = ((uint32_t)hi << 16) | lo;
+    return true;
+}
+
+// Split off a length-prefixed (or given length) sub-cursor
+static bool sub(cursor_t *c, uint32_t len, cursor_t *out)
+{
+    if (c->left < len)
+        return false;
+    out->p = c->p;
+    out->left = len;
+    c->p += len;
+    c->left -= len;
+    return true;
+}
+
+static bool octets(cursor_t *c, cursor_t *out)
+{
+    uint16_t len;
+    return get16(c, &len) && sub(c, len, out);
+}
+
+static void deliver(bt_health_channel_t *ch, bt_health_measurement_t *m, const cursor_t *val)
+{
+    m->data = val->p;
+    m->len = val->left;
+    ch->stats.measurements++;
+    if (ch->cb)
+        ch->cb(ch, m, ch->user);
+}
+
+// ScanReportInfoFixed: every observation is a handle and a value
+static bool parse_scan_fixed(bt_health_channel_t *ch, cursor_t *c, bt_health_measurement_t *m)
+{
+    uint16_t req_id, report_no, count, len, handle;
+    cursor_t list, val;
+    if (!get16(c, &req_id) || !get16(c, &report_no) || !get16(c, &count) || !get16(c, &len)
+     || !sub(c, len, &list))
+        return false;
+    m->attr_id = 0;
+    while (count--) {
+        if (!get16(&list, &handle) || !octets(&list, &val))
+            return false;
+        m->obj_handle = handle;
+        deliver(ch, m, &val);
+    }
+    return true;
+}
+
+// ScanReportInfoVar: every observation is a handle and an attribute list
+static bool parse_scan_var(bt_health_channel_t *ch, cursor_t *c, bt_health_measurement_t *m)
+{
+    uint16_t req_id, report_no, count, len, handle, attrs, attr_id;
+    cursor_t list, alist, val;
+    if (!get16(c, &req_id) || !get16(c, &report_no) || !get16(c, &count) || !get16(c, &len)
+     || !sub(c, len, &list))
+        return false;
+    while (count--) {
+        if (!get16(&list, &handle) || !get16(&list, &attrs) || !get16(&list, &len)
+         || !sub(&list, len, &alist))
+            return false;
+        m->obj_handle = handle;
+        while (attrs--) {
+            if (!get16(&alist, &attr_id) || !octets(&alist, &val))
+                return false;
+            m->attr_id = attr_id;
+            deliver(ch, m, &val);
+        }
+    }
+    return true;
+}
+
+static bool parse_prst(bt_health_channel_t *ch, cursor_t *c)
+{
+    uint16_t invoke_id, choice, handle, event_type;
+    uint32_t event_time;
+    cursor_t data, msg, info;
+    bt_health_measurement_t m;
+
+    if (!octets(c, &data) || !get16(&data, &invoke_id) || !get16(&data, &choice)
+     || !octets(&data, &msg))
+        return false;
+    if (choice != ROIV_CMIP_EVENT_REPORT && choice != ROIV_CMIP_CONFIRMED_EVENT_REPORT)
+        return true;
+    if (!get16(&msg, &handle) || !get32(&msg, &event_time) || !get16(&msg, &event_type)
+     || !octets(&msg, &info))
+        return false;
+    m.invoke_id = invoke_id;
+    m.event_time = event_time;
+    switch (event_type) {
+    case MDC_NOTI_SCAN_REPORT_FIXED:
+        return parse_scan_fixed(ch, &info, &m);
+    case MDC_NOTI_SCAN_REPORT_VAR:
+        return parse_scan_var(ch, &info, &m);
+    default:
+        // configuration and person-indexed reports are left to the caller's agent
+        return true;
+    }
+}
+
+static void parse_apdu(bt_health_channel_t *ch, uint16_t choice, const uint8_t *body, uint16_t len)
+{
+    cursor_t c = { body, len };
+    bool ok = true;
+
+    ch->stats.apdus++;
+    switch (choice) {
+    case APDU_PRST:
+        ok = parse_prst(ch, &c);
+        break;
+    case APDU_AARQ:
+    case APDU_AARE:
+    case APDU_RLRQ:
+    case APDU_RLRE:
+    case APDU_ABRT:
+        break;
+    default:
+        ok = false;
+    }
+    if (!ok)
+        ch->stats.errors++;
+}
+
+static void ring_copy(const bt_health_channel_t *ch, uint32_t pos, uint8_t *out, uint32_t n)
+{
+    uint32_t off = pos & BT_HEALTH_RING_MASK;
+    uint32_t first = BT_HEALTH_RING_SIZE - off;
+    if (first > n)
+        first = n;
+    memcpy(out, ch->ring + off, first);
+    memcpy(out + first, ch->ring, n - first);
+}
+
+// Cut every complete APDU out of the ring
+static void parse_ring(bt_health_channel_t *ch, nsecs_t now)
+{
+    uint8_t hdr[4];
+
+    while (ch->head - ch->tail >= sizeof(hdr)) {
+        ring_copy(ch, ch->tail, hdr, sizeof(hdr));
+        uint16_t choice = (hdr[0] << 8) | hdr[1];
+        uint32_t len = (hdr[2] << 8) | hdr[3];
+        if (len + sizeof(hdr) > BT_HEALTH_RING_SIZE) {
+            // lengths are all we have to frame on, so there is no resyncing
+            ALOGE("%s: %u byte APDU on fd %d, dropping buffered data\n", __FUNCTION__, len, ch->fd);
+            ch->stats.errors++;
+            ch->tail = ch->head;
+            return;
+        }
+        if (ch->head - ch->tail < sizeof(hdr) + len)
+            return;
+        uint32_t off = (ch->tail + sizeof(hdr)) & BT_HEALTH_RING_MASK;
+        const uint8_t *body = ch->ring + off;
+        if (off + len > BT_HEALTH_RING_SIZE) {
+            ring_copy(ch, ch->tail + sizeof(hdr), ch->apdu, len);
+            body = ch->apdu;
+        }
+        nsecs_t latency = now - ch->head_time;
+        ch->stats.latency_total += latency;
+        if (latency > ch->stats.latency_max)
+            ch->stats.latency_max = latency;
+        parse_apdu(ch, choice, body, len);
+        ch->tail += sizeof(hdr) + len;
+        // whatever follows a completed APDU came in with the latest read
+        ch->head_time = now;
+    }
+}
+
+bt_health_channel_t *bt_health_open(int fd, bt_health_cb_t cb, void *user)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ALOGE("%s: can't make fd %d non-blocking: %s\n", __FUNCTION__, fd, strerror(errno));
+        return NULL;
+    }
+    bt_health_channel_t *ch = (bt_health_channel_t *)calloc(1, sizeof(*ch));
+    if (!ch)
+        return NULL;
+    ch->fd = fd;
+    ch->cb = cb;
+    ch->user = user;
+    return ch;
+}
+
+int bt_health_fd(bt_health_channel_t *ch)
+{
+    return ch->fd;
+}
+
+// Drain the fd into the ring, parsing as it fills.  Returns the number of
+// bytes read, -EPIPE once the remote end has closed, or another -errno.
+int bt_health_read(bt_health_channel_t *ch)
+{
+    struct iovec iov[2];
+    int total = 0;
+
+    for (;;) {
+        uint32_t space = BT_HEALTH_RING_SIZE - (ch->head - ch->tail);
+        uint32_t off = ch->head & BT_HEALTH_RING_MASK;
+        uint32_t first = BT_HEALTH_RING_SIZE - off;
+        if (first > space)
+            first = space;
+        iov[0].iov_base = ch->ring + off;
+        iov[0].iov_len = first;
+        iov[1].iov_base = ch->ring;
+        iov[1].iov_len = space - first;
+        ssize_t n = readv(ch->fd, iov, iov[1].iov_len ? 2 : 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return total;
+            return -errno;
+        }
+        if (n == 0)
+            return -EPIPE;
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (ch->head == ch->tail)
+            ch->head_time = now;
+        if (!ch->stats.first_read)
+            ch->stats.first_read = now;
+        ch->stats.last_read = now;
+        ch->stats.bytes += n;
+        ch->stats.reads++;
+        ch->head += n;
+        total += n;
+        parse_ring(ch, now);
+    }
+}
+
+void bt_health_get_stats(bt_health_channel_t *ch, bt_health_stats_t *stats)
+{
+    *stats = ch->stats;
+}
+
+void bt_health_close(bt_health_channel_t *ch)
+{
+    if (!ch)
+        return;
+    close(ch->fd);
+    free(ch);
+}
+
+} /* namespace android */
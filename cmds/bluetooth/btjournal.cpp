@@ -0,0 +1,248 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define LOG_TAG "bluetooth_journal.cpp"
+
+#include "btcommon.h"
+#include "utils/Log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dbus/dbus.h>
+
+/*
+ * Binary journal of incoming D-Bus traffic.  Each message is stored
+ * marshalled, exactly as it came off the bus, behind a small record header
+ * carrying a monotonic timestamp.  Records live in a ring inside a
+ * memory-mapped file, so appending is a memcpy and the journal survives a
+ * crash; once full, the oldest records are overwritten.  When a record
+ * does not fit before the end of the ring a wrap marker sends readers back
+ * to the start.
+ */
+
+namespace android {
+
+#define BT_JOURNAL_MAGIC 0x314a5442   // "BTJ1"
+#define BT_JOURNAL_WRAP 0xffffffffu   // record length meaning "continue at 0"
+#define BT_JOURNAL_DATA 64            // records start here, after the header
+#define BT_JOURNAL_ALIGN(n) (((n) + 7) & ~7u)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                   // bytes in the record area
+    uint32_t head;                   // where the next record goes
+    uint32_t tail;                   // oldest record
+    uint32_t count;                  // records between tail and head
+    uint32_t pad;
+    uint64_t written;                // records ever appended
+    uint64_t overwritten;            // records lost to wrapping
+} bt_journal_header_t;
+
+typedef struct {
+    uint32_t len;                    // payload bytes, or BT_JOURNAL_WRAP
+    uint32_t type;                   // DBUS_MESSAGE_TYPE_*
+    int64_t timestamp;               // systemTime(SYSTEM_TIME_MONOTONIC)
+} bt_journal_record_t;
+
+static bt_journal_header_t *journal;
+static uint8_t *journalData;
+static size_t journalMapSize;
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const bt_journal_record_t *record_at(const bt_journal_header_t *hdr, const uint8_t *data, uint32_t *offset)
+{
+    if (*offset + sizeof(bt_journal_record_t) > hdr->size
+     || ((const bt_journal_record_t *)(data + *offset))->len == BT_JOURNAL_WRAP)
+        *offset = 0;
+    return (const bt_journal_record_t *)(data + *offset);
+}
+
+// Whether the record at offset, as returned by record_at(), ends inside
+// the record area; a damaged file can say anything in len
+static bool record_fits(const bt_journal_header_t *hdr, const bt_journal_record_t *rec, uint32_t offset)
+{
+    return rec->len <= hdr->size - offset - sizeof(*rec);
+}
+
+int bt_journal_open(const char *path, size_t size)
+{
+    struct stat st;
+    size = BT_JOURNAL_ALIGN(size);
+    if (size < 4096)
+        return -EINVAL;
+    bt_journal_close();
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ALOGE("%s: can't open %s: %s\n", __FUNCTION__, path, strerror(errno));
+        return -errno;
+    }
+    size_t mapsize = BT_JOURNAL_DATA + size;
+    bool fresh = fstat(fd, &st) || (size_t)st.st_size != mapsize;
+    if (fresh && ftruncate(fd, mapsize) < 0) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+    void *map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    pthread_mutex_lock(&journalLock);
+    journal = (bt_journal_header_t *)map;
+    journalData = (uint8_t *)map + BT_JOURNAL_DATA;
+    journalMapSize = mapsize;
+    // keep appending to an existing journal of the same size
+    if (fresh || journal->magic != BT_JOURNAL_MAGIC || journal->size != size
+     || journal->head >= size || journal->tail >= size) {
+        memset(journal, 0, sizeof(*journal));
+        journal->magic = BT_JOURNAL_MAGIC;
+        journal->size = size;
+    }
+    pthread_mutex_unlock(&journalLock);
+    return 0;
+}
+
+void bt_journal_close(void)
+{
+    pthread_mutex_lock(&journalLock);
+    if (journal) {
+        munmap(journal, journalMapSize);
+        journal = NULL;
+        journalData = NULL;
+    }
+    pthread_mutex_unlock(&journalLock);
+}
+
+bool bt_journal_enabled(void)
+{
+    return journal != NULL;
+}
+
+// Drop the oldest record to make room
+static void evict_oldest(void)
+{
+    const bt_journal_record_t *rec = record_at(journal, journalData, &journal->tail);
+    if (!record_fits(journal, rec, journal->tail)) {
+        // reopened a damaged journal: start it over
+        journal->overwritten += journal->count;
+        journal->count = 0;
+        return;
+    }
+    journal->tail += BT_JOURNAL_ALIGN(sizeof(*rec) + rec->len);
+    journal->count--;
+    journal->overwritten++;
+}
+
+void bt_journal_append(DBusMessage *msg)
+{
+    char *buf;
+    int len;
+
+    if (!journal)
+        return;
+    if (!dbus_message_marshal(msg, &buf, &len))
+        return;
+    uint32_t total = BT_JOURNAL_ALIGN(sizeof(bt_journal_record_t) + len);
+    pthread_mutex_lock(&journalLock);
+    if (!journal || total > journal->size / 2)
+        goto out;
+    for (;;) {
+        if (!journal->count)
+            journal->head = journal->tail = 0;
+        if (journal->count && journal->head <= journal->tail) {
+            // writing behind the oldest record
+            if (journal->tail - journal->head >= total)
+                break;
+            evict_oldest();
+        } else {
+            if (journal->size - journal->head >= total)
+                break;
+            if (journal->size - journal->head >= sizeof(uint32_t))
+                *(uint32_t *)(journalData + journal->head) = BT_JOURNAL_WRAP;
+            journal->head = 0;
+        }
+    }
+    {
+        bt_journal_record_t *rec = (bt_journal_record_t *)(journalData + journal->head);
+        rec->type = dbus_message_get_type(msg);
+        rec->timestamp = systemTime(SYSTEM_TIME_MONOTONIC);
+        memcpy(rec + 1, buf, len);
+        rec->len = len;
+        journal->head += total;
+        journal->count++;
+        journal->written++;
+    }
+out:
+    pthread_mutex_unlock(&journalLock);
+    dbus_free(buf);
+}
+
+// Feed every record in the journal at path, oldest first, to cb.  Returns
+// the number of records or a negative errno.
+int bt_journal_replay(const char *path, bt_journal_cb_t cb, void *user)
+{
+    struct stat st;
+    DBusError err;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) || st.st_size < BT_JOURNAL_DATA) {
+        close(fd);
+        return -EINVAL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -errno;
+    const bt_journal_header_t *hdr = (const bt_journal_header_t *)map;
+    const uint8_t *data = (const uint8_t *)map + BT_JOURNAL_DATA;
+    if (hdr->magic != BT_JOURNAL_MAGIC || BT_JOURNAL_DATA + (off_t)hdr->size != st.st_size
+     || hdr->size < sizeof(bt_journal_record_t) || hdr->tail >= hdr->size) {
+        munmap(map, st.st_size);
+        return -EINVAL;
+    }
+    printf("journal %s: %u records, %llu written, %llu overwritten\n", path, hdr->count,
+            (unsigned long long)hdr->written, (unsigned long long)hdr->overwritten);
+    uint32_t offset = hdr->tail;
+    int n;
+    for (n = 0; n < (int)hdr->count; n++) {
+        const bt_journal_record_t *rec = record_at(hdr, data, &offset);
+        if (!record_fits(hdr, rec, offset)) {
+            printf("journal %s: record %d at %u runs past the end (%u bytes), stopping\n", path, n, offset, rec->len);
+            break;
+        }
+        dbus_error_init(&err);
+        DBusMessage *msg = dbus_message_demarshal((const char *)(rec + 1), rec->len, &err);
+        if (!msg) {
+            LOG_AND_FREE_DBUS_ERROR(&err);
+            break;
+        }
+        cb(msg, rec->timestamp, user);
+        dbus_message_unref(msg);
+        offset += BT_JOURNAL_ALIGN(sizeof(*rec) + rec->len);
+    }
+    munmap(map, st.st_size);
+    return n;
+}
+
+} /* namespace android */
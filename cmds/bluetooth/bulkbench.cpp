@@ -0,0 +1,251 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * bulkbench: throughput benchmark for the bulk transfer path in
+ * socket.cpp.  A file is pushed, OBEX style, over an AF_UNIX socketpair
+ * standing in for the Bluetooth socket: SOCK_STREAM for RFCOMM and
+ * SOCK_SEQPACKET for L2CAP, with -u as the L2CAP outgoing MTU.  Each run
+ * uses one way of sending:
+ *   copy      read() into a buffer and asocket_write(), as writeNative()
+ *   writev    the same buffer through bulkWritevNative()
+ *   sendfile  bulkSendFromFdNative() from the file
+ *   splice    bulkSendFromFdNative() from a non-blocking pipe that a
+ *             second thread fills in bursts
+ * A reader thread checks that every byte arrives and, on packet sockets,
+ * that no packet is larger than the MTU.  Reports MB/s and the sender's
+ * CPU time per MB.
+ *
+ *   bulkbench [-m MB] [-u mtu] [-d dir]
+ */
+
+#include "socket.cpp"
+
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+namespace android {
+// btcommon.cpp's D-Bus helpers use service.cpp's connection; nothing here calls them
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+enum {MODE_COPY, MODE_WRITEV, MODE_SENDFILE, MODE_SPLICE, MODE_COUNT};
+static const char *mode_names[] = {"copy", "writev", "sendfile", "splice"};
+
+static uint32_t fnv(uint32_t h, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619;
+    return h;
+}
+
+struct reader_args {
+    int fd;
+    uint64_t bytes;
+    uint32_t hash;
+    size_t max_packet;
+};
+
+static void *reader(void *arg) {
+    reader_args *r = (reader_args *)arg;
+    size_t size = 256 * 1024;
+    uint8_t *buf = (uint8_t *)malloc(size);
+    r->hash = 2166136261u;
+    for (;;) {
+        ssize_t n = read(r->fd, buf, size);
+        if (n <= 0)
+            break;
+        r->hash = fnv(r->hash, buf, n);
+        r->bytes += n;
+        if ((size_t)n > r->max_packet)
+            r->max_packet = n;
+    }
+    free(buf);
+    return NULL;
+}
+
+struct feeder_args {
+    int file;
+    int pipe;
+};
+
+// Fill the pipe in uneven bursts with pauses, so the sender often finds it
+// empty
+static void *feeder(void *arg) {
+    feeder_args *f = (feeder_args *)arg;
+    char buf[48 * 1024];
+    unsigned seed = 1;
+    ssize_t n;
+    while ((n = read(f->file, buf, 4096 + rand_r(&seed) % (sizeof(buf) - 4096))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            struct pollfd pfd = { f->pipe, POLLOUT, 0 };
+            poll(&pfd, 1, -1);
+            ssize_t w = write(f->pipe, buf + off, n - off);
+            if (w < 0 && errno != EAGAIN)
+                goto out;
+            if (w > 0)
+                off += w;
+        }
+        if (rand_r(&seed) % 8 == 0)
+            usleep(1000);
+    }
+out:
+    close(f->pipe);
+    return NULL;
+}
+
+static nsecs_t thread_cpu() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool run(int sock_type, int mode, const char *path, size_t size, uint32_t expect, size_t mtu) {
+    int sv[2];
+    if (socketpair(AF_UNIX, sock_type | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "bulkbench: socketpair: %s\n", strerror(errno));
+        return false;
+    }
+    bool packet = sock_type == SOCK_SEQPACKET;
+    int type = packet ? TYPE_L2CAP : TYPE_RFCOMM;
+    struct asocket *s = asocket_init(sv[0]);
+    bt_bulk_t b;
+    bt_bulk_init(&b, s, type);
+    if (packet)
+        b.mtu = mtu;               // what L2CAP_OPTIONS would say on a real channel
+
+    reader_args r;
+    memset(&r, 0, sizeof(r));
+    r.fd = sv[1];
+    pthread_t rthread, fthread;
+    pthread_create(&rthread, NULL, reader, &r);
+
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t cpu = thread_cpu();
+    ssize_t sent = 0;
+    size_t chunk = packet ? mtu : BULK_CHUNK;
+    char *buf = (char *)malloc(BULK_CHUNK);
+    switch (mode) {
+    case MODE_COPY:
+        for (ssize_t n; (n = read(file, buf, chunk)) > 0; ) {
+            for (ssize_t off = 0; off < n; ) {
+                int w = asocket_write(s, buf + off, n - off, -1);
+                if (w < 0)
+                    goto out;
+                off += w;
+                sent += w;
+            }
+        }
+        break;
+    case MODE_WRITEV:
+        for (ssize_t n; (n = read(file, buf, chunk)) > 0; ) {
+            struct iovec iov = { buf, (size_t)n };
+            if (bulkWritevNative(&b, &iov, 1) < 0)
+                goto out;
+            sent += n;
+        }
+        break;
+    case MODE_SENDFILE: {
+        off_t offset = 0;
+        sent = bulkSendFromFdNative(&b, file, &offset, size);
+        break;
+        }
+    case MODE_SPLICE: {
+        int p[2];
+        pipe2(p, O_CLOEXEC | O_NONBLOCK);
+        feeder_args f = { file, p[1] };
+        pthread_create(&fthread, NULL, feeder, &f);
+        sent = bulkSendFromFdNative(&b, p[0], NULL, size);
+        pthread_join(fthread, NULL);
+        close(p[0]);
+        break;
+        }
+    }
+out:
+    cpu = thread_cpu() - cpu;
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(rthread, NULL);
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    free(buf);
+    close(file);
+    asocket_destroy(s);
+    close(sv[1]);
+
+    bool ok = (size_t)sent == size && r.bytes == size && r.hash == expect && (!packet || r.max_packet <= mtu);
+    double mb = size / 1048576.0;
+    printf("%-9s %-8s %7.1f MB/s, sender %6.2f ms CPU/MB, largest read %6zu, SO_SNDBUF %6d %s\n",
+           packet ? "seqpacket" : "stream", mode_names[mode], mb / (elapsed / 1E9),
+           cpu / 1E6 / mb, r.max_packet, b.sndbuf, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int megabytes = 64;
+    size_t mtu = 4096;
+    const char *dir = "/data/local/tmp";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:u:d:")) != -1) {
+        switch (opt) {
+        case 'm':
+            megabytes = atoi(optarg);
+            break;
+        case 'u':
+            mtu = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m MB] [-u mtu] [-d dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (megabytes <= 0 || mtu <= 0 || mtu > BULK_CHUNK) {
+        fprintf(stderr, "bulkbench: need MB > 0 and 0 < mtu <= %d\n", BULK_CHUNK);
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bulkbench.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "bulkbench: can't create a file in %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    size_t size = (size_t)megabytes << 20;
+    uint32_t expect = 2166136261u;
+    unsigned seed = 1;
+    uint8_t block[BULK_CHUNK];
+    for (size_t done = 0; done < size; done += sizeof(block)) {
+        for (size_t i = 0; i < sizeof(block); i++)
+            block[i] = rand_r(&seed);
+        expect = fnv(expect, block, sizeof(block));
+        write(fd, block, sizeof(block));
+    }
+    close(fd);
+
+    bool ok = true;
+    for (int mode = 0; mode < MODE_COUNT; mode++)
+        ok = run(SOCK_STREAM, mode, path, size, expect, mtu) && ok;
+    for (int mode = 0; mode < MODE_COUNT; mode++)
+        ok = run(SOCK_SEQPACKET, mode, path, size, expect, mtu) && ok;
+    unlink(path);
+    return ok ? 0 : 1;
+}
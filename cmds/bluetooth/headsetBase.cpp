@@ -25,6 +25,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
@@ -36,6 +37,29 @@
 
 namespace android {
 
+// Receive buffer for AT commands arriving on the RFCOMM link.  Bytes are
+// read in bulk into buf[start..end) and complete lines are handed out in
+// place; the unconsumed tail is only moved down when the buffer fills up.
+#define AT_RX_BUFFER_SIZE 1024
+
+typedef struct {
+    char buf[AT_RX_BUFFER_SIZE];
+    int start;
+    int end;
+} at_rx_buffer_t;
+
+// Result codes that could not be written straight away on a non-blocking
+// socket are queued in buf[start..end) and go out ahead of the next batch.
+#define AT_TX_BUFFER_SIZE 1024
+// Most URCs sent in a single writev(); each takes three iovecs
+#define AT_TX_MAX_BATCH 16
+
+typedef struct {
+    char buf[AT_TX_BUFFER_SIZE];
+    int start;
+    int end;
+} at_tx_buffer_t;
+
 typedef struct {
     String8 address;
     const char *c_address;
@@ -44,6 +68,8 @@ typedef struct {
     int rfcomm_sock;
     int rfcomm_connected; // -1 in progress, 0 not connected, 1 connected
     int rfcomm_sock_flags;
+    at_rx_buffer_t rx;
+    at_tx_buffer_t tx;
 } native_data_t;
 
 static inline native_data_t * get_native_data() {
@@ -53,52 +79,159 @@ static inline native_data_t * get_native_data() {
 static const char CRLF[] = "\xd\xa";
 static const int CRLF_LEN = 2;
 
-static inline int write_error_check(int fd, const char* line, int len) {
-    int ret;
+// Append the part of iov[] past the first 'written' bytes to the queue.
+static void queue_unwritten(at_tx_buffer_t *tx, const struct iovec *iov, int iovcnt, size_t written) {
+    for (int i = 0; i < iovcnt; i++) {
+        const char *base = (const char *)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        if (written >= len) {
+            written -= len;
+            continue;
+        }
+        base += written;
+        len -= written;
+        written = 0;
+        if (tx->start > 0 && tx->end + len > AT_TX_BUFFER_SIZE) {
+            memmove(tx->buf, tx->buf + tx->start, tx->end - tx->start);
+            tx->end -= tx->start;
+            tx->start = 0;
+        }
+        memcpy(tx->buf + tx->end, base, len);
+        tx->end += len;
+    }
+}
+
+// Write CRLF <line> CRLF for each line with one writev(), preceded by
+// anything still queued from a previous short write.  Whatever the socket
+// does not take now is queued; fails only if the queue would overflow.
+static int send_lines(int fd, at_tx_buffer_t *tx, const char **lines, int count) {
+    struct iovec iov[1 + AT_TX_MAX_BATCH * 3];
+    int iovcnt = 0;
+    size_t total = 0;
+    ssize_t ret;
+
+    if (count > AT_TX_MAX_BATCH) {
+        ALOGE("%s: %d URCs exceed batch limit of %d", __FUNCTION__, count, AT_TX_MAX_BATCH);
+        return -1;
+    }
+    if (tx->end > tx->start) {
+        iov[iovcnt].iov_base = tx->buf + tx->start;
+        iov[iovcnt++].iov_len = tx->end - tx->start;
+    }
+    for (int i = 0; i < count; i++) {
+        iov[iovcnt].iov_base = (void *)CRLF;
+        iov[iovcnt++].iov_len = CRLF_LEN;
+        iov[iovcnt].iov_base = (void *)lines[i];
+        iov[iovcnt++].iov_len = strlen(lines[i]);
+        iov[iovcnt].iov_base = (void *)CRLF;
+        iov[iovcnt++].iov_len = CRLF_LEN;
+    }
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (total == 0)
+        return 0;
     errno = 0;
-    ret = write(fd, line, len);
+    ret = TEMP_FAILURE_RETRY(writev(fd, iov, iovcnt));
     if (ret < 0) {
-        ALOGE("%s: write() failed: %s (%d)", __FUNCTION__, strerror(errno), errno);
-        return -1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            ALOGE("%s: writev() failed: %s (%d)", __FUNCTION__, strerror(errno), errno);
+            return -1;
+        }
+        ret = 0;
     }
-    if (ret != len) {
-        ALOGE("%s: write() only wrote %d of %d bytes", __FUNCTION__, ret, len);
+    if ((size_t)ret == total) {
+        tx->start = tx->end = 0;
+        return 0;
+    }
+    size_t unwritten = total - ret;
+    // Whatever of the queue went out is gone, even if the new lines can't
+    // be queued; otherwise the next flush would send it again
+    size_t pending = tx->end - tx->start;
+    if (pending) {
+        if ((size_t)ret < pending) {
+            tx->start += ret;
+            ret = 0;
+        } else {
+            tx->start = tx->end = 0;
+            ret -= pending;
+        }
+    }
+    if (unwritten > AT_TX_BUFFER_SIZE) {
+        ALOGE("%s: writev() left %d of %d bytes unwritten, URC queue full", __FUNCTION__, (int)unwritten, (int)total);
         return -1;
     }
+    ALOGV("%s: writev() left %d of %d bytes unwritten, queueing them", __FUNCTION__, (int)unwritten, (int)total);
+    queue_unwritten(tx, iov + (pending ? 1 : 0), iovcnt - (pending ? 1 : 0), ret);
     return 0;
 }
 
-static int send_line(int fd, const char* line) {
-    int nw;
-    int len = strlen(line);
-    int llen = len + CRLF_LEN * 2 + 1;
-    char *buffer = (char *)calloc(llen, sizeof(char));
-
-    snprintf(buffer, llen, "%s%s%s", CRLF, line, CRLF);
+static int send_line(int fd, at_tx_buffer_t *tx, const char* line) {
+    return send_lines(fd, tx, &line, 1);
+}
 
-    if (write_error_check(fd, buffer, llen - 1)) {
-        free(buffer);
+// Push out queued URC bytes; returns the number still pending or -1.
+static int flush_lines(int fd, at_tx_buffer_t *tx) {
+    if (send_lines(fd, tx, NULL, 0) < 0)
         return -1;
-    }
-    free(buffer);
-    return 0;
+    return tx->end - tx->start;
 }
 
-static void mask_eighth_bit(char *line)
+static void mask_eighth_bit(char *line, int len)
 {
-   for (;;line++) {
-     if (0 == *line) return;
-     *line &= 0x7F;
-   }
+    // Mask a word at a time; the tail (and unaligned buffers) byte by byte.
+    const uint64_t mask = 0x7F7F7F7F7F7F7F7FULL;
+    for (; len >= (int)sizeof(uint64_t); len -= sizeof(uint64_t), line += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, line, sizeof(w));
+        w &= mask;
+        memcpy(line, &w, sizeof(w));
+    }
+    for (; len > 0; len--, line++)
+        *line &= 0x7F;
+}
+
+// Cut the next CR terminated line out of the receive buffer.  As with the
+// old byte at a time reader, a LF discards anything received before it on
+// the same line.  Returns NULL if no complete line is buffered yet.
+static char *take_line(at_rx_buffer_t *rx, bool flush) {
+    char *line = rx->buf + rx->start;
+    int avail = rx->end - rx->start;
+    char *cr = (char *)memchr(line, '\xd', avail);
+    if (!cr) {
+        // Hand out a partial line on EOF or when it can no longer grow
+        if (!flush && !(rx->start == 0 && rx->end == AT_RX_BUFFER_SIZE - 1))
+            return NULL;
+        cr = line + avail;
+    }
+    char *lf;
+    while ((lf = (char *)memchr(line, '\xa', cr - line)) != NULL)
+        line = lf + 1;
+    *cr = 0;
+    rx->start = cr - rx->buf + (cr < rx->buf + rx->end ? 1 : 0);
+    if (rx->start == rx->end)
+        rx->start = rx->end = 0;
+    // According to ITU V.250 section 5.1, IA5 7 bit chars are used, 
+    //   the eighth bit or higher bits are ignored if they exists
+    // We mask out only eighth bit, no higher bit, since we do char
+    // string here, not wide char.
+    // We added this processing due to 2 real world problems.
+    // 1 BMW 2005 E46 which sends binary junk
+    // 2 Audi 2010 A3, dial command use 0xAD (soft-hyphen) as number 
+    //   formater, which was rejected by the AT handler
+    mask_eighth_bit(line, cr - line);
+    return line;
 }
 
-static const char* get_line(int fd, char *buf, int len, int timeout_ms, int *err) {
-    char *bufit=buf;
-    int fd_flags = fcntl(fd, F_GETFL, 0);
+// Returns a pointer into rx that stays valid until the next call.
+static const char* get_line(int fd, at_rx_buffer_t *rx, int timeout_ms, int *err) {
     struct pollfd pfd;
+    char *line;
 
+    *err = errno = 0;
+    // Lines already buffered from an earlier read are served without a syscall
+    if ((line = take_line(rx, false)) != NULL)
+        return line;
 again:
-    *bufit = 0;
     pfd.fd = fd;
     pfd.events = POLLIN;
     *err = errno = 0;
@@ -119,11 +252,16 @@ again:
         *err = errno;
         return NULL;
     } 
-    while ((int)(bufit - buf) < (len - 1)) {
+    for (;;) {
+        if (rx->end == AT_RX_BUFFER_SIZE - 1 && rx->start > 0) {
+            memmove(rx->buf, rx->buf + rx->start, rx->end - rx->start);
+            rx->end -= rx->start;
+            rx->start = 0;
+        }
         errno = 0;
-        int rc = TEMP_FAILURE_RETRY(read(fd, bufit, 1)); 
+        int rc = TEMP_FAILURE_RETRY(read(fd, rx->buf + rx->end, AT_RX_BUFFER_SIZE - 1 - rx->end));
         if (!rc)
-            break; 
+            return take_line(rx, true);
         if (rc < 0) {
             if (errno == EBUSY) {
                 ALOGI("read() error %s (%d): repeating read()...", strerror(errno), errno);
@@ -133,34 +271,244 @@ again:
             ALOGE("read() error %s (%d)", strerror(errno), errno);
             return NULL;
         } 
-        if (*bufit=='\xd') {
-            break;
-        } 
-        if (*bufit=='\xa')
-            bufit = buf;
-        else
-            bufit++;
-    } 
-    *bufit = 0; 
-    // According to ITU V.250 section 5.1, IA5 7 bit chars are used, 
-    //   the eighth bit or higher bits are ignored if they exists
-    // We mask out only eighth bit, no higher bit, since we do char
-    // string here, not wide char.
-    // We added this processing due to 2 real world problems.
-    // 1 BMW 2005 E46 which sends binary junk
-    // 2 Audi 2010 A3, dial command use 0xAD (soft-hyphen) as number 
-    //   formater, which was rejected by the AT handler
-    mask_eighth_bit(buf);
+        rx->end += rc;
+        if ((line = take_line(rx, false)) != NULL)
+            return line;
+        // Only a partial line so far; wait for the rest of it
+        ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, timeout_ms));
+        if (ret <= 0) {
+            *err = ret < 0 ? errno : 0;
+            return NULL;
+        }
+    }
+}
+
+// AT commands the AG understands, as named after the "AT" prefix.
+// Extended commands keep their leading '+'; a bare "AT" has no name.
+#define ATITEMS \
+    ATDEF("", AT_AT) \
+    ATDEF("A", AT_A) \
+    ATDEF("D", AT_D) \
+    ATDEF("+BRSF", AT_BRSF) \
+    ATDEF("+CIND", AT_CIND) \
+    ATDEF("+CMER", AT_CMER) \
+    ATDEF("+CHLD", AT_CHLD) \
+    ATDEF("+CHUP", AT_CHUP) \
+    ATDEF("+CLIP", AT_CLIP) \
+    ATDEF("+CCWA", AT_CCWA) \
+    ATDEF("+CMEE", AT_CMEE) \
+    ATDEF("+COPS", AT_COPS) \
+    ATDEF("+CLCC", AT_CLCC) \
+    ATDEF("+CNUM", AT_CNUM) \
+    ATDEF("+BTRH", AT_BTRH) \
+    ATDEF("+BLDN", AT_BLDN) \
+    ATDEF("+BVRA", AT_BVRA) \
+    ATDEF("+BINP", AT_BINP) \
+    ATDEF("+BIA", AT_BIA) \
+    ATDEF("+BAC", AT_BAC) \
+    ATDEF("+BCS", AT_BCS) \
+    ATDEF("+BCC", AT_BCC) \
+    ATDEF("+NREC", AT_NREC) \
+    ATDEF("+VGS", AT_VGS) \
+    ATDEF("+VGM", AT_VGM) \
+    ATDEF("+VTS", AT_VTS) \
+    ATDEF("+CKPD", AT_CKPD) \
+    ATDEF("+CSCS", AT_CSCS) \
+    ATDEF("+CPBS", AT_CPBS) \
+    ATDEF("+CPBR", AT_CPBR) \
+    ATDEF("+CPBF", AT_CPBF) \
+    ATDEF("+CGMI", AT_CGMI) \
+    ATDEF("+CGMM", AT_CGMM) \
+    ATDEF("+CGMR", AT_CGMR) \
+    ATDEF("+CGSN", AT_CGSN) \
+    ATDEF("+CSQ", AT_CSQ) \
+    ATDEF("+CBC", AT_CBC) \
+    ATDEF("+XAPL", AT_XAPL) \
+    ATDEF("+IPHONEACCEV", AT_IPHONEACCEV)
+
+enum {AT_UNKNOWN = -1,
+#define ATDEF(A,B) B,
+    ATITEMS
+#undef ATDEF
+    AT_NUM_COMMANDS};
+
+typedef struct {
+    const char *name;
+    int len;
+} ATTABLETYPE;
+
+#define ATDEF(A,B) {(A), sizeof(A) - 1},
+static const ATTABLETYPE attable[] = {
+    ATITEMS
+    {NULL, 0}};
+#undef ATDEF
+
+// The command form following the name
+enum {AT_FORM_EXEC, AT_FORM_SET, AT_FORM_READ, AT_FORM_TEST};
+
+#define AT_MAX_ARGS 16
+
+// A tokenized command.  All pointers point into the line it was parsed
+// from, which is split up in place.
+typedef struct {
+    int id;
+    const char *name;
+    int name_len;
+    int form;
+    int argc;
+    const char *argv[AT_MAX_ARGS];
+} at_command_t;
+
+// Result of a handler: send OK, send ERROR, or the handler replied itself
+enum {AT_RESULT_OK, AT_RESULT_ERROR, AT_RESULT_NONE};
+
+typedef int (*at_handler_t)(const at_command_t *cmd, void *user);
+
+typedef struct {
+    at_handler_t handler;
+    void *user;
+} at_dispatch_t;
+
+// Perfect hash over the command names above; at_init_table() checks at
+// startup that no two names share a slot.
+#define AT_HASH_SIZE 128
+static signed char at_hash_table[AT_HASH_SIZE];
+static at_dispatch_t at_handlers[AT_NUM_COMMANDS];
+
+static inline unsigned at_hash(const char *name, int len) {
+    unsigned c1 = len > 1 ? (unsigned char)name[1] : 0;
+    unsigned c2 = len > 2 ? (unsigned char)name[2] : 0;
+    unsigned c3 = len > 3 ? (unsigned char)name[3] : 0;
+    unsigned last = len > 0 ? (unsigned char)name[len - 1] : 0;
+    return (c1 + 21 * c2 + 3 * c3 + last + len) & (AT_HASH_SIZE - 1);
+}
+
+static bool at_init_table() {
+    memset(at_hash_table, AT_UNKNOWN, sizeof(at_hash_table));
+    for (int i = 0; attable[i].name; i++) {
+        unsigned h = at_hash(attable[i].name, attable[i].len);
+        if (at_hash_table[h] != AT_UNKNOWN) {
+            ALOGE("%s: AT commands %s and %s collide", __FUNCTION__, attable[i].name, attable[at_hash_table[h]].name);
+            memset(at_hash_table, AT_UNKNOWN, sizeof(at_hash_table));
+            return FALSE;
+        }
+        at_hash_table[h] = i;
+    }
+    return TRUE;
+}
+
+static int at_lookup(const char *name, int len) {
+    int id = at_hash_table[at_hash(name, len)];
+    if (id == AT_UNKNOWN || attable[id].len != len || memcmp(attable[id].name, name, len))
+        return AT_UNKNOWN;
+    return id;
+}
+
+// Strip blanks and a pair of double quotes around an argument, in place.
+static char *at_trim_arg(char *arg, char *end) {
+    while (arg < end && *arg == ' ')
+        arg++;
+    while (end > arg && end[-1] == ' ')
+        end--;
+    if (end - arg >= 2 && *arg == '"' && end[-1] == '"') {
+        arg++;
+        end--;
+    }
+    *end = 0;
+    return arg;
+}
+
+// Split an AT command line (as returned by get_line) into name, form and
+// arguments without copying.  Returns 0, or -1 if it is not an AT command.
+static int at_parse(char *line, at_command_t *cmd) {
+    char *p = line;
+
+    cmd->id = AT_UNKNOWN;
+    cmd->form = AT_FORM_EXEC;
+    cmd->argc = 0;
+    while (*p == ' ')
+        p++;
+    if ((p[0] & ~0x20) != 'A' || (p[1] & ~0x20) != 'T')
+        return -1;
+    p += 2;
+    cmd->name = p;
+    if (*p == '+') {
+        p++;
+        while (isalpha((unsigned char)*p)) {
+            *p &= ~0x20;
+            p++;
+        }
+    } else if (isalpha((unsigned char)*p)) {
+        // basic command: a single letter
+        *p &= ~0x20;
+        p++;
+    }
+    cmd->name_len = p - cmd->name;
+    if (cmd->name_len == 1 && cmd->name[0] == '+')
+        return -1;
+    cmd->id = at_lookup(cmd->name, cmd->name_len);
+
+    if (cmd->id == AT_D) {
+        // The dial string is everything up to the end of the line
+        cmd->argv[cmd->argc++] = p;
+        return 0;
+    }
+    if (*p == '?') {
+        cmd->form = AT_FORM_READ;
+        p++;
+    } else if (*p == '=') {
+        p++;
+        if (*p == '?') {
+            cmd->form = AT_FORM_TEST;
+            p++;
+        } else {
+            cmd->form = AT_FORM_SET;
+            char *arg = p;
+            for (;; p++) {
+                if (*p == ',' || *p == 0) {
+                    bool last = *p == 0;
+                    if (cmd->argc == AT_MAX_ARGS)
+                        return -1;
+                    cmd->argv[cmd->argc++] = at_trim_arg(arg, p);
+                    if (last)
+                        break;
+                    arg = p + 1;
+                } else if (*p == '"') {
+                    // commas inside a quoted string do not split
+                    char *q = strchr(p + 1, '"');
+                    if (q)
+                        p = q;
+                }
+            }
+        }
+    }
+    return *p == 0 ? 0 : -1;
+}
 
-    return buf;
+static void registerATHandlerNative(int id, at_handler_t handler, void *user) {
+    if (id < 0 || id >= AT_NUM_COMMANDS)
+        return;
+    at_handlers[id].handler = handler;
+    at_handlers[id].user = user;
 }
 
-static void classInitNative() {
+// A bare "AT" is the HF checking that the AG is there
+static int at_handle_at(const at_command_t *cmd, void *user) {
+    return cmd->form == AT_FORM_EXEC ? AT_RESULT_OK : AT_RESULT_ERROR;
+}
+
+static bool classInitNative() {
     ALOGV("%s", __FUNCTION__);
+    if (!at_init_table()) {
+        ALOGE("%s: AT command table is inconsistent, every command will fail", __FUNCTION__);
+        return FALSE;
+    }
+    registerATHandlerNative(AT_AT, at_handle_at, NULL);
     //field_mNativeData = get_field(env, clazz, "mNativeData", "I");
     //field_mAddress = get_field(env, clazz, "mAddress", "Ljava/lang/String;");
     //field_mTimeoutRemainingMs = get_field(env, clazz, "mTimeoutRemainingMs", "I");
     //field_mRfcommChannel = get_field(env, clazz, "mRfcommChannel", "I");
+    return TRUE;
 }
 
 static void initializeNativeDataNative(int socketFd) {
@@ -175,6 +523,8 @@ static void initializeNativeDataNative(int socketFd) {
     //nat->rfcomm_channel = env->GetIntField(object, field_mRfcommChannel);
     nat->rfcomm_sock = socketFd;
     nat->rfcomm_connected = socketFd >= 0;
+    nat->rx.start = nat->rx.end = 0;
+    nat->tx.start = nat->tx.end = 0;
     if (nat->rfcomm_connected)
         ALOGI("%s: ALREADY CONNECTED!", __FUNCTION__);
 }
@@ -372,6 +722,8 @@ static void disconnectNative() {
         nat->rfcomm_sock = -1;
         nat->rfcomm_connected = 0;
     }
+    nat->rx.start = nat->rx.end = 0;
+    nat->tx.start = nat->tx.end = 0;
 }
 
 static void pretty_log_urc(const char *urc) {
@@ -400,7 +752,7 @@ static bool sendURCNative(String8 urc) {
     native_data_t *nat = get_native_data();
     if (nat->rfcomm_connected) {
         const char *c_urc = urc.string();
-        bool ret = send_line(nat->rfcomm_sock, c_urc) == 0 ? TRUE : FALSE;
+        bool ret = send_line(nat->rfcomm_sock, &nat->tx, c_urc) == 0 ? TRUE : FALSE;
         if (ret == TRUE) pretty_log_urc(c_urc);
         //env->ReleaseStringUTFChars(urc, c_urc);
         return ret;
@@ -408,17 +760,85 @@ static bool sendURCNative(String8 urc) {
     return FALSE;
 }
 
+// Send a burst of URCs (e.g. the +CIEV updates for a call state change)
+// with a single system call.
+static bool sendURCsNative(const Vector<String8>& urcs) {
+    native_data_t *nat = get_native_data();
+    if (!nat->rfcomm_connected)
+        return FALSE;
+    const char *c_urcs[AT_TX_MAX_BATCH];
+    size_t done = 0;
+    while (done < urcs.size()) {
+        int count = 0;
+        while (count < AT_TX_MAX_BATCH && done + count < urcs.size()) {
+            c_urcs[count] = urcs[done + count].string();
+            count++;
+        }
+        if (send_lines(nat->rfcomm_sock, &nat->tx, c_urcs, count))
+            return FALSE;
+        for (int i = 0; i < count; i++)
+            pretty_log_urc(c_urcs[i]);
+        done += count;
+    }
+    return TRUE;
+}
+
+// Wait up to timeout_ms for queued URC bytes to drain; returns the number
+// of bytes still queued, or -1 on error.
+static int flushURCNative(int timeout_ms) {
+    native_data_t *nat = get_native_data();
+    if (!nat->rfcomm_connected)
+        return 0;
+    int pending = flush_lines(nat->rfcomm_sock, &nat->tx);
+    while (pending > 0) {
+        struct pollfd pfd;
+        pfd.fd = nat->rfcomm_sock;
+        pfd.events = POLLOUT;
+        int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, timeout_ms));
+        if (ret <= 0)
+            return ret < 0 ? -1 : pending;
+        pending = flush_lines(nat->rfcomm_sock, &nat->tx);
+    }
+    return pending;
+}
+
 static String8 readNative(int timeout_ms) {
         native_data_t *nat = get_native_data();
     String8 retval;
         if (nat->rfcomm_connected) {
-            char buf[256];
-            const char *ret = get_line(nat->rfcomm_sock, buf, sizeof(buf), timeout_ms, &nat->last_read_err);
+            const char *ret = get_line(nat->rfcomm_sock, &nat->rx, timeout_ms, &nat->last_read_err);
             retval = String8(ret);
         }
         return retval;
 }
 
+// Read one AT command, tokenize it in place and hand it to the handler
+// registered for it.  OK or ERROR is sent back unless the handler replies
+// itself.  Returns the command id, AT_UNKNOWN, or -2 if nothing was read.
+static int process_at_command(int fd, at_rx_buffer_t *rx, at_tx_buffer_t *tx, int timeout_ms, int *err) {
+    at_command_t cmd;
+    char *line = (char *)get_line(fd, rx, timeout_ms, err);
+    if (!line || !*line)
+        return -2;
+    // at_parse() splits the line up, so log it first
+    ALOGV("%s: %s", __FUNCTION__, line);
+    int result = AT_RESULT_ERROR;
+    if (at_parse(line, &cmd) == 0 && cmd.id != AT_UNKNOWN && at_handlers[cmd.id].handler)
+        result = at_handlers[cmd.id].handler(&cmd, at_handlers[cmd.id].user);
+    else
+        ALOGV("%s: unhandled AT command", __FUNCTION__);
+    if (result != AT_RESULT_NONE)
+        send_line(fd, tx, result == AT_RESULT_OK ? "OK" : "ERROR");
+    return cmd.id;
+}
+
+static int processATCommandNative(int timeout_ms) {
+    native_data_t *nat = get_native_data();
+    if (!nat->rfcomm_connected)
+        return -2;
+    return process_at_command(nat->rfcomm_sock, &nat->rx, &nat->tx, timeout_ms, &nat->last_read_err);
+}
+
 static int getLastReadStatusNative() {
         native_data_t *nat = get_native_data();
         if (nat->rfcomm_connected)
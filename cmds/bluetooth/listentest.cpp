@@ -0,0 +1,201 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * listentest: checks for the AG acceptor in socket.cpp, with AF_UNIX
+ * listeners standing in for the HF and HS RFCOMM server sockets.  Checks
+ * that:
+ *   - a burst of connections queued on both listeners is drained by one
+ *     pass of the loop, each to its own listener's handler
+ *   - accepted sockets come out non-blocking and close-on-exec
+ *   - connections never taken leave exactly one fd per slot open, and the
+ *     slot holds the latest
+ *   - dropping the slots and removing the listeners releases every fd
+ *   - an idle loop times out, and a listener can't be added to a loop
+ *     that was never set up
+ * Then times connect plus accept round trips.
+ *
+ *   listentest [-n connections]
+ */
+
+#include "socket.cpp"
+
+#include <sys/un.h>
+
+namespace android {
+// btcommon.cpp's D-Bus helpers use service.cpp's connection; nothing here calls them
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+static int failures;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static int open_fds(void) {
+    int n = 0;
+    for (int fd = 0; fd < 1024; fd++)
+        if (fcntl(fd, F_GETFD) >= 0)
+            n++;
+    return n;
+}
+
+// A listener on an abstract AF_UNIX address, so nothing is left on disk
+static int unix_listener(const char *name, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "listentest.%d.%s", getpid(), name);
+    int sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sk < 0 || bind(sk, (struct sockaddr *)addr, sizeof(*addr)) < 0 || listen(sk, 64) < 0) {
+        fprintf(stderr, "listentest: can't listen on %s: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    return sk;
+}
+
+static int unix_connect(const struct sockaddr_un *addr) {
+    int sk = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sk < 0 || connect(sk, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        fprintf(stderr, "listentest: can't connect: %s\n", strerror(errno));
+        exit(1);
+    }
+    return sk;
+}
+
+// Whether the connection parked in slot is the one whose other end is peer
+static bool slot_is(bt_accepted_t *slot, int peer) {
+    char c = 'x', got = 0;
+    if (slot->fd < 0 || write(peer, &c, 1) != 1)
+        return false;
+    struct pollfd pfd = { slot->fd, POLLIN, 0 };
+    return poll(&pfd, 1, 1000) == 1 && read(slot->fd, &got, 1) == 1 && got == c;
+}
+
+static void check_burst(int connections) {
+    bt_loop_t loop;
+    bt_accepted_t hf = { "HF", -1, -1, "" }, hs = { "HS", -1, -1, "" };
+    struct sockaddr_un hf_addr, hs_addr;
+    int base = open_fds();
+
+    check(bt_loop_init(&loop) == 0, "epoll set not created");
+    int hf_sk = unix_listener("hf", &hf_addr);
+    int hs_sk = unix_listener("hs", &hs_addr);
+    bt_listener_t *hf_l = bt_listener_add(&loop, hf_sk, onHandsfreeAccepted, &hf);
+    bt_listener_t *hs_l = bt_listener_add(&loop, hs_sk, onHandsfreeAccepted, &hs);
+    check(hf_l && hs_l, "listener not added");
+    if (!hf_l || !hs_l)
+        return;
+    int with_listeners = open_fds();
+
+    // queue a burst on both before the loop looks, keeping the last of each
+    int burst = connections < 64 ? connections : 64;
+    int last_hf = -1, last_hs = -1;
+    for (int i = 0; i < burst; i++) {
+        if (last_hf >= 0)
+            close(last_hf);
+        if (last_hs >= 0)
+            close(last_hs);
+        last_hf = unix_connect(&hf_addr);
+        last_hs = unix_connect(&hs_addr);
+    }
+    check(bt_loop_run_once(&loop, 1000) == 2, "one pass did not service both listeners");
+    check(hf_l->accepted == burst && hs_l->accepted == burst, "one pass did not drain the accept queues");
+    check(slot_is(&hf, last_hf) && slot_is(&hs, last_hs), "slot does not hold the latest connection");
+    check((fcntl(hf.fd, F_GETFL) & O_NONBLOCK) && (fcntl(hf.fd, F_GETFD) & FD_CLOEXEC),
+            "accepted socket not non-blocking and close-on-exec");
+
+    // one at a time through the loop, as connections normally arrive
+    for (int i = burst; i < connections; i++) {
+        close(last_hf);
+        last_hf = unix_connect(&hf_addr);
+        check(bt_loop_run_once(&loop, 1000) == 1, "connection not serviced");
+    }
+    check(hf_l->accepted == connections, "connections lost");
+    check(slot_is(&hf, last_hf), "slot does not hold the latest connection");
+    close(last_hf);
+    close(last_hs);
+    check(open_fds() == with_listeners + 2, "connections never taken leaked fds");
+
+    check(bt_loop_run_once(&loop, 10) == 0, "idle loop did not time out");
+    drop_accepted(&hf);
+    drop_accepted(&hs);
+    check(hf.fd < 0 && hs.fd < 0 && open_fds() == with_listeners, "dropping the slots leaked fds");
+    bt_listener_remove(&loop, hf_l);
+    bt_listener_remove(&loop, hs_l);
+    close(hf_sk);
+    close(hs_sk);
+    bt_loop_destroy(&loop);
+    check(open_fds() == base, "teardown leaked fds");
+
+    bt_loop_t unset = { -1 };
+    struct sockaddr_un addr;
+    int sk = unix_listener("unset", &addr);
+    check(!bt_listener_add(&unset, sk, NULL, NULL), "listener added without an epoll set");
+    close(sk);
+}
+
+static void bench(int connections) {
+    bt_loop_t loop;
+    bt_accepted_t slot = { "HF", -1, -1, "" };
+    struct sockaddr_un addr;
+    bt_loop_init(&loop);
+    int sk = unix_listener("bench", &addr);
+    bt_listener_t *l = bt_listener_add(&loop, sk, onHandsfreeAccepted, &slot);
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int i = 0; i < connections; i++) {
+        int c = unix_connect(&addr);
+        bt_loop_run_once(&loop, 1000);
+        close(c);
+    }
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    check(l->accepted == connections, "benchmark connections lost");
+    printf("%d connect + accept round trips: %.2f us each\n", connections, elapsed / 1000.0 / connections);
+    drop_accepted(&slot);
+    bt_listener_remove(&loop, l);
+    close(sk);
+    bt_loop_destroy(&loop);
+}
+
+int main(int argc, char **argv) {
+    int connections = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            connections = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n connections]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (connections <= 0) {
+        fprintf(stderr, "listentest: need connections > 0\n");
+        return 1;
+    }
+
+    check_burst(connections < 200 ? connections : 200);
+    bench(connections);
+    printf("listentest: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,760 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * mockbluez: a stand-in for bluetoothd, for load testing bluetest without
+ * radios.  It claims org.bluez on whatever bus it is pointed at, answers
+ * the Manager/Adapter/Device calls made by service.cpp, drives the
+ * registered Agent, and emits DeviceFound/PropertyChanged storms at a
+ * fixed rate while discovery is on.
+ *
+ * Typical use, with a private bus:
+ *
+ *   dbus-daemon --session --print-address --fork > /data/local/tmp/bus
+ *   export DBUS_SYSTEM_BUS_ADDRESS=`cat /data/local/tmp/bus`
+ *   mockbluez -r 2000 &
+ *   bluetest
+ *
+ * Every synthetic signal carries a "MockTimestamp" property (monotonic ns,
+ * as a string) so receivers can compute signal-to-handler latency; bluetest
+ * reports it on exit.
+ */
+
+#define LOG_TAG "mockbluez"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dbus/dbus.h>
+#include <utils/Timers.h>
+
+#define BLUEZ_NAME "org.bluez"
+#define MANAGER_IFACE BLUEZ_NAME ".Manager"
+#define ADAPTER_IFACE BLUEZ_NAME ".Adapter"
+#define DEVICE_IFACE BLUEZ_NAME ".Device"
+#define AGENT_IFACE BLUEZ_NAME ".Agent"
+#define INPUT_IFACE BLUEZ_NAME ".Input"
+#define NETWORK_IFACE BLUEZ_NAME ".Network"
+#define SINK_IFACE BLUEZ_NAME ".AudioSink"
+#define SINK_CTL_IFACE BLUEZ_NAME ".audio.Sink"   // Android's Suspend/Resume
+#define ERROR_IFACE BLUEZ_NAME ".Error"
+
+#define MAX_ADAPTERS 8
+#define MAX_DEVICES 4096
+#define TICK_MS 5
+#define MAX_CONNECTS 64
+#define MAX_SINKS 64
+
+typedef struct {
+    char path[64];
+    char agent_owner[64];      // unique bus name of the agent, "" if none
+    char agent_path[128];
+    bool discovering;
+    bool powered;
+    int next_device;           // round-robin cursor for the storm
+} mock_adapter_t;
+
+typedef struct {
+    const char *address;       // bus to connect to, NULL for the system bus
+    int adapters;
+    int devices;               // synthetic devices per adapter
+    int created;               // of those, how many ListDevices reports as created
+    int rate;                  // signals per second while discovering
+    int change_pct;            // share of PropertyChanged in the storm
+    long count;                // stop after this many signals, 0 = never
+    bool autostart;            // storm without waiting for StartDiscovery
+    int connect_ms;            // Input/Network Connect to Connected=true
+    int sink_ms;               // AudioSink call to its State change
+} mock_config_t;
+
+static mock_config_t config = { NULL, 1, 256, 0, 1000, 50, 0, false, 20, 15 };
+static mock_adapter_t mockAdapters[MAX_ADAPTERS];
+
+// Profile connects in progress: the ACL link comes up halfway through and
+// the profile reports Connected at the end
+typedef struct {
+    char path[128];
+    const char *iface;
+    nsecs_t acl_at;            // 0 once Device Connected has gone out
+    nsecs_t due;
+} mock_connect_t;
+static mock_connect_t connects[MAX_CONNECTS];
+static int connectCount;
+
+// A2DP sinks: every call is answered at once and moves State sink_ms
+// later, about what the AVDTP round trips take
+typedef struct {
+    char path[128];
+    const char *state;
+    const char *next;          // State due at due, NULL if none
+    nsecs_t due;
+    long calls;
+} mock_sink_t;
+static mock_sink_t sinks[MAX_SINKS];
+static int sinkCount;
+static DBusConnection *conn;
+static long signalsSent;
+static dbus_uint32_t nextRecordHandle = 0x10000;
+
+static void device_address(int adapter, int device, char *buf, size_t len) {
+    snprintf(buf, len, "00:1A:%02X:%02X:%02X:%02X", adapter, (device >> 16) & 0xff,
+            (device >> 8) & 0xff, device & 0xff);
+}
+
+static void device_path(int adapter, int device, char *buf, size_t len) {
+    char address[18];
+    device_address(adapter, device, address, sizeof(address));
+    for (char *p = address; *p; p++)
+        if (*p == ':')
+            *p = '_';
+    snprintf(buf, len, "%s/dev_%s", mockAdapters[adapter].path, address);
+}
+
+// Map an object path back to an adapter index, -1 if it is not ours
+static int path_to_adapter(const char *path) {
+    if (!path)
+        return -1;
+    for (int i = 0; i < config.adapters; i++) {
+        size_t len = strlen(mockAdapters[i].path);
+        if (!strncmp(path, mockAdapters[i].path, len) && (path[len] == 0 || path[len] == '/'))
+            return i;
+    }
+    return -1;
+}
+
+static void append_variant(DBusMessageIter *iter, int type, void *val) {
+    DBusMessageIter value;
+    char sig[2] = { (char)type, 0 };
+    dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, sig, &value);
+    dbus_message_iter_append_basic(&value, type, val);
+    dbus_message_iter_close_container(iter, &value);
+}
+
+static void append_dict_entry(DBusMessageIter *dict, const char *key, int type, void *val) {
+    DBusMessageIter entry;
+    dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    append_variant(&entry, type, val);
+    dbus_message_iter_close_container(dict, &entry);
+}
+
+static void open_dict(DBusMessageIter *iter, DBusMessageIter *dict) {
+    dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+            DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING
+            DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING, dict);
+}
+
+static void append_timestamp(DBusMessageIter *dict) {
+    char stamp[24];
+    const char *c_stamp = stamp;
+    snprintf(stamp, sizeof(stamp), "%lld", (long long)systemTime(SYSTEM_TIME_MONOTONIC));
+    append_dict_entry(dict, "MockTimestamp", DBUS_TYPE_STRING, &c_stamp);
+}
+
+static void append_device_properties(DBusMessageIter *iter, int adapter, int device) {
+    DBusMessageIter dict;
+    char address[18], name[32], path[128];
+    const char *c_address = address, *c_name = name, *c_adapter = mockAdapters[adapter].path;
+    dbus_uint32_t cod = 0x240404;            // audio, headset
+    dbus_int16_t rssi = -40 - (device % 50);
+    dbus_bool_t paired = FALSE;
+
+    device_address(adapter, device, address, sizeof(address));
+    device_path(adapter, device, path, sizeof(path));
+    snprintf(name, sizeof(name), "mock-%d-%d", adapter, device);
+    open_dict(iter, &dict);
+    append_dict_entry(&dict, "Address", DBUS_TYPE_STRING, &c_address);
+    append_dict_entry(&dict, "Name", DBUS_TYPE_STRING, &c_name);
+    append_dict_entry(&dict, "Alias", DBUS_TYPE_STRING, &c_name);
+    append_dict_entry(&dict, "Class", DBUS_TYPE_UINT32, &cod);
+    append_dict_entry(&dict, "RSSI", DBUS_TYPE_INT16, &rssi);
+    append_dict_entry(&dict, "Paired", DBUS_TYPE_BOOLEAN, &paired);
+    append_dict_entry(&dict, "Adapter", DBUS_TYPE_OBJECT_PATH, &c_adapter);
+    append_timestamp(&dict);
+    dbus_message_iter_close_container(iter, &dict);
+}
+
+static void send_and_unref(DBusMessage *msg) {
+    if (!msg)
+        return;
+    dbus_connection_send(conn, msg, NULL);
+    dbus_message_unref(msg);
+}
+
+static void emit_property_changed(const char *path, const char *iface, const char *name, int type, void *val) {
+    DBusMessage *msg = dbus_message_new_signal(path, iface, "PropertyChanged");
+    DBusMessageIter iter;
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name);
+    append_variant(&iter, type, val);
+    send_and_unref(msg);
+}
+
+static void emit_device_found(int adapter, int device) {
+    DBusMessage *msg = dbus_message_new_signal(mockAdapters[adapter].path, ADAPTER_IFACE, "DeviceFound");
+    DBusMessageIter iter;
+    char address[18];
+    const char *c_address = address;
+    device_address(adapter, device, address, sizeof(address));
+    dbus_message_iter_init_append(msg, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &c_address);
+    append_device_properties(&iter, adapter, device);
+    send_and_unref(msg);
+}
+
+// A device PropertyChanged whose value is the send time, so it doubles as
+// a latency probe for receivers that only look at PropertyChanged
+static void emit_device_stamp(int adapter, int device) {
+    char path[128], stamp[24];
+    const char *c_stamp = stamp;
+    device_path(adapter, device, path, sizeof(path));
+    snprintf(stamp, sizeof(stamp), "%lld", (long long)systemTime(SYSTEM_TIME_MONOTONIC));
+    emit_property_changed(path, DEVICE_IFACE, "MockTimestamp", DBUS_TYPE_STRING, &c_stamp);
+}
+
+static void set_discovering(int adapter, bool on) {
+    dbus_bool_t val = on;
+    if (mockAdapters[adapter].discovering == on)
+        return;
+    mockAdapters[adapter].discovering = on;
+    emit_property_changed(mockAdapters[adapter].path, ADAPTER_IFACE, "Discovering", DBUS_TYPE_BOOLEAN, &val);
+}
+
+static DBusMessage *error_reply(DBusMessage *msg, const char *name, const char *text) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), ERROR_IFACE ".%s", name);
+    return dbus_message_new_error(msg, buf, text);
+}
+
+static DBusMessage *path_reply(DBusMessage *msg, const char *path) {
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    dbus_message_append_args(reply, DBUS_TYPE_OBJECT_PATH, &path, DBUS_TYPE_INVALID);
+    return reply;
+}
+
+// Find the synthetic device index for an address, -1 if it is not ours
+static int address_to_device(int adapter, const char *address) {
+    unsigned a, b, c, d, e, f;
+    if (sscanf(address, "%2x:%2x:%2x:%2x:%2x:%2x", &a, &b, &c, &d, &e, &f) != 6
+     || a != 0 || b != 0x1a || (int)c != adapter)
+        return -1;
+    int device = (d << 16) | (e << 8) | f;
+    return device < config.devices ? device : -1;
+}
+
+static int path_to_device(int adapter, const char *path) {
+    const char *p = strrchr(path, '/');
+    char address[18];
+    if (!p || strncmp(p, "/dev_", 5) || strlen(p + 5) != 17)
+        return -1;
+    strcpy(address, p + 5);
+    for (char *q = address; *q; q++)
+        if (*q == '_')
+            *q = ':';
+    return address_to_device(adapter, address);
+}
+
+/*
+ * Pairing goes through the registered agent: CreatePairedDevice asks it
+ * for RequestConfirmation and is answered once the agent replies.
+ */
+typedef struct {
+    DBusMessage *request;       // the CreatePairedDevice call
+    int adapter;
+    int device;
+} pair_context_t;
+
+static void on_agent_reply(DBusPendingCall *call, void *user) {
+    pair_context_t *ctx = (pair_context_t *)user;
+    DBusMessage *reply = dbus_pending_call_steal_reply(call);
+    char path[128];
+    device_path(ctx->adapter, ctx->device, path, sizeof(path));
+    if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+        dbus_bool_t paired = TRUE;
+        send_and_unref(path_reply(ctx->request, path));
+        emit_property_changed(path, DEVICE_IFACE, "Paired", DBUS_TYPE_BOOLEAN, &paired);
+    } else {
+        send_and_unref(error_reply(ctx->request, "AuthenticationRejected", "Authentication Rejected"));
+    }
+    if (reply)
+        dbus_message_unref(reply);
+    dbus_message_unref(ctx->request);
+    free(ctx);
+    dbus_pending_call_unref(call);
+}
+
+static DBusMessage *create_paired_device(DBusMessage *msg, int adapter) {
+    mock_adapter_t *a = &mockAdapters[adapter];
+    const char *c_address, *c_agent, *c_caps;
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &c_address, DBUS_TYPE_OBJECT_PATH, &c_agent,
+            DBUS_TYPE_STRING, &c_caps, DBUS_TYPE_INVALID))
+        return error_reply(msg, "InvalidArguments", "Invalid arguments");
+    int device = address_to_device(adapter, c_address);
+    if (device < 0)
+        return error_reply(msg, "ConnectionAttemptFailed", "Host is down");
+    char path[128];
+    device_path(adapter, device, path, sizeof(path));
+    // Like bluetoothd, ask the agent given with the call, which lives with
+    // the caller; fall back to the adapter agent
+    const char *owner = dbus_message_get_sender(msg), *agent = c_agent;
+    if (!agent || !agent[0]) {
+        if (!a->agent_owner[0])
+            return path_reply(msg, path);      // no agent: "just works"
+        owner = a->agent_owner;
+        agent = a->agent_path;
+    }
+    DBusMessage *req = dbus_message_new_method_call(owner, agent, AGENT_IFACE, "RequestConfirmation");
+    const char *c_path = path;
+    dbus_uint32_t passkey = 100000 + device % 900000;
+    DBusPendingCall *call;
+    dbus_message_append_args(req, DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_UINT32, &passkey, DBUS_TYPE_INVALID);
+    if (!dbus_connection_send_with_reply(conn, req, &call, 30000) || !call) {
+        dbus_message_unref(req);
+        return error_reply(msg, "Failed", "Agent unreachable");
+    }
+    dbus_message_unref(req);
+    pair_context_t *ctx = (pair_context_t *)malloc(sizeof(pair_context_t));
+    ctx->request = dbus_message_ref(msg);
+    ctx->adapter = adapter;
+    ctx->device = device;
+    dbus_pending_call_set_notify(call, on_agent_reply, ctx, NULL);
+    return NULL;                                // answered from on_agent_reply
+}
+
+static DBusMessage *adapter_get_properties(DBusMessage *msg, int adapter) {
+    mock_adapter_t *a = &mockAdapters[adapter];
+    DBusMessage *reply = dbus_message_new_method_return(msg);
+    DBusMessageIter iter, dict;
+    char address[18], name[16];
+    const char *c_address = address, *c_name = name;
+    dbus_bool_t powered = a->powered, discovering = a->discovering, yes = TRUE;
+    dbus_uint32_t cod = 0x5a020c, timeout = 0;
+
+    snprintf(address, sizeof(address), "00:1A:%02X:00:00:00", 0x80 | adapter);
+    snprintf(name, sizeof(name), "mock%d", adapter);
+    dbus_message_iter_init_append(reply, &iter);
+    open_dict(&iter, &dict);
+    append_dict_entry(&dict, "Address", DBUS_TYPE_STRING, &c_address);
+    append_dict_entry(&dict, "Name", DBUS_TYPE_STRING, &c_name);
+    append_dict_entry(&dict, "Class", DBUS_TYPE_UINT32, &cod);
+    append_dict_entry(&dict, "Powered", DBUS_TYPE_BOOLEAN, &powered);
+    append_dict_entry(&dict, "Discoverable", DBUS_TYPE_BOOLEAN, &yes);
+    append_dict_entry(&dict, "Pairable", DBUS_TYPE_BOOLEAN, &yes);
+    append_dict_entry(&dict, "DiscoverableTimeout", DBUS_TYPE_UINT32, &timeout);
+    append_dict_entry(&dict, "Discovering", DBUS_TYPE_BOOLEAN, &discovering);
+    dbus_message_iter_close_container(&iter, &dict);
+    return reply;
+}
+
+static DBusMessage *handle_manager(DBusMessage *msg, const char *member) {
+    if (!strcmp(member, "DefaultAdapter"))
+        return path_reply(msg, mockAdapters[0].path);
+    if (!strcmp(member, "FindAdapter"))
+        return path_reply(msg, mockAdapters[0].path);
+    if (!strcmp(member, "ListAdapters")) {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        const char *paths[MAX_ADAPTERS];
+        const char **c_paths = paths;
+        for (int i = 0; i < config.adapters; i++)
+            paths[i] = mockAdapters[i].path;
+        dbus_message_append_args(reply, DBUS_TYPE_ARRAY, DBUS_TYPE_OBJECT_PATH, &c_paths, config.adapters, DBUS_TYPE_INVALID);
+        return reply;
+    }
+    return error_reply(msg, "NotSupported", "Operation is not supported");
+}
+
+static DBusMessage *handle_adapter(DBusMessage *msg, const char *member, int adapter) {
+    mock_adapter_t *a = &mockAdapters[adapter];
+    const char *c_str, *c_path;
+    if (!strcmp(member, "GetProperties"))
+        return adapter_get_properties(msg, adapter);
+    if (!strcmp(member, "SetProperty")) {
+        DBusMessageIter iter, value;
+        if (dbus_message_iter_init(msg, &iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING) {
+            dbus_message_iter_get_basic(&iter, &c_str);
+            if (dbus_message_iter_next(&iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT) {
+                dbus_message_iter_recurse(&iter, &value);
+                int type = dbus_message_iter_get_arg_type(&value);
+                if (dbus_type_is_basic(type)) {
+                    union {
+                        dbus_bool_t bool_val;
+                        dbus_uint32_t u32;
+                        dbus_uint64_t u64;
+                        const char *str;
+                    } val;
+                    dbus_message_iter_get_basic(&value, &val);
+                    if (!strcmp(c_str, "Powered") && type == DBUS_TYPE_BOOLEAN)
+                        a->powered = val.bool_val;
+                    emit_property_changed(a->path, ADAPTER_IFACE, c_str, type, &val);
+                }
+            }
+        }
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "StartDiscovery")) {
+        set_discovering(adapter, true);
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "StopDiscovery")) {
+        set_discovering(adapter, false);
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "RegisterAgent")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_STRING, &c_str, DBUS_TYPE_INVALID))
+            return error_reply(msg, "InvalidArguments", "Invalid arguments");
+        if (a->agent_owner[0])
+            return error_reply(msg, "AlreadyExists", "Agent already exists");
+        snprintf(a->agent_owner, sizeof(a->agent_owner), "%s", dbus_message_get_sender(msg));
+        snprintf(a->agent_path, sizeof(a->agent_path), "%s", c_path);
+        printf("agent %s%s registered on %s (%s)\n", a->agent_owner, a->agent_path, a->path, c_str);
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "UnregisterAgent")) {
+        if (!a->agent_owner[0])
+            return error_reply(msg, "DoesNotExist", "Agent does not exist");
+        a->agent_owner[0] = 0;
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "CreateDevice") || !strcmp(member, "FindDevice")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &c_str, DBUS_TYPE_INVALID))
+            return error_reply(msg, "InvalidArguments", "Invalid arguments");
+        int device = address_to_device(adapter, c_str);
+        if (device < 0)
+            return error_reply(msg, "DoesNotExist", "Device does not exist");
+        char path[128];
+        device_path(adapter, device, path, sizeof(path));
+        if (member[0] == 'C') {
+            DBusMessage *sig = dbus_message_new_signal(a->path, ADAPTER_IFACE, "DeviceCreated");
+            c_path = path;
+            dbus_message_append_args(sig, DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_INVALID);
+            send_and_unref(sig);
+        }
+        return path_reply(msg, path);
+    }
+    if (!strcmp(member, "CreatePairedDevice"))
+        return create_paired_device(msg, adapter);
+    if (!strcmp(member, "ListDevices")) {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        DBusMessageIter iter, array;
+        char path[128];
+        dbus_message_iter_init_append(reply, &iter);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_OBJECT_PATH_AS_STRING, &array);
+        for (int i = 0; i < config.created; i++) {
+            device_path(adapter, i, path, sizeof(path));
+            c_path = path;
+            dbus_message_iter_append_basic(&array, DBUS_TYPE_OBJECT_PATH, &c_path);
+        }
+        dbus_message_iter_close_container(&iter, &array);
+        return reply;
+    }
+    if (!strcmp(member, "RemoveDevice")) {
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_INVALID))
+            return error_reply(msg, "InvalidArguments", "Invalid arguments");
+        DBusMessage *sig = dbus_message_new_signal(a->path, ADAPTER_IFACE, "DeviceRemoved");
+        dbus_message_append_args(sig, DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_INVALID);
+        send_and_unref(sig);
+        return dbus_message_new_method_return(msg);
+    }
+    if (!strcmp(member, "AddRfcommServiceRecord")) {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        dbus_uint32_t handle = nextRecordHandle++;
+        dbus_message_append_args(reply, DBUS_TYPE_UINT32, &handle, DBUS_TYPE_INVALID);
+        return reply;
+    }
+    if (!strcmp(member, "AddReservedServiceRecords")) {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        dbus_uint32_t handles[8], *c_handles = handles;
+        int n = 0;
+        dbus_uint32_t *classes;
+        if (dbus_message_get_args(msg, NULL, DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &classes, &n, DBUS_TYPE_INVALID)) {
+            if (n > 8)
+                n = 8;
+            for (int i = 0; i < n; i++)
+                handles[i] = nextRecordHandle++;
+        }
+        dbus_message_append_args(reply, DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &c_handles, n, DBUS_TYPE_INVALID);
+        return reply;
+    }
+    if (!strcmp(member, "CancelDeviceCreation") || !strcmp(member, "RemoveServiceRecord")
+     || !strcmp(member, "RemoveReservedServiceRecords") || !strcmp(member, "SetLinkTimeout"))
+        return dbus_message_new_method_return(msg);
+    return error_reply(msg, "NotSupported", "Operation is not supported");
+}
+
+static DBusMessage *handle_device(DBusMessage *msg, const char *member, int adapter, int device) {
+    if (!strcmp(member, "GetProperties")) {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        DBusMessageIter iter;
+        dbus_message_iter_init_append(reply, &iter);
+        append_device_properties(&iter, adapter, device);
+        return reply;
+    }
+    if (!strcmp(member, "DiscoverServices")) {
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        DBusMessageIter iter, dict;
+        dbus_message_iter_init_append(reply, &iter);
+        dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{us}", &dict);
+        dbus_message_iter_close_container(&iter, &dict);
+        return reply;
+    }
+    if (!strcmp(member, "SetProperty") || !strcmp(member, "Disconnect") || !strcmp(member, "CancelDiscovery"))
+        return dbus_message_new_method_return(msg);
+    if (!strcmp(member, "GetServiceAttributeValue"))
+        return error_reply(msg, "DoesNotExist", "Attribute does not exist");
+    return error_reply(msg, "NotSupported", "Operation is not supported");
+}
+
+static DBusMessage *handle_profile(DBusMessage *msg, const char *iface, const char *member, const char *path) {
+    dbus_bool_t off = FALSE;
+    if (!strcmp(member, "Connect")) {
+        if (connectCount == MAX_CONNECTS)
+            return error_reply(msg, "ConnectionAttemptFailed", "Too many connects");
+        mock_connect_t *c = &connects[connectCount++];
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        snprintf(c->path, sizeof(c->path), "%s", path);
+        bool network = !strcmp(iface, NETWORK_IFACE);
+        c->iface = network ? NETWORK_IFACE : INPUT_IFACE;
+        c->acl_at = now + ms2ns(config.connect_ms) / 2;
+        c->due = now + ms2ns(config.connect_ms);
+        DBusMessage *reply = dbus_message_new_method_return(msg);
+        if (network) {
+            const char *ifname = "bnep0";
+            dbus_message_append_args(reply, DBUS_TYPE_STRING, &ifname, DBUS_TYPE_INVALID);
+        }
+        return reply;
+    }
+    if (!strcmp(member, "Disconnect")) {
+        // one profile per mock device, so the ACL goes with it
+        emit_property_changed(path, iface, "Connected", DBUS_TYPE_BOOLEAN, &off);
+        emit_property_changed(path, DEVICE_IFACE, "Connected", DBUS_TYPE_BOOLEAN, &off);
+    }
+    return dbus_message_new_method_return(msg);
+}
+
+static DBusMessage *handle_sink(DBusMessage *msg, const char *member, const char *path) {
+    mock_sink_t *sink = NULL;
+    for (int i = 0; i < sinkCount && !sink; i++)
+        if (!strcmp(sinks[i].path, path))
+            sink = &sinks[i];
+    if (!sink) {
+        if (sinkCount == MAX_SINKS)
+            return error_reply(msg, "Failed", "Too many sinks");
+        sink = &sinks[sinkCount++];
+        snprintf(sink->path, sizeof(sink->path), "%s", path);
+        sink->state = "disconnected";
+        sink->next = NULL;
+        sink->calls = 0;
+    }
+    const char *from = sink->next ? sink->next : sink->state;
+    const char *to = NULL;
+    if (!strcmp(member, "Connect"))
+        to = "connected";
+    else if (!strcmp(member, "Disconnect"))
+        to = "disconnected";
+    else if (!strcmp(member, "Suspend") || !strcmp(member, "Resume")) {
+        if (!strcmp(from, "disconnected"))
+            return error_reply(msg, "NotConnected", "Device not Connected");
+        to = member[0] == 'S' ? "connected" : "playing";
+    } else {
+        return dbus_message_new_method_return(msg);
+    }
+    sink->calls++;
+    printf("mockbluez: %s %s (%ld calls): %s -> %s\n", path, member, sink->calls, from, to);
+    if (strcmp(from, to)) {
+        if (!strcmp(member, "Connect")) {
+            sink->state = "connecting";
+            emit_property_changed(path, SINK_IFACE, "State", DBUS_TYPE_STRING, &sink->state);
+        }
+        sink->next = to;
+        sink->due = systemTime(SYSTEM_TIME_MONOTONIC) + ms2ns(config.sink_ms);
+    }
+    return dbus_message_new_method_return(msg);
+}
+
+static void sink_tick(void) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int i = 0; i < sinkCount; i++) {
+        mock_sink_t *sink = &sinks[i];
+        if (!sink->next || now < sink->due)
+            continue;
+        sink->state = sink->next;
+        sink->next = NULL;
+        emit_property_changed(sink->path, SINK_IFACE, "State", DBUS_TYPE_STRING, &sink->state);
+    }
+}
+
+static void connect_tick(void) {
+    dbus_bool_t on = TRUE;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int i = connectCount; i-- > 0; ) {
+        mock_connect_t *c = &connects[i];
+        if (c->acl_at && now >= c->acl_at) {
+            emit_property_changed(c->path, DEVICE_IFACE, "Connected", DBUS_TYPE_BOOLEAN, &on);
+            c->acl_at = 0;
+        }
+        if (now >= c->due) {
+            emit_property_changed(c->path, c->iface, "Connected", DBUS_TYPE_BOOLEAN, &on);
+            connects[i] = connects[--connectCount];
+        }
+    }
+}
+
+static DBusHandlerResult mock_filter(DBusConnection *c, DBusMessage *msg, void *data) {
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    const char *iface = dbus_message_get_interface(msg);
+    const char *member = dbus_message_get_member(msg);
+    const char *path = dbus_message_get_path(msg);
+    DBusMessage *reply;
+    if (!iface || !member || !path)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    int adapter = path_to_adapter(path);
+    if (!strcmp(iface, MANAGER_IFACE))
+        reply = handle_manager(msg, member);
+    else if (adapter >= 0 && !strcmp(path, mockAdapters[adapter].path) && !strcmp(iface, ADAPTER_IFACE))
+        reply = handle_adapter(msg, member, adapter);
+    else if (adapter >= 0 && !strcmp(iface, DEVICE_IFACE)) {
+        int device = path_to_device(adapter, path);
+        reply = device < 0 ? error_reply(msg, "DoesNotExist", "Device does not exist")
+                           : handle_device(msg, member, adapter, device);
+    }
+    else if (adapter >= 0 && (!strcmp(iface, INPUT_IFACE) || !strcmp(iface, NETWORK_IFACE)))
+        reply = handle_profile(msg, iface, member, path);
+    else if (adapter >= 0 && (!strcmp(iface, SINK_IFACE) || !strcmp(iface, SINK_CTL_IFACE)))
+        reply = handle_sink(msg, member, path);
+    else if (adapter >= 0)
+        // Health, Control: accept and do nothing
+        reply = dbus_message_new_method_return(msg);
+    else
+        reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, path);
+    send_and_unref(reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+// Emit whatever the storm owes since the last tick
+static void storm_tick(nsecs_t elapsed, long *emitted) {
+    long due = (long)(ns2ms(elapsed) * config.rate / 1000);
+    while (*emitted < due && (!config.count || signalsSent < config.count)) {
+        bool any = false;
+        for (int i = 0; i < config.adapters && *emitted < due; i++) {
+            mock_adapter_t *a = &mockAdapters[i];
+            if (!a->discovering)
+                continue;
+            any = true;
+            int device = a->next_device;
+            a->next_device = (a->next_device + 1) % config.devices;
+            if ((int)(signalsSent % 100) < config.change_pct)
+                emit_device_stamp(i, device);
+            else
+                emit_device_found(i, device);
+            signalsSent++;
+            (*emitted)++;
+        }
+        if (!any)
+            break;
+    }
+}
+
+static void usage(void) {
+    printf("usage: mockbluez [-a bus_address] [-n adapters] [-d devices] [-k created]\n"
+           "                 [-r signals/sec] [-p changed_percent] [-c count]\n"
+           "                 [-l connect_ms] [-t sink_ms] [-s]\n"
+           "  -k  report the first N devices of each adapter from ListDevices\n"
+           "  -l  time from Input/Network Connect to Connected=true (20 ms)\n"
+           "  -t  time from an AudioSink call to its State change (15 ms)\n"
+           "  -s  start the storm immediately instead of on StartDiscovery\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    DBusError err;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:n:d:k:r:p:c:l:t:sh")) != -1) {
+        switch (opt) {
+        case 'a': config.address = optarg; break;
+        case 'n': config.adapters = atoi(optarg); break;
+        case 'd': config.devices = atoi(optarg); break;
+        case 'k': config.created = atoi(optarg); break;
+        case 'r': config.rate = atoi(optarg); break;
+        case 'p': config.change_pct = atoi(optarg); break;
+        case 'c': config.count = atol(optarg); break;
+        case 'l': config.connect_ms = atoi(optarg); break;
+        case 't': config.sink_ms = atoi(optarg); break;
+        case 's': config.autostart = true; break;
+        default: usage();
+        }
+    }
+    if (config.adapters < 1 || config.adapters > MAX_ADAPTERS
+     || config.devices < 1 || config.devices > MAX_DEVICES || config.rate < 1
+     || config.created < 0 || config.created > config.devices)
+        usage();
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    dbus_threads_init_default();
+    dbus_error_init(&err);
+    if (config.address) {
+        conn = dbus_connection_open_private(config.address, &err);
+        if (conn && !dbus_bus_register(conn, &err)) {
+            dbus_connection_close(conn);
+            conn = NULL;
+        }
+    } else {
+        conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    }
+    if (!conn) {
+        printf("mockbluez: can't connect: %s\n", err.message);
+        return 1;
+    }
+    if (dbus_bus_request_name(conn, BLUEZ_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE, &err)
+            != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        printf("mockbluez: can't own " BLUEZ_NAME ": %s\n", dbus_error_is_set(&err) ? err.message : "name taken");
+        return 1;
+    }
+    for (int i = 0; i < config.adapters; i++) {
+        snprintf(mockAdapters[i].path, sizeof(mockAdapters[i].path), "/org/bluez/%d/hci%d", getpid(), i);
+        mockAdapters[i].powered = true;
+        mockAdapters[i].discovering = config.autostart;
+    }
+    dbus_connection_add_filter(conn, mock_filter, NULL, NULL);
+
+    printf("mockbluez: %d adapter(s), %d devices each, %d signals/sec\n",
+            config.adapters, config.devices, config.rate);
+
+    // The storm runs on its own clock, restarted whenever it goes idle so
+    // that a long pause does not turn into a burst
+    nsecs_t epoch = 0;
+    long emitted = 0;
+    while (dbus_connection_read_write_dispatch(conn, TICK_MS)) {
+        bool active = false;
+        connect_tick();
+        sink_tick();
+        for (int i = 0; i < config.adapters; i++)
+            active |= mockAdapters[i].discovering;
+        if (!active || (config.count && signalsSent >= config.count)) {
+            epoch = 0;
+            continue;
+        }
+        if (!epoch) {
+            epoch = systemTime(SYSTEM_TIME_MONOTONIC);
+            emitted = 0;
+        }
+        storm_tick(systemTime(SYSTEM_TIME_MONOTONIC) - epoch, &emitted);
+    }
+    return 0;
+}
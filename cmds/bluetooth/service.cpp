@@ -24,21 +24,32 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <dbus/dbus.h>
 #include <bluedroid/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
 #include <cutils/properties.h>
 #include "cutils/sockets.h"
 //#include "android_runtime/AndroidRuntime.h"
 #include "utils/Log.h"
 #include "utils/misc.h"
+#include <utils/Timers.h>
 
 #include "btcommon.h"
 
+// Per-event printing is off unless asked for (-v); it costs more CPU than
+// handling the events.  Use the journal (-j) for routine diagnostics.
+static bool verboseEvents;
+
 #undef ALOGE
 #define ALOGE printf
 #undef ALOGV
-#define ALOGV printf
+#define ALOGV(...) do { if (verboseEvents) printf(__VA_ARGS__); } while (0)
 
 #define DBUS_ADAPTER_IFACE BLUEZ_DBUS_BASE_IFC ".Adapter"
 #define DBUS_DEVICE_IFACE BLUEZ_DBUS_BASE_IFC ".Device"
@@ -85,16 +96,75 @@ static SIGTABLETYPE methtable[] = {
 
 static struct pollfd *pollData;
 static DBusWatch **watchData;
+// Plain fds (health channels) share the poll set with the D-Bus watches;
+// their watchData slot is NULL and the handler lives here instead.
+typedef void (*fd_watch_cb_t)(int fd, short revents, void *user);
+typedef struct {
+    fd_watch_cb_t cb;
+    void *user;
+} fd_watch_t;
+static fd_watch_t *fdWatchData;
 static int pollMemberCount = 1; 
 static int pollDataSize = DEFAULT_INITIAL_POLLFD_COUNT;
 static int controlFdR;
 static int controlFdW;
-static DBusConnection *global_conn;
-static const char *global_adapter;  // dbus object name of the local adapter
-static void onConnectSinkResult(DBusMessage *msg, void *user, void *n);
+DBusConnection *global_conn;       // shared with btcommon.cpp
+static const char *global_adapter;  // dbus object name of the default adapter
+
+enum { DISC_OFF, DISC_IDLE, DISC_INQUIRY, DISC_DONE };   // discovery scheduler phase
+
+// One entry per local adapter, all served from global_conn.  Each has its
+// own agent object and keeps the devices it has seen, keyed by address.
+typedef struct {
+    int index;
+    String8 path;              // e.g. /org/bluez/123/hci1
+    String8 agent_path;        // agent_path + "/" + index
+    bool agent_registered;
+    bool discovering;
+    bool found_new;            // a device was added since the last check
+    pthread_mutex_t lock;      // guards devices, discovering and found_new
+    KeyedVector<String8, BTProperties> devices;
+    int disc_phase;            // DISC_*, guarded by discoveryLock
+    nsecs_t disc_deadline;     // end of the current window
+} bt_adapter_t;
+
+static bt_adapter_t *adapters[BLUEZ_MAX_ADAPTERS];
+static int adapterCount;
+static int adapterSerial;      // never reused, so agent paths stay unique
+static bt_adapter_t *add_adapter(const char *path);
+static void remove_adapter(const char *path);
+static pthread_mutex_t discoveryLock = PTHREAD_MUTEX_INITIALIZER;  // discovery schedule and targets
+static void discovery_arm(bt_adapter_t *adapter);
+static int discovery_poll_timeout(void);
+static void discovery_tick(void);
+static bool pairing_answer(int methvalue, const char *object_path, DBusMessage *msg);
+static int pairing_poll_timeout(void);
+static void pairing_tick(void);
+static void stop_health_channel(const char *channelPath);
+static void sdp_reregister(void);
+enum { CONN_PROFILE_INPUT, CONN_PROFILE_PAN, CONN_PROFILE_COUNT };   // connect latency profiles
+static void conn_reply(int profile, const char *path, int result);
+static void conn_connected(int profile, const char *path, bool connected, nsecs_t when);
+static void conn_acl(bt_addr_t addr, bool up);
+static void conn_tick(void);
+static int conn_poll_timeout(void);
+static void link_acl(const char *path, bt_addr_t addr, bool up);
+static void link_activity(bt_addr_t addr);
+static void link_streaming(const char *path, bool streaming);
+static bool link_path_addr(const char *path, bt_addr_t *addr);
+static void link_tick(void);
+static int link_poll_timeout(void);
+enum { SINK_DISCONNECTED, SINK_CONNECTING, SINK_CONNECTED, SINK_PLAYING };    // AudioSink State
+static bool sink_request(String8 path, int want, bool connect);
+static void sink_state(const char *path, const char *state, nsecs_t when);
+static void sink_tick(void);
+static int sink_poll_timeout(void);
+static void print_sink_stats(void);
 
 static void dumpprop(BTProperties& prop, const char *name)
 {
+    if (!verboseEvents)
+        return;
     printf("prop %s: ", name);
     for (size_t i = 0; i < prop.size(); ++i)
         printf("%s=%s; ", prop.keyAt(i).string(), prop.valueAt(i).string());
@@ -126,24 +196,22 @@ dumpprop(prop, "getsink");
     return result;
 }
 
+// These only say where the sink should end up; sink_request() makes the calls.
+// Suspend and resume fail on a sink that is not connected or connecting.
 static bool connectSinkNative(String8 path) {
-    const char *c_path = path.string();
-    int len = path.length() + 1;
-    char *context_path = (char *)calloc(len, sizeof(char));
-    strlcpy(context_path, c_path, len);  // for callback
-    return dbus_func_async(-1, onConnectSinkResult, context_path, path.string(), "org.bluez.AudioSink", "Connect", DBUS_TYPE_INVALID); 
+    return sink_request(path, SINK_CONNECTED, true);
 }
 
 static bool disconnectSinkNative(String8 path) {
-    return dbus_func_async(-1,NULL,NULL, path.string(), "org.bluez.AudioSink", "Disconnect", DBUS_TYPE_INVALID); 
+    return sink_request(path, SINK_DISCONNECTED, false);
 }
 
 static bool suspendSinkNative(String8 path) {
-    return dbus_func_async(-1, NULL, NULL, path.string(), "org.bluez.audio.Sink", "Suspend", DBUS_TYPE_INVALID);
+    return sink_request(path, SINK_CONNECTED, false);
 }
 
 static bool resumeSinkNative(String8 path) {
-    return dbus_func_async(-1, NULL, NULL, path.string(), "org.bluez.audio.Sink", "Resume", DBUS_TYPE_INVALID);
+    return sink_request(path, SINK_PLAYING, false);
 }
 
 static bool avrcpVolumeUpNative(String8 path) {
@@ -154,17 +222,6 @@ static bool avrcpVolumeDownNative(String8 path) {
     return dbus_func_async(-1, NULL, NULL, path.string(), "org.bluez.Control", "VolumeDown", DBUS_TYPE_INVALID);
 }
 
-void onConnectSinkResult(DBusMessage *msg, void *user, void *n) {
-    const char *path = (const char *)user;
-    DBusError err;
-    dbus_error_init(&err);
-    if (dbus_set_error_from_message(&err, msg)) {
-        LOG_AND_FREE_DBUS_ERROR(&err);
-    }
-    ALOGV("... Device Path = %s\n", path); 
-    free(user);
-} 
-
 static unsigned int unix_events_to_dbus_flags(short events) {
     return (events & DBUS_WATCH_READABLE ? POLLIN : 0) | (events & DBUS_WATCH_WRITABLE ? POLLOUT : 0) | (events & DBUS_WATCH_ERROR ? POLLERR : 0) | (events & DBUS_WATCH_HANGUP ? POLLHUP : 0);
 }
@@ -178,6 +235,8 @@ static short dbus_flags_to_unix_events(unsigned int flags) {
 #define EVENT_LOOP_ADD  2
 #define EVENT_LOOP_REMOVE 3
 #define EVENT_LOOP_WAKEUP 4
+#define EVENT_LOOP_ADD_FD 5
+#define EVENT_LOOP_REMOVE_FD 6
 
 dbus_bool_t dbusAddWatch(DBusWatch *watch, void *data) {
 printf("[%s:%d]\n", __FUNCTION__, __LINE__);
@@ -217,34 +276,31 @@ printf("[%s:%d]\n", __FUNCTION__, __LINE__);
     }
 }
 
-static void addmatch(void)
-{
-    DBusError err;
-    const char **p = signames;
-    while (*p) {
-        dbus_bus_add_match(global_conn, *p, &err);
-        if (dbus_error_is_set(&err)) {
-            LOG_AND_FREE_DBUS_ERROR(&err);
-            exit(1);
-        } 
-        p++;
-    }
+// Watch fd for input from the event loop thread.  When the watch is
+// removed the handler is called one last time with no events, on the loop
+// thread, so it can free whatever user points at.
+static void eventLoopAddFd(int fd, fd_watch_cb_t cb, void *user) {
+    char buf[sizeof(char) + sizeof(int) + sizeof(fd_watch_cb_t) + sizeof(void *)];
+    char *p = buf;
+    *p++ = EVENT_LOOP_ADD_FD;
+    memcpy(p, &fd, sizeof(int)); p += sizeof(int);
+    memcpy(p, &cb, sizeof(fd_watch_cb_t)); p += sizeof(fd_watch_cb_t);
+    memcpy(p, &user, sizeof(void *));
+    // one write, so concurrent callers can't interleave their messages
+    write(controlFdW, buf, sizeof(buf));
 }
-static void removematch(void)
-{
-    DBusError err;
-    const char **p = signames;
-    while (*p) {
-        dbus_bus_remove_match(global_conn, *p, &err);
-        if (dbus_error_is_set(&err)) {
-            LOG_AND_FREE_DBUS_ERROR(&err);
-        }
-        p++;
-    }
+
+static void eventLoopRemoveFd(int fd) {
+    char buf[sizeof(char) + sizeof(int)];
+    buf[0] = EVENT_LOOP_REMOVE_FD;
+    memcpy(buf + 1, &fd, sizeof(int));
+    write(controlFdW, buf, sizeof(buf));
 }
 
 void dbusWakeup(void *data) {
     char control = EVENT_LOOP_WAKEUP;
+    if (!controlFdW)           // no event loop (journal replay)
+        return;
     write(controlFdW, &control, sizeof(char));
 }
 
@@ -303,6 +359,735 @@ static int findsignal(SIGTABLETYPE *map, DBusMessage *msg)
     }
     return map->value;
 }
+/*
+ * Signal handlers are split in two.  event_filter() does the cheap part on
+ * the event loop thread: classify the signal, note ACL changes, pick the
+ * object path it belongs to.  Property parsing, table updates and dumps
+ * run later on a small work-stealing pool, so a slow handler no longer
+ * holds up dbus_watch_handle() for every other fd.
+ *
+ * Work is ordered by object path: each path hashes to one of WORK_STRANDS
+ * strands, and a strand runs in order on one worker at a time.  Paths that
+ * share a strand are serialised together, which costs a little parallelism
+ * but never order.  A strand that becomes runnable goes on the run queue
+ * of the worker its hash picks; an idle worker takes from its own queue
+ * first and then steals from the others.  A strand gives up its worker
+ * after WORK_STRAND_BATCH items so one chatty device cannot starve the
+ * rest.  All queue state is under workLock; the critical sections are a
+ * few pointer moves and the handlers run outside it.
+ */
+#define WORK_POOL_THREADS 3
+#define WORK_STRANDS 256
+#define WORK_STRAND_BATCH 8
+
+typedef struct work_item {
+    struct work_item *next;
+    bt_adapter_t *adapter;     // looked up on the loop thread, may be NULL
+    DBusMessage *msg;
+    int sigvalue;
+    nsecs_t queued;
+} work_item_t;
+
+typedef struct work_strand {
+    struct work_strand *next;  // on a worker's run queue
+    work_item_t *head;
+    work_item_t *tail;
+    int depth;
+    bool running;              // on a run queue or held by a worker
+} work_strand_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    work_strand_t *head;       // runnable strands
+    work_strand_t *tail;
+} work_worker_t;
+
+typedef struct {
+    uint64_t queued;
+    uint64_t processed;
+    uint64_t steals;           // strands taken from another worker's run queue
+    int depth;                 // items queued or running
+    int max_depth;
+    int max_strand_depth;      // most queued on a single strand
+    nsecs_t wait_total;        // queued to started
+    nsecs_t wait_max;
+    nsecs_t handler_total;
+    nsecs_t handler_max;
+} work_stats_t;
+
+static work_worker_t workWorkers[WORK_POOL_THREADS];
+static work_strand_t workStrands[WORK_STRANDS];
+static int workIdle;           // workers waiting for a strand
+static work_stats_t workStats;
+static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;        // a strand is runnable
+static pthread_cond_t workIdleCond = PTHREAD_COND_INITIALIZER;    // depth reached 0
+
+// Latency of the signals mockbluez stamps with its send time ("MockTimestamp"),
+// to event_filter and to the end of their handler, over the last
+// STAMP_SAMPLES of them, and the process CPU time they cost
+#define STAMP_SAMPLES 4096
+typedef struct {
+    uint64_t count;
+    nsecs_t received[STAMP_SAMPLES];
+    nsecs_t handled[STAMP_SAMPLES];
+    uint64_t window_start;         // count when the current window began
+    nsecs_t window_cpu;            // process CPU time then
+} stamp_stats_t;
+
+static stamp_stats_t stampStats;
+static pthread_mutex_t stampLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key for an address in adapter->devices and discoveryTargets: upper case,
+// as BlueZ prints them, whatever case the caller used
+static String8 address_key(const char *address) {
+    char key[BTADDR_SIZE];
+    strlcpy(key, address, sizeof(key));
+    for (char *q = key; *q; q++)
+        *q = toupper((unsigned char)*q);
+    return String8(key);
+}
+
+// Object paths of remote devices end in dev_XX_XX_XX_XX_XX_XX
+static String8 device_path_to_address(const char *path) {
+    const char *p = path ? strrchr(path, '/') : NULL;
+    char address[BTADDR_SIZE];
+    if (!p || strncmp(p, "/dev_", 5) || strlen(p + 5) != BTADDR_SIZE - 1)
+        return String8();
+    strlcpy(address, p + 5, sizeof(address));
+    for (char *q = address; *q; q++)
+        if (*q == '_')
+            *q = ':';
+    return address_key(address);
+}
+
+static bt_adapter_t *find_adapter(const char *path) {
+    if (!path)
+        return NULL;
+    for (int i = 0; i < adapterCount; i++) {
+        const char *apath = adapters[i]->path.string();
+        size_t len = adapters[i]->path.length();
+        if (!strncmp(path, apath, len) && (path[len] == 0 || path[len] == '/'))
+            return adapters[i];
+    }
+    return NULL;
+}
+
+/*
+ * Match rules.  Interface-wide rules wake us for every signal bluetoothd
+ * sends on those interfaces, handled or not, so instead we subscribe to
+ * exactly the (interface, member, path) triples in sigtable: Manager
+ * signals on "/", adapter signals on each tracked adapter and device and
+ * profile signals on each created device.  Rules are refcounted and
+ * follow adapters and devices as they come and go.  -W puts back the old
+ * wide rules (signames) for comparison; "unmatched" then counts the
+ * deliveries the narrow set would have kept away.  It only means something
+ * under -W: with the narrow rules in place those signals never reach us,
+ * and counting them would take the subscriptions the rules exist to avoid.
+ */
+#define MATCH_MAX_RULES 400    // the system bus allows 512 per connection
+
+typedef struct {
+    uint64_t rules_added;
+    uint64_t rules_removed;
+    uint64_t wakeups;          // returns from poll in the event loop
+    uint64_t signals;          // signals dispatched to event_filter
+    uint64_t unhandled;        // of those, ones not in sigtable
+    uint64_t unmatched;        // ones no narrow rule would have matched; -W only
+} match_stats_t;
+
+static bool matchWide;
+static KeyedVector<String8, int> matchRules;      // rule -> refcount
+static KeyedVector<String8, bool> matchDevices;   // created device -> has per-signal rules
+static match_stats_t matchStats;
+static pthread_mutex_t matchLock = PTHREAD_MUTEX_INITIALIZER;
+static int lookupmap(CHARMAPTYPE *map, const char *name);
+
+// Called with matchLock held
+static void match_rule(const char *rule, bool add)
+{
+    String8 key(rule);
+    ssize_t i = matchRules.indexOfKey(key);
+    if (add) {
+        if (i >= 0) {
+            matchRules.editValueAt(i)++;
+            return;
+        }
+        matchRules.add(key, 1);
+        matchStats.rules_added++;
+        // without an error to fill in this doesn't wait for the bus
+        if (global_conn)
+            dbus_bus_add_match(global_conn, rule, NULL);
+    } else {
+        if (i < 0 || --matchRules.editValueAt(i) > 0)
+            return;
+        matchRules.removeItemsAt(i);
+        matchStats.rules_removed++;
+        if (global_conn)
+            dbus_bus_remove_match(global_conn, rule, NULL);
+    }
+}
+
+static int match_scope_size(int scope)
+{
+    int n = 0;
+    for (SIGTABLETYPE *s = sigtable; s->group; s++)
+        if (lookupmap(matchscopemap, s->group) == scope)
+            n++;
+    return n;
+}
+
+// One rule per signal of the scope on path, or with precise false a single
+// rule for everything bluetoothd sends on path.  Called with matchLock held.
+static void match_scope(int scope, const char *path, bool precise, bool add)
+{
+    char rule[256];
+    if (matchWide)
+        return;
+    if (!precise) {
+        snprintf(rule, sizeof(rule), "type='signal',sender='" BLUEZ_DBUS_BASE_IFC "',path='%s'", path);
+        match_rule(rule, add);
+        return;
+    }
+    for (SIGTABLETYPE *s = sigtable; s->group; s++) {
+        if (lookupmap(matchscopemap, s->group) != scope)
+            continue;
+        snprintf(rule, sizeof(rule), "type='signal',sender='" BLUEZ_DBUS_BASE_IFC "',interface='%s',member='%s',path='%s'",
+            s->group, s->name, path);
+        match_rule(rule, add);
+    }
+}
+
+static void match_device(const char *path, bool add)
+{
+    String8 key(path);
+    pthread_mutex_lock(&matchLock);
+    ssize_t i = matchDevices.indexOfKey(key);
+    if (add && i < 0) {
+        // past the budget a device gets one catch-all rule instead
+        bool precise = matchRules.size() + match_scope_size(MATCH_DEVICE) <= MATCH_MAX_RULES;
+        matchDevices.add(key, precise);
+        match_scope(MATCH_DEVICE, path, precise, true);
+    } else if (!add && i >= 0) {
+        match_scope(MATCH_DEVICE, path, matchDevices.valueAt(i), false);
+        matchDevices.removeItemsAt(i);
+    }
+    pthread_mutex_unlock(&matchLock);
+}
+
+// Subscribe to an adapter and the devices already created on it, or drop
+// all of that again
+static void match_adapter(const char *path, bool add)
+{
+    size_t len = strlen(path);
+    pthread_mutex_lock(&matchLock);
+    match_scope(MATCH_ADAPTER, path, true, add);
+    for (size_t i = matchDevices.size(); !add && i-- > 0; ) {
+        const char *dpath = matchDevices.keyAt(i).string();
+        if (!strncmp(dpath, path, len) && dpath[len] == '/') {
+            match_scope(MATCH_DEVICE, dpath, matchDevices.valueAt(i), false);
+            matchDevices.removeItemsAt(i);
+        }
+    }
+    pthread_mutex_unlock(&matchLock);
+    if (!add || !global_conn)
+        return;
+    // the adapter rules went out first, so a device created from here on
+    // is seen either in this list or as DeviceCreated
+    DBusMessage *reply = dbus_func_args(path, DBUS_ADAPTER_IFACE, "ListDevices", DBUS_TYPE_INVALID);
+    if (!reply)
+        return;
+    DBusError err;
+    char **paths = NULL;
+    int count = 0;
+    dbus_error_init(&err);
+    if (dbus_message_get_args(reply, &err, DBUS_TYPE_ARRAY, DBUS_TYPE_OBJECT_PATH, &paths, &count, DBUS_TYPE_INVALID)) {
+        for (int i = 0; i < count; i++)
+            match_device(paths[i], true);
+        dbus_free_string_array(paths);
+    } else {
+        LOG_AND_FREE_DBUS_ERROR(&err);
+    }
+    dbus_message_unref(reply);
+}
+
+static void addmatch(void)
+{
+    DBusError err;
+    const char **p = signames;
+    if (!matchWide) {
+        pthread_mutex_lock(&matchLock);
+        match_scope(MATCH_ROOT, "/", true, true);
+        pthread_mutex_unlock(&matchLock);
+        return;
+    }
+    dbus_error_init(&err);
+    while (*p) {
+        dbus_bus_add_match(global_conn, *p, &err);
+        if (dbus_error_is_set(&err)) {
+            LOG_AND_FREE_DBUS_ERROR(&err);
+            exit(1);
+        } 
+        p++;
+    }
+}
+static void removematch(void)
+{
+    DBusError err;
+    const char **p = signames;
+    if (!matchWide) {
+        pthread_mutex_lock(&matchLock);
+        match_scope(MATCH_ROOT, "/", true, false);
+        pthread_mutex_unlock(&matchLock);
+        return;
+    }
+    dbus_error_init(&err);
+    while (*p) {
+        dbus_bus_remove_match(global_conn, *p, &err);
+        if (dbus_error_is_set(&err)) {
+            LOG_AND_FREE_DBUS_ERROR(&err);
+        }
+        p++;
+    }
+}
+
+// Account for a signal reaching event_filter
+static void match_count(DBusMessage *msg, int sigvalue)
+{
+    const char *path = dbus_message_get_path(msg);
+    bool matched = false;
+    pthread_mutex_lock(&matchLock);
+    matchStats.signals++;
+    if (sigvalue < 0) {
+        matchStats.unhandled++;
+    } else {
+        switch (lookupmap(matchscopemap, dbus_message_get_interface(msg))) {
+        case MATCH_NONE:
+            matched = true;
+            break;
+        case MATCH_ROOT:
+            matched = path && !strcmp(path, "/");
+            break;
+        case MATCH_ADAPTER: {
+            bt_adapter_t *adapter = find_adapter(path);
+            matched = adapter && !strcmp(adapter->path.string(), path);
+            break;
+            }
+        case MATCH_DEVICE:
+            matched = path && matchDevices.indexOfKey(String8(path)) >= 0;
+            break;
+        }
+    }
+    if (!matched)
+        matchStats.unmatched++;
+    pthread_mutex_unlock(&matchLock);
+}
+
+static void getMatchStatsNative(match_stats_t *stats) {
+    pthread_mutex_lock(&matchLock);
+    *stats = matchStats;
+    pthread_mutex_unlock(&matchLock);
+}
+
+static void print_match_stats(void)
+{
+    match_stats_t st;
+    getMatchStatsNative(&st);
+    printf("match rules (%s): %llu added, %llu removed; %llu wakeups, %llu signals, %llu unhandled",
+        matchWide ? "wide" : "narrow",
+        (unsigned long long)st.rules_added, (unsigned long long)st.rules_removed,
+        (unsigned long long)st.wakeups, (unsigned long long)st.signals, (unsigned long long)st.unhandled);
+    if (matchWide)
+        printf(", %llu outside the narrow rules\n", (unsigned long long)st.unmatched);
+    else
+        printf("; run with -W to count what the narrow rules keep away\n");
+}
+
+static int compare_nsecs(const void *a, const void *b) {
+    nsecs_t x = *(const nsecs_t *)a, y = *(const nsecs_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static nsecs_t process_cpu(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void print_stamp_stats(void)
+{
+    nsecs_t *received = (nsecs_t *)malloc(2 * STAMP_SAMPLES * sizeof(nsecs_t));
+    nsecs_t *handled = received + STAMP_SAMPLES;
+    pthread_mutex_lock(&stampLock);
+    uint64_t count = stampStats.count;
+    uint64_t signals = count - stampStats.window_start;
+    nsecs_t cpu = process_cpu() - stampStats.window_cpu;
+    int n = count < STAMP_SAMPLES ? count : STAMP_SAMPLES;
+    memcpy(received, stampStats.received, n * sizeof(nsecs_t));
+    memcpy(handled, stampStats.handled, n * sizeof(nsecs_t));
+    pthread_mutex_unlock(&stampLock);
+    if (!n) {
+        free(received);
+        return;
+    }
+    qsort(received, n, sizeof(nsecs_t), compare_nsecs);
+    qsort(handled, n, sizeof(nsecs_t), compare_nsecs);
+    printf("mock signals: %llu stamped, last %d: send to event_filter us p50 %lld p99 %lld max %lld; "
+           "send to handled us p50 %lld p90 %lld p99 %lld max %lld; CPU %lld us per 1k signals\n",
+        (unsigned long long)count, n,
+        (long long)ns2us(received[n / 2]), (long long)ns2us(received[n * 99 / 100]), (long long)ns2us(received[n - 1]),
+        (long long)ns2us(handled[n / 2]), (long long)ns2us(handled[n * 9 / 10]),
+        (long long)ns2us(handled[n * 99 / 100]), (long long)ns2us(handled[n - 1]),
+        signals ? (long long)ns2us(cpu * 1000 / (nsecs_t)signals) : 0LL);
+    free(received);
+}
+
+// Called by the workers once a signal is handled; queued is when
+// event_filter saw it.  Reports every STAMP_SAMPLES signals; the CPU
+// figure is the whole process's, over the window since the last report.
+static void stamp_record(const BTProperties& prop, nsecs_t queued) {
+    ssize_t index = prop.indexOfKey(String8("MockTimestamp"));
+    if (index < 0)
+        return;
+    nsecs_t sent = strtoll(prop.valueAt(index).string(), NULL, 10);
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    pthread_mutex_lock(&stampLock);
+    int i = stampStats.count++ % STAMP_SAMPLES;
+    if (!i) {
+        stampStats.window_start = stampStats.count;
+        stampStats.window_cpu = process_cpu();
+    }
+    stampStats.received[i] = queued - sent;
+    stampStats.handled[i] = now - sent;
+    bool report = i == STAMP_SAMPLES - 1;
+    pthread_mutex_unlock(&stampLock);
+    if (report)
+        print_stamp_stats();
+}
+
+// The deferred half of event_filter(), on a pool worker
+static void work_process(bt_adapter_t *adapter, DBusMessage *msg, int sigvalue, nsecs_t queued) {
+    BTProperties prop;
+    DBusMessageIter iter;
+    char *c_address;
+    const char *c_path = dbus_message_get_path(msg);
+    switch (sigvalue) {
+    case BSIG_AdapterDeviceFound: {
+        if (!dbus_message_iter_init(msg, &iter))
+            break;
+        dbus_message_iter_get_basic(&iter, &c_address);
+        if (!dbus_message_iter_next(&iter) || parse_properties(prop, &iter))
+            break;
+        String8 key = address_key(c_address);
+        bool found_new = false;
+        pthread_mutex_lock(&adapter->lock);
+        if (adapter->devices.indexOfKey(key) < 0)
+            found_new = adapter->found_new = true;
+        adapter->devices.replaceValueFor(key, prop);
+        pthread_mutex_unlock(&adapter->lock);
+        dumpprop(prop, "adapterfound");
+        // let the discovery scheduler check its target set
+        if (found_new)
+            dbusWakeup(NULL);
+        stamp_record(prop, queued);
+        break;
+        }
+    case BSIG_AdapterDeviceDisappeared:
+        if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &c_address, DBUS_TYPE_INVALID))
+            break;
+        pthread_mutex_lock(&adapter->lock);
+        adapter->devices.removeItem(address_key(c_address));
+        pthread_mutex_unlock(&adapter->lock);
+        break;
+    case BSIG_AdapterPropertyChanged: {
+        if (parse_property_change(prop, msg))
+            break;
+        dumpprop(prop, "adapterchanged");
+        ssize_t index = prop.indexOfKey(String8("Discovering"));
+        if (index >= 0) {
+            pthread_mutex_lock(&adapter->lock);
+            adapter->discovering = !strcmp(prop.valueAt(index).string(), "1");
+            pthread_mutex_unlock(&adapter->lock);
+        }
+        index = prop.indexOfKey(String8("Powered"));
+        if (index >= 0)
+            printf("[%s:%d] %s Powered %s\n", __FUNCTION__, __LINE__, adapter->path.string(), prop.valueAt(index).string());
+        break;
+        }
+    case BSIG_DevicePropertyChanged: {
+        if (parse_property_change(prop, msg))
+            break;
+        dumpprop(prop, "devchanged");
+        String8 address = device_path_to_address(dbus_message_get_path(msg));
+        if (address.length() == 0)
+            break;
+        pthread_mutex_lock(&adapter->lock);
+        ssize_t index = adapter->devices.indexOfKey(address);
+        if (index < 0)
+            index = adapter->devices.add(address, BTProperties());
+        BTProperties& known = adapter->devices.editValueAt(index);
+        for (size_t i = 0; i < prop.size(); i++)
+            known.replaceValueFor(prop.keyAt(i), prop.valueAt(i));
+        pthread_mutex_unlock(&adapter->lock);
+        // link load changed, the discovery scheduler may want to back off
+        if (prop.indexOfKey(String8("Connected")) >= 0)
+            dbusWakeup(NULL);
+        stamp_record(prop, queued);
+        break;
+        }
+    case BSIG_InputDevicePropertyChanged:
+        if (parse_property_change(prop, msg))
+            break;
+        dumpprop(prop, "inpdevchanged");
+        if (prop.indexOfKey(String8("Connected")) >= 0)
+            conn_connected(CONN_PROFILE_INPUT, c_path, !strcmp(prop.valueFor(String8("Connected")).string(), "1"), queued);
+        break;
+    case BSIG_PanDevicePropertyChanged:
+        if (parse_property_change(prop, msg))
+            break;
+        dumpprop(prop, "pandevchanged");
+        if (prop.indexOfKey(String8("Connected")) >= 0)
+            conn_connected(CONN_PROFILE_PAN, c_path, !strcmp(prop.valueFor(String8("Connected")).string(), "1"), queued);
+        break;
+    case BSIG_HealthDevicePropertyChanged:
+        if (parse_property_change(prop, msg))
+            break;
+        dumpprop(prop, "healdevchanged");
+        break;
+    case BSIG_AudioPropertyChanged: {
+        if (parse_property_change(prop, msg))
+            break;
+        dumpprop(prop, "auddevchanged");
+        if (prop.indexOfKey(String8("State")) < 0)
+            break;
+        String8 address = device_path_to_address(c_path);
+        if (adapter && address.length()) {
+            pthread_mutex_lock(&adapter->lock);
+            ssize_t index = adapter->devices.indexOfKey(address);
+            if (index < 0)
+                index = adapter->devices.add(address, BTProperties());
+            adapter->devices.editValueAt(index).replaceValueFor(String8("AudioState"), prop.valueFor(String8("State")));
+            pthread_mutex_unlock(&adapter->lock);
+        }
+        link_streaming(c_path, !strcmp(prop.valueFor(String8("State")).string(), "playing"));
+        sink_state(c_path, prop.valueFor(String8("State")).string(), queued);
+        break;
+        }
+    }
+}
+
+
+// Called with workLock held
+static void work_push(work_worker_t *w, work_strand_t *strand) {
+    strand->next = NULL;
+    if (w->tail)
+        w->tail->next = strand;
+    else
+        w->head = strand;
+    w->tail = strand;
+}
+
+// Next strand for w: its own run queue first, then steal the oldest from
+// another worker.  Called with workLock held.
+static work_strand_t *work_take(work_worker_t *w) {
+    for (int i = 0; i < WORK_POOL_THREADS; i++) {
+        work_worker_t *victim = &workWorkers[(w->index + i) % WORK_POOL_THREADS];
+        work_strand_t *strand = victim->head;
+        if (!strand)
+            continue;
+        victim->head = strand->next;
+        if (!victim->head)
+            victim->tail = NULL;
+        if (i)
+            workStats.steals++;
+        return strand;
+    }
+    return NULL;
+}
+
+static void *work_worker_main(void *arg) {
+    work_worker_t *w = (work_worker_t *)arg;
+    pthread_mutex_lock(&workLock);
+    for (;;) {
+        work_strand_t *strand;
+        while (!(strand = work_take(w))) {
+            workIdle++;
+            pthread_cond_wait(&workCond, &workLock);
+            workIdle--;
+        }
+        // detach a batch so the lock is taken twice per batch, not per item
+        work_item_t *batch = strand->head, *last = batch;
+        int n = 1;
+        while (last->next && n < WORK_STRAND_BATCH) {
+            last = last->next;
+            n++;
+        }
+        strand->head = last->next;
+        if (!strand->head)
+            strand->tail = NULL;
+        last->next = NULL;
+        pthread_mutex_unlock(&workLock);
+        nsecs_t wait_total = 0, wait_max = 0, handler_total = 0, handler_max = 0;
+        while (batch) {
+            work_item_t *item = batch;
+            batch = item->next;
+            nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+            nsecs_t wait = start - item->queued;
+            work_process(item->adapter, item->msg, item->sigvalue, item->queued);
+            dbus_message_unref(item->msg);
+            free(item);
+            nsecs_t handler = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+            wait_total += wait;
+            if (wait > wait_max)
+                wait_max = wait;
+            handler_total += handler;
+            if (handler > handler_max)
+                handler_max = handler;
+        }
+        pthread_mutex_lock(&workLock);
+        strand->depth -= n;
+        workStats.processed += n;
+        workStats.wait_total += wait_total;
+        if (wait_max > workStats.wait_max)
+            workStats.wait_max = wait_max;
+        workStats.handler_total += handler_total;
+        if (handler_max > workStats.handler_max)
+            workStats.handler_max = handler_max;
+        workStats.depth -= n;
+        if (!workStats.depth)
+            pthread_cond_broadcast(&workIdleCond);
+        if (strand->head) {
+            // more to do: back of the queue, where an idle worker can steal it
+            work_push(w, strand);
+            if (workIdle)
+                pthread_cond_signal(&workCond);
+        } else {
+            strand->running = false;
+        }
+    }
+    return NULL;
+}
+
+// Wait until the workers have caught up with everything queued so far
+static void work_pool_drain(void) {
+    pthread_mutex_lock(&workLock);
+    while (workStats.depth)
+        pthread_cond_wait(&workIdleCond, &workLock);
+    pthread_mutex_unlock(&workLock);
+}
+
+static void work_pool_start(void) {
+    for (int i = 0; i < WORK_POOL_THREADS; i++) {
+        work_worker_t *w = &workWorkers[i];
+        w->index = i;
+        w->head = w->tail = NULL;
+        pthread_create(&w->thread, NULL, work_worker_main, w);
+    }
+}
+
+static uint32_t work_hash(uint32_t h, const char *p) {
+    for (; *p; p++)
+        h = (h ^ (uint8_t)(*p == ':' ? '_' : *p)) * 16777619u;     // FNV-1a
+    return h;
+}
+
+// Hash of the object path a signal's work is ordered by.  DeviceFound and
+// DeviceDisappeared are sent on the adapter but are about a device, so
+// they are ordered with that device's PropertyChanged.
+static uint32_t work_key(bt_adapter_t *adapter, DBusMessage *msg, int sigvalue) {
+    DBusMessageIter iter;
+    const char *c_address;
+    if ((sigvalue == BSIG_AdapterDeviceFound || sigvalue == BSIG_AdapterDeviceDisappeared)
+     && adapter && dbus_message_iter_init(msg, &iter)
+     && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&iter, &c_address);
+        return work_hash(work_hash(work_hash(2166136261u, adapter->path.string()), "/dev_"), c_address);
+    }
+    const char *path = dbus_message_get_path(msg);
+    return work_hash(2166136261u, path ? path : "");
+}
+
+// Hand msg to the pool, behind anything already queued for the same
+// object path.  Takes a reference.
+static void work_queue(bt_adapter_t *adapter, DBusMessage *msg, int sigvalue) {
+    uint32_t key = work_key(adapter, msg, sigvalue);
+    work_strand_t *strand = &workStrands[key % WORK_STRANDS];
+    work_item_t *item = (work_item_t *)malloc(sizeof(work_item_t));
+    item->next = NULL;
+    item->adapter = adapter;
+    item->msg = dbus_message_ref(msg);
+    item->sigvalue = sigvalue;
+    item->queued = systemTime(SYSTEM_TIME_MONOTONIC);
+    pthread_mutex_lock(&workLock);
+    if (strand->tail)
+        strand->tail->next = item;
+    else
+        strand->head = item;
+    strand->tail = item;
+    if (++strand->depth > workStats.max_strand_depth)
+        workStats.max_strand_depth = strand->depth;
+    if (++workStats.depth > workStats.max_depth)
+        workStats.max_depth = workStats.depth;
+    workStats.queued++;
+    if (!strand->running) {
+        strand->running = true;
+        work_push(&workWorkers[(key / WORK_STRANDS) % WORK_POOL_THREADS], strand);
+        if (workIdle)
+            pthread_cond_signal(&workCond);
+    }
+    pthread_mutex_unlock(&workLock);
+}
+
+static void getWorkStatsNative(work_stats_t *stats) {
+    pthread_mutex_lock(&workLock);
+    *stats = workStats;
+    pthread_mutex_unlock(&workLock);
+}
+
+static void print_template_stats(void)
+{
+    msg_template_stats_t st;
+    dbus_template_stats(&st);
+    printf("method call templates: %d held, %llu hits, %llu misses, %llu evicted\n", st.count,
+        (unsigned long long)st.hits, (unsigned long long)st.misses, (unsigned long long)st.evictions);
+}
+
+static void print_work_stats(void)
+{
+    work_stats_t st;
+    getWorkStatsNative(&st);
+    printf("signal workers: %llu queued, %llu processed, %llu stolen; depth %d (max %d, %d on one path); "
+           "wait avg %lld us max %lld us; handler avg %lld us max %lld us\n",
+        (unsigned long long)st.queued, (unsigned long long)st.processed, (unsigned long long)st.steals,
+        st.depth, st.max_depth, st.max_strand_depth,
+        st.processed ? (long long)ns2us(st.wait_total / st.processed) : 0LL, (long long)ns2us(st.wait_max),
+        st.processed ? (long long)ns2us(st.handler_total / st.processed) : 0LL, (long long)ns2us(st.handler_max));
+}
+
+// Device PropertyChanged Connected, i.e. the ACL link going up or down.
+// Looked at in event_filter rather than on the signal workers so that it
+// is ordered before the profiles' own PropertyChanged.
+static bool acl_changed(DBusMessage *msg, bt_addr_t *addr, bool *up)
+{
+    DBusMessageIter iter, value;
+    const char *name;
+    dbus_bool_t val;
+    if (!dbus_message_iter_init(msg, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return false;
+    dbus_message_iter_get_basic(&iter, &name);
+    if (strcmp(name, "Connected") || !dbus_message_iter_next(&iter)
+     || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT)
+        return false;
+    dbus_message_iter_recurse(&iter, &value);
+    if (dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_BOOLEAN
+     || bt_addr_parse(device_path_to_address(dbus_message_get_path(msg)).string(), addr) < 0)
+        return false;
+    dbus_message_iter_get_basic(&value, &val);
+    *up = val;
+    return true;
+}
+
 // Called by dbus during WaitForAndDispatchEventNative()
 static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg, void *data)
 {
@@ -320,21 +1105,79 @@ static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg, vo
     int rc = -1;
 
     dbus_error_init(&err); 
+    bt_journal_append(msg);
     int sigvalue = findsignal(sigtable, msg);
-    printf("%s: %d Received signal %s:%s from %s\n", __FUNCTION__, sigvalue, dbus_message_get_interface(msg), dbus_message_get_member(msg), dbus_message_get_path(msg)); 
+    if (sigvalue != BSIG_NOT_SIGNAL)
+        match_count(msg, sigvalue);
+    ALOGV("%s: %d Received signal %s:%s from %s\n", __FUNCTION__, sigvalue, dbus_message_get_interface(msg), dbus_message_get_member(msg), dbus_message_get_path(msg)); 
+    switch(sigvalue) {
+    case BSIG_AdapterDeviceFound:
+    case BSIG_AdapterDeviceDisappeared:
+    case BSIG_AdapterPropertyChanged:
+    case BSIG_DevicePropertyChanged: {
+        bt_addr_t addr;
+        bool up;
+        if (sigvalue == BSIG_DevicePropertyChanged && acl_changed(msg, &addr, &up)) {
+            conn_acl(addr, up);
+            link_acl(dbus_message_get_path(msg), addr, up);
+        }
+        bt_adapter_t *adapter = find_adapter(dbus_message_get_path(msg));
+        if (adapter) {
+            work_queue(adapter, msg, sigvalue);
+            return DBUS_HANDLER_RESULT_HANDLED;
+        }
+        break;
+        }
+    case BSIG_InputDevicePropertyChanged:
+    case BSIG_PanDevicePropertyChanged:
+    case BSIG_HealthDevicePropertyChanged:
+    case BSIG_AudioPropertyChanged:
+        work_queue(find_adapter(dbus_message_get_path(msg)), msg, sigvalue);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
     switch(sigvalue) {
     case BSIG_NOT_SIGNAL:
         ALOGV("%s: not interested (not a signal).", __FUNCTION__);
         return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     case BSIG_NameAcquired:
         break;
-    case BSIG_AdapterDeviceFound:
-        if (dbus_message_iter_init(msg, &iter)) {
-            dbus_message_iter_get_basic(&iter, &c_address);
-            if (dbus_message_iter_next(&iter))
-                rc = parse_properties(prop, &iter); // remote_device_properties);
-            int indexaddr = prop.indexOfKey(String8("Address"));
-            if (indexaddr >= 0)
+    case BSIG_ManagerAdapterAdded:
+        if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &c_object_path, DBUS_TYPE_INVALID))
+            goto failed;
+        if (bt_adapter_t *adapter = add_adapter(c_object_path)) {
+            pthread_mutex_lock(&discoveryLock);
+            discovery_arm(adapter);
+            pthread_mutex_unlock(&discoveryLock);
+            // first adapter back after bluetoothd went away
+            if (!global_adapter) {
+                global_adapter = adapter->path.string();
+                sdp_reregister();
+            }
+        }
+        break;
+    case BSIG_ManagerDefaultAdapterChanged:
+        if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &c_object_path, DBUS_TYPE_INVALID))
+            goto failed;
+        add_adapter(c_object_path);
+        if (bt_adapter_t *adapter = find_adapter(c_object_path)) {
+            if (!global_adapter || strcmp(global_adapter, c_object_path)) {
+                global_adapter = adapter->path.string();
+                sdp_reregister();
+            }
+        }
+        break;
+    case BSIG_ManagerAdapterRemoved:
+        if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &c_object_path, DBUS_TYPE_INVALID))
+            goto failed;
+        remove_adapter(c_object_path);
+        break;
+    case BSIG_AdapterDeviceFound:
+        if (dbus_message_iter_init(msg, &iter)) {
+            dbus_message_iter_get_basic(&iter, &c_address);
+            if (dbus_message_iter_next(&iter))
+                rc = parse_properties(prop, &iter); // remote_device_properties);
+            int indexaddr = prop.indexOfKey(String8("Address"));
+            if (indexaddr >= 0)
                 ; //printf("[%s:%d] Address %s\n", __FUNCTION__, __LINE__, prop.valueAt(indexaddr).string());
             dumpprop(prop, "adapterfound");
         }
@@ -346,18 +1189,25 @@ static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg, vo
         if (!dbus_message_get_args(msg, &err, DBUS_TYPE_STRING, &c_address, DBUS_TYPE_INVALID))
             goto failed;
         ALOGV("... address = %s", c_address);
+        if (bt_adapter_t *adapter = find_adapter(dbus_message_get_path(msg))) {
+            pthread_mutex_lock(&adapter->lock);
+            adapter->devices.removeItem(address_key(c_address));
+            pthread_mutex_unlock(&adapter->lock);
+        }
         //c_address));
         break;
     case BSIG_AdapterDeviceCreated:
         if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &c_object_path, DBUS_TYPE_INVALID))
             goto failed;
         ALOGV("... address = %s", c_object_path);
+        match_device(c_object_path, true);
         //c_object_path));
         break;
     case BSIG_AdapterDeviceRemoved:
         if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &c_object_path, DBUS_TYPE_INVALID))
             goto failed;
         ALOGV("... Object Path = %s", c_object_path);
+        match_device(c_object_path, false);
         //c_object_path));
         break;
     case BSIG_AdapterPropertyChanged: {
@@ -367,13 +1217,13 @@ static DBusHandlerResult event_filter(DBusConnection *conn, DBusMessage *msg, vo
         dumpprop(prop, "adapterchanged");
         int indexaddr = prop.indexOfKey(String8("Powered"));
         if (indexaddr >= 0)
-            printf("[%s:%d] Powered %s\n", __FUNCTION__, __LINE__, prop.valueAt(indexaddr).string());
+            ALOGV("[%s:%d] Powered %s\n", __FUNCTION__, __LINE__, prop.valueAt(indexaddr).string());
         /* Check if bluetoothd has (re)started, if so update the path. */
         //JAVA(method_onPropertyChanged, str_array);
         break;
         }
     case BSIG_DevicePropertyChanged: {
-printf("[%s:%d]\n", __FUNCTION__, __LINE__);
+ALOGV("[%s:%d]\n", __FUNCTION__, __LINE__);
         rc = parse_property_change(prop, msg); // remote_device_properties);
         if (rc)
             goto failed;
@@ -387,24 +1237,6 @@ dumpprop(prop, "devchanged");
         //remote_device_path));
         break;
         }
-    case BSIG_InputDevicePropertyChanged:
-printf("[%s:%d]\n", __FUNCTION__, __LINE__);
-        rc = parse_property_change(prop, msg); // input_properties);
-        if (rc)
-            goto failed;
-dumpprop(prop, "inpdevchanged");
-        c_path = dbus_message_get_path(msg);
-        //c_path), str_array);
-        break;
-    case BSIG_PanDevicePropertyChanged:
-printf("[%s:%d]\n", __FUNCTION__, __LINE__);
-        rc = parse_property_change(prop, msg); // pan_properties);
-        if (rc)
-            goto failed;
-dumpprop(prop, "pandevchanged");
-        c_path = dbus_message_get_path(msg);
-        //c_path), str_array);
-        break;
     case BSIG_NetworkDeviceDisconnected:
         if (!dbus_message_get_args(msg, &err, DBUS_TYPE_STRING, &c_address, DBUS_TYPE_INVALID))
             goto failed;
@@ -426,32 +1258,49 @@ dumpprop(prop, "pandevchanged");
         exists = FALSE;
         if (!dbus_message_get_args(msg, &err, DBUS_TYPE_OBJECT_PATH, &c_channel_path, DBUS_TYPE_INVALID))
             goto failed;
+        stop_health_channel(c_channel_path);
         //c_path), String8(c_channel_path), exists);
         break;
-    case BSIG_HealthDevicePropertyChanged:
-printf("[%s:%d]\n", __FUNCTION__, __LINE__);
-        rc = parse_property_change(prop, msg); // health_device_properties);
-        if (rc)
-            goto failed;
-dumpprop(prop, "healdevchanged");
-        c_path = dbus_message_get_path(msg);
-        //c_path), str_array);
-        break;
-    case BSIG_AudioPropertyChanged:
-printf("[%s:%d]\n", __FUNCTION__, __LINE__);
-        rc = parse_property_change(prop, msg); // sink_properties);
-        c_path = dbus_message_get_path(msg);
-dumpprop(prop, "auddevchanged");
-        break;
     default:
         goto failed;
     }
     return DBUS_HANDLER_RESULT_HANDLED;
 failed:
     LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-printf("[%s:%d] end bad\n", __FUNCTION__, __LINE__);
+ALOGV("[%s:%d] end bad\n", __FUNCTION__, __LINE__);
     return DBUS_HANDLER_RESULT_HANDLED;
 }
+static void grow_poll_data(void)
+{
+    if (pollMemberCount < pollDataSize)
+        return;
+    ALOGV("Bluetooth EventLoop poll struct growing");
+    struct pollfd *temp = (struct pollfd *)malloc( sizeof(struct pollfd) * (pollMemberCount+1));
+    memcpy(temp, pollData, sizeof(struct pollfd) * pollMemberCount);
+    free(pollData);
+    pollData = temp;
+    DBusWatch **temp2 = (DBusWatch **)malloc(sizeof(DBusWatch *) * (pollMemberCount+1));
+    memcpy(temp2, watchData, sizeof(DBusWatch *) * pollMemberCount);
+    free(watchData);
+    watchData = temp2;
+    fd_watch_t *temp3 = (fd_watch_t *)malloc(sizeof(fd_watch_t) * (pollMemberCount+1));
+    memcpy(temp3, fdWatchData, sizeof(fd_watch_t) * pollMemberCount);
+    free(fdWatchData);
+    fdWatchData = temp3;
+    pollDataSize++;
+}
+
+static void remove_poll_data(int y)
+{
+    int newCount = --pollMemberCount;
+    // copy the last live member over this one
+    pollData[y].fd = pollData[newCount].fd;
+    pollData[y].events = pollData[newCount].events;
+    pollData[y].revents = pollData[newCount].revents;
+    watchData[y] = watchData[newCount];
+    fdWatchData[y] = fdWatchData[newCount];
+}
+
 static void process_control(void)
 {
                 char data;
@@ -459,24 +1308,15 @@ static void process_control(void)
                     switch (data) {
                     case EVENT_LOOP_EXIT: {
                         dbus_connection_set_watch_functions(global_conn, NULL, NULL, NULL, NULL, NULL);
-                        DBusMessage *msg, *reply;
-                        DBusError err;
-                        dbus_error_init(&err);
-                        msg = dbus_message_new_method_call("org.bluez", global_adapter, "org.bluez.Adapter", "UnregisterAgent");
-                        dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH, &agent_path, DBUS_TYPE_INVALID);
-                        reply = dbus_connection_send_with_reply_and_block(global_conn, msg, -1, &err); 
-                        if (!reply) {
-                            if (dbus_error_is_set(&err)) {
-                                LOG_AND_FREE_DBUS_ERROR(&err);
-                                dbus_error_free(&err);
-                            }
-                        } else {
-                            dbus_message_unref(reply);
-                        }
-                        dbus_message_unref(msg);
+                        while (adapterCount > 0)
+                            remove_adapter(adapters[adapterCount - 1]->path.string());
                         dbus_connection_flush(global_conn);
-                        dbus_connection_unregister_object_path(global_conn, agent_path); 
                         removematch();
+                        print_match_stats();
+                        print_work_stats();
+                        print_stamp_stats();
+                        print_template_stats();
+                        print_sink_stats();
                         dbus_connection_remove_filter(global_conn, event_filter, NULL);
                         int fd = controlFdR;
                         controlFdR = 0;
@@ -497,25 +1337,44 @@ static void process_control(void)
                                 exit(1);
                             }
                         }
-                        if (pollMemberCount == pollDataSize) {
-                            ALOGV("Bluetooth EventLoop poll struct growing");
-                            struct pollfd *temp = (struct pollfd *)malloc( sizeof(struct pollfd) * (pollMemberCount+1));
-                            memcpy(temp, pollData, sizeof(struct pollfd) * pollMemberCount);
-                            free(pollData);
-                            pollData = temp;
-                            DBusWatch **temp2 = (DBusWatch **)malloc(sizeof(DBusWatch *) * (pollMemberCount+1));
-                            memcpy(temp2, watchData, sizeof(DBusWatch *) * pollMemberCount);
-                            free(watchData);
-                            watchData = temp2;
-                            pollDataSize++;
-                        }
+                        grow_poll_data();
                         pollData[pollMemberCount].fd = newFD;
                         pollData[pollMemberCount].revents = 0;
                         pollData[pollMemberCount].events = events;
                         watchData[pollMemberCount] = watch;
+                        fdWatchData[pollMemberCount].cb = NULL;
                         pollMemberCount++;
                         break;
                     }
+                    case EVENT_LOOP_ADD_FD: {
+                        int newFD;
+                        fd_watch_t fdwatch;
+                        read(controlFdR, &newFD, sizeof(int));
+                        read(controlFdR, &fdwatch.cb, sizeof(fd_watch_cb_t));
+                        read(controlFdR, &fdwatch.user, sizeof(void *));
+                        grow_poll_data();
+                        pollData[pollMemberCount].fd = newFD;
+                        pollData[pollMemberCount].revents = 0;
+                        pollData[pollMemberCount].events = POLLIN;
+                        watchData[pollMemberCount] = NULL;
+                        fdWatchData[pollMemberCount] = fdwatch;
+                        pollMemberCount++;
+                        break;
+                    }
+                    case EVENT_LOOP_REMOVE_FD: {
+                        int removeFD;
+                        read(controlFdR, &removeFD, sizeof(int));
+                        for (int y = 1; y < pollMemberCount; y++) {
+                            if (pollData[y].fd == removeFD && !watchData[y]) {
+                                fd_watch_t fdwatch = fdWatchData[y];
+                                remove_poll_data(y);
+                                fdwatch.cb(removeFD, 0, fdwatch.user);
+                                goto switchover;
+                            }
+                        }
+                        ALOGW("fd watch remove given with unknown fd %d", removeFD);
+                        break;
+                    }
                     case EVENT_LOOP_REMOVE: {
                         int removeFD;
                         unsigned int flags; 
@@ -523,13 +1382,8 @@ static void process_control(void)
                         read(controlFdR, &flags, sizeof(unsigned int));
                         short events = dbus_flags_to_unix_events(flags); 
                         for (int y = 0; y < pollMemberCount; y++) {
-                            if ((pollData[y].fd == removeFD) && (pollData[y].events == events)) {
-                                int newCount = --pollMemberCount;
-                                // copy the last live member over this one
-                                pollData[y].fd = pollData[newCount].fd;
-                                pollData[y].events = pollData[newCount].events;
-                                pollData[y].revents = pollData[newCount].revents;
-                                watchData[y] = watchData[newCount];
+                            if ((pollData[y].fd == removeFD) && (pollData[y].events == events) && watchData[y]) {
+                                remove_poll_data(y);
                                 goto switchover;
                             }
                         }
@@ -553,6 +1407,7 @@ static void *eventLoopMain(void)
 printf("[%s:%d]\n", __FUNCTION__, __LINE__);
     pollData = (struct pollfd *)calloc( DEFAULT_INITIAL_POLLFD_COUNT, sizeof(struct pollfd));
     watchData = (DBusWatch **)calloc( DEFAULT_INITIAL_POLLFD_COUNT, sizeof(DBusWatch *));
+    fdWatchData = (fd_watch_t *)calloc( DEFAULT_INITIAL_POLLFD_COUNT, sizeof(fd_watch_t));
     if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sockvec)) {
         ALOGE("Error getting BT control socket");
         exit(1);
@@ -571,6 +1426,12 @@ printf("[%s:%d]\n", __FUNCTION__, __LINE__);
             }
             if (pollData[i].fd == controlFdR) {
                 process_control();
+            } else if (!watchData[i]) {
+                short events = pollData[i].revents;
+                pollData[i].revents = 0;
+                // removal goes through the control socket, so the arrays
+                // stay put while the handler runs
+                fdWatchData[i].cb(pollData[i].fd, events, fdWatchData[i].user);
             } else {
                 short events = pollData[i].revents;
                 unsigned int flags = unix_events_to_dbus_flags(events);
@@ -580,9 +1441,32 @@ printf("[%s:%d]\n", __FUNCTION__, __LINE__);
                 break;
             }
         }
+        dbus_dispatch_lock();
         while (dbus_connection_dispatch(global_conn) == DBUS_DISPATCH_DATA_REMAINS) {
             } 
-        poll(pollData, pollMemberCount, -1);
+        dbus_dispatch_unlock();
+        discovery_tick();
+        pairing_tick();
+        link_tick();
+        sink_tick();
+        conn_tick();
+        int timeout = discovery_poll_timeout();
+        int pair_timeout = pairing_poll_timeout();
+        if (timeout < 0 || (pair_timeout >= 0 && pair_timeout < timeout))
+            timeout = pair_timeout;
+        int link_timeout = link_poll_timeout();
+        if (timeout < 0 || (link_timeout >= 0 && link_timeout < timeout))
+            timeout = link_timeout;
+        int sink_timeout = sink_poll_timeout();
+        if (timeout < 0 || (sink_timeout >= 0 && sink_timeout < timeout))
+            timeout = sink_timeout;
+        int conn_timeout = conn_poll_timeout();
+        if (timeout < 0 || (conn_timeout >= 0 && conn_timeout < timeout))
+            timeout = conn_timeout;
+        poll(pollData, pollMemberCount, timeout);
+        pthread_mutex_lock(&matchLock);
+        matchStats.wakeups++;
+        pthread_mutex_unlock(&matchLock);
     }
 }
 
@@ -604,8 +1488,8 @@ static DBusHandlerResult agent_event_filter(DBusConnection *conn, DBusMessage *m
     uint32_t passkey;
     DBusMessage *reply;
 
-    int methvalue = findsignal(sigtable, msg);
-    printf("%s: Received method %s:%s\n", __FUNCTION__, dbus_message_get_interface(msg), dbus_message_get_member(msg)); 
+    int methvalue = findmethod(methtable, msg);
+    ALOGV("%s: Received method %s:%s\n", __FUNCTION__, dbus_message_get_interface(msg), dbus_message_get_member(msg)); 
     switch(methvalue) {
     case BSIG_NOT_SIGNAL:
         ALOGV("%s: not interested (not a method call).", __FUNCTION__);
@@ -655,6 +1539,8 @@ static DBusHandlerResult agent_event_filter(DBusConnection *conn, DBusMessage *m
             ALOGE("%s: Invalid arguments for RequestPinCode() method", __FUNCTION__);
             return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
         } 
+        if (pairing_answer(methvalue, object_path, msg))
+            break;
         dbus_message_ref(msg);  // increment refcount because we pass to java
         //object_path), int(msg));
         break;
@@ -664,6 +1550,8 @@ static DBusHandlerResult agent_event_filter(DBusConnection *conn, DBusMessage *m
             ALOGE("%s: Invalid arguments for RequestPasskey() method", __FUNCTION__);
             return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
         } 
+        if (pairing_answer(methvalue, object_path, msg))
+            break;
         dbus_message_ref(msg);  // increment refcount because we pass to java
         //object_path), int(msg));
         break;
@@ -688,6 +1576,8 @@ static DBusHandlerResult agent_event_filter(DBusConnection *conn, DBusMessage *m
             ALOGE("%s: Invalid arguments for RequestConfirmation() method", __FUNCTION__);
             return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
         } 
+        if (pairing_answer(methvalue, object_path, msg))
+            break;
         dbus_message_ref(msg);  // increment refcount because we pass to java
         //object_path), passkey, int(msg));
         break;
@@ -696,6 +1586,8 @@ static DBusHandlerResult agent_event_filter(DBusConnection *conn, DBusMessage *m
             ALOGE("%s: Invalid arguments for RequestPairingConsent() method", __FUNCTION__);
             return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
         } 
+        if (pairing_answer(methvalue, object_path, msg))
+            break;
         dbus_message_ref(msg);  // increment refcount because we pass to java
         //object_path), int(msg));
         break;
@@ -817,6 +1709,7 @@ void onInputDeviceConnectionResult(DBusMessage *msg, void *user, void *n) {
         LOG_AND_FREE_DBUS_ERROR(&err);
     } 
     ALOGV("... Device Path = %s, result = %d", path, result);
+    conn_reply(CONN_PROFILE_INPUT, path, result);
     free(user);
 }
 
@@ -840,6 +1733,7 @@ void onPanDeviceConnectionResult(DBusMessage *msg, void *user, void *n) {
         LOG_AND_FREE_DBUS_ERROR(&err);
     }
     ALOGV("... Pan Device Path = %s, result = %d", path, result);
+    conn_reply(CONN_PROFILE_PAN, path, result);
     free(user);
 }
 
@@ -873,11 +1767,29 @@ static bool tearDownNativeDataNative() {
     return TRUE;
 }
 
+static bool startDiscoveryNative() {
+    bt_adapter_t *adapter = find_adapter(global_adapter);
+    if (!adapter)
+        return FALSE;
+    pthread_mutex_lock(&discoveryLock);
+    discovery_arm(adapter);
+    pthread_mutex_unlock(&discoveryLock);
+    dbusWakeup(NULL);
+    return TRUE;
+}
+
 static bool stopDiscoveryNative() {
     DBusError err;
     const char *name;
     bool ret = FALSE; 
+    if (!global_adapter)
+        return FALSE;
     dbus_error_init(&err); 
+    if (bt_adapter_t *adapter = find_adapter(global_adapter)) {
+        pthread_mutex_lock(&discoveryLock);
+        adapter->disc_phase = DISC_OFF;
+        pthread_mutex_unlock(&discoveryLock);
+    }
     DBusMessage *msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, global_adapter, DBUS_ADAPTER_IFACE, "StopDiscovery");
     DBusMessage *reply = dbus_connection_send_with_reply_and_block(global_conn, msg, -1, &err);
     if (dbus_error_is_set(&err)) {
@@ -897,6 +1809,7 @@ done:
     return ret;
 }
 
+// Returns hash and randomizer, 16 bytes each, as one malloc'd base64 string
 static char * readAdapterOutOfBandDataNative() {
     DBusError err;
     char *hash, *randomizer;
@@ -906,11 +1819,12 @@ static char * readAdapterOutOfBandDataNative() {
     dbus_error_init(&err);
     if (dbus_message_get_args(reply, &err, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &hash, &hash_len, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &randomizer, &r_len, DBUS_TYPE_INVALID)) {
         if (hash_len == 16 && r_len == 16) {
-            byteArray =NULL;// env->NewByteArray(32);
-            if (byteArray) {
-                //env->SetByteArrayRegion(byteArray, 0, 16, hash);
-                //env->SetByteArrayRegion(byteArray, 16, 16, randomizer);
-            }
+            uint8_t oob[32];
+            memcpy(oob, hash, 16);
+            memcpy(oob + 16, randomizer, 16);
+            byteArray = (char *)malloc(BT_BASE64_ENCODED_LEN(sizeof(oob)) + 1);
+            if (byteArray)
+                byteArray[bt_base64_encode(oob, sizeof(oob), byteArray)] = 0;
         } else {
             ALOGE("readAdapterOutOfBandDataNative: Hash len = %d, R len = %d", hash_len, r_len);
         }
@@ -1002,11 +1916,24 @@ static bool setPasskeyNative(String8 address, int passkey, int nativeData) {
     return TRUE;
 }
 
+// hash and randomizer arrive base64 encoded, 16 bytes each once decoded
 static bool setRemoteOutOfBandDataNative(String8 address, char * hash, char * randomizer, int nativeData) {
     DBusMessage *msg = (DBusMessage *)nativeData;
+    uint8_t h[BT_BASE64_DECODED_MAX(24)], r[BT_BASE64_DECODED_MAX(24)];
+    if (strlen(hash) != 24 || strlen(randomizer) != 24
+     || bt_base64_decode(hash, 24, h) != 16 || bt_base64_decode(randomizer, 24, r) != 16) {
+        ALOGE("%s: bad OOB data for %s", __FUNCTION__, address.string());
+        DBusMessage *reply = dbus_message_new_error(msg, "org.bluez.Error.Rejected", "Malformed OOB data");
+        if (reply) {
+            dbus_connection_send(global_conn, reply, NULL);
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(msg);
+        return FALSE;
+    }
     DBusMessage *reply = dbus_message_new_method_return(msg);
-    char *h_ptr =NULL; // env->GetByteArrayElements(hash, NULL);
-    char *r_ptr =NULL; // env->GetByteArrayElements(randomizer, NULL);
+    uint8_t *h_ptr = h;
+    uint8_t *r_ptr = r;
     dbus_message_append_args(reply, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &h_ptr, 16, DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &r_ptr, 16, DBUS_TYPE_INVALID); 
     dbus_connection_send(global_conn, reply, NULL);
     dbus_message_unref(msg);
@@ -1053,6 +1980,305 @@ static bool cancelPairingUserInputNative(String8 address, int nativeData) {
     return TRUE;
 }
 
+/*
+ * Bulk pairing.  Addresses queued with queuePairingNative() are bonded
+ * pairingParallel at a time through CreatePairedDevice on the default
+ * adapter, using device_agent_path as the agent.  Agent requests for a
+ * device we are pairing are answered straight away from pairPolicies
+ * (longest matching address prefix wins); with no matching policy, or
+ * for devices we are not pairing, requests still go the manual route.  Failures are retried or given up on according to the
+ * bondmap result.
+ */
+#define PAIR_MAX_PARALLEL 4       // ACL links BlueZ/controllers cope with while bonding
+#define PAIR_MAX_ATTEMPTS 3
+#define PAIR_TIMEOUT_MS 60000
+#define PAIR_RETRY_MS 2000
+#define PAIR_REPEATED_RETRY_MS 10000  // controller backs off after RepeatedAttempts
+
+enum { PAIR_QUEUED, PAIR_ACTIVE, PAIR_RETRY, PAIR_DONE, PAIR_FAILED };
+enum { PAIR_POLICY_ACCEPT, PAIR_POLICY_REJECT, PAIR_POLICY_MANUAL };
+
+typedef struct {
+    String8 address;
+    bt_addr_t addr;
+    int state;                 // PAIR_*
+    int attempts;
+    int result;                // last BOND_RESULT_*
+    nsecs_t queued;
+    nsecs_t started;           // first attempt
+    nsecs_t retry_at;
+    nsecs_t finished;
+} pair_job_t;
+
+typedef struct {
+    String8 prefix;            // address prefix, "" matches everything
+    int action;                // PAIR_POLICY_*
+    uint32_t passkey;
+    String8 pin;
+} pair_policy_t;
+
+static Vector<pair_job_t *> pairJobs;
+static bt_addr_map_t *pairJobIndex;   // addr -> entry in pairJobs
+static Vector<pair_policy_t> pairPolicies;
+static int pairingParallel = 2;
+static int pairActive;
+static nsecs_t pairBatchStart;
+static bool deviceAgentRegistered;
+static pthread_mutex_t pairLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool setupNativeDataNative();
+
+static pair_job_t *find_pair_job(const char *address) {
+    bt_addr_t addr;
+    if (!pairJobIndex || bt_addr_parse(address, &addr) < 0)
+        return NULL;
+    return (pair_job_t *)bt_addr_map_get(pairJobIndex, addr);
+}
+
+static const pair_policy_t *find_pair_policy(const char *address) {
+    const pair_policy_t *best = NULL;
+    for (size_t i = 0; i < pairPolicies.size(); i++) {
+        const pair_policy_t *p = &pairPolicies[i];
+        if (strncasecmp(address, p->prefix.string(), p->prefix.length()))
+            continue;
+        if (!best || p->prefix.length() > best->prefix.length())
+            best = p;
+    }
+    return best;
+}
+
+// Answer an agent request for a device being bulk paired.  Returns false
+// if the request should be left to the manual path.
+static bool pairing_answer(int methvalue, const char *object_path, DBusMessage *msg) {
+    String8 address = device_path_to_address(object_path);
+    DBusMessage *reply = NULL;
+    pthread_mutex_lock(&pairLock);
+    pair_job_t *job = find_pair_job(address.string());
+    const pair_policy_t *policy = find_pair_policy(address.string());
+    if (!job || job->state != PAIR_ACTIVE || !policy || policy->action == PAIR_POLICY_MANUAL) {
+        pthread_mutex_unlock(&pairLock);
+        return false;
+    }
+    // policy points into pairPolicies, which may be reallocated once
+    // pairLock is dropped
+    int action = policy->action;
+    if (action == PAIR_POLICY_REJECT) {
+        reply = dbus_message_new_error(msg, "org.bluez.Error.Rejected", "Rejected by pairing policy");
+    } else {
+        reply = dbus_message_new_method_return(msg);
+        if (methvalue == BMETH_RequestPasskey) {
+            dbus_uint32_t passkey = policy->passkey;
+            dbus_message_append_args(reply, DBUS_TYPE_UINT32, &passkey, DBUS_TYPE_INVALID);
+        } else if (methvalue == BMETH_RequestPinCode) {
+            const char *c_pin = policy->pin.string();
+            dbus_message_append_args(reply, DBUS_TYPE_STRING, &c_pin, DBUS_TYPE_INVALID);
+        }
+    }
+    pthread_mutex_unlock(&pairLock);
+    printf("pair %s: %s %s by policy\n", address.string(), dbus_message_get_member(msg),
+            action == PAIR_POLICY_REJECT ? "rejected" : "answered");
+    dbus_connection_send(global_conn, reply, NULL);
+    dbus_message_unref(reply);
+    return true;
+}
+
+static void pairing_report(void) {
+    int ok = 0, failed = 0;
+    nsecs_t total = 0;
+    for (size_t i = 0; i < pairJobs.size(); i++) {
+        pair_job_t *job = pairJobs[i];
+        if (job->state == PAIR_DONE) {
+            ok++;
+            total += job->finished - job->started;
+        } else if (job->state == PAIR_FAILED) {
+            failed++;
+        } else {
+            return;            // batch still running
+        }
+    }
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - pairBatchStart;
+    printf("pairing: %d paired, %d failed in %lld ms, mean %lld ms/device, %.1f devices/min\n",
+            ok, failed, (long long)ns2ms(elapsed), ok ? (long long)ns2ms(total / ok) : 0LL,
+            elapsed ? ok * 60000.0 / ns2ms(elapsed) : 0.0);
+}
+
+static void onPairJobResult(DBusMessage *msg, void *user, void *n) {
+    pair_job_t *job = (pair_job_t *)user;
+    DBusError err;
+    dbus_error_init(&err);
+    int result = BOND_RESULT_SUCCESS;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (dbus_set_error_from_message(&err, msg)) {
+        result = lookupmap(bondmap, err.name);
+        if (dbus_error_has_name(&err, DBUS_ERROR_NO_REPLY))
+            result = BOND_RESULT_AUTH_TIMEOUT;
+    }
+
+    pthread_mutex_lock(&pairLock);
+    pairActive--;
+    job->result = result;
+    int retry_ms = -1;
+    switch (result) {
+    case BOND_RESULT_SUCCESS:
+        break;
+    case BOND_RESULT_REPEATED_ATTEMPTS:
+        retry_ms = PAIR_REPEATED_RETRY_MS;
+        break;
+    case BOND_RESULT_DISCOVERY_IN_PROGRESS:
+    case BOND_RESULT_REMOTE_DEVICE_DOWN:
+    case BOND_RESULT_AUTH_TIMEOUT:
+        retry_ms = PAIR_RETRY_MS * job->attempts;
+        break;
+    default:                   // rejected, canceled, bad PIN: don't insist
+        break;
+    }
+    if (result == BOND_RESULT_SUCCESS) {
+        job->state = PAIR_DONE;
+        job->finished = now;
+        printf("pair %s: paired in %lld ms, %d attempt(s)\n", job->address.string(),
+                (long long)ns2ms(now - job->started), job->attempts);
+    } else if (retry_ms >= 0 && job->attempts < PAIR_MAX_ATTEMPTS) {
+        job->state = PAIR_RETRY;
+        job->retry_at = now + ms2ns(retry_ms);
+        printf("pair %s: %s, retry in %d ms\n", job->address.string(), err.name, retry_ms);
+    } else {
+        job->state = PAIR_FAILED;
+        job->finished = now;
+        printf("pair %s: failed after %d attempt(s): %s\n", job->address.string(), job->attempts,
+                err.name ? err.name : "error");
+    }
+    pairing_report();
+    pthread_mutex_unlock(&pairLock);
+    dbus_error_free(&err);
+}
+
+// Start whatever queued or retrying jobs fit in the parallel budget
+static void pairing_tick(void) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    const char *capabilities = "DisplayYesNo";
+    pthread_mutex_lock(&pairLock);
+    for (size_t i = 0; i < pairJobs.size() && pairActive < pairingParallel; i++) {
+        pair_job_t *job = pairJobs[i];
+        if (job->state != PAIR_QUEUED && !(job->state == PAIR_RETRY && now >= job->retry_at))
+            continue;
+        if (!global_adapter)
+            break;
+        if (!deviceAgentRegistered)
+            deviceAgentRegistered = setupNativeDataNative();
+        const char *c_address = job->address.string();
+        if (!job->attempts)
+            job->started = now;
+        job->attempts++;
+        job->state = PAIR_ACTIVE;
+        pairActive++;
+        if (!dbus_func_async(PAIR_TIMEOUT_MS, onPairJobResult, job, global_adapter, DBUS_ADAPTER_IFACE, "CreatePairedDevice",
+                DBUS_TYPE_STRING, &c_address, DBUS_TYPE_OBJECT_PATH, &device_agent_path, DBUS_TYPE_STRING, &capabilities, DBUS_TYPE_INVALID)) {
+            pairActive--;
+            job->state = PAIR_FAILED;
+            job->finished = now;
+            printf("pair %s: failed after %d attempt(s): can't send CreatePairedDevice\n",
+                    job->address.string(), job->attempts);
+            pairing_report();
+        }
+    }
+    pthread_mutex_unlock(&pairLock);
+}
+
+static int pairing_poll_timeout(void) {
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t next = -1;
+    pthread_mutex_lock(&pairLock);
+    for (size_t i = 0; i < pairJobs.size(); i++) {
+        pair_job_t *job = pairJobs[i];
+        if (job->state != PAIR_RETRY)
+            continue;
+        nsecs_t wait = job->retry_at > now ? job->retry_at - now : 0;
+        if (next < 0 || wait < next)
+            next = wait;
+    }
+    pthread_mutex_unlock(&pairLock);
+    return next < 0 ? -1 : (int)ns2ms(next + ms2ns(1) - 1);
+}
+
+static bool queuePairingNative(String8 address) {
+    bt_addr_t addr;
+    if (bt_addr_parse(address.string(), &addr) < 0)
+        return FALSE;
+    pthread_mutex_lock(&pairLock);
+    if (!pairJobIndex)
+        pairJobIndex = bt_addr_map_new();
+    if (!pairJobIndex || bt_addr_map_get(pairJobIndex, addr)) {
+        pthread_mutex_unlock(&pairLock);
+        return FALSE;
+    }
+    bool idle = true;
+    for (size_t i = 0; i < pairJobs.size(); i++)
+        if (pairJobs[i]->state != PAIR_DONE && pairJobs[i]->state != PAIR_FAILED)
+            idle = false;
+    pair_job_t *job = new pair_job_t;
+    job->address = address;
+    job->addr = addr;
+    job->state = PAIR_QUEUED;
+    job->attempts = 0;
+    job->result = BOND_RESULT_ERROR;
+    job->queued = job->started = job->retry_at = job->finished = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (idle)
+        pairBatchStart = job->queued;
+    if (bt_addr_map_put(pairJobIndex, addr, job) < 0) {
+        pthread_mutex_unlock(&pairLock);
+        delete job;
+        return FALSE;
+    }
+    pairJobs.add(job);
+    pthread_mutex_unlock(&pairLock);
+    dbusWakeup(NULL);
+    return TRUE;
+}
+
+// Forget finished jobs so their addresses can be queued again
+static void clearPairingNative() {
+    pthread_mutex_lock(&pairLock);
+    for (size_t i = pairJobs.size(); i-- > 0; ) {
+        if (pairJobs[i]->state == PAIR_DONE || pairJobs[i]->state == PAIR_FAILED) {
+            bt_addr_map_remove(pairJobIndex, pairJobs[i]->addr);
+            delete pairJobs[i];
+            pairJobs.removeAt(i);
+        }
+    }
+    pthread_mutex_unlock(&pairLock);
+}
+
+static bool setPairingParallelNative(int n) {
+    if (n < 1 || n > PAIR_MAX_PARALLEL)
+        return FALSE;
+    pthread_mutex_lock(&pairLock);
+    pairingParallel = n;
+    pthread_mutex_unlock(&pairLock);
+    dbusWakeup(NULL);
+    return TRUE;
+}
+
+static bool setPairingPolicyNative(String8 prefix, int action, int passkey, String8 pin) {
+    if (action < PAIR_POLICY_ACCEPT || action > PAIR_POLICY_MANUAL)
+        return FALSE;
+    pair_policy_t policy;
+    policy.prefix = prefix;
+    policy.action = action;
+    policy.passkey = passkey;
+    policy.pin = pin;
+    pthread_mutex_lock(&pairLock);
+    for (size_t i = 0; i < pairPolicies.size(); i++) {
+        if (!strcasecmp(pairPolicies[i].prefix.string(), prefix.string())) {
+            pairPolicies.editItemAt(i) = policy;
+            pthread_mutex_unlock(&pairLock);
+            return TRUE;
+        }
+    }
+    pairPolicies.add(policy);
+    pthread_mutex_unlock(&pairLock);
+    return TRUE;
+}
+
 static Vector<String8> getDevicePropertiesNative(String8 path)
 {
     DBusMessageIter iter;
@@ -1109,6 +2335,8 @@ static bool setAdapterPropertyNative(String8 key, void *value, int type) {
     DBusMessageIter iter;
     dbus_bool_t reply = FALSE;
     const char *c_key = key.string();
+    if (!global_adapter)
+        return FALSE;
     msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, global_adapter, DBUS_ADAPTER_IFACE, "SetProperty");
     dbus_message_append_args(msg, DBUS_TYPE_STRING, &c_key, DBUS_TYPE_INVALID);
     dbus_message_iter_init_append(msg, &iter);
@@ -1194,60 +2422,1057 @@ static bool discoverServicesNative(String8 path, String8 pattern) {
     return dbus_func_async(-1, onDiscoverServicesResult, context_path, c_path, DBUS_DEVICE_IFACE, "DiscoverServices", DBUS_TYPE_STRING, &c_pattern, DBUS_TYPE_INVALID);
 }
 
-static int * extract_handles(DBusMessage *reply) {
-    int *handles;
-    int * handleArray = NULL;
+/*
+ * SDP records.  Records go out in batches: every RFCOMM record is its own
+ * async AddRfcommServiceRecord call and all reserved service classes share
+ * one AddReservedServiceRecords call, so a batch costs one round trip
+ * however many records it holds.  Every registered record is remembered in
+ * sdpRecords with its handle; when bluetoothd comes back with a new
+ * default adapter the whole cache is re-registered in a single batch.
+ * Callers keep the handle they were first given: each entry maps it to
+ * the one bluetoothd knows the record by now, and the remove calls
+ * translate before they go out.
+ */
+#define SDP_RECORD_RFCOMM   0
+#define SDP_RECORD_RESERVED 1
+
+typedef struct {
+    int type;
+    String8 name;              // RFCOMM records
+    long long uuid_msb;
+    long long uuid_lsb;
+    short channel;
+    uint32_t svc_class;        // reserved records
+    int handle;                // -1 until registered
+    int id;                    // the handle the caller has; -1 until cached
+} sdp_record_t;
+
+typedef struct {
+    Vector<sdp_record_t> records;
+    int pending;               // calls still out
+    bool waiting;              // a caller sleeps on cond and frees the batch
+    bool finished;             // handles are final and cached
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sdp_batch_t;
+
+typedef struct {
+    sdp_batch_t *batch;
+    int type;                  // which records this call covers
+    int index;                 // the RFCOMM record, or -1
+} sdp_call_t;
+
+static Vector<sdp_record_t> sdpRecords;
+static pthread_mutex_t sdpLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool sdp_same_record(const sdp_record_t& a, const sdp_record_t& b)
+{
+    if (a.type != b.type)
+        return false;
+    if (a.type == SDP_RECORD_RESERVED)
+        return a.svc_class == b.svc_class;
+    return a.uuid_msb == b.uuid_msb && a.uuid_lsb == b.uuid_lsb && a.channel == b.channel
+        && a.name == b.name;
+}
+
+static ssize_t sdp_find_id(int id)
+{
+    for (size_t i = 0; i < sdpRecords.size(); i++) {
+        if (sdpRecords[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+// Fold a finished batch into the cache.  A caller's new records replace
+// stale entries for the same record; re-registered ones only update the
+// current handle of their entry.
+static void sdp_cache_batch(const sdp_batch_t *batch)
+{
+    Vector<sdp_record_t> orphans;
+    pthread_mutex_lock(&sdpLock);
+    for (size_t i = 0; i < batch->records.size(); i++) {
+        const sdp_record_t& rec = batch->records[i];
+        if (rec.id >= 0) {
+            ssize_t j = sdp_find_id(rec.id);
+            if (j >= 0)
+                sdpRecords.editItemAt(j).handle = rec.handle;
+            else if (rec.handle >= 0)
+                orphans.add(rec);      // removed while it was going back in
+            continue;
+        }
+        if (rec.handle < 0)
+            continue;
+        size_t j;
+        for (j = 0; j < sdpRecords.size(); j++) {
+            if (sdp_same_record(sdpRecords[j], rec))
+                break;
+        }
+        if (j == sdpRecords.size())
+            j = sdpRecords.add(rec);
+        sdp_record_t& entry = sdpRecords.editItemAt(j);
+        entry.handle = entry.id = rec.handle;
+    }
+    pthread_mutex_unlock(&sdpLock);
+
+    for (size_t i = 0; i < orphans.size(); i++) {
+        dbus_uint32_t handle = orphans[i].handle;
+        if (orphans[i].type == SDP_RECORD_RESERVED) {
+            const dbus_uint32_t *values = &handle;
+            dbus_func_async(-1, NULL, NULL, global_adapter, DBUS_ADAPTER_IFACE, "RemoveReservedServiceRecords",
+                    DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &values, 1, DBUS_TYPE_INVALID);
+        } else {
+            dbus_func_async(-1, NULL, NULL, global_adapter, DBUS_ADAPTER_IFACE, "RemoveServiceRecord",
+                    DBUS_TYPE_UINT32, &handle, DBUS_TYPE_INVALID);
+        }
+    }
+}
+
+// Drop a record from the cache by the handle its caller holds.  Returns
+// the handle bluetoothd knows it by: the same one for a record that was
+// never cached, -1 for one a re-registration failed to put back.
+static int sdp_forget(int id)
+{
+    int handle = id;
+    pthread_mutex_lock(&sdpLock);
+    ssize_t i = sdp_find_id(id);
+    if (i >= 0) {
+        handle = sdpRecords[i].handle;
+        sdpRecords.removeAt(i);
+    }
+    pthread_mutex_unlock(&sdpLock);
+    return handle;
+}
+
+static void sdp_batch_free(sdp_batch_t *batch)
+{
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->cond);
+    delete batch;
+}
+
+// Handles from an AddReservedServiceRecords reply go to the reserved records in order
+static void extract_handles(DBusMessage *reply, sdp_batch_t *batch) {
+    dbus_uint32_t *handles;
     int len;
 
     DBusError err;
     dbus_error_init(&err); 
     if (dbus_message_get_args(reply, &err, DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &handles, &len, DBUS_TYPE_INVALID)) {
-        //handleArray = env->NewIntArray(len);
-        if (handleArray) {
-            //env->SetIntArrayRegion(handleArray, 0, len, handles);
-        } else {
-            ALOGE("Null array in extract_handles");
+        for (size_t i = 0; i < batch->records.size() && len > 0; i++) {
+            if (batch->records[i].type == SDP_RECORD_RESERVED) {
+                batch->records.editItemAt(i).handle = *handles++;
+                len--;
+            }
         }
     } else {
         LOG_AND_FREE_DBUS_ERROR(&err);
     }
-    return handleArray;
 }
 
-static int * addReservedServiceRecordsNative(int * uuids) {
-    int* svc_classes =NULL; // env->GetIntArrayElements(uuids, NULL);
-    if (!svc_classes) return NULL;
-    int len =0; // env->GetArrayLength(uuids);
-    DBusMessage *reply = dbus_func_args(global_adapter, DBUS_ADAPTER_IFACE, "AddReservedServiceRecords", DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &svc_classes, len, DBUS_TYPE_INVALID);
-    return reply ? extract_handles(reply) : NULL;
+static void onSdpRecordResult(DBusMessage *msg, void *user, void *n) {
+    sdp_call_t *call = (sdp_call_t *)user;
+    sdp_batch_t *batch = call->batch;
+    DBusError err;
+    dbus_error_init(&err);
+    if (dbus_set_error_from_message(&err, msg)) {
+        LOG_AND_FREE_DBUS_ERROR(&err);
+    } else if (call->type == SDP_RECORD_RESERVED) {
+        extract_handles(msg, batch);
+    } else {
+        dbus_uint32_t handle;
+        if (dbus_message_get_args(msg, &err, DBUS_TYPE_UINT32, &handle, DBUS_TYPE_INVALID))
+            batch->records.editItemAt(call->index).handle = handle;
+        else
+            LOG_AND_FREE_DBUS_ERROR(&err);
+    }
+    free(call);
+    pthread_mutex_lock(&batch->lock);
+    bool done = --batch->pending == 0;
+    bool waiting = batch->waiting;
+    pthread_mutex_unlock(&batch->lock);
+    if (!done)
+        return;
+    sdp_cache_batch(batch);
+    if (waiting) {
+        pthread_mutex_lock(&batch->lock);
+        batch->finished = true;
+        pthread_cond_signal(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    } else {
+        sdp_batch_free(batch);
+    }
+}
+
+static void sdp_batch_hold(sdp_batch_t *batch, int delta)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->pending += delta;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void sdp_submit_rfcomm(sdp_batch_t *batch, int index, int timeout_ms)
+{
+    const sdp_record_t& rec = batch->records[index];
+    const char *c_name = rec.name.string();
+    sdp_call_t *call = (sdp_call_t *)malloc(sizeof(sdp_call_t));
+    call->batch = batch;
+    call->type = SDP_RECORD_RFCOMM;
+    call->index = index;
+    sdp_batch_hold(batch, 1);
+    if (!dbus_func_async(timeout_ms, onSdpRecordResult, call, global_adapter, DBUS_ADAPTER_IFACE, "AddRfcommServiceRecord",
+            DBUS_TYPE_STRING, &c_name, DBUS_TYPE_UINT64, &rec.uuid_msb, DBUS_TYPE_UINT64, &rec.uuid_lsb,
+            DBUS_TYPE_UINT16, &rec.channel, DBUS_TYPE_INVALID)) {
+        free(call);
+        sdp_batch_hold(batch, -1);
+    }
+}
+
+static void sdp_submit_reserved(sdp_batch_t *batch, const dbus_uint32_t *classes, int len, int timeout_ms)
+{
+    sdp_call_t *call = (sdp_call_t *)malloc(sizeof(sdp_call_t));
+    call->batch = batch;
+    call->type = SDP_RECORD_RESERVED;
+    call->index = -1;
+    sdp_batch_hold(batch, 1);
+    if (!dbus_func_async(timeout_ms, onSdpRecordResult, call, global_adapter, DBUS_ADAPTER_IFACE, "AddReservedServiceRecords",
+            DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &classes, len, DBUS_TYPE_INVALID)) {
+        free(call);
+        sdp_batch_hold(batch, -1);
+    }
+}
+
+// Send every record in records to bluetoothd at once.  With wait set the
+// records are a caller's new ones, and their handles are copied back once
+// all replies are in (so this must not run on the event loop thread);
+// otherwise they are cached ones going back in, which keep their ids, and
+// the batch finishes on its own with only the cache seeing the handles.
+static bool sdp_register(Vector<sdp_record_t>& records, bool wait, int timeout_ms)
+{
+    if (!global_adapter) {
+        for (size_t i = 0; i < records.size(); i++)
+            records.editItemAt(i).handle = -1;
+        return false;
+    }
+    sdp_batch_t *batch = new sdp_batch_t;
+    batch->records = records;
+    batch->pending = 1;        // held until everything is submitted
+    batch->waiting = wait;
+    batch->finished = false;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+
+    Vector<dbus_uint32_t> classes;
+    for (size_t i = 0; i < batch->records.size(); i++) {
+        sdp_record_t& rec = batch->records.editItemAt(i);
+        rec.handle = -1;
+        if (wait)
+            rec.id = -1;
+        if (rec.type == SDP_RECORD_RESERVED)
+            classes.add(rec.svc_class);
+        else
+            sdp_submit_rfcomm(batch, i, timeout_ms);
+    }
+    if (classes.size())
+        sdp_submit_reserved(batch, classes.array(), classes.size(), timeout_ms);
+    dbusWakeup(NULL);
+
+    // drop the submission hold; whoever takes pending to zero completes the batch
+    pthread_mutex_lock(&batch->lock);
+    bool done = --batch->pending == 0;
+    pthread_mutex_unlock(&batch->lock);
+    if (done) {
+        sdp_cache_batch(batch);
+        batch->finished = true;
+    }
+    if (!wait) {
+        if (done)
+            sdp_batch_free(batch);
+        return true;
+    }
+    pthread_mutex_lock(&batch->lock);
+    while (!batch->finished)
+        pthread_cond_wait(&batch->cond, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+    bool all = true;
+    for (size_t i = 0; i < records.size(); i++) {
+        records.editItemAt(i).handle = batch->records[i].handle;
+        all = all && batch->records[i].handle >= 0;
+    }
+    sdp_batch_free(batch);
+    return all;
+}
+
+// bluetoothd forgets our records when it restarts; put the cached set back
+static void sdp_reregister(void)
+{
+    pthread_mutex_lock(&sdpLock);
+    Vector<sdp_record_t> records = sdpRecords;
+    pthread_mutex_unlock(&sdpLock);
+    if (!records.size())
+        return;
+    printf("re-registering %d SDP records on %s\n", (int)records.size(), global_adapter);
+    sdp_register(records, false, -1);
+}
+
+// Register records in one batch, filling in each handle; true if all took
+static bool addServiceRecordsNative(Vector<sdp_record_t>& records, int timeout_ms) {
+    return sdp_register(records, true, timeout_ms);
 }
 
-static bool removeReservedServiceRecordsNative(int * handles) {
-    int *values =NULL; // env->GetIntArrayElements(handles, NULL);
-    DBusMessage *msg = NULL;
-    if (values == NULL) return FALSE; 
-    int len =0; // env->GetArrayLength(handles); 
+static bool addReservedServiceRecordsNative(const Vector<int>& uuids, Vector<int>& handles) {
+    Vector<sdp_record_t> records;
+    sdp_record_t rec;
+    rec.type = SDP_RECORD_RESERVED;
+    for (size_t i = 0; i < uuids.size(); i++) {
+        rec.svc_class = uuids[i];
+        records.add(rec);
+    }
+    bool ok = sdp_register(records, true, -1);
+    handles.clear();
+    for (size_t i = 0; i < records.size(); i++)
+        handles.add(records[i].handle);
+    return ok;
+}
+
+static bool removeReservedServiceRecordsNative(const Vector<int>& handles) {
+    Vector<dbus_uint32_t> current;
+    for (size_t i = 0; i < handles.size(); i++) {
+        int handle = sdp_forget(handles[i]);
+        if (handle >= 0)
+            current.add(handle);
+    }
+    if (!current.size())
+        return TRUE;           // none of them is registered now
+    const dbus_uint32_t *values = current.array();
+    int len = current.size();
     DBusMessage *reply = dbus_func_args(global_adapter, DBUS_ADAPTER_IFACE, "RemoveReservedServiceRecords", DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &values, len, DBUS_TYPE_INVALID);
+    if (reply)
+        dbus_message_unref(reply);
     return reply ? TRUE : FALSE;
 }
 
 static int addRfcommServiceRecordNative(String8 name, long long uuidMsb, long long uuidLsb, short channel) {
-    const char *c_name = name.string();
-    printf("... name = %s uuid1 = %llX, uuid2 = %llX, channel = %d\n", c_name, uuidMsb, uuidLsb, channel);
-    DBusMessage *reply = dbus_func_args(global_adapter, DBUS_ADAPTER_IFACE, "AddRfcommServiceRecord", DBUS_TYPE_STRING, &c_name, DBUS_TYPE_UINT64, &uuidMsb, DBUS_TYPE_UINT64, &uuidLsb, DBUS_TYPE_UINT16, &channel, DBUS_TYPE_INVALID);
-    return reply ? dbus_returns_uint32(reply) : -1;
+    ALOGV("... name = %s uuid1 = %llX, uuid2 = %llX, channel = %d\n", name.string(), uuidMsb, uuidLsb, channel);
+    Vector<sdp_record_t> records;
+    sdp_record_t rec;
+    rec.type = SDP_RECORD_RFCOMM;
+    rec.name = name;
+    rec.uuid_msb = uuidMsb;
+    rec.uuid_lsb = uuidLsb;
+    rec.channel = channel;
+    records.add(rec);
+    sdp_register(records, true, -1);
+    return records[0].handle;
 }
 
 static bool removeServiceRecordNative(int handle) {
     ALOGV("... handle = %X", handle);
+    handle = sdp_forget(handle);
+    if (handle < 0)
+        return TRUE;           // a re-registration failed to put it back
     DBusMessage *reply = dbus_func_args(global_adapter, DBUS_ADAPTER_IFACE, "RemoveServiceRecord", DBUS_TYPE_UINT32, &handle, DBUS_TYPE_INVALID);
+    if (reply)
+        dbus_message_unref(reply);
     return reply ? TRUE : FALSE;
 }
 
 static bool setLinkTimeoutNative(String8 object_path, int num_slots) {
     const char *c_object_path = object_path.string();
     DBusMessage *reply = dbus_func_args(global_adapter, DBUS_ADAPTER_IFACE, "SetLinkTimeout", DBUS_TYPE_OBJECT_PATH, &c_object_path, DBUS_TYPE_UINT32, &num_slots, DBUS_TYPE_INVALID);
-    return reply ? TRUE : FALSE;
+    if (!reply)
+        return FALSE;
+    dbus_message_unref(reply);
+    return TRUE;
+}
+
+/*
+ * Connect latency for HID and PAN.  Every Connect() is timed from the
+ * request through BlueZ's reply to the profile's PropertyChanged
+ * Connected=true.  Connects the device makes itself (a keyboard coming
+ * back from suspend) have no request, so they are timed from its ACL link
+ * coming up instead.  Finished timelines go into a fixed ring that the
+ * summaries and the stats file (-L) are computed from.  A connect that
+ * hasn't finished by CONN_DEADLINE_MS goes in as a failure, so the ones
+ * that hang don't drop out of the summaries.
+ */
+#define CONN_RING_SIZE 256
+#define CONN_ACL_WINDOW_MS 30000   // an older ACL link didn't bring the profile up
+#define CONN_DEADLINE_MS 60000     // past D-Bus's own 25 s, so a late reply still counts
+
+enum { CONN_OUTGOING, CONN_INCOMING };
+
+static const char *connProfileName[CONN_PROFILE_COUNT] = { "input", "pan" };
+static const int connSuccess[CONN_PROFILE_COUNT] = { INPUT_OPERATION_SUCCESS, PAN_OPERATION_SUCCESS };
+
+typedef struct {
+    bt_addr_t addr;
+    int profile;               // CONN_PROFILE_*
+    int kind;                  // CONN_OUTGOING or CONN_INCOMING
+    int result;                // INPUT_* or PAN_* from the reply
+    nsecs_t start;             // request issued, or ACL up when incoming
+    nsecs_t replied;           // 0 for incoming
+    nsecs_t connected;         // 0 if it never got there
+} conn_sample_t;
+
+typedef struct {
+    int count;
+    int64_t p50, p90, p99, max;    // microseconds
+} conn_latency_t;
+
+typedef struct {
+    int attempts;              // outgoing timelines in the ring
+    int failed;
+    conn_latency_t reply;      // request -> reply
+    conn_latency_t connect;    // request -> Connected=true
+    conn_latency_t incoming;   // ACL up -> Connected=true
+} conn_summary_t;
+
+static conn_sample_t connRing[CONN_RING_SIZE];
+static uint32_t connRecorded;                      // samples ever put in the ring
+static bt_addr_map_t *connPending[CONN_PROFILE_COUNT];   // addr -> conn_sample_t in flight
+static KeyedVector<bt_addr_t, nsecs_t> connAclUp;
+static nsecs_t connNextCheck = -1;                 // next deadline or ACL expiry; -1 for none
+static const char *connStatsFile;
+static pthread_mutex_t connLock = PTHREAD_MUTEX_INITIALIZER;
+static bool dumpConnectStatsNative(const char *path);
+
+static bool conn_path_addr(const char *path, bt_addr_t *addr)
+{
+    return path && bt_addr_parse(device_path_to_address(path).string(), addr) == 0;
+}
+
+// Called with connLock held; frees a pending sample.  The caller updates
+// the stats file once the lock is dropped.
+static void conn_record(conn_sample_t *sample, bool pending)
+{
+    connRing[connRecorded++ % CONN_RING_SIZE] = *sample;
+    char address[BTADDR_SIZE];
+    bt_addr_format(sample->addr, address);
+    const char *name = connProfileName[sample->profile];
+    if (sample->kind == CONN_INCOMING)
+        printf("%s %s: reconnected %lld ms after the link came up\n", name, address,
+            (long long)ns2ms(sample->connected - sample->start));
+    else if (sample->connected)
+        printf("%s %s: connected in %lld ms, reply after %lld ms\n", name, address,
+            (long long)ns2ms(sample->connected - sample->start), (long long)ns2ms(sample->replied - sample->start));
+    else if (sample->result == connSuccess[sample->profile])
+        printf("%s %s: connect timed out after %d ms, %s\n", name, address, CONN_DEADLINE_MS,
+            sample->replied ? "never connected" : "no reply");
+    else
+        printf("%s %s: connect failed (%d) after %lld ms\n", name, address, sample->result,
+            (long long)ns2ms(sample->replied - sample->start));
+    if (pending)
+        free(bt_addr_map_remove(connPending[sample->profile], sample->addr));
+}
+
+static void conn_begin(int profile, const char *path)
+{
+    bt_addr_t addr;
+    if (!conn_path_addr(path, &addr))
+        return;
+    pthread_mutex_lock(&connLock);
+    if (!connPending[profile])
+        connPending[profile] = bt_addr_map_new();
+    conn_sample_t *sample = (conn_sample_t *)bt_addr_map_get(connPending[profile], addr);
+    if (!sample) {
+        sample = (conn_sample_t *)malloc(sizeof(*sample));
+        if (!sample || bt_addr_map_put(connPending[profile], addr, sample) < 0) {
+            free(sample);
+            pthread_mutex_unlock(&connLock);
+            return;
+        }
+    }
+    // a repeated Connect starts the timeline over
+    sample->addr = addr;
+    sample->profile = profile;
+    sample->kind = CONN_OUTGOING;
+    sample->result = connSuccess[profile];
+    sample->start = systemTime(SYSTEM_TIME_MONOTONIC);
+    sample->replied = sample->connected = 0;
+    if (connNextCheck < 0)
+        connNextCheck = sample->start + ms2ns(CONN_DEADLINE_MS);
+    pthread_mutex_unlock(&connLock);
+}
+
+// A Disconnect abandons any connect in flight
+static void conn_cancel(int profile, const char *path)
+{
+    bt_addr_t addr;
+    if (!conn_path_addr(path, &addr))
+        return;
+    pthread_mutex_lock(&connLock);
+    if (connPending[profile])
+        free(bt_addr_map_remove(connPending[profile], addr));
+    pthread_mutex_unlock(&connLock);
+}
+
+static void conn_reply(int profile, const char *path, int result)
+{
+    bt_addr_t addr;
+    if (!conn_path_addr(path, &addr))
+        return;
+    bool done = false;
+    pthread_mutex_lock(&connLock);
+    conn_sample_t *sample = connPending[profile] ? (conn_sample_t *)bt_addr_map_get(connPending[profile], addr) : NULL;
+    if (sample && !sample->replied) {
+        sample->replied = systemTime(SYSTEM_TIME_MONOTONIC);
+        sample->result = result;
+        // Connected=true can beat the reply
+        done = result != connSuccess[profile] || sample->connected;
+        if (done)
+            conn_record(sample, true);
+    }
+    pthread_mutex_unlock(&connLock);
+    if (done && connStatsFile)
+        dumpConnectStatsNative(connStatsFile);
+}
+
+// when is the signal's arrival, not when a worker got to it
+static void conn_connected(int profile, const char *path, bool connected, nsecs_t when)
+{
+    bt_addr_t addr;
+    if (!connected || !conn_path_addr(path, &addr))
+        return;
+    nsecs_t now = when;
+    bool done = false;
+    pthread_mutex_lock(&connLock);
+    conn_sample_t *sample = connPending[profile] ? (conn_sample_t *)bt_addr_map_get(connPending[profile], addr) : NULL;
+    if (sample) {
+        if (!sample->connected)
+            sample->connected = now;
+        done = sample->replied != 0;
+        if (done)
+            conn_record(sample, true);
+    } else {
+        ssize_t i = connAclUp.indexOfKey(addr);
+        done = i >= 0 && now - connAclUp.valueAt(i) < ms2ns(CONN_ACL_WINDOW_MS);
+        if (done) {
+            conn_sample_t incoming = { addr, profile, CONN_INCOMING, connSuccess[profile], connAclUp.valueAt(i), 0, now };
+            conn_record(&incoming, false);
+        }
+    }
+    pthread_mutex_unlock(&connLock);
+    if (done && connStatsFile)
+        dumpConnectStatsNative(connStatsFile);
+}
+
+// Note when a device's ACL link comes up
+static void conn_acl(bt_addr_t addr, bool up)
+{
+    pthread_mutex_lock(&connLock);
+    if (up) {
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        connAclUp.replaceValueFor(addr, now);
+        if (connNextCheck < 0)
+            connNextCheck = now + ms2ns(CONN_ACL_WINDOW_MS);
+    } else
+        connAclUp.removeItem(addr);
+    pthread_mutex_unlock(&connLock);
+}
+
+// The event loop calls this.  Records connects that are past their
+// deadline as failures, and forgets ACL links too old to be matched.
+static void conn_tick(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    bool expired = false;
+    pthread_mutex_lock(&connLock);
+    if (connNextCheck < 0 || now < connNextCheck) {
+        pthread_mutex_unlock(&connLock);
+        return;
+    }
+    nsecs_t next = -1;
+    for (int p = 0; p < CONN_PROFILE_COUNT; p++) {
+        if (!connPending[p])
+            continue;
+        Vector<conn_sample_t *> late;
+        size_t pos = 0;
+        bt_addr_t addr;
+        conn_sample_t *sample;
+        while ((sample = (conn_sample_t *)bt_addr_map_next(connPending[p], &pos, &addr)) != NULL) {
+            nsecs_t deadline = sample->start + ms2ns(CONN_DEADLINE_MS);
+            if (now >= deadline)
+                late.add(sample);
+            else if (next < 0 || deadline < next)
+                next = deadline;
+        }
+        for (size_t i = 0; i < late.size(); i++)
+            conn_record(late[i], true);
+        expired = expired || late.size();
+    }
+    for (ssize_t i = connAclUp.size() - 1; i >= 0; i--) {
+        nsecs_t expiry = connAclUp.valueAt(i) + ms2ns(CONN_ACL_WINDOW_MS);
+        if (now >= expiry)
+            connAclUp.removeItemsAt(i);
+        else if (next < 0 || expiry < next)
+            next = expiry;
+    }
+    connNextCheck = next;
+    pthread_mutex_unlock(&connLock);
+    if (expired && connStatsFile)
+        dumpConnectStatsNative(connStatsFile);
+}
+
+static int conn_poll_timeout(void)
+{
+    pthread_mutex_lock(&connLock);
+    nsecs_t next = connNextCheck;
+    pthread_mutex_unlock(&connLock);
+    if (next < 0)
+        return -1;
+    nsecs_t wait = next - systemTime(SYSTEM_TIME_MONOTONIC);
+    return wait > 0 ? (int)ns2ms(wait + ms2ns(1) - 1) : 0;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void conn_percentiles(int64_t *v, int n, conn_latency_t *out)
+{
+    out->count = n;
+    if (!n) {
+        out->p50 = out->p90 = out->p99 = out->max = -1;
+        return;
+    }
+    qsort(v, n, sizeof(*v), compare_int64);
+    out->p50 = v[(n - 1) * 50 / 100];
+    out->p90 = v[(n - 1) * 90 / 100];
+    out->p99 = v[(n - 1) * 99 / 100];
+    out->max = v[n - 1];
+}
+
+// Summarise the timelines still in the ring for one profile
+static bool getConnectStatsNative(int profile, conn_summary_t *summary) {
+    int64_t reply[CONN_RING_SIZE], connect[CONN_RING_SIZE], incoming[CONN_RING_SIZE];
+    int nreply = 0, nconnect = 0, nincoming = 0;
+    if (profile < 0 || profile >= CONN_PROFILE_COUNT)
+        return FALSE;
+    memset(summary, 0, sizeof(*summary));
+    pthread_mutex_lock(&connLock);
+    uint32_t n = connRecorded < CONN_RING_SIZE ? connRecorded : CONN_RING_SIZE;
+    for (uint32_t i = 0; i < n; i++) {
+        const conn_sample_t *s = &connRing[i];
+        if (s->profile != profile)
+            continue;
+        if (s->kind == CONN_INCOMING) {
+            incoming[nincoming++] = ns2us(s->connected - s->start);
+            continue;
+        }
+        summary->attempts++;
+        if (s->replied)
+            reply[nreply++] = ns2us(s->replied - s->start);
+        if (s->connected)
+            connect[nconnect++] = ns2us(s->connected - s->start);
+        else
+            summary->failed++;
+    }
+    pthread_mutex_unlock(&connLock);
+    conn_percentiles(reply, nreply, &summary->reply);
+    conn_percentiles(connect, nconnect, &summary->connect);
+    conn_percentiles(incoming, nincoming, &summary->incoming);
+    return TRUE;
+}
+
+static void print_conn_latency(FILE *f, const char *what, const conn_latency_t *l)
+{
+    fprintf(f, "  %-9s n=%d p50=%lld p90=%lld p99=%lld max=%lld us\n", what, l->count,
+        (long long)l->p50, (long long)l->p90, (long long)l->p99, (long long)l->max);
+}
+
+// Write the summaries and the ring, oldest first, to path.  Replaced
+// atomically so readers never see half a file.
+static bool dumpConnectStatsNative(const char *path) {
+    conn_summary_t summary[CONN_PROFILE_COUNT];
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return FALSE;
+    for (int p = 0; p < CONN_PROFILE_COUNT; p++) {
+        getConnectStatsNative(p, &summary[p]);
+        fprintf(f, "%s: %d connects, %d failed\n", connProfileName[p], summary[p].attempts, summary[p].failed);
+        print_conn_latency(f, "reply", &summary[p].reply);
+        print_conn_latency(f, "connect", &summary[p].connect);
+        print_conn_latency(f, "reconnect", &summary[p].incoming);
+    }
+    fprintf(f, "# profile address kind result start_ms reply_ms connected_ms\n");
+    pthread_mutex_lock(&connLock);
+    uint32_t first = connRecorded > CONN_RING_SIZE ? connRecorded - CONN_RING_SIZE : 0;
+    for (uint32_t i = first; i < connRecorded; i++) {
+        const conn_sample_t *s = &connRing[i % CONN_RING_SIZE];
+        char address[BTADDR_SIZE];
+        bt_addr_format(s->addr, address);
+        fprintf(f, "%s %s %s %d %lld %lld %lld\n", connProfileName[s->profile], address,
+            s->kind == CONN_INCOMING ? "in" : "out", s->result, (long long)ns2ms(s->start),
+            s->replied ? (long long)ns2ms(s->replied - s->start) : -1LL,
+            s->connected ? (long long)ns2ms(s->connected - s->start) : -1LL);
+    }
+    pthread_mutex_unlock(&connLock);
+    bool ok = !ferror(f);
+    if (fclose(f) || !ok || rename(tmp, path)) {
+        unlink(tmp);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * A2DP sinks.  connect/disconnect/suspend/resumeSinkNative() only move the
+ * state the caller wants and wake the event loop; a per-sink state machine
+ * there makes the BlueZ calls to get there, one at a time.  A call is
+ * finished when State reaches what it asked for, it fails, or
+ * SINK_STATE_TIMEOUT_MS passes, and only then is the next one worked out
+ * from the latest request.  So requests collapse: a suspend, resume,
+ * suspend burst on a suspended sink costs no call, and one made while a
+ * call is out costs at most one more.  Only connectSinkNative() may lead
+ * to a Connect: suspend and resume are refused on a sink that is neither
+ * connected nor being connected, as BlueZ would with NotConnected, and a
+ * sink that drops out under them is left disconnected.  A sink whose
+ * State has not been seen counts as disconnected.
+ *
+ * Two latencies are kept: each call from being sent to its State, and
+ * each transition from the first request of a burst to the sink settling
+ * where the last request asked.
+ */
+#define SINK_STATE_TIMEOUT_MS 3000
+#define SINK_RING_SIZE 256
+
+enum { SINK_OP_NONE, SINK_OP_CONNECT, SINK_OP_DISCONNECT, SINK_OP_SUSPEND, SINK_OP_RESUME };
+static const char *sinkStateName[] = { "disconnected", "connecting", "connected", "playing" };
+static const char *sinkOpName[] = { NULL, "Connect", "Disconnect", "Suspend", "Resume" };
+static const char *sinkOpIface[] = { NULL, "org.bluez.AudioSink", "org.bluez.AudioSink",
+    "org.bluez.audio.Sink", "org.bluez.audio.Sink" };
+static const int sinkOpTarget[] = { -1, SINK_CONNECTED, SINK_DISCONNECTED, SINK_CONNECTED, SINK_PLAYING };
+
+typedef struct {
+    String8 path;
+    int state;                 // SINK_*, as BlueZ last reported it
+    int want;                  // SINK_* asked for, -1 once reached or given up
+    bool connecting;           // want came from connectSinkNative(), may Connect
+    nsecs_t wanted;            // first request of the current burst
+    int op;                    // call out or waiting for its State
+    nsecs_t op_issued;
+    nsecs_t op_replied;        // 0 until the reply
+} sink_t;
+
+typedef struct {
+    bool call;                 // a call, else a transition
+    bool ok;
+    nsecs_t latency;
+} sink_sample_t;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t calls;
+    uint64_t collapsed;        // requests beyond the calls made
+    int failed;                // calls in the ring that failed or timed out
+    conn_latency_t call;       // call sent -> State
+    conn_latency_t transition; // first request -> settled
+} sink_summary_t;
+
+static KeyedVector<String8, sink_t *> sinks;
+static sink_sample_t sinkRing[SINK_RING_SIZE];
+static uint32_t sinkRecorded;
+static uint64_t sinkRequests, sinkCalls;
+static pthread_mutex_t sinkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sink_state_value(const char *state)
+{
+    for (int i = 0; i <= SINK_PLAYING; i++)
+        if (!strcmp(state, sinkStateName[i]))
+            return i;
+    return -1;
+}
+
+// Called with sinkLock held
+static void sink_record(bool call, bool ok, nsecs_t latency)
+{
+    sink_sample_t *sample = &sinkRing[sinkRecorded++ % SINK_RING_SIZE];
+    sample->call = call;
+    sample->ok = ok;
+    sample->latency = latency;
+}
+
+// Called with sinkLock held
+static sink_t *sink_find(const char *path, bool create)
+{
+    ssize_t i = sinks.indexOfKey(String8(path));
+    if (i >= 0)
+        return sinks.valueAt(i);
+    if (!create)
+        return NULL;
+    sink_t *sink = new sink_t;
+    sink->path = String8(path);
+    sink->state = SINK_DISCONNECTED;
+    sink->want = -1;
+    sink->connecting = false;
+    sink->wanted = 0;
+    sink->op = SINK_OP_NONE;
+    sink->op_issued = sink->op_replied = 0;
+    // start from the State the workers saw, if any
+    bt_adapter_t *adapter = find_adapter(path);
+    String8 address = device_path_to_address(path);
+    if (adapter && address.length()) {
+        pthread_mutex_lock(&adapter->lock);
+        ssize_t j = adapter->devices.indexOfKey(address);
+        if (j >= 0) {
+            ssize_t k = adapter->devices.valueAt(j).indexOfKey(String8("AudioState"));
+            if (k >= 0 && sink_state_value(adapter->devices.valueAt(j).valueAt(k).string()) >= 0)
+                sink->state = sink_state_value(adapter->devices.valueAt(j).valueAt(k).string());
+        }
+        pthread_mutex_unlock(&adapter->lock);
+    }
+    sinks.add(sink->path, sink);
+    return sink;
+}
+
+// The call that moves sink towards want, SINK_OP_NONE if there is none to
+// make.  Called with sinkLock held.
+static int sink_next_op(const sink_t *sink)
+{
+    switch (sink->want) {
+    case SINK_DISCONNECTED:
+        return sink->state == SINK_DISCONNECTED ? SINK_OP_NONE : SINK_OP_DISCONNECT;
+    case SINK_CONNECTED:
+    case SINK_PLAYING:
+        if (sink->state == SINK_DISCONNECTED)
+            return sink->connecting ? SINK_OP_CONNECT : SINK_OP_NONE;
+        if (sink->want == SINK_PLAYING && sink->state == SINK_CONNECTED)
+            return SINK_OP_RESUME;
+        if (sink->want == SINK_CONNECTED && sink->state == SINK_PLAYING)
+            return SINK_OP_SUSPEND;
+        break;
+    }
+    return SINK_OP_NONE;
+}
+
+// Settle the transition once the sink is where it was wanted.  Called with
+// sinkLock held.
+static void sink_settle(sink_t *sink, nsecs_t now)
+{
+    if (sink->want < 0 || sink->state != sink->want)
+        return;
+    nsecs_t latency = now - sink->wanted;
+    sink_record(false, true, latency);
+    ALOGV("sink %s: %s after %lld us\n", sink->path.string(), sinkStateName[sink->state], (long long)ns2us(latency));
+    sink->want = -1;
+    sink->connecting = false;
+}
+
+// The call in flight is over.  Called with sinkLock held.
+static void sink_op_done(sink_t *sink, bool ok, nsecs_t now)
+{
+    sink_record(true, ok, now - sink->op_issued);
+    if (!ok && sink->want >= 0) {
+        // give up on this burst rather than retrying into the same failure
+        sink_record(false, false, now - sink->wanted);
+        sink->want = -1;
+        sink->connecting = false;
+    }
+    sink->op = SINK_OP_NONE;
+}
+
+static void onSinkResult(DBusMessage *msg, void *user, void *n);
+
+// Make the next call for path, if one is due and none is out.  Only the
+// event loop calls this, from sink_tick().
+static void sink_run(const char *path)
+{
+    pthread_mutex_lock(&sinkLock);
+    sink_t *sink = sink_find(path, false);
+    int op = sink && sink->op == SINK_OP_NONE ? sink_next_op(sink) : SINK_OP_NONE;
+    if (op != SINK_OP_NONE) {
+        sink->op = op;
+        sink->op_issued = systemTime(SYSTEM_TIME_MONOTONIC);
+        sink->op_replied = 0;
+        sinkCalls++;
+    }
+    pthread_mutex_unlock(&sinkLock);
+    if (op == SINK_OP_NONE)
+        return;
+    char *context_path = strdup(path);  // for callback
+    if (!dbus_func_async(-1, onSinkResult, context_path, path, sinkOpIface[op], sinkOpName[op], DBUS_TYPE_INVALID)) {
+        free(context_path);
+        pthread_mutex_lock(&sinkLock);
+        sink_op_done(sink, false, systemTime(SYSTEM_TIME_MONOTONIC));
+        pthread_mutex_unlock(&sinkLock);
+    }
+}
+
+static void onSinkResult(DBusMessage *msg, void *user, void *n) {
+    const char *path = (const char *)user;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    DBusError err;
+    bool again = false;
+    dbus_error_init(&err);
+    pthread_mutex_lock(&sinkLock);
+    sink_t *sink = sink_find(path, false);
+    if (sink && sink->op != SINK_OP_NONE) {
+        if (dbus_set_error_from_message(&err, msg)) {
+            printf("sink %s: %s failed: %s\n", path, sinkOpName[sink->op], err.message);
+            dbus_error_free(&err);
+            sink_op_done(sink, false, now);
+            again = true;
+        } else {
+            sink->op_replied = now;
+            // State can beat the reply
+            if (sink->state == sinkOpTarget[sink->op]) {
+                sink_op_done(sink, true, now);
+                again = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sinkLock);
+    if (again)
+        dbusWakeup(NULL);
+    free(user);
+}
+
+// State from AudioSink PropertyChanged, timed from the signal's arrival
+static void sink_state(const char *path, const char *state, nsecs_t when)
+{
+    int value = sink_state_value(state);
+    bool again = false;
+    if (value < 0)
+        return;
+    pthread_mutex_lock(&sinkLock);
+    sink_t *sink = sink_find(path, false);
+    if (sink) {
+        sink->state = value;
+        if (sink->op != SINK_OP_NONE && sink->op_replied && value == sinkOpTarget[sink->op]) {
+            sink_op_done(sink, true, when);
+            again = true;
+        } else if (sink->op != SINK_OP_NONE && sink->op != SINK_OP_DISCONNECT && value == SINK_DISCONNECTED) {
+            printf("sink %s: disconnected during %s\n", path, sinkOpName[sink->op]);
+            sink_op_done(sink, false, when);
+        } else if (sink->op == SINK_OP_NONE && sink->want >= 0) {
+            // moved by someone else; see what it takes from here
+            again = true;
+        }
+        if (value == SINK_DISCONNECTED && sink->want > SINK_DISCONNECTED && !sink->connecting) {
+            // suspend/resume don't bring a lost sink back
+            sink_record(false, false, when - sink->wanted);
+            sink->want = -1;
+        }
+        sink_settle(sink, when);
+    }
+    pthread_mutex_unlock(&sinkLock);
+    if (again)
+        dbusWakeup(NULL);
+}
+
+static bool sink_request(String8 path, int want, bool connect)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (!path.length())
+        return FALSE;
+    pthread_mutex_lock(&sinkLock);
+    sink_t *sink = sink_find(path.string(), true);
+    if (want != SINK_DISCONNECTED && !connect) {
+        // suspend/resume: the sink must be up, or a connect under way
+        bool up = sink->state >= SINK_CONNECTED && sink->want != SINK_DISCONNECTED;
+        if (!up && !(sink->connecting && sink->want > SINK_DISCONNECTED)) {
+            pthread_mutex_unlock(&sinkLock);
+            return FALSE;
+        }
+    } else {
+        sink->connecting = connect;
+    }
+    sinkRequests++;
+    if (sink->want < 0)
+        sink->wanted = now;
+    sink->want = want;
+    bool wake = sink->op == SINK_OP_NONE;
+    if (wake && sink->state == want) {
+        sink->want = -1;       // already there, nothing to time
+        sink->connecting = false;
+    }
+    pthread_mutex_unlock(&sinkLock);
+    // with a call out, its completion picks up the new target
+    if (wake)
+        dbusWakeup(NULL);
+    return TRUE;
+}
+
+// Give up on calls whose State never came, and make the calls that are due
+static void sink_tick(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    Vector<String8> again;
+    pthread_mutex_lock(&sinkLock);
+    for (size_t i = 0; i < sinks.size(); i++) {
+        sink_t *sink = sinks.valueAt(i);
+        if (sink->op == SINK_OP_NONE && sink->want >= 0)
+            again.add(sink->path);
+        if (sink->op == SINK_OP_NONE || now - sink->op_issued < ms2ns(SINK_STATE_TIMEOUT_MS))
+            continue;
+        printf("sink %s: no %s after %s in %d ms, still %s\n", sink->path.string(), sinkStateName[sinkOpTarget[sink->op]],
+            sinkOpName[sink->op], SINK_STATE_TIMEOUT_MS, sinkStateName[sink->state]);
+        sink_op_done(sink, false, now);
+        again.add(sink->path);
+    }
+    pthread_mutex_unlock(&sinkLock);
+    for (size_t i = 0; i < again.size(); i++)
+        sink_run(again[i].string());
+}
+
+static int sink_poll_timeout(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t next = -1;
+    pthread_mutex_lock(&sinkLock);
+    for (size_t i = 0; i < sinks.size(); i++) {
+        const sink_t *sink = sinks.valueAt(i);
+        if (sink->op == SINK_OP_NONE)
+            continue;
+        nsecs_t wait = sink->op_issued + ms2ns(SINK_STATE_TIMEOUT_MS) - now;
+        if (wait < 0)
+            wait = 0;
+        if (next < 0 || wait < next)
+            next = wait;
+    }
+    pthread_mutex_unlock(&sinkLock);
+    return next < 0 ? -1 : (int)ns2ms(next + ms2ns(1) - 1);
+}
+
+static void getSinkStatsNative(sink_summary_t *summary) {
+    int64_t call[SINK_RING_SIZE], transition[SINK_RING_SIZE];
+    int ncall = 0, ntransition = 0;
+    memset(summary, 0, sizeof(*summary));
+    pthread_mutex_lock(&sinkLock);
+    summary->requests = sinkRequests;
+    summary->calls = sinkCalls;
+    summary->collapsed = sinkRequests > sinkCalls ? sinkRequests - sinkCalls : 0;
+    uint32_t n = sinkRecorded < SINK_RING_SIZE ? sinkRecorded : SINK_RING_SIZE;
+    for (uint32_t i = 0; i < n; i++) {
+        const sink_sample_t *s = &sinkRing[i];
+        if (s->call && !s->ok)
+            summary->failed++;
+        else if (s->call)
+            call[ncall++] = ns2us(s->latency);
+        else if (s->ok)
+            transition[ntransition++] = ns2us(s->latency);
+    }
+    pthread_mutex_unlock(&sinkLock);
+    conn_percentiles(call, ncall, &summary->call);
+    conn_percentiles(transition, ntransition, &summary->transition);
+}
+
+static void print_sink_stats(void)
+{
+    sink_summary_t st;
+    getSinkStatsNative(&st);
+    if (!st.requests)
+        return;
+    printf("sinks: %llu requests, %llu calls (%llu collapsed), %d failed; call p50 %lld p99 %lld us; "
+           "transition p50 %lld p99 %lld max %lld us\n",
+        (unsigned long long)st.requests, (unsigned long long)st.calls, (unsigned long long)st.collapsed, st.failed,
+        (long long)st.call.p50, (long long)st.call.p99,
+        (long long)st.transition.p50, (long long)st.transition.p99, (long long)st.transition.max);
 }
 
 static bool connectInputDeviceNative(String8 path) {
@@ -1255,6 +3480,7 @@ static bool connectInputDeviceNative(String8 path) {
     int len = path.length() + 1;
     char *context_path = (char *)calloc(len, sizeof(char));
     strlcpy(context_path, c_path, len);  // for callback 
+    conn_begin(CONN_PROFILE_INPUT, c_path);
     return dbus_func_async(-1, onInputDeviceConnectionResult, context_path, c_path, DBUS_INPUT_IFACE, "Connect", DBUS_TYPE_INVALID); 
 }
 
@@ -1263,6 +3489,7 @@ static bool disconnectInputDeviceNative(String8 path) {
     int len = path.length() + 1;
     char *context_path = (char *)calloc(len, sizeof(char));
     strlcpy(context_path, c_path, len);  // for callback 
+    conn_cancel(CONN_PROFILE_INPUT, c_path);
     return dbus_func_async(-1, onInputDeviceConnectionResult, context_path, c_path, DBUS_INPUT_IFACE, "Disconnect", DBUS_TYPE_INVALID); 
 }
 
@@ -1286,6 +3513,7 @@ static bool connectPanDeviceNative(String8 path, String8 dstRole) {
     int len = path.length() + 1;
     char *context_path = (char *)calloc(len, sizeof(char));
     strlcpy(context_path, c_path, len);  // for callback 
+    conn_begin(CONN_PROFILE_PAN, c_path);
     return dbus_func_async(-1,onPanDeviceConnectionResult, context_path, c_path, DBUS_NETWORK_IFACE, "Connect", DBUS_TYPE_STRING, &dst, DBUS_TYPE_INVALID); 
 }
 
@@ -1294,6 +3522,7 @@ static bool disconnectPanDeviceNative(String8 path) {
     int len = path.length() + 1;
     char *context_path = (char *)calloc(len, sizeof(char));
     strlcpy(context_path, c_path, len);  // for callback 
+    conn_cancel(CONN_PROFILE_PAN, c_path);
     return dbus_func_async(-1,onPanDeviceConnectionResult, context_path, c_path, DBUS_NETWORK_IFACE, "Disconnect", DBUS_TYPE_INVALID); 
 }
 
@@ -1457,18 +3686,105 @@ dumpprop(prop, "chanapp");
     return String8("");
 }
 
+/*
+ * HDP data channels.  Acquired channel fds stay non-blocking and are read
+ * by the event loop as data arrives; measurements go to healthDataCb.
+ * healthChannels is only touched on the event loop thread, except for the
+ * lookups done under healthLock by the Native calls.
+ */
+typedef struct {
+    String8 path;
+    bt_health_channel_t *reader;
+    bool stopping;             // removal sent to the event loop
+} health_channel_t;
+static KeyedVector<String8, health_channel_t *> healthChannels;
+static pthread_mutex_t healthLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void health_measurement(bt_health_channel_t *ch, const bt_health_measurement_t *m, void *user)
+{
+    ALOGV("health %s: handle %d attr %04x time %u, %d bytes\n",
+        ((health_channel_t *)user)->path.string(), m->obj_handle, m->attr_id, m->event_time, m->len);
+}
+static bt_health_cb_t healthDataCb = health_measurement;
+
+static void print_health_stats(const char *name, const bt_health_stats_t *st)
+{
+    nsecs_t span = st->last_read - st->first_read;
+    printf("%s: %llu bytes in %llu reads, %llu apdus, %llu measurements, %llu errors; "
+           "%lld kB/s, apdu latency avg %lld us max %lld us\n", name,
+        (unsigned long long)st->bytes, (unsigned long long)st->reads,
+        (unsigned long long)st->apdus, (unsigned long long)st->measurements,
+        (unsigned long long)st->errors,
+        span > 0 ? (long long)(st->bytes * 1000000 / span) : 0LL,
+        st->apdus ? (long long)ns2us(st->latency_total / st->apdus) : 0LL,
+        (long long)ns2us(st->latency_max));
+}
+
+static void health_fd_event(int fd, short revents, void *user)
+{
+    health_channel_t *hc = (health_channel_t *)user;
+    bt_health_stats_t st;
+
+    if (!revents) {
+        // watch removed: the channel is finished with
+        bt_health_get_stats(hc->reader, &st);
+        print_health_stats(hc->path.string(), &st);
+        pthread_mutex_lock(&healthLock);
+        healthChannels.removeItem(hc->path);
+        pthread_mutex_unlock(&healthLock);
+        bt_health_close(hc->reader);
+        delete hc;
+        return;
+    }
+    int rc = bt_health_read(hc->reader);
+    bt_addr_t addr;
+    if (rc > 0 && link_path_addr(hc->path.string(), &addr))
+        link_activity(addr);
+    if (rc < 0 || (revents & (POLLHUP | POLLERR))) {
+        if (rc < 0 && rc != -EPIPE)
+            ALOGE("%s: read on %s failed: %s\n", __FUNCTION__, hc->path.string(), strerror(-rc));
+        stop_health_channel(hc->path.string());
+    }
+}
+
+// Stop reading channelPath; the fd is closed once the event loop lets go of it
+static void stop_health_channel(const char *channelPath)
+{
+    pthread_mutex_lock(&healthLock);
+    ssize_t i = healthChannels.indexOfKey(String8(channelPath));
+    int fd = -1;
+    if (i >= 0 && !healthChannels.valueAt(i)->stopping) {
+        healthChannels.valueAt(i)->stopping = true;
+        fd = bt_health_fd(healthChannels.valueAt(i)->reader);
+    }
+    pthread_mutex_unlock(&healthLock);
+    if (fd >= 0)
+        eventLoopRemoveFd(fd);
+}
+
 static bool releaseChannelFdNative(String8 channelPath) {
     DBusError err;
     dbus_error_init(&err);
+    stop_health_channel(channelPath.string());
     DBusMessage *reply = dbus_func_args(channelPath.string(), DBUS_HEALTH_CHANNEL_IFACE, "Release", DBUS_TYPE_INVALID);
     return reply ? TRUE : FALSE;
 }
 
+// Returns a dup() of the channel fd, which the caller must close; the
+// original belongs to the channel's reader and is closed by
+// bt_health_close() when the channel is released
 static int getChannelFdNative(String8 channelPath) {
     int32_t fd;
     DBusError err;
     dbus_error_init(&err);
 
+    pthread_mutex_lock(&healthLock);
+    ssize_t i = healthChannels.indexOfKey(channelPath);
+    // already being read, or still being torn down
+    fd = i >= 0 && !healthChannels.valueAt(i)->stopping ? dup(bt_health_fd(healthChannels.valueAt(i)->reader)) : -1;
+    pthread_mutex_unlock(&healthLock);
+    if (i >= 0)
+        return fd;
     DBusMessage *reply = dbus_func_args(channelPath.string(), DBUS_HEALTH_CHANNEL_IFACE, "Acquire", DBUS_TYPE_INVALID);
     if (!reply) {
         if (dbus_error_is_set(&err)) {
@@ -1478,73 +3794,817 @@ static int getChannelFdNative(String8 channelPath) {
     }
     fd = dbus_returns_unixfd(reply);
     if (fd == -1) return -1;
-    int flags = fcntl(fd, F_GETFL);
-    if (flags < 0) {
-       ALOGE("Can't get flags with fcntl(): %s (%d)", strerror(errno), errno);
-       releaseChannelFdNative( channelPath);
-       close(fd);
-       return -1;
-    } 
-    flags &= ~O_NONBLOCK;
-    int status = fcntl(fd, F_SETFL, flags);
-    if (status < 0) {
-       ALOGE("Can't set flags with fcntl(): %s (%d)", strerror(errno), errno);
-       releaseChannelFdNative( channelPath);
-       close(fd);
-       return -1;
-    } 
-    // Create FileDescriptor object
-    int fileDesc = 0; //jniCreateFileDescriptor(fd);
-    if (fileDesc < 0) {
-        // FileDescriptor constructor has thrown an exception
+    health_channel_t *hc = new health_channel_t;
+    hc->path = channelPath;
+    hc->stopping = false;
+    hc->reader = bt_health_open(fd, healthDataCb, hc);
+    if (!hc->reader) {
+        delete hc;
         releaseChannelFdNative( channelPath);
         close(fd);
         return -1;
-    } 
-#if 0
-    // Wrap it in a ParcelFileDescriptor
-    jobject parcelFileDesc = newParcelFileDescriptor(fileDesc);
-    if (parcelFileDesc == NULL) {
-        // ParcelFileDescriptor constructor has thrown an exception
-        releaseChannelFdNative( channelPath);
-        close(fd);
-        return NULL;
-    } 
-    return parcelFileDesc;
-#endif
-    return fileDesc;
+    }
+    pthread_mutex_lock(&healthLock);
+    healthChannels.add(channelPath, hc);
+    pthread_mutex_unlock(&healthLock);
+    eventLoopAddFd(fd, health_fd_event, hc);
+    return dup(fd);
+}
+
+// Measurements from channels acquired after this call go to cb
+static void setHealthDataCallbackNative(bt_health_cb_t cb) {
+    healthDataCb = cb ? cb : health_measurement;
+}
+
+static bool getChannelStatsNative(String8 channelPath, bt_health_stats_t *stats) {
+    pthread_mutex_lock(&healthLock);
+    ssize_t i = healthChannels.indexOfKey(channelPath);
+    if (i >= 0)
+        bt_health_get_stats(healthChannels.valueAt(i)->reader, stats);
+    pthread_mutex_unlock(&healthLock);
+    return i >= 0;
 }
 
 static const DBusObjectPathVTable agent_vtable = { NULL, agent_event_filter, NULL, NULL, NULL, NULL }; 
-static int register_agent(const char * capabilities)
-{
-    DBusMessage *msg, *reply;
+static void onRegisterAgentResult(DBusMessage *msg, void *user, void *n) {
+    bt_adapter_t *adapter = (bt_adapter_t *)user;
     DBusError err;
-    dbus_bool_t oob = TRUE;
+    dbus_error_init(&err);
+    if (!dbus_set_error_from_message(&err, msg))
+        return;
+    ALOGE("%s: Can't register agent on %s!", __FUNCTION__, adapter->path.string());
+    LOG_AND_FREE_DBUS_ERROR(&err);
+    // unless the adapter went away meanwhile and took the agent with it
+    if (adapter->agent_registered) {
+        dbus_connection_unregister_object_path(global_conn, adapter->agent_path.string());
+        adapter->agent_registered = false;
+    }
+}
 
-    if (!dbus_connection_register_object_path(global_conn, agent_path, &agent_vtable, NULL)) {
-        ALOGE("%s: Can't register object path %s for agent!", __FUNCTION__, agent_path);
+// Export the agent object and ask the adapter to use it.  Adapters are
+// added from event_filter, so RegisterAgent must not block; a refusal is
+// handled in onRegisterAgentResult().
+static int register_agent(bt_adapter_t *adapter, const char * capabilities)
+{
+    const char *c_agent_path = adapter->agent_path.string();
+
+    // The adapter is handed to agent_event_filter as its user data
+    if (!dbus_connection_register_object_path(global_conn, c_agent_path, &agent_vtable, adapter)) {
+        ALOGE("%s: Can't register object path %s for agent!", __FUNCTION__, c_agent_path);
         return -1;
     }
-    global_adapter = get_adapter_path(global_conn);
-    if (global_adapter == NULL) {
+    adapter->agent_registered = true;
+    if (!dbus_func_async(-1, onRegisterAgentResult, adapter, adapter->path.string(), "org.bluez.Adapter", "RegisterAgent",
+            DBUS_TYPE_OBJECT_PATH, &c_agent_path, DBUS_TYPE_STRING, &capabilities, DBUS_TYPE_INVALID)) {
+        ALOGE("%s: Can't register agent on %s!", __FUNCTION__, adapter->path.string());
+        dbus_connection_unregister_object_path(global_conn, c_agent_path);
+        adapter->agent_registered = false;
         return -1;
     }
-    msg = dbus_message_new_method_call("org.bluez", global_adapter, "org.bluez.Adapter", "RegisterAgent");
-    dbus_message_append_args(msg, DBUS_TYPE_OBJECT_PATH, &agent_path, DBUS_TYPE_STRING, &capabilities, DBUS_TYPE_INVALID); 
-    dbus_error_init(&err);
-    reply = dbus_connection_send_with_reply_and_block(global_conn, msg, -1, &err);
-    dbus_message_unref(msg); 
-    if (!reply) {
-        ALOGE("%s: Can't register agent!", __FUNCTION__);
-        if (dbus_error_is_set(&err)) {
+    return 0;
+}
+
+// The UnregisterAgent goes out behind any RegisterAgent still in flight,
+// and its reply is not waited for.
+static void unregister_agent(bt_adapter_t *adapter)
+{
+    const char *c_agent_path = adapter->agent_path.string();
+
+    if (!adapter->agent_registered)
+        return;
+    dbus_func_async(-1, NULL, NULL, adapter->path.string(), "org.bluez.Adapter", "UnregisterAgent",
+            DBUS_TYPE_OBJECT_PATH, &c_agent_path, DBUS_TYPE_INVALID);
+    dbus_connection_unregister_object_path(global_conn, c_agent_path);
+    adapter->agent_registered = false;
+}
+
+// Track a new local adapter and register our agent with it.
+static bt_adapter_t *add_adapter(const char *path)
+{
+    if (find_adapter(path))
+        return NULL;
+    if (adapterCount == BLUEZ_MAX_ADAPTERS) {
+        ALOGE("%s: too many adapters, ignoring %s\n", __FUNCTION__, path);
+        return NULL;
+    }
+    bt_adapter_t *adapter = new bt_adapter_t;
+    adapter->index = adapterSerial++;
+    adapter->path = String8(path);
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s/%d", agent_path, adapter->index);
+    adapter->agent_path = String8(buf);
+    adapter->agent_registered = false;
+    adapter->discovering = false;
+    adapter->found_new = false;
+    adapter->disc_phase = DISC_OFF;
+    adapter->disc_deadline = 0;
+    pthread_mutex_init(&adapter->lock, NULL);
+    // offline (journal replay) there is no bus to register with
+    if (global_conn && register_agent(adapter, "DisplayYesNo") < 0) {
+        pthread_mutex_destroy(&adapter->lock);
+        delete adapter;
+        return NULL;
+    }
+    adapters[adapterCount++] = adapter;
+    match_adapter(path, true);
+    printf("adapter %d: %s\n", adapter->index, path);
+    return adapter;
+}
+
+static void remove_adapter(const char *path)
+{
+    for (int i = 0; i < adapterCount; i++) {
+        if (strcmp(adapters[i]->path.string(), path))
+            continue;
+        bt_adapter_t *adapter = adapters[i];
+        unregister_agent(adapter);
+        match_adapter(path, false);
+        adapters[i] = adapters[--adapterCount];
+        // With none left, global_adapter is NULL: the single-adapter calls
+        // fail until an AdapterAdded or DefaultAdapterChanged brings one back
+        if (global_adapter == adapter->path.string())
+            global_adapter = adapterCount ? adapters[0]->path.string() : NULL;
+        // Workers may still hold queued signals for it, so it is left
+        // allocated (adapters come and go rarely).
+        return;
+    }
+}
+
+// Find every adapter bluetoothd knows about; the default one also becomes
+// global_adapter for the single-adapter calls above.
+static int register_adapters(void)
+{
+    DBusMessage *reply;
+    DBusError err;
+    char **paths = NULL;
+    int count = 0;
+
+    const char *default_path = get_adapter_path(global_conn);
+    if (default_path == NULL)
+        return -1;
+    if (add_adapter(default_path))
+        global_adapter = adapters[0]->path.string();
+    reply = dbus_func_args("/", "org.bluez.Manager", "ListAdapters", DBUS_TYPE_INVALID);
+    if (reply) {
+        dbus_error_init(&err);
+        if (dbus_message_get_args(reply, &err, DBUS_TYPE_ARRAY, DBUS_TYPE_OBJECT_PATH, &paths, &count, DBUS_TYPE_INVALID)) {
+            for (int i = 0; i < count; i++)
+                add_adapter(paths[i]);
+            dbus_free_string_array(paths);
+        } else {
             LOG_AND_FREE_DBUS_ERROR(&err);
         }
+        dbus_message_unref(reply);
+    }
+    return adapterCount > 0 ? 0 : -1;
+}
+
+/*
+ * Discovery duty cycle.  Inquiry shares the radio with every connected
+ * ACL link, so rather than leaving it on forever we alternate inquiry
+ * windows with idle windows.  Each connected link shortens the inquiry
+ * window and stretches the idle one; a streaming A2DP sink adds a long
+ * extra idle period or, with pause_on_audio, holds inquiry off entirely.
+ * Once every address in discoveryTargets has been seen the adapter stops
+ * scanning until re-armed.
+ */
+typedef struct {
+    int inquiry_ms;            // inquiry window with no links up
+    int min_inquiry_ms;        // never shorter than this
+    int idle_ms;               // idle window with no links up
+    int audio_idle_ms;         // added to the idle window while streaming
+    bool pause_on_audio;       // no inquiry at all while streaming
+} discovery_config_t;
+
+static discovery_config_t discoveryConfig = { 10240, 2560, 5000, 30000, false };
+static Vector<String8> discoveryTargets;
+
+static void set_discovery(bt_adapter_t *adapter, bool on)
+{
+    dbus_func_async(-1, NULL, NULL, adapter->path.string(), DBUS_ADAPTER_IFACE,
+            on ? "StartDiscovery" : "StopDiscovery", DBUS_TYPE_INVALID);
+}
+
+static void link_load(bt_adapter_t *adapter, int *connected, int *streaming)
+{
+    *connected = *streaming = 0;
+    pthread_mutex_lock(&adapter->lock);
+    for (size_t i = 0; i < adapter->devices.size(); i++) {
+        const BTProperties& prop = adapter->devices.valueAt(i);
+        ssize_t index = prop.indexOfKey(String8("Connected"));
+        if (index >= 0 && !strcmp(prop.valueAt(index).string(), "1"))
+            (*connected)++;
+        index = prop.indexOfKey(String8("AudioState"));
+        if (index >= 0 && !strcmp(prop.valueAt(index).string(), "playing"))
+            (*streaming)++;
+    }
+    pthread_mutex_unlock(&adapter->lock);
+}
+
+// Whether every target has been seen, checked only when a device was added
+// since the last time.  Called with discoveryLock held.
+static bool targets_found(bt_adapter_t *adapter)
+{
+    bool found = discoveryTargets.size() > 0;
+    pthread_mutex_lock(&adapter->lock);
+    found = found && adapter->found_new;
+    adapter->found_new = false;
+    for (size_t i = 0; found && i < discoveryTargets.size(); i++)
+        found = adapter->devices.indexOfKey(discoveryTargets[i]) >= 0;
+    pthread_mutex_unlock(&adapter->lock);
+    return found;
+}
+
+// Start duty-cycling discovery on this adapter at the next tick
+static void discovery_arm(bt_adapter_t *adapter)
+{
+    adapter->disc_phase = DISC_IDLE;
+    adapter->disc_deadline = 0;
+}
+
+static void discovery_tick(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    pthread_mutex_lock(&discoveryLock);
+    const discovery_config_t *cfg = &discoveryConfig;
+    for (int i = 0; i < adapterCount; i++) {
+        bt_adapter_t *adapter = adapters[i];
+        if (adapter->disc_phase != DISC_IDLE && adapter->disc_phase != DISC_INQUIRY)
+            continue;
+        int connected, streaming;
+        link_load(adapter, &connected, &streaming);
+        bool hold = streaming && cfg->pause_on_audio;
+        if (adapter->disc_phase == DISC_INQUIRY) {
+            if (targets_found(adapter)) {
+                printf("discovery %s: all %d targets found\n", adapter->path.string(), (int)discoveryTargets.size());
+                set_discovery(adapter, false);
+                adapter->disc_phase = DISC_DONE;
+                continue;
+            }
+            if (now < adapter->disc_deadline && !hold)
+                continue;
+            set_discovery(adapter, false);
+            adapter->disc_phase = DISC_IDLE;
+            int idle_ms = cfg->idle_ms * (1 + connected) + (streaming ? cfg->audio_idle_ms : 0);
+            adapter->disc_deadline = now + ms2ns(idle_ms);
+            printf("discovery %s: idle %d ms (%d links, %d streaming)\n", adapter->path.string(), idle_ms, connected, streaming);
+        } else if (now >= adapter->disc_deadline) {
+            if (hold) {
+                adapter->disc_deadline = now + ms2ns(cfg->audio_idle_ms);
+                continue;
+            }
+            int inquiry_ms = cfg->inquiry_ms / (1 + connected);
+            if (inquiry_ms < cfg->min_inquiry_ms)
+                inquiry_ms = cfg->min_inquiry_ms;
+            set_discovery(adapter, true);
+            adapter->disc_phase = DISC_INQUIRY;
+            adapter->disc_deadline = now + ms2ns(inquiry_ms);
+            printf("discovery %s: inquiry %d ms (%d links)\n", adapter->path.string(), inquiry_ms, connected);
+        }
+    }
+    pthread_mutex_unlock(&discoveryLock);
+}
+
+// How long the event loop may sleep before the next window boundary
+static int discovery_poll_timeout(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t next = -1;
+    for (int i = 0; i < adapterCount; i++) {
+        bt_adapter_t *adapter = adapters[i];
+        if (adapter->disc_phase != DISC_IDLE && adapter->disc_phase != DISC_INQUIRY)
+            continue;
+        nsecs_t wait = adapter->disc_deadline > now ? adapter->disc_deadline - now : 0;
+        if (next < 0 || wait < next)
+            next = wait;
+    }
+    // round up so we don't wake just short of the deadline
+    return next < 0 ? -1 : (int)ns2ms(next + ms2ns(1) - 1);
+}
+
+static bool setDiscoveryScheduleNative(int inquiry_ms, int min_inquiry_ms, int idle_ms, int audio_idle_ms, bool pause_on_audio) {
+    if (inquiry_ms <= 0 || min_inquiry_ms <= 0 || idle_ms < 0 || audio_idle_ms < 0)
+        return FALSE;
+    pthread_mutex_lock(&discoveryLock);
+    discoveryConfig.inquiry_ms = inquiry_ms;
+    discoveryConfig.min_inquiry_ms = min_inquiry_ms;
+    discoveryConfig.idle_ms = idle_ms;
+    discoveryConfig.audio_idle_ms = audio_idle_ms;
+    discoveryConfig.pause_on_audio = pause_on_audio;
+    pthread_mutex_unlock(&discoveryLock);
+    dbusWakeup(NULL);
+    return TRUE;
+}
+
+// Stop discovery once all of these addresses have been found; an empty
+// set means scan indefinitely
+static bool setDiscoveryTargetsNative(const Vector<String8>& addresses) {
+    pthread_mutex_lock(&discoveryLock);
+    discoveryTargets.clear();
+    for (size_t i = 0; i < addresses.size(); i++)
+        discoveryTargets.push(address_key(addresses[i].string()));
+    for (int i = 0; i < adapterCount; i++)
+        if (adapters[i]->disc_phase == DISC_DONE)
+            discovery_arm(adapters[i]);
+    pthread_mutex_unlock(&discoveryLock);
+    dbusWakeup(NULL);
+    return TRUE;
+}
+
+/*
+ * Link policy.  Each ACL link is watched for traffic (health channel
+ * reads, linkActivityNative() from socket users) and profile state (A2DP
+ * streaming).  After a quiet spell the link is asked into sniff mode,
+ * which saves radio power, and given that class's supervision timeout
+ * for sniff.  Traffic or streaming brings it back to active with the
+ * active timeout.  A longer supervision timeout keeps a fading link up
+ * instead of paying for a reconnect; a shorter one lets a dead link go
+ * (and audio re-route) sooner.
+ *
+ * Rules are per major device class, from linkDefaults or setLinkPolicyNative()
+ * or -P.  BlueZ 4 has no D-Bus call for sniff, so mode changes are HCI
+ * commands on a raw socket, whose Mode Change events are read back.
+ * Without HCI access only the supervision timeouts are managed.
+ */
+#define LINK_CLASS_DEFAULT -1
+
+typedef struct {
+    int major_class;           // CoD major device class, or LINK_CLASS_DEFAULT
+    const char *name;
+    int idle_ms;               // quiet for this long before sniff, 0 never
+    int active_supervision;    // supervision timeout in slots while active
+    int sniff_supervision;     // and while in sniff
+    int sniff_min;             // sniff interval, slots
+    int sniff_max;
+    int sniff_attempt;
+    int sniff_timeout;
+} link_policy_t;
+
+static const link_policy_t linkDefaults[] = {
+    // HID: a short interval keeps key latency down, a long timeout saves reconnects
+    { 0x05, "peripheral", 2000, 8000, 12800, 18, 36, 1, 0 },
+    // never while streaming; drop dead links quickly so audio re-routes
+    { 0x04, "audio", 10000, 3200, 8000, 400, 800, 4, 1 },
+    { 0x02, "phone", 5000, 8000, 8000, 400, 800, 4, 1 },
+    { 0x01, "computer", 5000, 8000, 8000, 400, 800, 4, 1 },
+    { 0x03, "network", 2000, 8000, 8000, 400, 800, 4, 1 },
+    { 0x09, "health", 3000, 8000, 8000, 400, 800, 4, 1 },
+    { LINK_CLASS_DEFAULT, "default", 5000, 8000, 8000, 400, 800, 4, 1 },
+};
+
+enum { LINK_ACTIVE, LINK_SNIFF };
+
+typedef struct {
+    String8 path;              // device object path
+    bt_addr_t addr;
+    int dev_id;                // hciN of the adapter, -1 if unknown
+    int handle;                // ACL handle, -1 until looked up
+    int major_class;
+    int mode;                  // LINK_*, as last requested
+    bool streaming;
+    int supervision;           // slots last asked for, 0 for none yet
+    nsecs_t up;
+    nsecs_t last_activity;
+    nsecs_t requested;         // last mode change request
+} link_state_t;
+
+typedef struct {
+    bt_addr_t addr;
+    String8 path;              // device object path
+    int slots;
+    nsecs_t issued;
+} link_timeout_req_t;
+
+static Vector<link_policy_t> linkPolicies;
+static KeyedVector<bt_addr_t, link_state_t *> links;
+static KeyedVector<int, int> linkHci;        // hci dev -> raw socket, -1 if unavailable
+static pthread_mutex_t linkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *link_mode_name[] = { "active", "sniff" };
+
+// Address of the device an object path belongs to: the device itself or
+// anything below it, such as a health channel
+static bool link_path_addr(const char *path, bt_addr_t *addr)
+{
+    const char *p = path ? strstr(path, "/dev_") : NULL;
+    char address[BTADDR_SIZE];
+    if (!p || strlen(p + 5) < BTADDR_SIZE - 1)
+        return false;
+    memcpy(address, p + 5, BTADDR_SIZE - 1);
+    address[BTADDR_SIZE - 1] = 0;
+    for (char *q = address; *q; q++)
+        if (*q == '_')
+            *q = ':';
+    return bt_addr_parse(address, addr) == 0;
+}
+
+// Called with linkLock held
+static const link_policy_t *link_policy(int major_class)
+{
+    const link_policy_t *fallback = NULL;
+    if (linkPolicies.isEmpty())
+        for (size_t i = 0; i < sizeof(linkDefaults) / sizeof(linkDefaults[0]); i++)
+            linkPolicies.add(linkDefaults[i]);
+    for (size_t i = 0; i < linkPolicies.size(); i++) {
+        if (linkPolicies[i].major_class == major_class)
+            return &linkPolicies[i];
+        if (linkPolicies[i].major_class == LINK_CLASS_DEFAULT)
+            fallback = &linkPolicies[i];
+    }
+    return fallback;
+}
+
+// Major device class from the Class property seen in DeviceFound or
+// PropertyChanged, LINK_CLASS_DEFAULT if we never saw one
+static int link_major_class(const char *path)
+{
+    bt_adapter_t *adapter = find_adapter(path);
+    String8 address = device_path_to_address(path);
+    int major = LINK_CLASS_DEFAULT;
+    if (!adapter || !address.length())
+        return major;
+    pthread_mutex_lock(&adapter->lock);
+    ssize_t i = adapter->devices.indexOfKey(address);
+    if (i >= 0) {
+        ssize_t j = adapter->devices.valueAt(i).indexOfKey(String8("Class"));
+        if (j >= 0)
+            major = (strtoul(adapter->devices.valueAt(i).valueAt(j).string(), NULL, 10) >> 8) & 0x1f;
+    }
+    pthread_mutex_unlock(&adapter->lock);
+    return major;
+}
+
+static void link_hci_event(int fd, short revents, void *user)
+{
+    uint8_t buf[HCI_MAX_EVENT_SIZE];
+    if (!revents)
+        return;
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0)
+            return;
+        hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+        if (n < 1 + HCI_EVENT_HDR_SIZE + EVT_MODE_CHANGE_SIZE || buf[0] != HCI_EVENT_PKT
+         || hdr->evt != EVT_MODE_CHANGE)
+            continue;
+        evt_mode_change *ev = (evt_mode_change *)(hdr + 1);
+        int handle = btohs(ev->handle);
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        pthread_mutex_lock(&linkLock);
+        for (size_t i = 0; i < links.size(); i++) {
+            link_state_t *link = links.valueAt(i);
+            if (link->handle != handle || link->dev_id != (int)(intptr_t)user)
+                continue;
+            char address[BTADDR_SIZE];
+            bt_addr_format(link->addr, address);
+            // HCI modes: 0 active, 1 hold, 2 sniff, 3 park
+            printf("link %s: controller reports mode %d interval %d slots, status %d, %lld ms after the request\n",
+                address, ev->mode, btohs(ev->interval), ev->status, (long long)ns2ms(now - link->requested));
+        }
+        pthread_mutex_unlock(&linkLock);
+    }
+}
+
+// Raw HCI socket for a controller, opened the first time it is needed.
+// Called with linkLock held.
+static int link_hci_socket(int dev_id)
+{
+    ssize_t i = linkHci.indexOfKey(dev_id);
+    if (i >= 0)
+        return linkHci.valueAt(i);
+    struct sockaddr_hci addr;
+    struct hci_filter filter;
+    int fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, BTPROTO_HCI);
+    if (fd >= 0) {
+        memset(&addr, 0, sizeof(addr));
+        addr.hci_family = AF_BLUETOOTH;
+        addr.hci_dev = dev_id;
+        hci_filter_clear(&filter);
+        hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+        hci_filter_set_event(EVT_MODE_CHANGE, &filter);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+         || setsockopt(fd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0)
+        printf("link: no HCI access to hci%d (%s), managing supervision timeouts only\n", dev_id, strerror(errno));
+    else
+        eventLoopAddFd(fd, link_hci_event, (void *)(intptr_t)dev_id);
+    linkHci.add(dev_id, fd);
+    return fd;
+}
+
+// Socket to send link policy commands for link on, with its ACL handle
+// looked up; -1 without HCI access.  Called with linkLock held.
+static int link_hci_prepare(link_state_t *link)
+{
+    if (link->dev_id < 0)
         return -1;
-    } 
-    dbus_message_unref(reply);
-    dbus_connection_flush(global_conn); 
-    return 0;
+    int fd = link_hci_socket(link->dev_id);
+    if (fd < 0 || link->handle >= 0)
+        return fd;
+    struct hci_conn_info_req *cr = (struct hci_conn_info_req *)
+        calloc(1, sizeof(*cr) + sizeof(struct hci_conn_info));
+    if (!cr)
+        return -1;
+    bt_addr_unpack(link->addr, &cr->bdaddr);
+    cr->type = ACL_LINK;
+    if (ioctl(fd, HCIGETCONNINFO, cr) == 0)
+        link->handle = cr->conn_info->handle;
+    free(cr);
+    return link->handle >= 0 ? fd : -1;
+}
+
+static bool link_hci_cmd(int fd, uint16_t ocf, const void *param, uint8_t plen)
+{
+    uint8_t buf[1 + HCI_COMMAND_HDR_SIZE + 16];
+    hci_command_hdr *hdr = (hci_command_hdr *)(buf + 1);
+    buf[0] = HCI_COMMAND_PKT;
+    hdr->opcode = htobs(cmd_opcode_pack(OGF_LINK_POLICY, ocf));
+    hdr->plen = plen;
+    memcpy(hdr + 1, param, plen);
+    return write(fd, buf, 1 + HCI_COMMAND_HDR_SIZE + plen) == 1 + HCI_COMMAND_HDR_SIZE + plen;
+}
+
+static void onLinkTimeoutResult(DBusMessage *msg, void *user, void *n) {
+    link_timeout_req_t *req = (link_timeout_req_t *)user;
+    char address[BTADDR_SIZE];
+    DBusError err;
+    dbus_error_init(&err);
+    bt_addr_format(req->addr, address);
+    if (dbus_set_error_from_message(&err, msg)) {
+        printf("link %s: supervision timeout %d slots refused: %s\n", address, req->slots, err.message);
+        dbus_error_free(&err);
+    } else {
+        ALOGV("link %s: supervision timeout %d slots set in %lld us\n", address, req->slots,
+            (long long)ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - req->issued));
+    }
+    delete req;
+}
+
+// Called with linkLock held.  Only queues the SetLinkTimeout call on out:
+// dbus_func_async() takes the dispatch lock, which event_filter() already
+// holds when it takes linkLock, so the caller sends it with
+// link_send_timeouts() after dropping linkLock.
+static void link_set_supervision(link_state_t *link, int slots, Vector<link_timeout_req_t *>& out)
+{
+    if (!slots || slots == link->supervision || !global_conn)
+        return;
+    link_timeout_req_t *req = new link_timeout_req_t;
+    req->addr = link->addr;
+    req->path = link->path;
+    req->slots = slots;
+    req->issued = systemTime(SYSTEM_TIME_MONOTONIC);
+    link->supervision = slots;
+    out.add(req);
+}
+
+// Called without linkLock
+static void link_send_timeouts(const Vector<link_timeout_req_t *>& reqs)
+{
+    for (size_t i = 0; i < reqs.size(); i++) {
+        link_timeout_req_t *req = reqs[i];
+        bt_adapter_t *adapter = find_adapter(req->path.string());
+        const char *c_path = req->path.string();
+        dbus_uint32_t c_slots = req->slots;
+        if (!adapter || !dbus_func_async(-1, onLinkTimeoutResult, req, adapter->path.string(), DBUS_ADAPTER_IFACE,
+                "SetLinkTimeout", DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_UINT32, &c_slots, DBUS_TYPE_INVALID))
+            delete req;
+    }
+}
+
+// Move a link to mode and log why.  Called with linkLock held; any
+// supervision timeout change is queued on timeouts.
+static void link_set_mode(link_state_t *link, const link_policy_t *policy, int mode, const char *why, nsecs_t now,
+        Vector<link_timeout_req_t *>& timeouts)
+{
+    char address[BTADDR_SIZE];
+    const char *hci = "unavailable";
+    int from = link->mode;
+    nsecs_t t = systemTime(SYSTEM_TIME_MONOTONIC);
+    int fd = link_hci_prepare(link);
+    bool sent = false;
+    if (fd >= 0 && mode == LINK_SNIFF) {
+        sniff_mode_cp cp;
+        cp.handle = htobs(link->handle);
+        cp.max_interval = htobs(policy->sniff_max);
+        cp.min_interval = htobs(policy->sniff_min);
+        cp.attempt = htobs(policy->sniff_attempt);
+        cp.timeout = htobs(policy->sniff_timeout);
+        sent = link_hci_cmd(fd, OCF_SNIFF_MODE, &cp, SNIFF_MODE_CP_SIZE);
+    } else if (fd >= 0) {
+        exit_sniff_mode_cp cp;
+        cp.handle = htobs(link->handle);
+        sent = link_hci_cmd(fd, OCF_EXIT_SNIFF_MODE, &cp, EXIT_SNIFF_MODE_CP_SIZE);
+    }
+    if (fd >= 0)
+        hci = sent ? "sent" : strerror(errno);
+    bt_addr_format(link->addr, address);
+    link->requested = now;
+    // with HCI access but a failed write, stay put and retry after another idle spell
+    if (fd < 0 || sent) {
+        link_set_supervision(link, mode == LINK_SNIFF ? policy->sniff_supervision : policy->active_supervision, timeouts);
+        link->mode = mode;
+    }
+    printf("link %s (%s): %s -> %s, %s; supervision %d slots; hci %s in %lld us\n", address, policy->name,
+        link_mode_name[from], link_mode_name[link->mode], why,
+        link->supervision, hci, (long long)ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - t));
+}
+
+static void link_acl(const char *path, bt_addr_t addr, bool up)
+{
+    char address[BTADDR_SIZE];
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    bt_addr_format(addr, address);
+    int major = up ? link_major_class(path) : LINK_CLASS_DEFAULT;
+    Vector<link_timeout_req_t *> timeouts;
+    pthread_mutex_lock(&linkLock);
+    ssize_t i = links.indexOfKey(addr);
+    if (!up) {
+        if (i >= 0) {
+            link_state_t *link = links.valueAt(i);
+            printf("link %s: down after %lld ms, last %s\n", address, (long long)ns2ms(now - link->up),
+                link_mode_name[link->mode]);
+            links.removeItemsAt(i);
+            delete link;
+        }
+        pthread_mutex_unlock(&linkLock);
+        return;
+    }
+    if (i < 0) {
+        link_state_t *link = new link_state_t;
+        const char *hci = strstr(path, "/hci");
+        link->path = String8(path);
+        link->addr = addr;
+        link->dev_id = hci ? atoi(hci + 4) : -1;
+        link->handle = -1;
+        link->major_class = major;
+        link->mode = LINK_ACTIVE;
+        link->streaming = false;
+        link->supervision = 0;
+        link->up = link->last_activity = link->requested = now;
+        links.add(addr, link);
+        const link_policy_t *policy = link_policy(major);
+        printf("link %s (%s): up\n", address, policy->name);
+        link_set_supervision(link, policy->active_supervision, timeouts);
+    }
+    pthread_mutex_unlock(&linkLock);
+    link_send_timeouts(timeouts);
+}
+
+static void link_activity(bt_addr_t addr)
+{
+    bool wake = false;
+    pthread_mutex_lock(&linkLock);
+    ssize_t i = links.indexOfKey(addr);
+    if (i >= 0) {
+        link_state_t *link = links.valueAt(i);
+        link->last_activity = systemTime(SYSTEM_TIME_MONOTONIC);
+        wake = link->mode == LINK_SNIFF;
+    }
+    pthread_mutex_unlock(&linkLock);
+    // only a sniffing link needs the loop to act now
+    if (wake)
+        dbusWakeup(NULL);
+}
+
+static void link_streaming(const char *path, bool streaming)
+{
+    bt_addr_t addr;
+    if (!link_path_addr(path, &addr))
+        return;
+    bool wake = false;
+    pthread_mutex_lock(&linkLock);
+    ssize_t i = links.indexOfKey(addr);
+    if (i >= 0) {
+        link_state_t *link = links.valueAt(i);
+        wake = link->streaming != streaming;
+        link->streaming = streaming;
+        if (!streaming)
+            link->last_activity = systemTime(SYSTEM_TIME_MONOTONIC);
+    }
+    pthread_mutex_unlock(&linkLock);
+    // streaming pulls a sniffing link out; stopping starts its idle clock
+    if (wake)
+        dbusWakeup(NULL);
+}
+
+static void link_tick(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    char why[64];
+    Vector<link_timeout_req_t *> timeouts;
+    pthread_mutex_lock(&linkLock);
+    for (size_t i = 0; i < links.size(); i++) {
+        link_state_t *link = links.valueAt(i);
+        const link_policy_t *policy = link_policy(link->major_class);
+        if (link->mode == LINK_SNIFF) {
+            if (link->streaming)
+                link_set_mode(link, policy, LINK_ACTIVE, "streaming", now, timeouts);
+            else if (link->last_activity > link->requested)
+                link_set_mode(link, policy, LINK_ACTIVE, "traffic", now, timeouts);
+        } else if (!link->streaming && policy->idle_ms) {
+            nsecs_t idle = now - (link->last_activity > link->requested ? link->last_activity : link->requested);
+            if (idle >= ms2ns(policy->idle_ms)) {
+                snprintf(why, sizeof(why), "idle %lld ms", (long long)ns2ms(idle));
+                link_set_mode(link, policy, LINK_SNIFF, why, now, timeouts);
+            }
+        }
+    }
+    pthread_mutex_unlock(&linkLock);
+    link_send_timeouts(timeouts);
+}
+
+// How long until an active link has been quiet long enough for sniff
+static int link_poll_timeout(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t next = -1;
+    pthread_mutex_lock(&linkLock);
+    for (size_t i = 0; i < links.size(); i++) {
+        link_state_t *link = links.valueAt(i);
+        const link_policy_t *policy = link_policy(link->major_class);
+        if (link->mode != LINK_ACTIVE || link->streaming || !policy->idle_ms)
+            continue;
+        nsecs_t since = link->last_activity > link->requested ? link->last_activity : link->requested;
+        nsecs_t wait = since + ms2ns(policy->idle_ms) - now;
+        if (wait < 0)
+            wait = 0;
+        if (next < 0 || wait < next)
+            next = wait;
+    }
+    pthread_mutex_unlock(&linkLock);
+    return next < 0 ? -1 : (int)ns2ms(next + ms2ns(1) - 1);
+}
+
+// Replace the rules for policy->major_class
+static bool setLinkPolicyNative(const link_policy_t& policy) {
+    if (policy.idle_ms < 0 || policy.sniff_min <= 0 || (policy.sniff_min & 1) || (policy.sniff_max & 1)
+     || policy.sniff_max < policy.sniff_min || policy.sniff_max > 0xfffe
+     || policy.active_supervision <= 0 || policy.active_supervision > 0xffff
+     || policy.sniff_supervision > 0xffff || policy.sniff_supervision <= 2 * policy.sniff_max)
+        return FALSE;
+    pthread_mutex_lock(&linkLock);
+    const link_policy_t *old = link_policy(policy.major_class);
+    if (old && old->major_class == policy.major_class) {
+        link_policy_t& p = linkPolicies.editItemAt(old - linkPolicies.array());
+        const char *name = p.name;
+        p = policy;
+        if (!p.name)
+            p.name = name;
+    } else {
+        ssize_t i = linkPolicies.add(policy);
+        if (!policy.name)
+            linkPolicies.editItemAt(i).name = "custom";
+    }
+    pthread_mutex_unlock(&linkLock);
+    dbusWakeup(NULL);
+    return TRUE;
+}
+
+// Note traffic on a link, from anything moving data over it
+static void linkActivityNative(String8 address) {
+    bt_addr_t addr;
+    if (bt_addr_parse(address.string(), &addr) == 0)
+        link_activity(addr);
+}
+
+/*
+ * Rules from a file, one class per line:
+ *   class idle_ms active_supervision sniff_supervision sniff_min sniff_max attempt timeout
+ * where class is a linkDefaults name or a major class number.
+ */
+static int loadLinkPoliciesNative(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[256], name[32];
+    int count = 0;
+    if (!f)
+        return -errno;
+    while (fgets(line, sizeof(line), f)) {
+        link_policy_t policy;
+        if (line[0] == '#' || sscanf(line, "%31s %d %d %d %d %d %d %d", name, &policy.idle_ms,
+                &policy.active_supervision, &policy.sniff_supervision, &policy.sniff_min, &policy.sniff_max,
+                &policy.sniff_attempt, &policy.sniff_timeout) != 8)
+            continue;
+        char *end;
+        policy.major_class = strtol(name, &end, 0);
+        policy.name = NULL;
+        if (*end) {
+            policy.major_class = -2;
+            for (size_t i = 0; i < sizeof(linkDefaults) / sizeof(linkDefaults[0]); i++)
+                if (!strcmp(name, linkDefaults[i].name))
+                    policy.major_class = linkDefaults[i].major_class;
+        }
+        if (policy.major_class == -2 || !setLinkPolicyNative(policy)) {
+            printf("%s: bad link policy: %s", path, line);
+            continue;
+        }
+        count++;
+    }
+    fclose(f);
+    return count;
 }
 
 void initme(void)
@@ -1565,8 +4625,8 @@ printf("[%s:%d] global_conn %p\n", __FUNCTION__, __LINE__, global_conn);
     if (!bt_is_enabled())
         bt_enable();
     dbus_error_init(&err);
-    if (register_agent("DisplayYesNo") < 0) {
-        dbus_connection_unregister_object_path (global_conn, agent_path);
+    work_pool_start();
+    if (register_adapters() < 0) {
 printf("[%s:%d] registration failed\n", __FUNCTION__, __LINE__);
         exit(1);
     }
@@ -1577,21 +4637,11 @@ printf("[%s:%d]\n", __FUNCTION__, __LINE__);
     }
     // Set which messages will be processed by this dbus connection
     addmatch();
-printf ("pathname %s\n", global_adapter);
+printf ("pathname %s, %d adapters\n", global_adapter, adapterCount);
 
-    DBusMessage *msg = NULL;
-    DBusMessage *reply = NULL;
-    const char *name;
 printf("[%s:%d]\n", __FUNCTION__, __LINE__);
-    dbus_error_init(&err); 
-    msg = dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, global_adapter, DBUS_ADAPTER_IFACE, "StartDiscovery"); 
-    reply = dbus_connection_send_with_reply_and_block(global_conn, msg, -1, &err);
-    if (dbus_error_is_set(&err)) {
-         LOG_AND_FREE_DBUS_ERROR_WITH_MSG(&err, msg);
-         exit(1);
-    } 
-    if (reply) dbus_message_unref(reply);
-    if (msg) dbus_message_unref(msg);
+    for (int i = 0; i < adapterCount; i++)
+        discovery_arm(adapters[i]);
     //bt_disable();
 printf("[%s:%d]\n", __FUNCTION__, __LINE__);
     eventLoopMain();
@@ -1599,10 +4649,166 @@ printf("[%s:%d]\n", __FUNCTION__, __LINE__);
     dbus_connection_close(global_conn);
 }
 
+/*
+ * Offline replay of a journal through event_filter(), for debugging and
+ * for timing the handlers without a bus.  Adapters are made up from the
+ * object paths seen so that adapter signals still reach the workers.
+ */
+typedef struct {
+    int signals;
+    int other;
+    nsecs_t handler;           // time spent in event_filter on this thread
+} replay_stats_t;
+
+static void replay_message(DBusMessage *msg, nsecs_t timestamp, void *user) {
+    replay_stats_t *stats = (replay_stats_t *)user;
+    const char *path = dbus_message_get_path(msg);
+    const char *hci = path ? strstr(path, "/hci") : NULL;
+    if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL) {
+        stats->other++;
+        return;
+    }
+    if (hci) {
+        const char *end = strchr(hci + 1, '/');
+        String8 adapter_path(path, end ? end - path : strlen(path));
+        if (!find_adapter(adapter_path.string()))
+            add_adapter(adapter_path.string());
+    }
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    event_filter(NULL, msg, NULL);
+    stats->handler += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    stats->signals++;
+}
+
+static int replayJournal(const char *path) {
+    replay_stats_t stats = { 0, 0, 0 };
+    work_pool_start();
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    int n = bt_journal_replay(path, replay_message, &stats);
+    work_pool_drain();
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    if (n < 0) {
+        printf("replay %s: %s\n", path, strerror(-n));
+        return 1;
+    }
+    printf("replay: %d signals, %d other messages in %lld us; event_filter %lld ns/signal, %lld ns/signal with workers\n",
+            stats.signals, stats.other, (long long)ns2us(elapsed),
+            stats.signals ? (long long)(stats.handler / stats.signals) : 0LL,
+            stats.signals ? (long long)(elapsed / stats.signals) : 0LL);
+    print_work_stats();
+    return 0;
+}
+
+/*
+ * Stand-in for an HDP channel: a recorded APDU stream (raw channel bytes)
+ * is written into one end of a socketpair in uneven pieces, the way L2CAP
+ * hands it over, while the reader works the other end non-blocking.
+ */
+typedef struct {
+    int fd;
+    const uint8_t *data;
+    size_t len;
+} health_feed_t;
+
+static void *health_feed_main(void *arg) {
+    health_feed_t *feed = (health_feed_t *)arg;
+    uint32_t seed = 1;
+    size_t off = 0;
+    while (off < feed->len) {
+        seed = seed * 1103515245 + 12345;
+        size_t n = 1 + (seed >> 16) % 700;
+        if (n > feed->len - off)
+            n = feed->len - off;
+        ssize_t w = write(feed->fd, feed->data + off, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += w;
+        if (!(seed & 0x700))
+            usleep(200);
+    }
+    close(feed->fd);
+    return NULL;
+}
+
+static void count_measurement(bt_health_channel_t *ch, const bt_health_measurement_t *m, void *user) {
+    if (verboseEvents)
+        health_measurement(ch, m, user);
+}
+
+static int replayHealth(const char *path) {
+    int sockvec[2];
+    struct stat st;
+    pthread_t thread;
+    health_channel_t hc;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("health %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    uint8_t *data = (uint8_t *)malloc(st.st_size);
+    if (!data || read(fd, data, st.st_size) != st.st_size) {
+        printf("health %s: short read\n", path);
+        return 1;
+    }
+    close(fd);
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sockvec))
+        return 1;
+    hc.path = String8(path);
+    hc.reader = bt_health_open(sockvec[0], count_measurement, &hc);
+    if (!hc.reader)
+        return 1;
+    health_feed_t feed = { sockvec[1], data, (size_t)st.st_size };
+    pthread_create(&thread, NULL, health_feed_main, &feed);
+    struct pollfd pfd = { sockvec[0], POLLIN, 0 };
+    while (poll(&pfd, 1, -1) >= 0 && bt_health_read(hc.reader) >= 0)
+        ;
+    pthread_join(thread, NULL);
+    bt_health_stats_t stats;
+    bt_health_get_stats(hc.reader, &stats);
+    print_health_stats(path, &stats);
+    bt_health_close(hc.reader);
+    free(data);
+    return 0;
+}
+
 } /* namespace android */
 
 int main(int argc, char *argv[])
 {
+    const char *journal = NULL, *replay = NULL, *health = NULL, *link_rules = NULL;
+    int journal_kb = 1024;
+    int opt;
+    while ((opt = getopt(argc, argv, "vWj:s:R:H:L:P:")) != -1) {
+        switch (opt) {
+        case 'v': verboseEvents = true; break;
+        case 'W': android::matchWide = true; break;
+        case 'j': journal = optarg; break;
+        case 's': journal_kb = atoi(optarg); break;
+        case 'R': replay = optarg; break;
+        case 'H': health = optarg; break;
+        case 'L': android::connStatsFile = optarg; break;
+        case 'P': link_rules = optarg; break;
+        default:
+            printf("usage: %s [-v] [-W] [-j journal [-s size_kb]] [-R journal] [-H apdu_stream]\n"
+                   "       [-L connect_stats_file] [-P link_policy_file]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (replay)
+        return android::replayJournal(replay);
+    if (health)
+        return android::replayHealth(health);
+    if (journal && android::bt_journal_open(journal, journal_kb * 1024) < 0)
+        printf("can't open journal %s\n", journal);
+    if (link_rules) {
+        int n = android::loadLinkPoliciesNative(link_rules);
+        if (n < 0)
+            printf("can't read link policies %s: %s\n", link_rules, strerror(-n));
+    }
     printf("[%s:%d] start\n", __FUNCTION__, __LINE__);
     android::initme();
     printf("[%s:%d] end\n", __FUNCTION__, __LINE__);
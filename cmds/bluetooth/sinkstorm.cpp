@@ -0,0 +1,172 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * sinkstorm: drives the A2DP sink state machine in service.cpp against
+ * mockbluez.  bluetest's event loop runs as usual while a second thread
+ * connects a few sinks and then flips them between suspend and resume as
+ * fast as a media app gone wrong would.  Checks that:
+ *   - suspend and resume are refused on a sink that isn't connected, and
+ *     make no call
+ *   - after the storm every sink settles where the last request asked
+ *   - a suspend, resume, suspend burst on a suspended sink makes no call
+ *   - resume is refused once a disconnect has been asked for
+ * and prints the sink request, call and latency counts.
+ *
+ * The sinks are mockbluez's first devices, which -k must report as created
+ * so that their AudioSink signals are matched:
+ *
+ *   mockbluez -t 15 -k 16 &
+ *   sinkstorm [-d sinks] [-n toggles] [-g max_gap_ms]
+ */
+
+#define main bluetest_main
+#include "service.cpp"
+#undef main
+
+using namespace android;
+
+static int stormSinks = 2, stormToggles = 200, stormGapMs = 3;
+static int failures;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static uint64_t calls_made(void) {
+    pthread_mutex_lock(&sinkLock);
+    uint64_t calls = sinkCalls;
+    pthread_mutex_unlock(&sinkLock);
+    return calls;
+}
+
+static int state_of(const String8& path) {
+    pthread_mutex_lock(&sinkLock);
+    sink_t *sink = sink_find(path.string(), false);
+    int state = sink ? sink->state : SINK_DISCONNECTED;
+    pthread_mutex_unlock(&sinkLock);
+    return state;
+}
+
+// Wait for every sink to be done with its requests and calls
+static bool settle(const String8 *sink, int count, int timeout_ms) {
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + ms2ns(timeout_ms);
+    while (systemTime(SYSTEM_TIME_MONOTONIC) < deadline) {
+        bool busy = false;
+        pthread_mutex_lock(&sinkLock);
+        for (int i = 0; i < count; i++) {
+            sink_t *s = sink_find(sink[i].string(), false);
+            busy |= s && (s->want >= 0 || s->op != SINK_OP_NONE);
+        }
+        pthread_mutex_unlock(&sinkLock);
+        if (!busy)
+            return true;
+        usleep(5000);
+    }
+    return false;
+}
+
+static void *driver(void *arg) {
+    while (!global_adapter)
+        usleep(10000);
+    usleep(100000);            // let the adapter's signals settle
+    String8 *sink = new String8[stormSinks];
+    for (int i = 0; i < stormSinks; i++)
+        sink[i] = String8::format("%s/dev_00_1A_00_00_00_%02X", global_adapter, i);
+
+    uint64_t calls = calls_made();
+    check(!suspendSinkNative(sink[0]) && !resumeSinkNative(sink[0]), "suspend/resume accepted while disconnected");
+    usleep(50000);
+    check(calls_made() == calls && state_of(sink[0]) == SINK_DISCONNECTED, "suspend/resume made a call while disconnected");
+
+    for (int i = 0; i < stormSinks; i++)
+        connectSinkNative(sink[i]);
+    // a resume while the connect is out is fine: it plays once connected
+    check(resumeSinkNative(sink[0]), "resume refused during connect");
+    check(settle(sink, stormSinks, 5000), "connect did not settle");
+    check(state_of(sink[0]) == SINK_PLAYING, "connect then resume did not end playing");
+    for (int i = 1; i < stormSinks; i++)
+        check(state_of(sink[i]) == SINK_CONNECTED, "connect did not end connected");
+
+    unsigned seed = 1;
+    int *last = new int[stormSinks];
+    calls = calls_made();
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int t = 0; t < stormToggles; t++) {
+        for (int i = 0; i < stormSinks; i++) {
+            bool resume = rand_r(&seed) & 1;
+            check(resume ? resumeSinkNative(sink[i]) : suspendSinkNative(sink[i]), "toggle refused on a connected sink");
+            last[i] = resume ? SINK_PLAYING : SINK_CONNECTED;
+        }
+        if (stormGapMs)
+            usleep(rand_r(&seed) % (stormGapMs + 1) * 1000);
+    }
+    check(settle(sink, stormSinks, 10000), "storm did not settle");
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+    for (int i = 0; i < stormSinks; i++)
+        check(state_of(sink[i]) == last[i], "storm did not end where the last request asked");
+    printf("storm: %d toggles on %d sinks in %lld ms, %llu calls\n", stormToggles * stormSinks, stormSinks,
+            (long long)ns2ms(elapsed), (unsigned long long)(calls_made() - calls));
+
+    suspendSinkNative(sink[0]);
+    check(settle(sink, 1, 5000), "suspend did not settle");
+    calls = calls_made();
+    suspendSinkNative(sink[0]);
+    resumeSinkNative(sink[0]);
+    suspendSinkNative(sink[0]);
+    check(settle(sink, 1, 5000) && calls_made() == calls, "suspend/resume/suspend burst made a call");
+
+    disconnectSinkNative(sink[0]);
+    check(!resumeSinkNative(sink[0]), "resume accepted after disconnect");
+    check(settle(sink, 1, 5000) && state_of(sink[0]) == SINK_DISCONNECTED, "disconnect did not end disconnected");
+
+    print_sink_stats();
+    printf("sinkstorm: %s\n", failures ? "FAILED" : "ok");
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:g:")) != -1) {
+        switch (opt) {
+        case 'd':
+            stormSinks = atoi(optarg);
+            break;
+        case 'n':
+            stormToggles = atoi(optarg);
+            break;
+        case 'g':
+            stormGapMs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d sinks] [-n toggles] [-g max_gap_ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (stormSinks < 1 || stormSinks > 255 || stormToggles < 0 || stormGapMs < 0) {
+        fprintf(stderr, "sinkstorm: need 1-255 sinks, and toggles and gap >= 0\n");
+        return 1;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, driver, NULL);
+    android::initme();
+    return 1;
+}
@@ -22,6 +22,7 @@
 //#include "android_runtime/AndroidRuntime.h"
 #include "utils/Log.h"
 #include "utils/misc.h"
+#include "utils/Timers.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -37,6 +38,11 @@
 #include <sys/uio.h>
 #include <ctype.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <stddef.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
@@ -49,12 +55,53 @@
 
 #define TYPE_AS_STR(t) ((t) == TYPE_RFCOMM ? "RFCOMM" : ((t) == TYPE_SCO ? "SCO" : "L2CAP"))
 namespace android {
+
+// A long lived epoll set for the AG sockets.  Anything registered with it
+// embeds a bt_watch_t as its first member and gets called back with the
+// epoll events for its fd.
+struct bt_watch;
+typedef void (*bt_watch_cb_t)(struct bt_watch *watch, uint32_t events);
+
+typedef struct bt_watch {
+    int fd;
+    bt_watch_cb_t cb;
+} bt_watch_t;
+
+typedef struct {
+    int epfd;
+} bt_loop_t;
+
+// Called with each connection accepted on a listener.  The new socket is
+// already non-blocking and close-on-exec, and belongs to the handler.
+typedef void (*bt_accept_cb_t)(int fd, const struct sockaddr *addr, socklen_t addr_sz, void *user);
+
+typedef struct {
+    bt_watch_t watch;
+    bt_accept_cb_t handler;
+    void *user;
+    int accepted;
+} bt_listener_t;
+
+// An accepted HF or HS connection waiting for the headset object to take
+// it (the mConnectingHandsfree* / mConnectingHeadset* fields in Java)
+typedef struct {
+    const char *name;
+    int fd;
+    int channel;
+    char address[BTADDR_SIZE];
+} bt_accepted_t;
+
 typedef struct {
     int hcidev;
     int hf_ag_rfcomm_channel;
     int hs_ag_rfcomm_channel;
     int hf_ag_rfcomm_sock;
     int hs_ag_rfcomm_sock;
+    bt_loop_t loop;
+    bt_listener_t *hf_listener;
+    bt_listener_t *hs_listener;
+    bt_accepted_t hf_accepted;
+    bt_accepted_t hs_accepted;
 } native_data_t;
 
 static void initializeNativeDataNative() {
@@ -70,6 +117,13 @@ static void initializeNativeDataNative() {
     //env->SetIntField(object, field_mConnectingHandsfreeRfcommChannel, -1); 
     nat->hf_ag_rfcomm_sock = -1;
     nat->hs_ag_rfcomm_sock = -1;
+    nat->loop.epfd = -1;
+    nat->hf_accepted.name = "HF";
+    nat->hf_accepted.fd = -1;
+    nat->hf_accepted.channel = -1;
+    nat->hs_accepted.name = "HS";
+    nat->hs_accepted.fd = -1;
+    nat->hs_accepted.channel = -1;
 }
 
 static int set_nb(int sk, bool nb) {
@@ -90,95 +144,176 @@ static int set_nb(int sk, bool nb) {
     return 0;
 }
 
-static int do_accept(int ag_fd, int out_fd, int out_address, int out_channel) { 
-    if (set_nb(ag_fd, true) < 0)
+static int bt_loop_init(bt_loop_t *loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        ALOGE("epoll_create1() failed: %s (%d)", strerror(errno), errno);
         return -1;
-    struct sockaddr_rc raddr;
-    int alen = sizeof(raddr);
-    int nsk = TEMP_FAILURE_RETRY(accept(ag_fd, (struct sockaddr *) &raddr, &alen));
-    if (nsk < 0) {
-        ALOGE("Error on accept from socket fd %d: %s (%d).", ag_fd, strerror(errno), errno);
-        set_nb(ag_fd, false);
+    }
+    return 0;
+}
+
+static int bt_loop_add(bt_loop_t *loop, bt_watch_t *watch, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watch;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, watch->fd, &ev) < 0) {
+        ALOGE("epoll_ctl(ADD, %d) failed: %s (%d)", watch->fd, strerror(errno), errno);
         return -1;
     }
+    return 0;
+}
 
-    //env->SetIntField(object, out_fd, nsk);
-    //env->SetIntField(object, out_channel, raddr.rc_channel);
+static int bt_loop_modify(bt_loop_t *loop, bt_watch_t *watch, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watch;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, watch->fd, &ev);
+}
 
-    char addr[BTADDR_SIZE];
-    get_bdaddr_as_string(&raddr.rc_bdaddr, addr);
-    //env->SetObjectField(object, out_address, addr.string());
+static void bt_loop_remove(bt_loop_t *loop, bt_watch_t *watch) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
 
-    ALOGI("Successful accept() on AG socket %d: new socket %d, address %s, RFCOMM channel %d", ag_fd, nsk, addr, raddr.rc_channel);
-    set_nb(ag_fd, false);
-    return 0;
+static void bt_loop_destroy(bt_loop_t *loop) {
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    loop->epfd = -1;
+}
+
+// Wait up to timeout_ms and dispatch whatever is ready.  Returns the
+// number of watches serviced, 0 on timeout or -1 on error.
+static int bt_loop_run_once(bt_loop_t *loop, int timeout_ms) {
+    struct epoll_event events[16];
+    int n = TEMP_FAILURE_RETRY(epoll_wait(loop->epfd, events, sizeof(events)/sizeof(events[0]), timeout_ms));
+    if (n < 0) {
+        ALOGE("epoll_wait() failed: %s (%d)", strerror(errno), errno);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        bt_watch_t *watch = (bt_watch_t *)events[i].data.ptr;
+        watch->cb(watch, events[i].events);
+    }
+    return n;
+}
+
+// Drain the accept queue of a ready listener.
+static void bt_listener_event(bt_watch_t *watch, uint32_t events) {
+    bt_listener_t *l = (bt_listener_t *)watch;
+    for (;;) {
+        struct sockaddr_storage raddr;
+        socklen_t alen = sizeof(raddr);
+        int nsk = TEMP_FAILURE_RETRY(accept4(watch->fd, (struct sockaddr *)&raddr, &alen, SOCK_NONBLOCK | SOCK_CLOEXEC));
+        if (nsk < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ALOGE("Error on accept from socket fd %d: %s (%d).", watch->fd, strerror(errno), errno);
+            return;
+        }
+        l->accepted++;
+        if (raddr.ss_family == AF_BLUETOOTH) {
+            struct sockaddr_rc *rc = (struct sockaddr_rc *)&raddr;
+            char addr[BTADDR_SIZE];
+            get_bdaddr_as_string(&rc->rc_bdaddr, addr);
+            ALOGI("Successful accept() on AG socket %d: new socket %d, address %s, RFCOMM channel %d", watch->fd, nsk, addr, rc->rc_channel);
+        } else {
+            ALOGI("Successful accept() on socket %d: new socket %d", watch->fd, nsk);
+        }
+        if (l->handler)
+            l->handler(nsk, (struct sockaddr *)&raddr, alen, l->user);
+        else
+            close(nsk);
+    }
+}
+
+// Register a listening socket of any family (AF_UNIX works as a stand in
+// for RFCOMM).  The socket is switched to non-blocking once, here.
+static bt_listener_t *bt_listener_add(bt_loop_t *loop, int listen_fd, bt_accept_cb_t handler, void *user) {
+    if (set_nb(listen_fd, true) < 0)
+        return NULL;
+    bt_listener_t *l = (bt_listener_t *)calloc(1, sizeof(bt_listener_t));
+    l->watch.fd = listen_fd;
+    l->watch.cb = bt_listener_event;
+    l->handler = handler;
+    l->user = user;
+    if (bt_loop_add(loop, &l->watch, EPOLLIN)) {
+        free(l);
+        return NULL;
+    }
+    return l;
+}
+
+static void bt_listener_remove(bt_loop_t *loop, bt_listener_t *l) {
+    if (!l)
+        return;
+    bt_loop_remove(loop, &l->watch);
+    free(l);
+}
+
+// Park the connection until takeAcceptedSocketNative() picks it up.  One
+// that was never picked up is superseded by the new one.
+static void onHandsfreeAccepted(int fd, const struct sockaddr *addr, socklen_t addr_sz, void *user) {
+    bt_accepted_t *slot = (bt_accepted_t *)user;
+    ALOGI("Accepting %s connection.\n", slot->name);
+    if (slot->fd >= 0) {
+        ALOGW("%s connection from %s was never taken, closing it", slot->name, slot->address);
+        close(slot->fd);
+    }
+    slot->fd = fd;
+    slot->channel = -1;
+    slot->address[0] = 0;
+    if (addr->sa_family == AF_BLUETOOTH) {
+        const struct sockaddr_rc *rc = (const struct sockaddr_rc *)addr;
+        slot->channel = rc->rc_channel;
+        get_bdaddr_as_string(&rc->rc_bdaddr, slot->address);
+    }
+    //env->SetIntField(object, field_mConnectingHandsfreeSocketFd, fd);
+    //env->SetIntField(object, field_mConnectingHandsfreeRfcommChannel, raddr.rc_channel);
+    //env->SetObjectField(object, field_mConnectingHandsfreeAddress, addr);
+}
+
+// Hand the last accepted HF (or HS) connection to the caller, who then
+// owns the fd.  Returns -1 if there is none.
+static int takeAcceptedSocketNative(bool handsfree, char *address, int *channel) {
+    native_data_t *nat = NULL;
+    bt_accepted_t *slot = handsfree ? &nat->hf_accepted : &nat->hs_accepted;
+    int fd = slot->fd;
+    if (fd < 0)
+        return -1;
+    if (address)
+        strlcpy(address, slot->address, BTADDR_SIZE);
+    if (channel)
+        *channel = slot->channel;
+    slot->fd = -1;
+    return fd;
+}
+
+static void drop_accepted(bt_accepted_t *slot) {
+    if (slot->fd >= 0)
+        close(slot->fd);
+    slot->fd = -1;
 }
 
 static bool waitForHandsfreeConnectNative(int timeout_ms) {
     //env->SetIntField(object, field_mTimeoutRemainingMs, timeout_ms); 
-    int n = 0;
     native_data_t *nat = NULL;
-    struct pollfd fds[2];
-    int cnt = 0;
-    if (nat->hf_ag_rfcomm_channel > 0) {
-//        ALOGI("Setting HF AG server socket %d to RFCOMM port %d!", nat->hf_ag_rfcomm_sock, nat->hf_ag_rfcomm_channel);
-        fds[cnt].fd = nat->hf_ag_rfcomm_sock;
-        fds[cnt].events = POLLIN | POLLPRI | POLLOUT | POLLERR;
-        cnt++;
-    }
-    if (nat->hs_ag_rfcomm_channel > 0) {
-//        ALOGI("Setting HS AG server socket %d to RFCOMM port %d!", nat->hs_ag_rfcomm_sock, nat->hs_ag_rfcomm_channel);
-        fds[cnt].fd = nat->hs_ag_rfcomm_sock;
-        fds[cnt].events = POLLIN | POLLPRI | POLLOUT | POLLERR;
-        cnt++;
-    }
-    if (cnt == 0) {
+    if (!nat->hf_listener && !nat->hs_listener) {
         ALOGE("Neither HF nor HS listening sockets are open!");
         return FALSE;
     }
-    n = TEMP_FAILURE_RETRY(poll(fds, cnt, timeout_ms));
+    int n = bt_loop_run_once(&nat->loop, timeout_ms);
     if (n <= 0) {
-        if (n < 0)  {
-            ALOGE("listening poll() on RFCOMM sockets: %s (%d)", strerror(errno), errno);
-        }
-        else {
-            //env->SetIntField(object, field_mTimeoutRemainingMs, 0);
-//            ALOGI("listening poll() on RFCOMM socket timed out");
-        }
+        //if (n == 0) env->SetIntField(object, field_mTimeoutRemainingMs, 0);
         return FALSE;
     }
-
-    //ALOGI("listening poll() on RFCOMM socket returned %d", n);
-    int err = 0;
-    for (cnt = 0; cnt < (int)(sizeof(fds)/sizeof(fds[0])); cnt++) {
-        //ALOGI("Poll on fd %d revent = %d.", fds[cnt].fd, fds[cnt].revents);
-        if (fds[cnt].fd == nat->hf_ag_rfcomm_sock) {
-            if (fds[cnt].revents & (POLLIN | POLLPRI | POLLOUT)) {
-                ALOGI("Accepting HF connection.\n");
-                err += do_accept(fds[cnt].fd, 0, 0, 0); //field_mConnectingHandsfreeSocketFd, field_mConnectingHandsfreeAddress, field_mConnectingHandsfreeRfcommChannel);
-                n--;
-            }
-        }
-        else if (fds[cnt].fd == nat->hs_ag_rfcomm_sock) {
-            if (fds[cnt].revents & (POLLIN | POLLPRI | POLLOUT)) {
-                ALOGI("Accepting HS connection.\n");
-                err += do_accept(fds[cnt].fd, 0, 0, 0); //field_mConnectingHeadsetSocketFd, field_mConnectingHeadsetAddress, field_mConnectingHeadsetRfcommChannel);
-                n--;
-            }
-        }
-    } /* for */
-
-    if (n != 0) {
-        ALOGI("Bogus poll(): %d fake pollfd entrie(s)!", n);
-        return FALSE;
-    } 
-    return !err ? TRUE : FALSE;
+    return TRUE;
 }
 
 static int setup_listening_socket(int dev, int channel) {
     struct sockaddr_rc laddr;
     int sk, lm; 
-    sk = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    sk = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_CLOEXEC, BTPROTO_RFCOMM);
     if (sk < 0) {
         ALOGE("Can't create RFCOMM socket");
         return -1;
@@ -208,16 +343,37 @@ static int setup_listening_socket(int dev, int channel) {
 
 static bool setUpListeningSocketsNative() {
     native_data_t *nat = NULL;
+    if (bt_loop_init(&nat->loop) < 0)
+        return FALSE;
     nat->hf_ag_rfcomm_sock = setup_listening_socket(nat->hcidev, nat->hf_ag_rfcomm_channel);
     if (nat->hf_ag_rfcomm_sock < 0)
-        return FALSE; 
+        goto failed;
     nat->hs_ag_rfcomm_sock = setup_listening_socket(nat->hcidev, nat->hs_ag_rfcomm_channel);
-    if (nat->hs_ag_rfcomm_sock < 0) {
-        close(nat->hf_ag_rfcomm_sock);
-        nat->hf_ag_rfcomm_sock = -1;
-        return FALSE;
+    if (nat->hs_ag_rfcomm_sock < 0)
+        goto failed;
+    if (nat->hf_ag_rfcomm_channel > 0) {
+        nat->hf_listener = bt_listener_add(&nat->loop, nat->hf_ag_rfcomm_sock, onHandsfreeAccepted, &nat->hf_accepted);
+        if (!nat->hf_listener)
+            goto failed;
+    }
+    if (nat->hs_ag_rfcomm_channel > 0) {
+        nat->hs_listener = bt_listener_add(&nat->loop, nat->hs_ag_rfcomm_sock, onHandsfreeAccepted, &nat->hs_accepted);
+        if (!nat->hs_listener)
+            goto failed;
     }
     return TRUE;
+failed:
+    bt_listener_remove(&nat->loop, nat->hf_listener);
+    bt_listener_remove(&nat->loop, nat->hs_listener);
+    nat->hf_listener = nat->hs_listener = NULL;
+    if (nat->hf_ag_rfcomm_sock >= 0)
+        close(nat->hf_ag_rfcomm_sock);
+    nat->hf_ag_rfcomm_sock = -1;
+    if (nat->hs_ag_rfcomm_sock >= 0)
+        close(nat->hs_ag_rfcomm_sock);
+    nat->hs_ag_rfcomm_sock = -1;
+    bt_loop_destroy(&nat->loop);
+    return FALSE;
 }
 
 /*
@@ -226,6 +382,11 @@ static bool setUpListeningSocketsNative() {
 static void tearDownListeningSocketsNative() {
     native_data_t *nat = NULL;
 
+    bt_listener_remove(&nat->loop, nat->hf_listener);
+    bt_listener_remove(&nat->loop, nat->hs_listener);
+    nat->hf_listener = nat->hs_listener = NULL;
+    drop_accepted(&nat->hf_accepted);
+    drop_accepted(&nat->hs_accepted);
     if (nat->hf_ag_rfcomm_sock > 0) {
         if (close(nat->hf_ag_rfcomm_sock) < 0) {
             ALOGE("Could not close HF server socket: %s (%d)\n", strerror(errno), errno);
@@ -238,6 +399,7 @@ static void tearDownListeningSocketsNative() {
         }
         nat->hs_ag_rfcomm_sock = -1;
     }
+    bt_loop_destroy(&nat->loop);
 }
 
 /* Keep TYPE_RFCOMM etc in sync with BluetoothSocket.java */
@@ -245,7 +407,7 @@ static const int TYPE_RFCOMM = 1;
 static const int TYPE_SCO = 2;
 static const int TYPE_L2CAP = 3;  // TODO: Test l2cap code paths
 
-static const int RFCOMM_SO_SNDBUF = 70 * 1024;  // 70 KB send buffer
+static const int RFCOMM_SO_SNDBUF = 70 * 1024;  // 70 KB send buffer, initial size
 
 static void abortNative();
 static void destroyNative();
@@ -264,33 +426,29 @@ static void initSocketFromFdNative(int fd) {
     //env->SetIntField(obj, field_mSocketData, (int)s);
 }
 
-static void initSocketNative() {
+// Create a Bluetooth socket of the given TYPE_* with the link mode and
+// buffer sizes BluetoothSocket expects.  flags may add SOCK_NONBLOCK etc.
+static int create_socket(int type, bool auth, bool encrypt, int flags) {
     int fd;
     int lm = 0;
     int sndbuf;
-    bool auth;
-    bool encrypt;
-    int type; 
-    //type = //env->GetIntField(obj, field_mType); 
     switch (type) {
     case TYPE_RFCOMM:
-        fd = socket(PF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+        fd = socket(PF_BLUETOOTH, SOCK_STREAM | flags, BTPROTO_RFCOMM);
         break;
     case TYPE_SCO:
-        fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_SCO);
+        fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | flags, BTPROTO_SCO);
         break;
     case TYPE_L2CAP:
-        fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+        fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | flags, BTPROTO_L2CAP);
         break;
     default:
-        return;
+        return -1;
     } 
     if (fd < 0) {
         ALOGV("socket() failed, throwing");
-        return;
+        return -1;
     } 
-    //auth = env->GetBooleanField(obj, field_mAuth);
-    //encrypt = env->GetBooleanField(obj, field_mEncrypt); 
     /* kernel does not yet support LM for SCO */
     switch (type) {
     case TYPE_RFCOMM:
@@ -307,89 +465,370 @@ static void initSocketNative() {
     if (lm) {
         if (setsockopt(fd, SOL_RFCOMM, RFCOMM_LM, &lm, sizeof(lm))) {
             ALOGV("setsockopt(RFCOMM_LM) failed, throwing");
-            return;
+            close(fd);
+            return -1;
         }
     } 
     if (type == TYPE_RFCOMM) {
         sndbuf = RFCOMM_SO_SNDBUF;
         if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) {
             ALOGV("setsockopt(SO_SNDBUF) failed, throwing");
-            return;
+            close(fd);
+            return -1;
         }
     } 
     ALOGV("...fd %d created (%s, lm = %x)", fd, TYPE_AS_STR(type), lm); 
+    return fd;
+}
+
+static void initSocketNative() {
+    int fd;
+    bool auth;
+    bool encrypt;
+    int type; 
+    //type = //env->GetIntField(obj, field_mType); 
+    //auth = env->GetBooleanField(obj, field_mAuth);
+    //encrypt = env->GetBooleanField(obj, field_mEncrypt); 
+    fd = create_socket(type, auth, encrypt, 0);
+    if (fd < 0)
+        return;
     initSocketFromFdNative(fd);
 }
 
-static void connectNative() {
-    int ret;
+// Exponential backoff with jitter for reconnect attempts: attempt n waits
+// a random time between half and all of BACKOFF_BASE_MS << n, capped at
+// BACKOFF_MAX_MS, so headsets reconnecting together do not collide again.
+#define BACKOFF_BASE_MS 100
+#define BACKOFF_MAX_MS 5000
+
+static int backoff_delay_ms(int attempt) {
+    int delay = BACKOFF_MAX_MS;
+    if (attempt < 16 && (BACKOFF_BASE_MS << attempt) < BACKOFF_MAX_MS)
+        delay = BACKOFF_BASE_MS << attempt;
+    return delay / 2 + (int)(lrand48() % (delay / 2 + 1));
+}
+
+/*
+ * Non-blocking outbound connect driven from a bt_loop_t.  Each connection
+ * moves between CONNECTING (socket registered for EPOLLOUT) and BACKOFF
+ * (timerfd registered) until it succeeds, fails hard or runs out of
+ * attempts, so any number of them can be in flight at once.
+ */
+#define CONNECT_MAX_ATTEMPTS 6
+
+enum {CONNECT_IDLE, CONNECT_CONNECTING, CONNECT_BACKOFF, CONNECT_DONE, CONNECT_FAILED};
+
+struct bt_connect;
+// fd is the connected (non-blocking) socket, or -1 with err set
+typedef void (*bt_connect_cb_t)(struct bt_connect *c, int fd, int err);
+
+typedef struct bt_connect {
+    bt_watch_t sock;
+    bt_watch_t timer;
+    bt_loop_t *loop;
     int type;
-    const char *c_address;
-    String8 address;
-    bdaddr_t bdaddress;
+    bool auth;
+    bool encrypt;
+    struct sockaddr_storage addr;
     socklen_t addr_sz;
-    struct sockaddr *addr;
-    struct asocket *s = get_socketData();
-    int retry = 0;
+    char address[BTADDR_SIZE];
+    int state;
+    int attempts;
+    int collisions;
+    nsecs_t started;
+    nsecs_t attempt_started;
+    nsecs_t attempt_ns[CONNECT_MAX_ATTEMPTS];
+    bt_connect_cb_t cb;
+    void *user;
+} bt_connect_t;
 
-    if (!s)
-        return; 
-    //type = env->GetIntField(obj, field_mType); 
-    /* parse address into bdaddress */
-    //address = (String8) env->GetObjectField(obj, field_mAddress);
-    c_address = address.string();
-    if (get_bdaddr(c_address, &bdaddress)) {
-        //env->ReleaseStringUTFChars(address, c_address);
+static void connect_attempt(bt_connect_t *c);
+
+static void connect_finish(bt_connect_t *c, int fd, int err) {
+    nsecs_t total = systemTime(SYSTEM_TIME_MONOTONIC) - c->started;
+    c->state = fd >= 0 ? CONNECT_DONE : CONNECT_FAILED;
+    ALOGI("connect %s %s: %s after %d attempt(s), %d collision(s), %lld ms total",
+          TYPE_AS_STR(c->type), c->address, fd >= 0 ? "ok" : strerror(err),
+          c->attempts, c->collisions, (long long)ns2ms(total));
+    for (int i = 0; i < c->attempts && i < CONNECT_MAX_ATTEMPTS; i++)
+        ALOGV("...attempt %d: %lld ms", i + 1, (long long)ns2ms(c->attempt_ns[i]));
+    if (c->cb)
+        c->cb(c, fd, err);
+}
+
+// The attempt in flight ended with err; retry after a backoff if it is
+// worth it, otherwise report the failure.
+static void connect_retry(bt_connect_t *c, int err) {
+    if (c->attempts <= CONNECT_MAX_ATTEMPTS)
+        c->attempt_ns[c->attempts - 1] = systemTime(SYSTEM_TIME_MONOTONIC) - c->attempt_started;
+    if (c->sock.fd >= 0) {
+        bt_loop_remove(c->loop, &c->sock);
+        close(c->sock.fd);
+        c->sock.fd = -1;
+    }
+    if (err == EALREADY)
+        c->collisions++;   /* bug 5082381: EALREADY on ACL collision */
+    bool transient = err == EALREADY || err == EBUSY || err == EAGAIN || err == EHOSTDOWN;
+    if (!transient || c->attempts >= CONNECT_MAX_ATTEMPTS) {
+        connect_finish(c, -1, err);
+        return;
+    }
+    struct itimerspec its;
+    int delay = backoff_delay_ms(c->attempts - 1);
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay / 1000;
+    its.it_value.tv_nsec = (delay % 1000) * 1000000L;
+    timerfd_settime(c->timer.fd, 0, &its, NULL);
+    c->state = CONNECT_BACKOFF;
+    ALOGD("connect %s: %s, retrying in %d ms", c->address, strerror(err), delay);
+}
+
+static void connect_socket_event(bt_watch_t *watch, uint32_t events) {
+    bt_connect_t *c = (bt_connect_t *)((char *)watch - offsetof(bt_connect_t, sock));
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err) {
+        connect_retry(c, err);
+        return;
+    }
+    c->attempt_ns[c->attempts - 1] = systemTime(SYSTEM_TIME_MONOTONIC) - c->attempt_started;
+    bt_loop_remove(c->loop, &c->sock);
+    int fd = c->sock.fd;
+    c->sock.fd = -1;
+    connect_finish(c, fd, 0);
+}
+
+static void connect_timer_event(bt_watch_t *watch, uint32_t events) {
+    bt_connect_t *c = (bt_connect_t *)((char *)watch - offsetof(bt_connect_t, timer));
+    uint64_t expirations;
+    read(watch->fd, &expirations, sizeof(expirations));
+    if (c->state == CONNECT_BACKOFF)
+        connect_attempt(c);
+}
+
+static void connect_attempt(bt_connect_t *c) {
+    c->attempts++;
+    c->attempt_started = systemTime(SYSTEM_TIME_MONOTONIC);
+    c->state = CONNECT_CONNECTING;
+    c->sock.fd = create_socket(c->type, c->auth, c->encrypt, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (c->sock.fd < 0) {
+        connect_retry(c, errno ? errno : EINVAL);
+        return;
+    }
+    int ret = connect(c->sock.fd, (struct sockaddr *)&c->addr, c->addr_sz);
+    if (ret == 0) {
+        connect_socket_event(&c->sock, EPOLLOUT);
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        connect_retry(c, errno);
         return;
     }
-    //env->ReleaseStringUTFChars(address, c_address);
+    if (bt_loop_add(c->loop, &c->sock, EPOLLOUT) < 0)
+        connect_retry(c, errno);
+}
 
+// Start connecting to address (port is the RFCOMM channel or L2CAP PSM).
+// cb is called from bt_loop_run_once() once the connect completes or is
+// given up on (or right away if the first attempt fails outright); c must
+// stay valid until bt_connect_release().
+static int bt_connect_start(bt_loop_t *loop, bt_connect_t *c, int type, const char *address, int port,
+                            bool auth, bool encrypt, bt_connect_cb_t cb, void *user) {
+    bdaddr_t bdaddress;
+    memset(c, 0, sizeof(*c));
+    c->sock.fd = -1;
+    c->timer.fd = -1;
+    if (get_bdaddr(address, &bdaddress))
+        return -1;
     switch (type) {
-    case TYPE_RFCOMM:
-        struct sockaddr_rc addr_rc;
-        addr = (struct sockaddr *)&addr_rc;
-        addr_sz = sizeof(addr_rc); 
-        memset(addr, 0, addr_sz);
-        addr_rc.rc_family = AF_BLUETOOTH;
-        //addr_rc.rc_channel = env->GetIntField(obj, field_mPort);
-        memcpy(&addr_rc.rc_bdaddr, &bdaddress, sizeof(bdaddr_t)); 
+    case TYPE_RFCOMM: {
+        struct sockaddr_rc *addr_rc = (struct sockaddr_rc *)&c->addr;
+        addr_rc->rc_family = AF_BLUETOOTH;
+        addr_rc->rc_channel = port;
+        memcpy(&addr_rc->rc_bdaddr, &bdaddress, sizeof(bdaddr_t));
+        c->addr_sz = sizeof(*addr_rc);
         break;
-    case TYPE_SCO:
-        struct sockaddr_sco addr_sco;
-        addr = (struct sockaddr *)&addr_sco;
-        addr_sz = sizeof(addr_sco); 
-        memset(addr, 0, addr_sz);
-        addr_sco.sco_family = AF_BLUETOOTH;
-        memcpy(&addr_sco.sco_bdaddr, &bdaddress, sizeof(bdaddr_t)); 
+        }
+    case TYPE_SCO: {
+        struct sockaddr_sco *addr_sco = (struct sockaddr_sco *)&c->addr;
+        addr_sco->sco_family = AF_BLUETOOTH;
+        memcpy(&addr_sco->sco_bdaddr, &bdaddress, sizeof(bdaddr_t));
+        c->addr_sz = sizeof(*addr_sco);
         break;
-    case TYPE_L2CAP:
-        struct sockaddr_l2 addr_l2;
-        addr = (struct sockaddr *)&addr_l2;
-        addr_sz = sizeof(addr_l2); 
-        memset(addr, 0, addr_sz);
-        addr_l2.l2_family = AF_BLUETOOTH;
-        //addr_l2.l2_psm = env->GetIntField(obj, field_mPort);
-        memcpy(&addr_l2.l2_bdaddr, &bdaddress, sizeof(bdaddr_t)); 
+        }
+    case TYPE_L2CAP: {
+        struct sockaddr_l2 *addr_l2 = (struct sockaddr_l2 *)&c->addr;
+        addr_l2->l2_family = AF_BLUETOOTH;
+        addr_l2->l2_psm = port;
+        memcpy(&addr_l2->l2_bdaddr, &bdaddress, sizeof(bdaddr_t));
+        c->addr_sz = sizeof(*addr_l2);
         break;
+        }
     default:
+        return -1;
+    }
+    strlcpy(c->address, address, BTADDR_SIZE);
+    c->loop = loop;
+    c->type = type;
+    c->auth = auth;
+    c->encrypt = encrypt;
+    c->cb = cb;
+    c->user = user;
+    c->sock.cb = connect_socket_event;
+    c->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    c->timer.cb = connect_timer_event;
+    if (c->timer.fd < 0 || bt_loop_add(loop, &c->timer, EPOLLIN) < 0) {
+        if (c->timer.fd >= 0)
+            close(c->timer.fd);
+        c->timer.fd = -1;
+        return -1;
+    }
+    c->started = systemTime(SYSTEM_TIME_MONOTONIC);
+    connect_attempt(c);
+    return 0;
+}
+
+// Release the resources of a finished (or abandoned) connect.
+static void bt_connect_release(bt_connect_t *c) {
+    if (c->sock.fd >= 0) {
+        bt_loop_remove(c->loop, &c->sock);
+        close(c->sock.fd);
+        c->sock.fd = -1;
+    }
+    if (c->timer.fd >= 0) {
+        bt_loop_remove(c->loop, &c->timer);
+        close(c->timer.fd);
+        c->timer.fd = -1;
+    }
+}
+
+// Completion for the blocking callers below: user points at where the
+// connected fd goes, and errno is left as the connect's error.
+static void connect_store_fd(bt_connect_t *c, int fd, int err) {
+    *(int *)c->user = fd;
+    if (fd < 0)
+        errno = err;
+}
+
+// Run loop until none of the count connects in c is in flight, abort_fd
+// (if not -1) becomes readable or timeout_ms (if not -1) passes.  Returns
+// 0, or -1 with errno ECANCELED or ETIMEDOUT.
+static int bt_connect_wait(bt_loop_t *loop, bt_connect_t *c, int count, int abort_fd, int timeout_ms) {
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + ms2ns(timeout_ms);
+    for (;;) {
+        int pending = 0;
+        for (int i = 0; i < count; i++)
+            if (c[i].state == CONNECT_CONNECTING || c[i].state == CONNECT_BACKOFF)
+                pending++;
+        if (!pending)
+            return 0;
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+            if (left <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            wait_ms = (int)ns2ms(left + ms2ns(1) - 1);
+        }
+        struct pollfd fds[2];
+        fds[0].fd = loop->epfd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = abort_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, wait_ms)) < 0)
+            return -1;
+        if (fds[1].revents) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if (fds[0].revents && bt_loop_run_once(loop, 0) < 0)
+            return -1;
+    }
+}
+
+static void connectNative() {
+    int type;
+    int port;
+    bool auth;
+    bool encrypt;
+    String8 address;
+    struct asocket *s = get_socketData();
+
+    if (!s)
+        return; 
+    //type = env->GetIntField(obj, field_mType); 
+    //address = (String8) env->GetObjectField(obj, field_mAddress);
+    //port = env->GetIntField(obj, field_mPort);
+    //auth = env->GetBooleanField(obj, field_mAuth);
+    //encrypt = env->GetBooleanField(obj, field_mEncrypt); 
+
+    // Collisions (bug 5082381, EALREADY) are retried with backoff by the
+    // state machine, each on a fresh socket; the one that connects takes
+    // over s->fd, so the object keeps its fd number and abort still works.
+    bt_loop_t loop;
+    bt_connect_t c;
+    int fd = -1;
+    if (bt_loop_init(&loop) < 0)
         return;
-    } 
-connect:
-    ret = asocket_connect(s, addr, addr_sz, -1);
-    ALOGV("...connect(%d, %s) = %d (errno %d)", s->fd, TYPE_AS_STR(type), ret, errno); 
-    if (ret && errno == EALREADY && retry < 2) {
-        /* workaround for bug 5082381 (EALREADY on ACL collision):
-         * retry the connect. Unfortunately we have to create a new fd.
-         * It's not ideal to switch the fd underneath the object, but
-         * is currently safe */
-        ALOGD("Hit bug 5082381 (EALREADY on ACL collision), trying workaround");
-        usleep(100000);
-        retry++;
-        initSocketNative();
-        goto connect;
-    }
-    if (!ret && retry > 0)
-        ALOGD("...workaround ok"); 
+    if (bt_connect_start(&loop, &c, type, address.string(), port, auth, encrypt, connect_store_fd, &fd) < 0) {
+        bt_loop_destroy(&loop);
+        return;
+    }
+    int ret = bt_connect_wait(&loop, &c, 1, s->abort_fd[0], -1);
+    int err = errno;
+    bt_connect_release(&c);
+    bt_loop_destroy(&loop);
+    if (ret < 0 || fd < 0) {
+        ALOGV("...connect(%d, %s) failed (errno %d)", s->fd, TYPE_AS_STR(type), err);
+        errno = err;
+        return;
+    }
+    if (dup2(fd, s->fd) < 0)
+        err = errno;
+    close(fd);
+    ALOGV("...connect(%d, %s) = %d after %d attempt(s)", s->fd, TYPE_AS_STR(type), err ? -1 : 0, c.attempts);
+    errno = err;
+}
+
+// Connect to count devices at once, e.g. a fleet of headsets coming back
+// after a reboot, instead of one after another.  fds[i] gets the connected
+// (non-blocking) socket for addresses[i] on ports[i], or -1.  Connects
+// still running after timeout_ms are abandoned.  Returns the number that
+// connected, or -1.
+static int connectBatchNative(int type, const char **addresses, const int *ports, int count,
+                              bool auth, bool encrypt, int *fds, int timeout_ms) {
+    bt_loop_t loop;
+    if (count <= 0)
+        return 0;
+    bt_connect_t *c = (bt_connect_t *)calloc(count, sizeof(bt_connect_t));
+    if (!c)
+        return -1;
+    if (bt_loop_init(&loop) < 0) {
+        free(c);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        fds[i] = -1;
+        if (bt_connect_start(&loop, &c[i], type, addresses[i], ports[i], auth, encrypt, connect_store_fd, &fds[i]) < 0)
+            ALOGE("connect %s: can't start", addresses[i]);
+    }
+    if (bt_connect_wait(&loop, c, count, -1, timeout_ms) < 0)
+        ALOGE("batch connect: %s, abandoning the rest", strerror(errno));
+    int connected = 0;
+    for (int i = 0; i < count; i++) {
+        bt_connect_release(&c[i]);
+        if (fds[i] >= 0)
+            connected++;
+    }
+    bt_loop_destroy(&loop);
+    free(c);
+    ALOGI("batch connect: %d of %d connected", connected, count);
+    return connected;
 }
 
 /* Returns errno instead of throwing, so java can check errno */
@@ -564,6 +1003,243 @@ static int writeNative(char * jb, int offset, int length) {
     return (int)total;
 }
 
+/*
+ * Bulk transfer path (OBEX pushes and the like).  Data moves with
+ * readv()/writev() straight from the caller's buffers, or with sendfile()
+ * and splice() from files and pipes on stream sockets.  The send buffer
+ * is resized to hold about SNDBUF_TARGET_MS worth of the throughput
+ * actually observed instead of a fixed RFCOMM_SO_SNDBUF.  On packet
+ * sockets every write is one packet, so none is larger than the MTU.
+ */
+#define SNDBUF_MIN (16 * 1024)
+#define SNDBUF_MAX (512 * 1024)
+#define SNDBUF_TARGET_MS 200
+#define SNDBUF_WINDOW_MS 500
+#define BULK_CHUNK (64 * 1024)
+
+typedef struct {
+    struct asocket *s;
+    int type;
+    size_t mtu;                // largest single write
+    int sndbuf;
+    nsecs_t window_start;
+    size_t window_bytes;
+    uint64_t total_bytes;
+} bt_bulk_t;
+
+// The outgoing MTU of an L2CAP or SCO socket.  RFCOMM is a stream that the
+// kernel cuts into frames of the negotiated size itself, and exposes no
+// MTU, so it gets BULK_CHUNK.
+static size_t bulk_mtu(int fd, int type) {
+    switch (type) {
+    case TYPE_L2CAP: {
+        struct l2cap_options opts;
+        socklen_t len = sizeof(opts);
+        memset(&opts, 0, sizeof(opts));
+        if (getsockopt(fd, SOL_L2CAP, L2CAP_OPTIONS, &opts, &len) == 0 && opts.omtu)
+            return opts.omtu;
+        break;
+        }
+    case TYPE_SCO: {
+        struct sco_options opts;
+        socklen_t len = sizeof(opts);
+        memset(&opts, 0, sizeof(opts));
+        if (getsockopt(fd, SOL_SCO, SCO_OPTIONS, &opts, &len) == 0 && opts.mtu)
+            return opts.mtu;
+        break;
+        }
+    }
+    return BULK_CHUNK;
+}
+
+static void bt_bulk_init(bt_bulk_t *b, struct asocket *s, int type) {
+    memset(b, 0, sizeof(*b));
+    b->s = s;
+    b->type = type;
+    b->mtu = bulk_mtu(s->fd, type);
+    b->sndbuf = RFCOMM_SO_SNDBUF;
+    b->window_start = systemTime(SYSTEM_TIME_MONOTONIC);
+}
+
+// Wait for fd (the socket, or the fd being sent from) the way
+// asocket_read/write do, so abortNative() still interrupts a bulk transfer.
+static int bulk_wait(bt_bulk_t *b, int fd, short events) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = events;
+    fds[0].revents = 0;
+    fds[1].fd = b->s->abort_fd[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    int ret = TEMP_FAILURE_RETRY(poll(fds, 2, -1));
+    if (ret < 0)
+        return -1;
+    if (fds[1].revents) {
+        errno = ECANCELED;
+        return -1;
+    }
+    if (fds[0].revents & (POLLERR | POLLNVAL)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Account for bytes sent and, once per window, size SO_SNDBUF to the
+// rate just seen.
+static void bulk_account(bt_bulk_t *b, size_t bytes) {
+    b->total_bytes += bytes;
+    b->window_bytes += bytes;
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t elapsed = now - b->window_start;
+    if (elapsed < ms2ns(SNDBUF_WINDOW_MS))
+        return;
+    int64_t rate = (int64_t)b->window_bytes * 1000 / ns2ms(elapsed);   // bytes per second
+    int want = (int)(rate * SNDBUF_TARGET_MS / 1000);
+    if (want < SNDBUF_MIN)
+        want = SNDBUF_MIN;
+    if (want > SNDBUF_MAX)
+        want = SNDBUF_MAX;
+    // Only bother the kernel for changes of more than a quarter
+    if (want > b->sndbuf + b->sndbuf / 4 || want < b->sndbuf - b->sndbuf / 4) {
+        if (setsockopt(b->s->fd, SOL_SOCKET, SO_SNDBUF, &want, sizeof(want)) == 0) {
+            ALOGV("...fd %d: %lld B/s, SO_SNDBUF %d -> %d", b->s->fd, (long long)rate, b->sndbuf, want);
+            b->sndbuf = want;
+        }
+    }
+    b->window_start = now;
+    b->window_bytes = 0;
+}
+
+// Scatter read; returns bytes read, 0 on EOF, -1 on error.
+static ssize_t bulkReadvNative(bt_bulk_t *b, const struct iovec *iov, int iovcnt) {
+    for (;;) {
+        if (bulk_wait(b, b->s->fd, POLLIN) < 0)
+            return -1;
+        ssize_t ret = TEMP_FAILURE_RETRY(readv(b->s->fd, iov, iovcnt));
+        if (ret >= 0 || errno != EAGAIN)
+            return ret;
+    }
+}
+
+// Gather write of every byte in iov; returns the total or -1.  iov is
+// advanced in place as it is consumed.  On a packet socket iov is one
+// packet and must fit in b->mtu.
+static ssize_t bulkWritevNative(bt_bulk_t *b, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        if (bulk_wait(b, b->s->fd, POLLOUT) < 0)
+            return -1;
+        ssize_t ret = TEMP_FAILURE_RETRY(writev(b->s->fd, iov, iovcnt));
+        if (ret < 0) {
+            if (errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        total += ret;
+        bulk_account(b, ret);
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return total;
+}
+
+// Send count bytes from in_fd (a file at *offset, or a pipe, which may be
+// non-blocking).  RFCOMM streams use sendfile() or splice() so the data
+// never enters user space; packet sockets keep their message boundaries
+// with read/write, one packet of up to b->mtu per read.
+static ssize_t bulkSendFromFdNative(bt_bulk_t *b, int in_fd, off_t *offset, size_t count) {
+    struct stat st;
+    if (fstat(in_fd, &st) < 0)
+        return -1;
+    bool stream = b->type == TYPE_RFCOMM;
+    ssize_t total = 0;
+    bool failed = true;
+    char *buf = NULL;
+    while ((size_t)total < count) {
+        size_t chunk = count - total < b->mtu ? count - total : b->mtu;
+        if (bulk_wait(b, b->s->fd, POLLOUT) < 0)
+            goto done;
+        ssize_t ret;
+        if (stream && S_ISREG(st.st_mode)) {
+            ret = sendfile(b->s->fd, in_fd, offset, chunk);
+        } else if (stream && S_ISFIFO(st.st_mode)) {
+            ret = splice(in_fd, NULL, b->s->fd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            if (!buf && !(buf = (char *)malloc(b->mtu)))
+                goto done;
+            ret = offset ? pread(in_fd, buf, chunk, *offset) : read(in_fd, buf, chunk);
+            if (ret > 0) {
+                struct iovec iov;
+                iov.iov_base = buf;
+                iov.iov_len = ret;
+                if (bulkWritevNative(b, &iov, 1) < 0)
+                    goto done;
+                if (offset)
+                    *offset += ret;
+                total += ret;
+                continue;
+            }
+        }
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                // Either side may be short.  A full socket is waited for at
+                // the top of the loop; an empty pipe must be waited for here
+                // or the loop would spin.
+                if (!S_ISREG(st.st_mode) && bulk_wait(b, in_fd, POLLIN) < 0)
+                    goto done;
+                continue;
+            }
+            ALOGE("bulk send on fd %d failed: %s (%d)", b->s->fd, strerror(errno), errno);
+            goto done;
+        }
+        if (ret == 0)
+            break;
+        total += ret;
+        bulk_account(b, ret);
+    }
+    failed = false;
+done:
+    free(buf);
+    return failed && total == 0 ? -1 : total;
+}
+
+// Push a whole file, OBEX style, through the bulk path.  Returns the
+// number of bytes sent, or -1.
+static int64_t sendFileNative(const char *path) {
+    int type;
+    struct stat st;
+    struct asocket *s = get_socketData();
+    if (!s)
+        return -1;
+    //type = env->GetIntField(obj, field_mType);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("Can't open %s: %s (%d)", path, strerror(errno), errno);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    bt_bulk_t b;
+    bt_bulk_init(&b, s, type);
+    off_t offset = 0;
+    ssize_t sent = bulkSendFromFdNative(&b, fd, &offset, st.st_size);
+    close(fd);
+    ALOGV("...sent %lld of %lld bytes of %s on fd %d", (long long)sent, (long long)st.st_size, path, s->fd);
+    return sent;
+}
+
 static void abortNative() {
     struct asocket *s = get_socketData();
     if (!s)
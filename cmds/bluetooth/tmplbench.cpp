@@ -0,0 +1,148 @@
+/*
+** Copyright 2013, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * tmplbench: benchmark for the method call templates in btcommon.cpp,
+ * run against mockbluez.  The devices being talked to move on in phases,
+ * as they do when discovery keeps finding new ones, and each phase calls
+ * GetProperties round its own working set.  Each phase is timed twice:
+ * building every call with dbus_message_new_method_call(), and through the
+ * template cache.  Reports the cost of building a call, of a round trip,
+ * and the cache hit rate; with more devices over the run than the cache
+ * holds, later phases only hit if stale templates are evicted.
+ *
+ *   mockbluez -d 4096 &
+ *   tmplbench [-p phases] [-w working_set] [-n calls_per_phase]
+ */
+
+#include "btcommon.cpp"
+
+#include <utils/Timers.h>
+
+namespace android {
+DBusConnection *global_conn;
+}
+
+using namespace android;
+
+#define DEVICE_IFACE "org.bluez.Device"
+#define BUILDS_PER_CALL 20
+
+static char adapterPath[128];
+
+static void device_path(int device, char *buf, size_t len) {
+    // mockbluez's address scheme for adapter 0
+    snprintf(buf, len, "%s/dev_00_1A_00_%02X_%02X_%02X", adapterPath,
+            (device >> 16) & 0xff, (device >> 8) & 0xff, device & 0xff);
+}
+
+static DBusMessage *build(bool cached, const char *path) {
+    return cached ? new_method_call(path, DEVICE_IFACE, "GetProperties")
+                  : dbus_message_new_method_call(BLUEZ_DBUS_BASE_IFC, path, DEVICE_IFACE, "GetProperties");
+}
+
+static bool run(bool cached, int phase, int working, int calls) {
+    char path[128];
+    msg_template_stats_t before, after;
+    dbus_template_stats(&before);
+
+    // building alone, which is what the templates are for
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int i = 0; i < calls * BUILDS_PER_CALL; i++) {
+        device_path(phase * working + i % working, path, sizeof(path));
+        DBusMessage *msg = build(cached, path);
+        if (!msg)
+            return false;
+        dbus_message_unref(msg);
+    }
+    nsecs_t built = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    start = systemTime(SYSTEM_TIME_MONOTONIC);
+    int failed = 0;
+    for (int i = 0; i < calls; i++) {
+        device_path(phase * working + i % working, path, sizeof(path));
+        DBusMessage *msg = build(cached, path);
+        DBusMessage *reply = msg ? dbus_connection_send_with_reply_and_block(global_conn, msg, -1, NULL) : NULL;
+        if (msg)
+            dbus_message_unref(msg);
+        if (!reply || dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+            failed++;
+        if (reply)
+            dbus_message_unref(reply);
+    }
+    nsecs_t elapsed = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+
+    dbus_template_stats(&after);
+    uint64_t hits = after.hits - before.hits, misses = after.misses - before.misses;
+    printf("phase %2d %-9s build %5lld ns, round trip %6.1f us", phase, cached ? "templates" : "direct",
+            (long long)(built / (calls * BUILDS_PER_CALL)), elapsed / 1000.0 / calls);
+    if (cached)
+        printf(", hits %5.1f%%, %d held, %llu evicted", 100.0 * hits / (hits + misses ? hits + misses : 1),
+                after.count, (unsigned long long)(after.evictions - before.evictions));
+    printf("%s\n", failed ? " FAILED" : "");
+    return !failed;
+}
+
+int main(int argc, char **argv) {
+    int phases = 8, working = 64, calls = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:w:n:")) != -1) {
+        switch (opt) {
+        case 'p':
+            phases = atoi(optarg);
+            break;
+        case 'w':
+            working = atoi(optarg);
+            break;
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p phases] [-w working_set] [-n calls_per_phase]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (phases <= 0 || working <= 0 || calls <= 0) {
+        fprintf(stderr, "tmplbench: need phases, working set and calls > 0\n");
+        return 1;
+    }
+
+    DBusError err;
+    dbus_error_init(&err);
+    global_conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    if (!global_conn) {
+        fprintf(stderr, "tmplbench: can't get onto the system bus: %s\n", err.message);
+        return 1;
+    }
+    DBusMessage *reply = dbus_func_args("/", "org.bluez.Manager", "DefaultAdapter", DBUS_TYPE_INVALID);
+    const char *c_path;
+    if (!reply || !dbus_message_get_args(reply, NULL, DBUS_TYPE_OBJECT_PATH, &c_path, DBUS_TYPE_INVALID)) {
+        fprintf(stderr, "tmplbench: no default adapter; is mockbluez running?\n");
+        return 1;
+    }
+    strlcpy(adapterPath, c_path, sizeof(adapterPath));
+    dbus_message_unref(reply);
+    printf("%s: %d phases of %d devices, %d calls each; cache holds %d\n", adapterPath, phases, working,
+            calls, MSG_TEMPLATE_MAX);
+
+    bool ok = true;
+    for (int phase = 0; phase < phases; phase++) {
+        ok = run(false, phase, working, calls) && ok;
+        ok = run(true, phase, working, calls) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -3,7 +3,9 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:=         \
-        cameracapture.cpp
+        cameracapture.cpp \
+        HttpUploader.cpp \
+        SinkMux.cpp
 
 LOCAL_SHARED_LIBRARIES := \
 	libstagefright liblog libutils libbinder libstagefright_foundation \
@@ -27,3 +29,12 @@ LOCAL_MODULE:= cameracapture
 include $(BUILD_EXECUTABLE)
 
 ################################################################################
+
+# Local HTTP server to post to, for testing cameracapture -a
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= httpsink.cpp
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE:= httpsink
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HttpUploader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+#ifndef SIOCOUTQ
+#define SIOCOUTQ TIOCOUTQ
+#endif
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+// Largest chunk put together at once: everything buffered up to this goes
+// out as one chunk, header and trailer included, in one call
+#define MAX_CHUNK (256 * 1024)
+// Keep only this much unsent in the kernel; the rest waits in our ring,
+// where it can be measured
+#define NOTSENT_LOWAT (128 * 1024)
+#define PIPE_SIZE (1024 * 1024)
+
+HttpUploader::HttpUploader(int sock, const char *hostname, const char *path, size_t ringBytes)
+    : mSock(sock),
+      mRing((uint8_t *)malloc(ringBytes)),
+      mRingSize(ringBytes),
+      mHead(0),
+      mTail(0),
+      mChunkHeaderLen(0),
+      mChunkHeaderOff(0),
+      mChunkLeft(0),
+      mChunkTrailerOff(0),
+      mInChunk(false),
+      mLastSent(false),
+      mStallStart(0),
+      mFullStart(0),
+      mStarted(false),
+      mDone(false),
+      mError(0) {
+    mPipe[0] = mPipe[1] = -1;
+    mWake[0] = mWake[1] = -1;
+    snprintf(mHost, sizeof(mHost), "%s", hostname);
+    snprintf(mPath, sizeof(mPath), "%s", path);
+    memset(&mStats, 0, sizeof(mStats));
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+}
+
+HttpUploader::~HttpUploader() {
+    if (mStarted) {
+        write(mWake[1], "x", 1);
+        pthread_join(mThread, NULL);
+    }
+    // the write end of the pipe is the caller's
+    if (mPipe[0] >= 0)
+        close(mPipe[0]);
+    for (int i = 0; i < 2; i++) {
+        if (mWake[i] >= 0)
+            close(mWake[i]);
+    }
+    if (mSock >= 0)
+        close(mSock);
+    free(mRing);
+    pthread_mutex_destroy(&mLock);
+    pthread_cond_destroy(&mCond);
+}
+
+int HttpUploader::start() {
+    char line[1024];
+    int one = 1, lowat = NOTSENT_LOWAT;
+
+    if (mSock < 0 || !mRing)
+        return -1;
+    int nchars = snprintf(line, sizeof(line), "POST %s HTTP/1.1\r\n", mPath);
+    nchars += snprintf(line+nchars, sizeof(line)-nchars, "Host: %s\r\n", mHost);
+    nchars += snprintf(line+nchars, sizeof(line)-nchars, "User-Agent: nrcc-webcam\r\n");
+    nchars += snprintf(line+nchars, sizeof(line)-nchars, "Content-Type: video/avc\r\n");
+    nchars += snprintf(line+nchars, sizeof(line)-nchars, "Transfer-Encoding: chunked\r\n");
+    nchars += snprintf(line+nchars, sizeof(line)-nchars, "\r\n");
+    for (int off = 0; off < nchars; ) {
+        int n = write(mSock, line + off, nchars - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "HttpUploader: can't send headers: errno=%d\n", errno);
+            return -1;
+        }
+        off += n;
+    }
+
+    // small frames go out at once; the unsent backlog stays in the ring
+    setsockopt(mSock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (setsockopt(mSock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0)
+        fprintf(stderr, "HttpUploader: no TCP_NOTSENT_LOWAT (errno=%d)\n", errno);
+    fcntl(mSock, F_SETFL, fcntl(mSock, F_GETFL) | O_NONBLOCK);
+
+    if (pipe(mPipe) < 0 || pipe(mWake) < 0) {
+        fprintf(stderr, "HttpUploader: pipe failed: errno=%d\n", errno);
+        return -1;
+    }
+    // the recorder writes blocking; we drain without blocking
+    fcntl(mPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(mPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(mPipe[0], F_SETPIPE_SZ, PIPE_SIZE);
+    fcntl(mWake[0], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&mThread, NULL, threadEntry, this)) {
+        fprintf(stderr, "HttpUploader: can't start thread\n");
+        close(mPipe[1]);
+        return -1;
+    }
+    mStarted = true;
+    return mPipe[1];
+}
+
+void *HttpUploader::threadEntry(void *me) {
+    ((HttpUploader *)me)->threadLoop();
+    return NULL;
+}
+
+// Read what the pipe has into the ring.  Returns false at end of stream.
+bool HttpUploader::fillRing() {
+    for (;;) {
+        size_t space = mRingSize - (size_t)(mHead - mTail);
+        if (!space)
+            return true;
+        size_t off = mHead % mRingSize;
+        size_t first = mRingSize - off;
+        if (first > space)
+            first = space;
+        struct iovec iov[2] = { { mRing + off, first }, { mRing, space - first } };
+        ssize_t n = readv(mPipe[0], iov, iov[1].iov_len ? 2 : 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (n < 0)
+            mError = -errno;
+        if (n <= 0)
+            return false;
+        mHead += n;
+        pthread_mutex_lock(&mLock);
+        mStats.bytesIn += n;
+        mStats.buffered = mHead - mTail;
+        if (mStats.buffered > mStats.maxBuffered)
+            mStats.maxBuffered = mStats.buffered;
+        pthread_mutex_unlock(&mLock);
+    }
+}
+
+// Send as much of the ring as the socket takes, as chunks; at eof, finish
+// with the terminating chunk.  Returns false on a socket error.
+bool HttpUploader::sendRing(bool eof) {
+    static const char crlf[] = "\r\n";
+    for (;;) {
+        if (!mInChunk) {
+            size_t avail = mHead - mTail;
+            if (!avail && (!eof || mLastSent))
+                return true;
+            mChunkLeft = avail < MAX_CHUNK ? avail : MAX_CHUNK;
+            if (mChunkLeft)
+                mChunkHeaderLen = snprintf(mChunkHeader, sizeof(mChunkHeader), "%zx\r\n", mChunkLeft);
+            else
+                mChunkHeaderLen = snprintf(mChunkHeader, sizeof(mChunkHeader), "0\r\n\r\n");
+            mChunkHeaderOff = 0;
+            mChunkTrailerOff = 0;
+            mInChunk = true;
+        }
+        bool last = mChunkHeaderLen == 5 && !memcmp(mChunkHeader, "0\r\n\r\n", 5);
+        size_t trailerLen = last ? 0 : 2;
+
+        struct iovec iov[4];
+        int cnt = 0;
+        size_t offered = 0;
+        if (mChunkHeaderOff < mChunkHeaderLen) {
+            iov[cnt].iov_base = mChunkHeader + mChunkHeaderOff;
+            iov[cnt++].iov_len = mChunkHeaderLen - mChunkHeaderOff;
+        }
+        if (mChunkLeft) {
+            size_t off = mTail % mRingSize;
+            size_t first = mRingSize - off;
+            if (first > mChunkLeft)
+                first = mChunkLeft;
+            iov[cnt].iov_base = mRing + off;
+            iov[cnt++].iov_len = first;
+            if (mChunkLeft > first) {
+                iov[cnt].iov_base = mRing;
+                iov[cnt++].iov_len = mChunkLeft - first;
+            }
+        }
+        if (mChunkTrailerOff < trailerLen) {
+            iov[cnt].iov_base = (void *)(crlf + mChunkTrailerOff);
+            iov[cnt++].iov_len = trailerLen - mChunkTrailerOff;
+        }
+        for (int i = 0; i < cnt; i++)
+            offered += iov[i].iov_len;
+
+        // sendmsg rather than writev, so a closed peer is EPIPE, not SIGPIPE
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t n = sendmsg(mSock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "HttpUploader: send failed: errno=%d\n", errno);
+            mError = -errno;
+            return false;
+        }
+        if (n < 0)
+            n = 0;
+        // how much of what we sent the network is still sitting on
+        int unacked = -1;
+        ioctl(mSock, SIOCOUTQ, &unacked);
+
+        size_t left = n, body = 0;
+        size_t h = mChunkHeaderLen - mChunkHeaderOff;
+        h = left < h ? left : h;
+        mChunkHeaderOff += h;
+        left -= h;
+        body = left < mChunkLeft ? left : mChunkLeft;
+        mChunkLeft -= body;
+        mTail += body;
+        left -= body;
+        mChunkTrailerOff += left;
+
+        bool complete = mChunkHeaderOff == mChunkHeaderLen && !mChunkLeft && mChunkTrailerOff == trailerLen;
+        pthread_mutex_lock(&mLock);
+        if (n) {
+            mStats.writes++;
+            mStats.bytesSent += body;
+            mStats.buffered = mHead - mTail;
+            if (mStallStart) {
+                mStats.stallTime += now - mStallStart;
+                mStallStart = 0;
+            }
+        }
+        if (unacked >= 0) {
+            mStats.unacked = unacked;
+            if (mStats.unacked > mStats.maxUnacked)
+                mStats.maxUnacked = mStats.unacked;
+        }
+        if (complete && !last)
+            mStats.chunks++;
+        if ((size_t)n < offered && !mStallStart) {
+            // the socket is full: we are waiting on the network now
+            mStats.stalls++;
+            mStallStart = now;
+        }
+        pthread_mutex_unlock(&mLock);
+        if (complete) {
+            mInChunk = false;
+            if (last) {
+                mLastSent = true;
+                return true;
+            }
+        }
+        if ((size_t)n < offered)
+            return true;
+    }
+}
+
+void HttpUploader::threadLoop() {
+    bool eof = false;
+    for (;;) {
+        bool room = mHead - mTail < mRingSize;
+        bool pending = mHead != mTail || mInChunk || (eof && !mLastSent);
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (!eof && !room && !mFullStart)
+            mFullStart = now;
+        if (room && mFullStart) {
+            pthread_mutex_lock(&mLock);
+            mStats.fullTime += now - mFullStart;
+            pthread_mutex_unlock(&mLock);
+            mFullStart = 0;
+        }
+        struct pollfd fds[3];
+        fds[0].fd = mWake[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = pending ? mSock : -1;
+        fds[1].events = POLLOUT;
+        fds[2].fd = !eof && room ? mPipe[0] : -1;
+        fds[2].events = POLLIN;
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            mError = -errno;
+            break;
+        }
+        if (fds[0].revents) {
+            mError = -ECANCELED;
+            break;
+        }
+        if (fds[2].revents && !fillRing()) {
+            eof = true;
+            if (mError)
+                break;
+        }
+        if ((fds[1].revents || eof) && !sendRing(eof))
+            break;
+        if (eof && mLastSent)
+            break;
+    }
+    if (mError && mPipe[0] >= 0) {
+        // let the recorder see EPIPE rather than block on a full pipe
+        close(mPipe[0]);
+        mPipe[0] = -1;
+    }
+    pthread_mutex_lock(&mLock);
+    mDone = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mLock);
+}
+
+// Read the status line, leaving the socket for the server to close
+void HttpUploader::readResponse(nsecs_t deadline) {
+    char buf[1024];
+    size_t len = 0;
+    while (len < sizeof(buf) - 1) {
+        nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+        struct pollfd pfd = { mSock, POLLIN, 0 };
+        if (left <= 0 || poll(&pfd, 1, ns2ms(left) + 1) <= 0)
+            break;
+        ssize_t n = read(mSock, buf + len, sizeof(buf) - 1 - len);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = 0;
+        if (strstr(buf, "\r\n\r\n"))
+            break;
+    }
+    buf[len] = 0;
+    int status = 0;
+    if (sscanf(buf, "HTTP/%*d.%*d %d", &status) == 1) {
+        pthread_mutex_lock(&mLock);
+        mStats.httpStatus = status;
+        pthread_mutex_unlock(&mLock);
+    }
+}
+
+int HttpUploader::finish(nsecs_t timeout) {
+    if (!mStarted)
+        return -EINVAL;
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + timeout;
+    pthread_mutex_lock(&mLock);
+    while (!mDone) {
+        nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+        if (left <= 0)
+            break;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        nsecs_t abs = (nsecs_t)ts.tv_sec * 1000000000LL + ts.tv_nsec + left;
+        ts.tv_sec = abs / 1000000000LL;
+        ts.tv_nsec = abs % 1000000000LL;
+        pthread_cond_timedwait(&mCond, &mLock, &ts);
+    }
+    bool done = mDone;
+    pthread_mutex_unlock(&mLock);
+    if (!done) {
+        write(mWake[1], "x", 1);
+        mError = -ETIMEDOUT;
+    }
+    pthread_join(mThread, NULL);
+    mStarted = false;
+    if (mStallStart) {
+        mStats.stallTime += systemTime(SYSTEM_TIME_MONOTONIC) - mStallStart;
+        mStallStart = 0;
+    }
+    if (!mError)
+        readResponse(deadline);
+    return mError;
+}
+
+void HttpUploader::getStats(Stats *stats) {
+    pthread_mutex_lock(&mLock);
+    *stats = mStats;
+    pthread_mutex_unlock(&mLock);
+}
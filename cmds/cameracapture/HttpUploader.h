@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAMERACAPTURE_HTTP_UPLOADER_H
+#define CAMERACAPTURE_HTTP_UPLOADER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <utils/Timers.h>
+
+/*
+ * Streams whatever is written into a pipe to an HTTP server as a chunked
+ * POST.  The recorder writes into the pipe; a writer thread drains it into
+ * a large ring and sends from the ring, so a network stall only holds the
+ * recorder back once the ring is full.
+ */
+class HttpUploader {
+public:
+    struct Stats {
+        uint64_t bytesIn;          // read from the pipe
+        uint64_t bytesSent;        // body bytes on the socket, framing excluded
+        uint64_t chunks;
+        uint64_t writes;           // gathered sends that moved data
+        size_t buffered;           // in the ring now
+        size_t maxBuffered;
+        size_t unacked;            // in the socket, not yet acknowledged (SIOCOUTQ)
+        size_t maxUnacked;
+        uint32_t stalls;           // times the socket stopped taking data
+        nsecs_t stallTime;         // data waiting, socket not writable
+        nsecs_t fullTime;          // ring full, recorder held back
+        int httpStatus;            // from the response, 0 until finish()
+    };
+
+    // sock is a connected TCP socket, which the uploader takes over
+    HttpUploader(int sock, const char *hostname, const char *path, size_t ringBytes);
+    ~HttpUploader();
+
+    // Send the request headers and start the writer thread.  Returns the
+    // fd for the recorder to write to, or -1.  The caller closes it when
+    // the recording is over; that is what ends the upload.
+    int start();
+
+    // Wait for the pipe to close and the last chunk to go out, then read
+    // the response.  Returns 0, or -errno (-ETIMEDOUT at the deadline).
+    int finish(nsecs_t timeout);
+
+    void getStats(Stats *stats);
+
+private:
+    static void *threadEntry(void *me);
+    void threadLoop();
+    bool fillRing();
+    bool sendRing(bool eof);
+    void readResponse(nsecs_t deadline);
+
+    int mSock;
+    int mPipe[2];
+    int mWake[2];                  // tells the thread to give up
+    char mHost[256];
+    char mPath[256];
+
+    uint8_t *mRing;
+    size_t mRingSize;
+    uint64_t mHead;                // free-running write position
+    uint64_t mTail;                // free-running send position
+
+    // the chunk being sent: header, mChunkLeft body bytes, then CRLF
+    char mChunkHeader[24];
+    size_t mChunkHeaderLen;
+    size_t mChunkHeaderOff;
+    size_t mChunkLeft;
+    size_t mChunkTrailerOff;
+    bool mInChunk;
+    bool mLastSent;                // the terminating 0-length chunk
+
+    nsecs_t mStallStart;
+    nsecs_t mFullStart;
+    bool mStarted;
+    bool mDone;
+    int mError;
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    Stats mStats;
+};
+
+#endif // CAMERACAPTURE_HTTP_UPLOADER_H
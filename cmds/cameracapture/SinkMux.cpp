@@ -0,0 +1,583 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SinkMux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+// Most taken from the recorder per round; also the least backlog a sink gets
+#define MUX_ROUND (256 * 1024)
+// The recorder's pipe and the sink pipes are the same size, so an empty
+// sink pipe always takes a whole round
+#define PIPE_SIZE (1024 * 1024)
+// How often a followed file is checked for more when the follower has
+// caught up with the recorder and can't have inotify tell it
+#define FOLLOW_POLL_MS 20
+
+SinkMux::SinkMux()
+    : mSinkCount(0),
+      mNull(-1),
+      mScratch(NULL),
+      mStarted(false),
+      mDone(false),
+      mFollowFd(-1),
+      mFollowOut(-1),
+      mFollowing(false),
+      mFollowEnd(false),
+      mBlockedSince(0),
+      mBlockedBy(-1) {
+    mPipe[0] = mPipe[1] = -1;
+    mWake[0] = mWake[1] = -1;
+    mFollowWake[0] = mFollowWake[1] = -1;
+    memset(mSinks, 0, sizeof(mSinks));
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+}
+
+SinkMux::~SinkMux() {
+    if (mStarted) {
+        write(mWake[1], "x", 1);
+        pthread_join(mThread, NULL);
+    }
+    if (mFollowing) {
+        // the thread has closed the pipe, so the follower can't block on it
+        pthread_mutex_lock(&mLock);
+        mFollowEnd = true;
+        pthread_mutex_unlock(&mLock);
+        write(mFollowWake[1], "x", 1);
+        pthread_join(mFollower, NULL);
+    }
+    if (mFollowFd >= 0)
+        close(mFollowFd);
+    for (int i = 0; i < 2; i++) {
+        if (mFollowWake[i] >= 0)
+            close(mFollowWake[i]);
+    }
+    for (int i = 0; i < mSinkCount; i++) {
+        Sink *sink = &mSinks[i];
+        if (!sink->dead)
+            detach(sink, NULL);
+        free(sink->backlog);
+        free(sink->ring);
+    }
+    if (mPipe[0] >= 0)
+        close(mPipe[0]);
+    for (int i = 0; i < 2; i++) {
+        if (mWake[i] >= 0)
+            close(mWake[i]);
+    }
+    if (mNull >= 0)
+        close(mNull);
+    free(mScratch);
+    pthread_mutex_destroy(&mLock);
+    pthread_cond_destroy(&mCond);
+}
+
+int SinkMux::addSink(Type type, const char *name, int fd, Policy policy, size_t bytes) {
+    if (mStarted || mSinkCount == MAX_SINKS || (type == SINK_PIPE && fd < 0))
+        return -1;
+    Sink *sink = &mSinks[mSinkCount];
+    memset(sink, 0, sizeof(*sink));
+    sink->type = type;
+    snprintf(sink->name, sizeof(sink->name), "%s", name);
+    sink->policy = policy;
+    sink->in = sink->out = -1;
+    if (type == SINK_PIPE) {
+        sink->out = fd;
+    } else {
+        int fds[2];
+        if (pipe(fds) < 0) {
+            fprintf(stderr, "SinkMux: pipe failed: errno=%d\n", errno);
+            return -1;
+        }
+        sink->in = fds[0];
+        sink->out = fds[1];
+        fcntl(sink->in, F_SETFL, O_NONBLOCK);
+    }
+    fcntl(sink->out, F_SETFL, fcntl(sink->out, F_GETFL) | O_NONBLOCK);
+    fcntl(sink->out, F_SETPIPE_SZ, PIPE_SIZE);
+    if (type == SINK_RING) {
+        sink->ring = bytes ? (uint8_t *)malloc(bytes) : NULL;
+        if (!sink->ring) {
+            fprintf(stderr, "SinkMux: %s: can't have a ring of %zu bytes\n", name, bytes);
+            close(sink->in);
+            close(sink->out);
+            return -1;
+        }
+        sink->ringSize = bytes;
+        bytes = 0;
+    } else if (bytes < MUX_ROUND) {
+        bytes = MUX_ROUND;
+    }
+    // a ring sink is drained every round, so it never needs a backlog
+    sink->backlogSize = type == SINK_RING ? MUX_ROUND : bytes;
+    sink->backlog = (uint8_t *)malloc(sink->backlogSize);
+    return mSinkCount++;
+}
+
+int SinkMux::addPipe(const char *name, int fd, Policy policy, size_t backlogBytes) {
+    return addSink(SINK_PIPE, name, fd, policy, backlogBytes);
+}
+
+int SinkMux::addRing(const char *name, size_t ringBytes) {
+    return addSink(SINK_RING, name, -1, DROP, ringBytes);
+}
+
+int SinkMux::start() {
+    mScratch = (uint8_t *)malloc(MUX_ROUND);
+    // the zero-copy way of consuming a round once every sink has it
+    mNull = open("/dev/null", O_WRONLY);
+    if (!mScratch || pipe(mPipe) < 0 || pipe(mWake) < 0) {
+        fprintf(stderr, "SinkMux: can't set up: errno=%d\n", errno);
+        return -1;
+    }
+    fcntl(mPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(mPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(mPipe[0], F_SETPIPE_SZ, PIPE_SIZE);
+    fcntl(mWake[0], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&mThread, NULL, threadEntry, this)) {
+        fprintf(stderr, "SinkMux: can't start thread\n");
+        close(mPipe[1]);
+        return -1;
+    }
+    mStarted = true;
+    return mPipe[1];
+}
+
+int SinkMux::follow(int fd) {
+    if (fd < 0)
+        return -1;
+    mFollowFd = fd;
+    if (pipe(mFollowWake) < 0) {
+        fprintf(stderr, "SinkMux: can't set up the follower: errno=%d\n", errno);
+        return -1;
+    }
+    mFollowOut = start();
+    if (mFollowOut < 0)
+        return -1;
+    if (pthread_create(&mFollower, NULL, followerEntry, this)) {
+        fprintf(stderr, "SinkMux: can't start follower\n");
+        // the thread sees the end of the stream and winds up
+        close(mFollowOut);
+        mFollowOut = -1;
+        return -1;
+    }
+    mFollowing = true;
+    return 0;
+}
+
+void *SinkMux::followerEntry(void *me) {
+    ((SinkMux *)me)->followLoop();
+    return NULL;
+}
+
+// Splice the recorder's file into the pipe as it grows, at our own offset
+// so the recorder's seeks don't matter.  Between writes the follower
+// sleeps on inotify.  Once finish() says the file is complete, splice what
+// is left and close the pipe, which ends the stream.
+void SinkMux::followLoop() {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", mFollowFd);
+    int notify = inotify_init();
+    if (notify >= 0 && inotify_add_watch(notify, path, IN_MODIFY) < 0) {
+        close(notify);
+        notify = -1;
+    }
+    if (notify >= 0)
+        fcntl(notify, F_SETFL, O_NONBLOCK);
+    loff_t off = 0;
+    bool end = false;
+    for (;;) {
+        ssize_t n = splice(mFollowFd, &off, mFollowOut, NULL, MUX_ROUND, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            // EPIPE is the thread having stopped reading
+            if (errno != EPIPE)
+                fprintf(stderr, "SinkMux: can't splice the followed file: errno=%d\n", errno);
+            break;
+        }
+        if (n)
+            continue;
+        if (end)
+            break;
+        // look again after seeing the end, for what came just before it
+        pthread_mutex_lock(&mLock);
+        end = mFollowEnd;
+        pthread_mutex_unlock(&mLock);
+        if (end)
+            continue;
+        struct pollfd fds[2] = {
+            { mFollowWake[0], POLLIN, 0 },
+            { notify, POLLIN, 0 }
+        };
+        if (poll(fds, 2, notify >= 0 ? -1 : FOLLOW_POLL_MS) > 0 && fds[1].revents) {
+            char events[1024];
+            while (read(notify, events, sizeof(events)) > 0)
+                ;
+        }
+    }
+    if (notify >= 0)
+        close(notify);
+    close(mFollowOut);
+    mFollowOut = -1;
+}
+
+void *SinkMux::threadEntry(void *me) {
+    ((SinkMux *)me)->threadLoop();
+    return NULL;
+}
+
+void SinkMux::detach(Sink *sink, const char *why) {
+    if (why)
+        fprintf(stderr, "SinkMux: %s: %s, detached\n", sink->name, why);
+    pthread_mutex_lock(&mLock);
+    sink->dead = true;
+    sink->stats.detached = why != NULL;
+    sink->stats.dropped += sink->backlogLen;
+    sink->backlogLen = 0;
+    pthread_mutex_unlock(&mLock);
+    close(sink->out);
+    sink->out = -1;
+    if (sink->in >= 0) {
+        close(sink->in);
+        sink->in = -1;
+    }
+}
+
+// How much of the recorder's output to take this round: no more than every
+// blocking sink can take into its backlog, should its tee come up short
+size_t SinkMux::admit(size_t avail, int *blockedBy) {
+    size_t n = avail < MUX_ROUND ? avail : MUX_ROUND;
+    *blockedBy = -1;
+    for (int i = 0; i < mSinkCount; i++) {
+        Sink *sink = &mSinks[i];
+        if (sink->dead || sink->policy != BLOCK)
+            continue;
+        size_t room = sink->backlogSize - sink->backlogLen;
+        if (room < n) {
+            n = room;
+            *blockedBy = i;
+        }
+    }
+    return n;
+}
+
+// Append to the backlog, applying the sink's policy if it doesn't fit
+void SinkMux::queue(Sink *sink, const uint8_t *data, size_t len) {
+    size_t room = sink->backlogSize - sink->backlogLen;
+    if (len > room && sink->policy == DETACH) {
+        detach(sink, "backlog full");
+        return;
+    }
+    pthread_mutex_lock(&mLock);
+    if (len > room) {
+        sink->stats.dropped += len - room;
+        len = room;
+    }
+    if (sink->backlogOff + sink->backlogLen + len > sink->backlogSize) {
+        memmove(sink->backlog, sink->backlog + sink->backlogOff, sink->backlogLen);
+        sink->backlogOff = 0;
+    }
+    memcpy(sink->backlog + sink->backlogOff + sink->backlogLen, data, len);
+    sink->backlogLen += len;
+    if (sink->backlogLen > sink->stats.maxBacklog)
+        sink->stats.maxBacklog = sink->backlogLen;
+    pthread_mutex_unlock(&mLock);
+}
+
+// Move the backlog into the sink's pipe.  Returns true once it is empty.
+bool SinkMux::flush(Sink *sink) {
+    while (sink->backlogLen) {
+        ssize_t n = write(sink->out, sink->backlog + sink->backlogOff, sink->backlogLen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return false;
+        if (n < 0) {
+            // EPIPE: whoever drained the pipe has given up
+            detach(sink, strerror(errno));
+            return true;
+        }
+        pthread_mutex_lock(&mLock);
+        sink->backlogLen -= n;
+        sink->backlogOff = sink->backlogLen ? sink->backlogOff + n : 0;
+        sink->stats.bytes += n;
+        pthread_mutex_unlock(&mLock);
+    }
+    return true;
+}
+
+// Empty a ring sink's pipe into the ring
+void SinkMux::drain(Sink *sink) {
+    if (!sink->ringSize)
+        return;
+    for (;;) {
+        pthread_mutex_lock(&mLock);
+        size_t off = sink->ringHead % sink->ringSize;
+        struct iovec iov[2] = {
+            { sink->ring + off, sink->ringSize - off },
+            { sink->ring, off }
+        };
+        ssize_t n = readv(sink->in, iov, off ? 2 : 1);
+        if (n > 0)
+            sink->ringHead += n;
+        pthread_mutex_unlock(&mLock);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN)
+            detach(sink, strerror(errno));
+        if (n <= 0)
+            return;
+    }
+}
+
+// Pass n bytes of the recorder's output on to every sink, then consume
+// them.  Sinks whose tee came up short, or that are working off a backlog,
+// get a copy.
+void SinkMux::deliver(size_t n) {
+    size_t got[MAX_SINKS];
+    bool copy = false;
+    for (int i = 0; i < mSinkCount; i++) {
+        Sink *sink = &mSinks[i];
+        got[i] = n;
+        if (sink->dead)
+            continue;
+        got[i] = 0;
+        if (!sink->backlogLen) {
+            ssize_t k = tee(mPipe[0], sink->out, n, SPLICE_F_NONBLOCK);
+            if (k < 0 && errno != EAGAIN) {
+                detach(sink, strerror(errno));
+                got[i] = n;
+                continue;
+            }
+            if (k > 0) {
+                got[i] = k;
+                pthread_mutex_lock(&mLock);
+                sink->stats.bytes += k;
+                sink->stats.teed += k;
+                pthread_mutex_unlock(&mLock);
+            }
+        }
+        if (got[i] < n)
+            copy = true;
+    }
+
+    if (!copy) {
+        size_t left = n;
+        while (left && mNull >= 0) {
+            ssize_t k = splice(mPipe[0], NULL, mNull, NULL, left, SPLICE_F_MOVE);
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k <= 0) {
+                fprintf(stderr, "SinkMux: can't splice to /dev/null: errno=%d\n", errno);
+                close(mNull);
+                mNull = -1;
+                break;
+            }
+            left -= k;
+        }
+        while (left) {
+            ssize_t k = read(mPipe[0], mScratch, left < MUX_ROUND ? left : MUX_ROUND);
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k <= 0)
+                break;
+            left -= k;
+        }
+        return;
+    }
+
+    size_t len = 0;
+    while (len < n) {
+        ssize_t k = read(mPipe[0], mScratch + len, n - len);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            break;
+        len += k;
+    }
+    for (int i = 0; i < mSinkCount; i++) {
+        Sink *sink = &mSinks[i];
+        if (!sink->dead && got[i] < len)
+            queue(sink, mScratch + got[i], len - got[i]);
+    }
+}
+
+void SinkMux::threadLoop() {
+    bool eof = false, cancelled = false;
+    for (;;) {
+        bool pending = false;
+        for (int i = 0; i < mSinkCount; i++) {
+            Sink *sink = &mSinks[i];
+            if (!sink->dead && !flush(sink))
+                pending = true;
+            if (!sink->dead && sink->in >= 0)
+                drain(sink);
+        }
+        if (eof && !pending)
+            break;
+
+        int blockedBy = -1;
+        size_t room = eof ? 0 : admit(MUX_ROUND, &blockedBy);
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        if (!eof && !room) {
+            if (!mBlockedSince) {
+                mBlockedSince = now;
+                mBlockedBy = blockedBy;
+            }
+        } else if (mBlockedSince) {
+            pthread_mutex_lock(&mLock);
+            if (mBlockedBy >= 0)
+                mSinks[mBlockedBy].stats.blockedTime += now - mBlockedSince;
+            pthread_mutex_unlock(&mLock);
+            mBlockedSince = 0;
+        }
+
+        struct pollfd fds[2 + MAX_SINKS];
+        int nfds = 0;
+        fds[nfds].fd = mWake[0];
+        fds[nfds++].events = POLLIN;
+        fds[nfds].fd = !eof && room ? mPipe[0] : -1;
+        fds[nfds++].events = POLLIN;
+        for (int i = 0; i < mSinkCount; i++) {
+            Sink *sink = &mSinks[i];
+            fds[nfds].fd = !sink->dead && sink->backlogLen ? sink->out : -1;
+            fds[nfds++].events = POLLOUT;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents) {
+            cancelled = true;
+            break;
+        }
+        if (fds[1].revents) {
+            int avail = 0;
+            if (ioctl(mPipe[0], FIONREAD, &avail) < 0 || avail <= 0) {
+                if (fds[1].revents & (POLLHUP | POLLERR))
+                    eof = true;
+            } else {
+                deliver(admit(avail, &blockedBy));
+            }
+        }
+    }
+
+    if (mBlockedSince && mBlockedBy >= 0) {
+        pthread_mutex_lock(&mLock);
+        mSinks[mBlockedBy].stats.blockedTime += systemTime(SYSTEM_TIME_MONOTONIC) - mBlockedSince;
+        pthread_mutex_unlock(&mLock);
+        mBlockedSince = 0;
+    }
+    // closing the sink pipes is what ends each sink's stream
+    for (int i = 0; i < mSinkCount; i++) {
+        Sink *sink = &mSinks[i];
+        if (!sink->dead) {
+            if (sink->in >= 0)
+                drain(sink);
+            detach(sink, cancelled && sink->backlogLen ? "timed out" : NULL);
+        }
+    }
+    close(mPipe[0]);
+    mPipe[0] = -1;
+    pthread_mutex_lock(&mLock);
+    mDone = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mLock);
+}
+
+int SinkMux::finish(nsecs_t timeout) {
+    if (!mStarted)
+        return -EINVAL;
+    pthread_mutex_lock(&mLock);
+    mFollowEnd = true;
+    pthread_mutex_unlock(&mLock);
+    if (mFollowing)
+        write(mFollowWake[1], "x", 1);
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + timeout;
+    pthread_mutex_lock(&mLock);
+    while (!mDone) {
+        nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+        if (left <= 0)
+            break;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        nsecs_t abs = (nsecs_t)ts.tv_sec * 1000000000LL + ts.tv_nsec + left;
+        ts.tv_sec = abs / 1000000000LL;
+        ts.tv_nsec = abs % 1000000000LL;
+        pthread_cond_timedwait(&mCond, &mLock, &ts);
+    }
+    bool done = mDone;
+    pthread_mutex_unlock(&mLock);
+    if (!done)
+        write(mWake[1], "x", 1);
+    pthread_join(mThread, NULL);
+    mStarted = false;
+    if (mFollowing) {
+        pthread_join(mFollower, NULL);
+        mFollowing = false;
+    }
+    return done ? 0 : -ETIMEDOUT;
+}
+
+void SinkMux::getStats(int sink, SinkStats *stats) {
+    pthread_mutex_lock(&mLock);
+    *stats = mSinks[sink].stats;
+    pthread_mutex_unlock(&mLock);
+}
+
+size_t SinkMux::readRing(int sink, uint8_t *buf, size_t len) {
+    if (sink < 0 || sink >= mSinkCount)
+        return 0;
+    Sink *s = &mSinks[sink];
+    if (s->type != SINK_RING || !s->ringSize)
+        return 0;
+    pthread_mutex_lock(&mLock);
+    uint64_t have = s->ringHead < s->ringSize ? s->ringHead : s->ringSize;
+    if (len > have)
+        len = have;
+    uint64_t from = s->ringHead - len;
+    for (size_t done = 0; done < len; ) {
+        size_t off = (from + done) % s->ringSize;
+        size_t n = s->ringSize - off;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, s->ring + off, n);
+        done += n;
+    }
+    pthread_mutex_unlock(&mLock);
+    return len;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAMERACAPTURE_SINK_MUX_H
+#define CAMERACAPTURE_SINK_MUX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <utils/Timers.h>
+
+/*
+ * Fans one encoder output out to several sinks.  The recorder writes into
+ * a pipe, and a thread tee()s it into one pipe per sink, so in the normal
+ * case no byte is copied through user space.  A recorder that writes a
+ * file of its own can be followed instead: the file is spliced into the
+ * pipe as it grows.
+ *
+ * A followed MP4 is not what the sinks get.  The recorder goes back and
+ * patches the file (sizes, and the moov box it writes last), but by then
+ * the sinks have had the bytes as first written.  An upload fed this way
+ * differs from the local recording and may not play on its own; the local
+ * file is the one to keep.
+ *
+ * A sink that can't take a whole round gets the rest copied into its own
+ * backlog, and keeps going through the backlog until that drains.  What
+ * happens when the backlog is full is the sink's policy:
+ *   BLOCK   stop reading the recorder until there is room
+ *   DROP    discard what doesn't fit; the sink's stream has gaps
+ *   DETACH  close the sink and carry on without it
+ */
+class SinkMux {
+public:
+    enum Policy {
+        BLOCK,
+        DROP,
+        DETACH
+    };
+
+    struct SinkStats {
+        uint64_t bytes;            // delivered to the sink
+        uint64_t teed;             // of which passed on without a copy
+        uint64_t dropped;
+        size_t maxBacklog;
+        nsecs_t blockedTime;       // the recorder held back for this sink
+        bool detached;
+    };
+
+    SinkMux();
+    ~SinkMux();
+
+    // Each returns the sink's index, or -1.  fd is the write end of a pipe
+    // someone else drains, e.g. an uploader's; the mux takes it over and
+    // closes it at the end of the stream.
+    int addPipe(const char *name, int fd, Policy policy, size_t backlogBytes);
+    // Keeps the latest ringBytes of the stream in memory; never holds back
+    int addRing(const char *name, size_t ringBytes);
+
+    // Start the thread.  Returns the fd for the recorder to write to, or
+    // -1.  The caller closes it when the recording is over.
+    int start();
+    // Start the thread, fed from the file the recorder is writing: fd is
+    // spliced from as the file grows, up to where it ends once finish() is
+    // called.  The sinks only get the bytes as first written; see above.
+    // Returns 0 or -1.  The mux takes over the fd.
+    int follow(int fd);
+
+    // Wait for the end of the stream and the backlogs to go out.  Returns
+    // 0, or -ETIMEDOUT with the remaining backlogs dropped.
+    int finish(nsecs_t timeout);
+
+    int sinkCount() const { return mSinkCount; }
+    const char *sinkName(int sink) const { return mSinks[sink].name; }
+    void getStats(int sink, SinkStats *stats);
+
+    // Copy out what a ring sink holds, oldest first.  Returns the length.
+    size_t readRing(int sink, uint8_t *buf, size_t len);
+
+    enum {
+        MAX_SINKS = 8
+    };
+
+private:
+    enum Type {
+        SINK_PIPE,
+        SINK_RING
+    };
+
+    struct Sink {
+        Type type;
+        char name[64];
+        Policy policy;
+        int out;                   // pipe we tee into
+        int in;                    // our end of it, for ring sinks
+        uint8_t *backlog;
+        size_t backlogOff;
+        size_t backlogLen;
+        size_t backlogSize;
+        uint8_t *ring;
+        size_t ringSize;
+        uint64_t ringHead;         // free-running
+        bool dead;
+        SinkStats stats;
+    };
+
+    int addSink(Type type, const char *name, int fd, Policy policy, size_t bytes);
+    static void *threadEntry(void *me);
+    void threadLoop();
+    static void *followerEntry(void *me);
+    void followLoop();
+    size_t admit(size_t avail, int *blockedBy);
+    void deliver(size_t n);
+    void queue(Sink *sink, const uint8_t *data, size_t len);
+    bool flush(Sink *sink);
+    void drain(Sink *sink);
+    void detach(Sink *sink, const char *why);
+
+    Sink mSinks[MAX_SINKS];
+    int mSinkCount;
+    int mPipe[2];
+    int mWake[2];
+    int mNull;
+    uint8_t *mScratch;
+    bool mStarted;
+    bool mDone;
+    int mFollowFd;                 // the recorder's file, when following it
+    int mFollowOut;                // the write end of mPipe the follower fills
+    int mFollowWake[2];            // tells the follower the file is complete
+    bool mFollowing;
+    bool mFollowEnd;               // the file is complete; read to its end
+    pthread_t mFollower;
+    nsecs_t mBlockedSince;
+    int mBlockedBy;                // the sink mBlockedSince is charged to
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+};
+
+#endif // CAMERACAPTURE_SINK_MUX_H
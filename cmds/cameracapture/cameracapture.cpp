@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <errno.h>
@@ -29,6 +30,7 @@
 #include <media/stagefright/CameraSource.h>
 #include <media/stagefright/MediaBufferGroup.h>
 #include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/MetaData.h>
 #include <media/stagefright/MPEG4Writer.h>
 #include <media/stagefright/OMXClient.h>
@@ -36,16 +38,28 @@
 #include <media/MediaPlayerInterface.h>
 #include <media/mediarecorder.h>
 #include <SurfaceComposerClient.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+
+#include "HttpUploader.h"
+#include "SinkMux.h"
 
 using namespace android;
 
 static sp<SurfaceControl> surfaceControl;
+// Most -K may keep in memory per stream
+#define MAX_TAIL_KBYTES (64 * 1024)
+
 // Print usage showing how to use this utility to record videos
 static void usage(const char *me) {
     fprintf(stderr, "usage: %s\n", me);
     fprintf(stderr, "       -h(elp)\n");
-    fprintf(stderr, "       -a hostname to which to post video (default: unspecified)\n");
+    fprintf(stderr, "       -a hostname[:port] to which to post video, up to 3 may be specified (default: unspecified)\n");
     fprintf(stderr, "       -p port to which to post video (default: 80)\n");
+    fprintf(stderr, "       -B kbytes buffered per stream when posting (default: 4096)\n");
+    fprintf(stderr, "       -l also record to /sdcard/<stream_name> when posting\n");
+    fprintf(stderr, "       -K kbytes of the latest output to keep in memory, saved to /sdcard/<stream_name>.tail (1 to %d)\n", MAX_TAIL_KBYTES);
+    fprintf(stderr, "       -D when an upload falls behind by -B kbytes: [0] hold the encoder [1] drop [2] give up on it (default: 0)\n");
     fprintf(stderr, "       -b bit rate in bits per second (default: 300000)\n");
     fprintf(stderr, "       -f frame rate in frames per second (default: 30)\n");
     fprintf(stderr, "       -i I frame interval in seconds (default: 1)\n");
@@ -55,22 +69,105 @@ static void usage(const char *me) {
     fprintf(stderr, "       -v video codec: [0] H264 [1] MPEG_4_SP [2] H263 (default: 0)\n");
     fprintf(stderr, "       -c container format: [0] MPEG4 [1] DASH (default: 0)\n");
     fprintf(stderr, "       -s <stream_name> name of output, up to 4 may be specified\n");
+    fprintf(stderr, "       -T seconds to wait for the streams to finish (default: recording length + 10)\n");
     fprintf(stderr, "The output file is /sdcard/<stream_name>\n");
     exit(1);
 }
 
-volatile bool sDone = false;
+#define MAX_STREAMS 4
+#define MAX_HOSTS 3
+
+// Tracks when each recorder starts and finishes.  Completion events come in
+// on binder threads; main() sleeps on the condition until every stream has
+// finished or the timeout passes, instead of spinning against the encoders.
+class RecordingCompletion {
+public:
+    RecordingCompletion() : mPending(0) {
+        memset(mStart, 0, sizeof(mStart));
+        memset(mDone, 0, sizeof(mDone));
+        memset(mFailed, 0, sizeof(mFailed));
+    }
+
+    void started(int stream) {
+        Mutex::Autolock autoLock(mLock);
+        mStart[stream] = systemTime();
+        mDone[stream] = 0;
+        mFailed[stream] = false;
+        mPending++;
+    }
+
+    void finished(int stream, bool failed) {
+        Mutex::Autolock autoLock(mLock);
+        // a stream reports several completions, one per track and one for the file
+        if (!mStart[stream] || mDone[stream])
+            return;
+        mDone[stream] = systemTime();
+        mFailed[stream] = failed;
+        if (--mPending == 0)
+            mCondition.broadcast();
+    }
+
+    // Returns false if some stream was still going at the deadline
+    bool waitAll(nsecs_t timeout) {
+        Mutex::Autolock autoLock(mLock);
+        nsecs_t deadline = systemTime() + timeout;
+        while (mPending > 0) {
+            nsecs_t remaining = deadline - systemTime();
+            if (remaining <= 0)
+                return false;
+            mCondition.waitRelative(mLock, remaining);
+        }
+        return true;
+    }
+
+    // Start and finish times of a stream, finish 0 if it never did
+    void times(int stream, nsecs_t *start, nsecs_t *done, bool *failed) {
+        Mutex::Autolock autoLock(mLock);
+        *start = mStart[stream];
+        *done = mDone[stream];
+        *failed = mFailed[stream];
+    }
+
+private:
+    Mutex mLock;
+    Condition mCondition;
+    int mPending;
+    nsecs_t mStart[MAX_STREAMS];
+    nsecs_t mDone[MAX_STREAMS];
+    bool mFailed[MAX_STREAMS];
+};
+
+static RecordingCompletion sCompletion;
 
 class MyMediaRecorderListener : public MediaRecorderListener
 {
 public:
+    MyMediaRecorderListener(int stream) : mStream(stream) {}
+
     virtual void notify(int msg, int ext1, int ext2) {
-        fprintf(stderr, "MyMediaRecorderListener msg=%x ext1=%x ext2=%x", msg, ext1, ext2);
-        if (msg == MEDIA_RECORDER_TRACK_EVENT_INFO) {
-            if (ext1 & MEDIA_RECORDER_TRACK_INFO_COMPLETION_STATUS)
-                sDone = true;
+        fprintf(stderr, "MyMediaRecorderListener stream=%d msg=%x ext1=%x ext2=%x\n", mStream, msg, ext1, ext2);
+        switch (msg) {
+        case MEDIA_RECORDER_TRACK_EVENT_INFO:
+            // the writer puts the track number in the top four bits of ext1
+            // and the track's final status in ext2
+            if ((ext1 & 0x0fffffff) == MEDIA_RECORDER_TRACK_INFO_COMPLETION_STATUS)
+                sCompletion.finished(mStream, ext2 != OK && ext2 != ERROR_END_OF_STREAM);
+            break;
+        case MEDIA_RECORDER_EVENT_INFO:
+            // max-duration stops the writer; the track completion may not follow
+            if (ext1 == MEDIA_RECORDER_INFO_MAX_DURATION_REACHED
+             || ext1 == MEDIA_RECORDER_INFO_MAX_FILESIZE_REACHED)
+                sCompletion.finished(mStream, false);
+            break;
+        case MEDIA_RECORDER_EVENT_ERROR:
+        case MEDIA_RECORDER_TRACK_EVENT_ERROR:
+            sCompletion.finished(mStream, true);
+            break;
         }
     }
+
+private:
+    int mStream;
 };
 
 int connectToHost(const char *hostname, int port)
@@ -101,27 +198,11 @@ int connectToHost(const char *hostname, int port)
     return sock;
 }
 
-void httpPost(int sock, const char *hostname, const char *path)
-{
-    char line[1024];
-    int nchars = snprintf(line, sizeof(line), "POST %s HTTP/1.1\r\n", path);
-    nchars += snprintf(line+nchars, sizeof(line)-nchars, "Host: %s\r\n", hostname);
-    nchars += snprintf(line+nchars, sizeof(line)-nchars, "User-Agent: nrcc-webcam\r\n");
-    nchars += snprintf(line+nchars, sizeof(line)-nchars, "Content-Type: video/avc\r\n");
-    nchars += snprintf(line+nchars, sizeof(line)-nchars, "Content-Length: 2000000000\r\n");
-    nchars += snprintf(line+nchars, sizeof(line)-nchars, "\r\n");
-    int nWritten = write(sock, line, nchars);
-    if (nWritten < nchars) {
-	fprintf(stderr, "short write %d < %d errno=%d", nWritten, nchars, errno);
-    } else {
-        fprintf(stderr, "posted %d characters\n", nWritten);
-    }
-}
-
 class CameraRecorder : public virtual RefBase {
 public:
     CameraRecorder(int cameraNumber)
-        : mCameraNumber(cameraNumber) {
+        : mCameraNumber(cameraNumber),
+          mFd(-1) {
     }
     
     void connect() {
@@ -145,6 +226,8 @@ public:
         int output_format;
         int frameRateFps;
         int nFrames;        
+        int bitRateBps;
+        int iFramesIntervalSeconds;
     };
 
     void startPreview(const Params &params) {
@@ -181,6 +264,7 @@ public:
 
     void startRecording(const Params &params, int fd) {
         Size videoSize(params.width, params.height);
+        mFd = fd;
         sp<ICameraRecordingProxy> cameraRecordingProxy = mCamera->getRecordingProxy();
         mCamera->unlock();
 
@@ -210,6 +294,10 @@ public:
         char rparams[64];
         snprintf(rparams, sizeof(rparams), "max-duration=%d", params.nFrames/params.frameRateFps*1000);
         recorder->setParameters(String8(rparams));
+        snprintf(rparams, sizeof(rparams), "video-param-encoding-bitrate=%d", params.bitRateBps);
+        recorder->setParameters(String8(rparams));
+        snprintf(rparams, sizeof(rparams), "video-param-i-frames-interval=%d", params.iFramesIntervalSeconds);
+        recorder->setParameters(String8(rparams));
 
         recorder->setOutputFile(fd, 0, 0);
 
@@ -219,14 +307,24 @@ public:
         recorder->setPreviewSurface(mSurface);
 #endif
 
-        recorder->setListener(new MyMediaRecorderListener());
+        recorder->setListener(new MyMediaRecorderListener(mCameraNumber));
 
         recorder->prepare();
 
-        recorder->start();
+        if (recorder->start() == OK)
+            sCompletion.started(mCameraNumber);
+        else
+            fprintf(stderr, "%s:%d camera %d failed to start\n", __FILE__, __LINE__, mCameraNumber);
+    }
 
+    // Bytes written so far when recording to a file, -1 otherwise
+    off_t outputBytes() const {
+        struct stat st;
+        if (mFd < 0 || fstat(mFd, &st) < 0 || !S_ISREG(st.st_mode))
+            return -1;
+        return st.st_size;
     }
-    
+
     void stopRecording() {
         close(mFd);
         mRecorder->close();
@@ -258,15 +356,27 @@ int main(int argc, char **argv) {
         CONTAINER_DASH = 1
     };
     output_format output_format = OUTPUT_FORMAT_THREE_GPP;
-    const char *hostname = 0;
-    const char *streamNames[4];
-    sp<CameraRecorder> recorders[4];
+    struct {
+        const char *name;
+        int port;
+    } hosts[MAX_HOSTS];
+    int numHosts = 0;
+    bool recordLocal = false;
+    int tailKBytes = 0;
+    SinkMux::Policy uploadPolicy = SinkMux::BLOCK;
+    const char *streamNames[MAX_STREAMS];
+    sp<CameraRecorder> recorders[MAX_STREAMS];
     int numStreams = 0;
     int port = 80;
+    int timeoutSeconds = -1;
+    int ringKBytes = 4096;
+    HttpUploader *uploaders[MAX_STREAMS][MAX_HOSTS] = { { 0 } };
+    SinkMux *muxes[MAX_STREAMS] = { 0 };
+    int tailSinks[MAX_STREAMS];
 
     android::ProcessState::self()->startThreadPool();
     int res;
-    while ((res = getopt(argc, argv, "a:b:c:f:i:n:w:t:p:s:v:h")) >= 0) {
+    while ((res = getopt(argc, argv, "a:b:c:f:i:n:w:t:p:s:v:B:D:K:T:lh")) >= 0) {
         switch (res) {
             case 'b':
             {
@@ -282,7 +392,16 @@ int main(int argc, char **argv) {
 
             case 'a':
             {
-                hostname = optarg;
+                if (numHosts == MAX_HOSTS) {
+                    usage(argv[0]);
+                }
+                char *colon = strrchr(optarg, ':');
+                hosts[numHosts].port = 0;
+                if (colon) {
+                    *colon = 0;
+                    hosts[numHosts].port = atoi(colon + 1);
+                }
+                hosts[numHosts++].name = optarg;
                 break;
             }
 
@@ -306,10 +425,53 @@ int main(int argc, char **argv) {
 
             case 's':
             {
+                if (numStreams == MAX_STREAMS) {
+                    usage(argv[0]);
+                }
                 streamNames[numStreams++] = optarg;
                 break;
             }
 
+            case 'B':
+            {
+                ringKBytes = atoi(optarg);
+                if (ringKBytes <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+
+            case 'D':
+            {
+                int param = atoi(optarg);
+                if (param < SinkMux::BLOCK || param > SinkMux::DETACH) {
+                    usage(argv[0]);
+                }
+                uploadPolicy = (SinkMux::Policy)param;
+                break;
+            }
+
+            case 'K':
+            {
+                tailKBytes = atoi(optarg);
+                if (tailKBytes <= 0 || tailKBytes > MAX_TAIL_KBYTES) {
+                    usage(argv[0]);
+                }
+                break;
+            }
+
+            case 'l':
+            {
+                recordLocal = true;
+                break;
+            }
+
+            case 'T':
+            {
+                timeoutSeconds = atoi(optarg);
+                break;
+            }
+
             case 'w':
             {
                 width = atoi(optarg);
@@ -351,6 +513,13 @@ int main(int argc, char **argv) {
         }
     }
 
+    for (int h = 0; h < numHosts; h++) {
+        if (!hosts[h].port)
+            hosts[h].port = port;
+    }
+    // a sink that gives up closes its pipe; that must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
     for (int cam = numStreams-1; cam >= 0; cam--) {
         sp<CameraRecorder> recorder = new CameraRecorder(cam);
         recorders[cam] = recorder;
@@ -364,42 +533,183 @@ int main(int argc, char **argv) {
         params.output_format = output_format;
         params.frameRateFps = frameRateFps;
         params.nFrames = nFrames;
+        params.bitRateBps = bitRateBps;
+        params.iFramesIntervalSeconds = iFramesIntervalSeconds;
 
         fprintf(stderr, "%s:%d startPreview\n", __FILE__, __LINE__);
         recorder->startPreview(params);
         
         int fd = -1;
-        if (hostname == 0) {
-            char streamfile[128];
-            snprintf(streamfile, sizeof(streamfile), "/sdcard/%s", streamNames[cam]);
+        int localFd = -1;
+        char streamfile[128];
+        snprintf(streamfile, sizeof(streamfile), "/sdcard/%s", streamNames[cam]);
+        if (numHosts == 0 || recordLocal) {
             fprintf(stderr, "%s:%d open %s\n", __FILE__, __LINE__, streamfile);
-            fd = open(streamfile, O_WRONLY|O_CREAT, 0660);
-        } else {
-            fprintf(stderr, "%s:%d connect %s:%d\n", __FILE__, __LINE__, hostname, port);
-            fd = connectToHost(hostname, port);
+            localFd = open(streamfile, O_WRONLY|O_CREAT|O_TRUNC, 0660);
+        }
+        int uploadFds[MAX_HOSTS];
+        int uploadHosts[MAX_HOSTS];
+        int numUploads = 0;
+        for (int h = 0; h < numHosts; h++) {
+            fprintf(stderr, "%s:%d connect %s:%d\n", __FILE__, __LINE__, hosts[h].name, hosts[h].port);
+            int sock = connectToHost(hosts[h].name, hosts[h].port);
             char path[256];
             snprintf(path, sizeof(path), "/%s", streamNames[cam]);
-            httpPost(fd, hostname, path);
+            // the recorder writes into the uploader's pipe, so a slow
+            // network fills the ring before it reaches the encoder
+            if (sock >= 0) {
+                uploaders[cam][h] = new HttpUploader(sock, hosts[h].name, path, ringKBytes * 1024);
+                int ufd = uploaders[cam][h]->start();
+                if (ufd >= 0) {
+                    uploadHosts[numUploads] = h;
+                    uploadFds[numUploads++] = ufd;
+                }
+            }
+        }
+        tailSinks[cam] = -1;
+        int teed = numUploads + (tailKBytes > 0);
+        if (teed && (localFd >= 0 || teed > 1)) {
+            // one encode, teed to the uploads and the tail.  A local file
+            // stays the recorder's own: the MPEG4 writer seeks back into it
+            // to fill in the sizes, which it can't do through a pipe, so the
+            // mux follows the file as it grows.  The uploads get it as first
+            // written, without the patches, so they differ from the file.  A
+            // held back upload holds back the follower, not the encoder.
+            SinkMux *mux = new SinkMux();
+            muxes[cam] = mux;
+            for (int u = 0; u < numUploads; u++)
+                mux->addPipe(hosts[uploadHosts[u]].name, uploadFds[u], uploadPolicy, ringKBytes * 1024);
+            if (tailKBytes > 0)
+                tailSinks[cam] = mux->addRing("tail", tailKBytes * 1024);
+            if (localFd < 0) {
+                fd = mux->start();
+            } else {
+                fd = localFd;
+                if (mux->follow(open(streamfile, O_RDONLY)) < 0) {
+                    fprintf(stderr, "%s:%d can't follow %s, recording it only\n", __FILE__, __LINE__, streamfile);
+                    delete mux;
+                    muxes[cam] = NULL;
+                    tailSinks[cam] = -1;
+                }
+            }
+        } else if (localFd >= 0) {
+            fd = localFd;
+        } else if (numUploads) {
+            fd = uploadFds[0];
         }
         fprintf(stderr, "%s:%d start recording fd=%d\n", __FILE__, __LINE__, fd);
         recorder->startRecording(params, fd);
     }
 
-    int64_t start = systemTime();
-    while (!sDone) {
-        // wait for video capture to complete
+    if (timeoutSeconds < 0) {
+        timeoutSeconds = nFrames / frameRateFps + 10;
+    }
+    if (!sCompletion.waitAll(seconds(timeoutSeconds))) {
+        fprintf(stderr, "%s:%d timed out after %d s\n", __FILE__, __LINE__, timeoutSeconds);
+    }
+
+    // Each stream is timed from its own start to its own completion, so
+    // throughput is not skewed by how long the others took to set up
+    int64_t first = 0, last = 0;
+    int completed = 0;
+    for (int cam = 0; cam < numStreams; cam++) {
+        nsecs_t start, done;
+        bool failed;
+        sCompletion.times(cam, &start, &done, &failed);
+        off_t bytes = recorders[cam]->outputBytes();
+        if (!start) {
+            fprintf(stderr, "stream %s: never started\n", streamNames[cam]);
+        } else if (!done) {
+            fprintf(stderr, "stream %s: still running after %lld us\n", streamNames[cam],
+                    (systemTime() - start) / 1000);
+        } else {
+            int64_t us = (done - start) / 1000;
+            fprintf(stderr, "stream %s: %s after %lld us, %.2f fps", streamNames[cam],
+                    failed ? "failed" : "completed", us, (nFrames * 1E6) / us);
+            if (bytes >= 0)
+                fprintf(stderr, ", %lld bytes, %.0f kbps", (long long)bytes, bytes * 8E3 / us);
+            fprintf(stderr, "\n");
+            if (!failed) {
+                completed++;
+                if (!first || start < first)
+                    first = start;
+                if (done > last)
+                    last = done;
+            }
+        }
     }
-    int64_t end = systemTime();
 
     for (int cam = 0; cam < numStreams; cam++) {
         recorders[cam]->stopRecording();
     }
 
+    // stopping closed the pipes and completed the followed files; wait for
+    // the fan-outs, then for what is still in the upload rings to go out
+    for (int cam = 0; cam < numStreams; cam++) {
+        SinkMux *mux = muxes[cam];
+        if (!mux)
+            continue;
+        if (mux->finish(seconds(10)))
+            fprintf(stderr, "stream %s: timed out fanning out\n", streamNames[cam]);
+        for (int i = 0; i < mux->sinkCount(); i++) {
+            SinkMux::SinkStats stats;
+            mux->getStats(i, &stats);
+            fprintf(stderr, "sink %s/%s: %llu bytes, %llu without a copy, %llu dropped, "
+                    "max backlog %zu, held the encoder %lld ms%s\n",
+                    streamNames[cam], mux->sinkName(i), (unsigned long long)stats.bytes,
+                    (unsigned long long)stats.teed, (unsigned long long)stats.dropped,
+                    stats.maxBacklog, (long long)ns2ms(stats.blockedTime),
+                    stats.detached ? ", detached" : "");
+        }
+        if (tailSinks[cam] >= 0) {
+            char tailfile[128];
+            snprintf(tailfile, sizeof(tailfile), "/sdcard/%s.tail", streamNames[cam]);
+            uint8_t *tail = (uint8_t *)malloc(tailKBytes * 1024);
+            size_t len = tail ? mux->readRing(tailSinks[cam], tail, tailKBytes * 1024) : 0;
+            int tailFd = open(tailfile, O_WRONLY|O_CREAT|O_TRUNC, 0660);
+            if (tailFd < 0 || write(tailFd, tail, len) != (ssize_t)len)
+                fprintf(stderr, "%s:%d can't save %s errno=%d\n", __FILE__, __LINE__, tailfile, errno);
+            else
+                fprintf(stderr, "saved the last %zu bytes to %s\n", len, tailfile);
+            if (tailFd >= 0)
+                close(tailFd);
+            free(tail);
+        }
+        delete mux;
+    }
+
+    int uploadsFailed = 0;
+    for (int cam = 0; cam < numStreams; cam++) {
+        for (int h = 0; h < numHosts; h++) {
+            HttpUploader *uploader = uploaders[cam][h];
+            if (!uploader)
+                continue;
+            int err = uploader->finish(seconds(10));
+            HttpUploader::Stats stats;
+            uploader->getStats(&stats);
+            fprintf(stderr, "upload %s to %s: %llu of %llu bytes sent in %llu chunks, %llu writes, "
+                    "max buffered %zu, max unacked %zu, %u stalls %lld ms, ring full %lld ms, HTTP %d",
+                    streamNames[cam], hosts[h].name, (unsigned long long)stats.bytesSent,
+                    (unsigned long long)stats.bytesIn, (unsigned long long)stats.chunks,
+                    (unsigned long long)stats.writes, stats.maxBuffered, stats.maxUnacked, stats.stalls,
+                    (long long)ns2ms(stats.stallTime), (long long)ns2ms(stats.fullTime),
+                    stats.httpStatus);
+            if (err)
+                fprintf(stderr, ", error %d", err);
+            fprintf(stderr, "\n");
+            if (err || stats.httpStatus / 100 != 2)
+                uploadsFailed++;
+            delete uploader;
+        }
+    }
+
     fprintf(stderr, "$\n");
 
-    fprintf(stderr, "encoding %d frames in %lld us\n", nFrames, (end-start)/1000);
-    fprintf(stderr, "encoding speed is: %.2f fps\n", (nFrames * 1E9) / (end-start));
-    return 0;
+    if (completed) {
+        fprintf(stderr, "encoding %d frames x %d streams in %lld us\n", nFrames, completed, (last-first)/1000);
+        fprintf(stderr, "encoding speed is: %.2f fps\n", (nFrames * completed * 1E9) / (last-first));
+    }
+    return completed == numStreams && !uploadsFailed ? 0 : 1;
 }
 
 
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Local HTTP sink for cameracapture -a.  Accepts POSTs, strictly decodes
+ * the chunked (or Content-Length) body and answers 200, or 400 if the
+ * framing is wrong.  Reading can be throttled and stalled to put the
+ * uploader under back-pressure.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+static int rateKBps = 0;          // 0: read as fast as possible
+static int stallMs = 0;           // stop reading this long once a second
+static int requestsLeft = 0;      // exit after this many, 0: never
+static const char *outDir = NULL;
+static int rcvBuf = 0;
+static pthread_mutex_t sinkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(const char *me) {
+    fprintf(stderr, "usage: %s\n", me);
+    fprintf(stderr, "       -p port to listen on (default: 8080)\n");
+    fprintf(stderr, "       -o directory to store bodies in, named after the path (default: discard)\n");
+    fprintf(stderr, "       -r read at most this many kbytes per second\n");
+    fprintf(stderr, "       -z stop reading this many ms out of every second\n");
+    fprintf(stderr, "       -R receive buffer size in bytes\n");
+    fprintf(stderr, "       -n exit after this many requests\n");
+    exit(1);
+}
+
+static long long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+struct Conn {
+    int fd;
+    int out;
+    char buf[16384];
+    size_t len;
+    size_t off;
+    long long start;
+    long long paced;              // bytes read, for the rate limit
+    long long body;
+    long long chunks;
+};
+
+// Refill the buffer, applying the throttle and the stalls
+static bool fill(Conn *c) {
+    if (c->off == c->len)
+        c->off = c->len = 0;
+    size_t want = sizeof(c->buf) - c->len;
+    long long elapsed = nowUs() - c->start;
+    if (stallMs && elapsed % 1000000 < stallMs * 1000LL)
+        usleep(stallMs * 1000LL - elapsed % 1000000);
+    if (rateKBps) {
+        if (want > 4096)
+            want = 4096;
+        long long due = c->paced * 1000 / rateKBps;    // us at which we may read again
+        elapsed = nowUs() - c->start;
+        if (due > elapsed)
+            usleep(due - elapsed);
+    }
+    ssize_t n;
+    do {
+        n = read(c->fd, c->buf + c->len, want);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    c->len += n;
+    c->paced += n;
+    return true;
+}
+
+// Reads one CRLF-terminated line, which must fit the buffer
+static bool readLine(Conn *c, char *line, size_t size) {
+    for (;;) {
+        char *p = (char *)memchr(c->buf + c->off, '\n', c->len - c->off);
+        if (p) {
+            size_t n = p - (c->buf + c->off);
+            if (!n || p[-1] != '\r' || n > size)
+                return false;
+            memcpy(line, c->buf + c->off, n - 1);
+            line[n - 1] = 0;
+            c->off += n + 1;
+            return true;
+        }
+        if (c->len - c->off >= size)
+            return false;
+        if (c->off) {
+            memmove(c->buf, c->buf + c->off, c->len - c->off);
+            c->len -= c->off;
+            c->off = 0;
+        }
+        if (!fill(c))
+            return false;
+    }
+}
+
+static bool readBody(Conn *c, long long n) {
+    while (n > 0) {
+        if (c->off == c->len && !fill(c))
+            return false;
+        size_t take = c->len - c->off;
+        if ((long long)take > n)
+            take = n;
+        if (c->out >= 0 && write(c->out, c->buf + c->off, take) != (ssize_t)take) {
+            fprintf(stderr, "httpsink: write failed: errno=%d\n", errno);
+            c->out = -1;
+        }
+        c->off += take;
+        c->body += take;
+        n -= take;
+    }
+    return true;
+}
+
+static bool readChunked(Conn *c) {
+    char line[256], *end;
+    for (;;) {
+        if (!readLine(c, line, sizeof(line)))
+            return false;
+        errno = 0;
+        long long size = strtoll(line, &end, 16);
+        if (end == line || errno || size < 0 || (*end && *end != ';'))
+            return false;
+        if (!size)
+            break;
+        c->chunks++;
+        if (!readBody(c, size) || !readLine(c, line, sizeof(line)) || line[0])
+            return false;
+    }
+    // trailers, up to the empty line
+    do {
+        if (!readLine(c, line, sizeof(line)))
+            return false;
+    } while (line[0]);
+    return true;
+}
+
+static void reply(int fd, int status, const char *reason) {
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+                     "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason);
+    write(fd, line, n);
+}
+
+static void *serve(void *arg) {
+    Conn *c = (Conn *)arg;
+    char line[1024], method[16], path[256];
+    long long length = -1;
+    bool chunked = false, ok = false;
+
+    path[0] = 0;
+    c->start = nowUs();
+    if (readLine(c, line, sizeof(line))
+     && sscanf(line, "%15s %255s HTTP/1.%*d", method, path) == 2
+     && !strcmp(method, "POST")) {
+        ok = true;
+        while (ok && (ok = readLine(c, line, sizeof(line))) && line[0]) {
+            if (!strncasecmp(line, "Content-Length:", 15))
+                length = atoll(line + 15);
+            else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+                chunked = strstr(line + 18, "chunked") != NULL;
+        }
+        if (ok && outDir) {
+            char name[512];
+            const char *base = strrchr(path, '/');
+            snprintf(name, sizeof(name), "%s/%s", outDir, base ? base + 1 : path);
+            c->out = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        }
+        if (ok)
+            ok = chunked ? readChunked(c) : length >= 0 && readBody(c, length);
+    }
+    long long us = nowUs() - c->start;
+    reply(c->fd, ok ? 200 : 400, ok ? "OK" : "Bad Request");
+    printf("%s %s: %s, %lld bytes in %lld chunks, %lld ms, %.0f kbps\n",
+           ok ? "200" : "400", path, chunked ? "chunked" : "length", c->body, c->chunks,
+           us / 1000, us ? c->body * 8E3 / us : 0);
+    fflush(stdout);
+    if (c->out >= 0)
+        close(c->out);
+    close(c->fd);
+    delete c;
+
+    pthread_mutex_lock(&sinkLock);
+    bool last = requestsLeft && --requestsLeft == 0;
+    pthread_mutex_unlock(&sinkLock);
+    if (last)
+        exit(0);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int port = 8080;
+    int res;
+    while ((res = getopt(argc, argv, "p:o:r:z:R:n:h")) >= 0) {
+        switch (res) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'o':
+            outDir = optarg;
+            break;
+        case 'r':
+            rateKBps = atoi(optarg);
+            break;
+        case 'z':
+            stallMs = atoi(optarg);
+            if (stallMs < 0 || stallMs >= 1000)
+                usage(argv[0]);
+            break;
+        case 'R':
+            rcvBuf = atoi(optarg);
+            break;
+        case 'n':
+            requestsLeft = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    int sock = socket(PF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // set before listen so accepted sockets get the window from the start
+    if (rcvBuf)
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+        fprintf(stderr, "httpsink: can't listen on %d: errno=%d\n", port, errno);
+        return 1;
+    }
+    fprintf(stderr, "httpsink: listening on %d\n", port);
+
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "httpsink: accept failed: errno=%d\n", errno);
+            return 1;
+        }
+        Conn *c = new Conn;
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->out = -1;
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve, c);
+        pthread_detach(thread);
+    }
+}